@@ -14,10 +14,27 @@ OTAUpdate::OTAUpdate() {
     updateProgress = 0;
     lastError = "";
     lastCheck = 0;
+    deviceHash = 0;
+    nextCheck = 0;
+    bootCheckAt = 0;
+    backoffUntil = 0;
+    serverBackoffs = 0;
+    downloadStart = 0;
+    bytesWritten = 0;
+    resumedFrom = 0;
     otaTaskHandle = NULL;
+    manifest.brokerPort = 0;
+    manifest.valid = false;
+    manifest.fetchedAt = 0;
+    manifest.masterRollout = 100;
+    manifest.slaveRollout = 100;
+    manifestHits = 0;
+    manifestNotModified = 0;
+    manifestFetches = 0;
     
     // Create mutex
     mutex = xSemaphoreCreateMutex();
+    manifestMutex = xSemaphoreCreateMutex();
     
     // Callbacks
     onStartCallback = nullptr;
@@ -32,6 +49,9 @@ OTAUpdate::~OTAUpdate() {
     if (mutex != NULL) {
         vSemaphoreDelete(mutex);
     }
+    if (manifestMutex != NULL) {
+        vSemaphoreDelete(manifestMutex);
+    }
 }
 
 // Get singleton instance
@@ -53,6 +73,8 @@ bool OTAUpdate::begin(const String& serverUrl, const String& currentVersion,
     this->currentVersion = currentVersion;
     this->clientID = clientID;
     this->checkInterval = checkInterval;
+    deviceHash = fnv1a(clientID);
+    nextCheck = deviceHash % checkInterval;     // Check định kỳ theo pha riêng, không theo lúc boot
     
     Serial.println("🔄 [OTA] Initializing OTA Update Service...");
     Serial.printf("   📌 Server URL: %s\n", serverUrl.c_str());
@@ -61,6 +83,16 @@ bool OTAUpdate::begin(const String& serverUrl, const String& currentVersion,
     loadsettingInNVS();
     // Load OTA info from NVS
     loadOTAInfo();
+    loadManifest();
+
+    // Bật nguồn lại (thường là mất điện cả site, mọi thiết bị boot cùng lúc) và đã có manifest:
+    // boot bằng bản NVS, hỏi lại server ở thời điểm riêng của thiết bị này
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (manifest.valid && (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT)) {
+        bootCheckAt = millis() + deviceHash % OTA_BOOT_SPREAD_MS;
+        xTaskCreatePinnedToCore(deferredCheckTask, "OTABootCheck", 8192, this, 1, NULL, 1);
+        Serial.printf("   📌 Power-on: server check in %lus\n", (bootCheckAt - millis()) / 1000);
+    }
     
     // Create OTA monitoring task
     // xTaskCreatePinnedToCore(
@@ -95,27 +127,214 @@ void OTAUpdate::end() {
     }
 }
 
+String OTAUpdate::endpointUrl() {
+    if (serverUrl.startsWith("/")) {
+        return ServiceDiscovery::getInstance().url(serverUrl);
+    }
+    return serverUrl;
+}
+
+String OTAUpdate::resolveLink(const String& link) {
+    return link.startsWith("/") ? ServiceDiscovery::getInstance().url(link) : link;
+}
+
 // Check for update from server
-bool OTAUpdate::checkForUpdate(String& newVersion, String& downloadUrl) {
-     if (WiFi.status() != WL_CONNECTED) {
-        lastError = "WiFi not connected";
+bool OTAUpdate::checkForUpdate(UpdateTarget& target, bool revalidate, int attempts) {
+    if (!refreshManifest(revalidate, attempts)) {
+        return false;
+    }
+    if (xSemaphoreTake(manifestMutex, portMAX_DELAY) != pdTRUE) {
+        return false;
+    }
+    String masterLink    = manifest.masterLink;
+    String masterVersion = manifest.masterVersion;
+    String slaveLink     = manifest.slaveLink;
+    String slaveVersion  = manifest.slaveVersion;
+    String patchFrom = isMasterRole() ? manifest.masterPatchFrom : manifest.slavePatchFrom;
+    String patchLink = isMasterRole() ? manifest.masterPatchLink : manifest.slavePatchLink;
+    String compressedLink = isMasterRole() ? manifest.masterCompressedLink : manifest.slaveCompressedLink;
+    String originLink = isMasterRole() ? "" : manifest.slaveOriginLink;
+    target.sha256    = isMasterRole() ? manifest.masterSha256 : manifest.slaveSha256;
+    target.signature = isMasterRole() ? manifest.masterSignature : manifest.slaveSignature;
+    int rollout = isMasterRole() ? manifest.masterRollout : manifest.slaveRollout;
+    xSemaphoreGive(manifestMutex);
+
+    // Chọn dùng master làm nguồn update chính (bạn có thể đổi logic nếu muốn)
+    if (isMasterRole()) {
+        // Device này là Master
+        if (masterVersion.length() > 0 && masterLink.length() > 0 && masterVersion > currentVersion) {
+            target.version = masterVersion;
+            target.url = masterLink;
+            Serial.println("📌 [OTA] Using MASTER firmware");
+        } else {
+            isNewVersion = false;
+            lastError = "Master firmware info is empty";
+            Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+            return false;
+        }
+    } else {
+        // Device này là Slave
+        if (slaveVersion.length() > 0 && slaveLink.length() > 0 && slaveVersion > currentVersion) {
+            target.version = slaveVersion;
+            target.url = slaveLink;
+            Serial.println("📌 [OTA] Using SLAVE firmware");
+        } else {
+            isNewVersion = false;
+            lastError = "Slave firmware info is empty";
+            Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+            return false;
+        }
+    }
+    if (target.version == currentVersion) {
+        Serial.println("✅ [OTA] Already running latest version");
+        isNewVersion = false;
+        return false;
+    }
+    uint8_t bucket = rolloutBucket(target.version);
+    if (bucket >= rollout) {
+        lastError = "Not in rollout yet";
+        Serial.printf("⏳ [OTA] %s at %d%%, this device is bucket %u\n", target.version.c_str(), rollout, bucket);
+        isNewVersion = false;
+        return false;
+    }
+    // Patch chỉ dựng đúng ảnh mới từ đúng phiên bản gốc
+    target.patchUrl = (patchFrom == currentVersion && patchLink.length() > 0) ? resolveLink(patchLink) : "";
+    target.compressedUrl = compressedLink.length() > 0 ? resolveLink(compressedLink) : "";
+    target.originUrl = originLink.length() > 0 ? resolveLink(originLink) : "";
+    isNewVersion = true;
+    return true;
+}
+
+bool OTAUpdate::isMasterRole() {
+    return currentVersion.indexOf("Master") >= 0 || currentVersion.indexOf("master") >= 0;
+}
+
+uint32_t OTAUpdate::fnv1a(const String& text) {
+    uint32_t hash = 0x811C9DC5;
+    for (size_t i = 0; i < text.length(); i++) {
+        hash ^= (uint8_t)text[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+// Theo cả phiên bản: mỗi bản có nhóm thiết bị nhận trước khác nhau, tăng % thì nhóm cũ vẫn nằm trong
+uint8_t OTAUpdate::rolloutBucket(const String& version) {
+    return fnv1a(clientID + "@" + version) % 100;
+}
+
+// Retry thứ n chờ ngẫu nhiên trong [d/2, d], d = RETRY_DELAY_MS * 2^(n-1): thiết bị lỗi cùng lúc không retry cùng lúc
+uint32_t OTAUpdate::retryDelayMs(int attempt) {
+    uint32_t base = min((uint32_t)RETRY_DELAY_MS << min(attempt - 1, 4), (uint32_t)OTA_RETRY_MAX_DELAY_MS);
+    return base / 2 + esp_random() % (base / 2 + 1);
+}
+
+bool OTAUpdate::backoffActive() {
+    return backoffUntil != 0 && (long)(millis() - backoffUntil) < 0;
+}
+
+// Retry-After là số giây hoặc HTTP-date (RFC 9110). Thiết bị không có giờ thực nên HTTP-date
+// được trừ cho header Date của chính response; không đọc được thì chờ OTA_DEFAULT_BACKOFF_MS
+uint32_t OTAUpdate::retryAfterMs(const String& retryAfter, const String& date) {
+    String value = retryAfter;
+    value.trim();
+    bool numeric = value.length() > 0;
+    for (size_t i = 0; i < value.length(); i++) {
+        if (!isdigit((unsigned char)value[i])) numeric = false;
+    }
+    if (numeric) {
+        long seconds = min(value.toInt(), (long)(OTA_MAX_BACKOFF_MS / 1000));
+        return (uint32_t)seconds * 1000;
+    }
+    int64_t until, now;
+    if (parseHttpDate(value, until) && parseHttpDate(date, now)) {
+        if (until <= now) return 0;
+        return (uint32_t)min(until - now, (int64_t)(OTA_MAX_BACKOFF_MS / 1000)) * 1000;
+    }
+    Serial.printf("⚠️ [OTA] Unparseable Retry-After '%s', waiting %d s\n", value.c_str(), OTA_DEFAULT_BACKOFF_MS / 1000);
+    return OTA_DEFAULT_BACKOFF_MS;
+}
+
+// IMF-fixdate "Sun, 06 Nov 1994 08:49:37 GMT" -> giây kể từ 1970 (UTC)
+bool OTAUpdate::parseHttpDate(const String& text, int64_t& epoch) {
+    char weekday[4], monthName[4], zone[4];
+    int day, year, hour, minute, second;
+    if (sscanf(text.c_str(), "%3s, %d %3s %d %d:%d:%d %3s", weekday, &day, monthName, &year,
+               &hour, &minute, &second, zone) != 8 || strcmp(zone, "GMT") != 0) {
+        return false;
+    }
+    const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char* found = strstr(months, monthName);
+    if (found == nullptr || strlen(monthName) != 3 || (found - months) % 3 != 0) return false;
+    int month = (found - months) / 3 + 1;
+    if (day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) return false;
+
+    // Số ngày từ 1970-01-01 (days_from_civil, lịch Gregory)
+    int y = year - (month <= 2);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = (int64_t)era * 146097 + doe - 719468;
+    epoch = days * 86400 + hour * 3600 + minute * 60 + second;
+    return true;
+}
+
+// Chỉ giữ manifestMutex khi đọc cache / ghi kết quả: request + retry (tới vài chục giây) chạy ngoài lock,
+// để getSlaveImage() và các lần check khác (vd. từ MQTT callback) không phải chờ
+bool OTAUpdate::refreshManifest(bool revalidate, int attempts) {
+    if (xSemaphoreTake(manifestMutex, portMAX_DELAY) != pdTRUE) {
         return false;
     }
+    bool valid = manifest.valid;
+    String etag = manifest.etag;
+    bool hit = false;
+    if (valid && manifest.fetchedAt == 0 && !revalidate &&
+        bootCheckAt != 0 && (long)(millis() - bootCheckAt) < 0) {
+        hit = true;
+        Serial.printf("📦 [OTA] Manifest from NVS, server check in %lus\n", (bootCheckAt - millis()) / 1000);
+    } else if (valid && manifest.fetchedAt != 0 && !revalidate &&
+               millis() - manifest.fetchedAt < OTA_MANIFEST_TTL_MS) {
+        hit = true;
+        Serial.printf("📦 [OTA] Manifest from cache (%lus old)\n", (millis() - manifest.fetchedAt) / 1000);
+    }
+    if (hit) {
+        manifestHits++;
+    }
+    xSemaphoreGive(manifestMutex);
+    if (hit) {
+        return true;
+    }
+
+    if (!WiFiStation::getInstance().isConnected()) {
+        lastError = "WiFi not connected";
+        return valid;               // Dùng tạm bản cũ
+    }
+    if (backoffActive()) {
+        lastError = "Server busy, retry in " + String((backoffUntil - millis()) / 1000) + "s";
+        Serial.printf("⏸️ [OTA] %s\n", lastError.c_str());
+        return valid;
+    }
 
-    HTTPClient http;
-    String url = serverUrl;
+    String url = endpointUrl();
+    // Mượn kết nối keep-alive tới backend: lần check sau (hoặc audio URL) không phải kết nối lại
+    HttpLease lease(url);
+    HTTPClient& http = lease.http();
 
     Serial.printf("🔍 [OTA] Checking for updates: %s\n", url.c_str());
 
     // Cấu hình retry// 6 giây
     int httpCode = 0;
     
-    // Thử lại tối đa MAX_RETRIES lần
-    for (int attempt = 1; attempt <= MAX_RETRIES; attempt++) {
-        Serial.printf("🔄 [OTA] Attempt %d/%d\n", attempt, MAX_RETRIES);
+    // Thử lại tối đa attempts lần
+    for (int attempt = 1; attempt <= attempts; attempt++) {
+        Serial.printf("🔄 [OTA] Attempt %d/%d\n", attempt, attempts);
         
         // Bắt đầu HTTP
-        http.begin(url);
+        if (attempt > 1) {
+            url = endpointUrl();    // Discovery có thể đã tìm ra backend mới sau lần lỗi trước
+            lease.open(url);
+        }
         http.addHeader("Content-Type", "application/json");
 
         // Thêm header Authorization: Bearer {client_id}
@@ -123,250 +342,589 @@ bool OTAUpdate::checkForUpdate(String& newVersion, String& downloadUrl) {
         String authHeader = "Bearer " + clientID;
         http.addHeader("Authorization", authHeader);
 
-        httpCode = http.GET();
+        // Có manifest -> chỉ cần server xác nhận còn đúng (304, không body)
+        if (valid && etag.length() > 0) {
+            http.addHeader("If-None-Match", etag);
+        }
+        const char* headerKeys[] = {"ETag", "Retry-After", "Date"};
+        http.collectHeaders(headerKeys, 3);
 
-        if (httpCode == HTTP_CODE_OK) {
+        httpCode = lease.GET();
+
+        if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_NOT_MODIFIED) {
             // Request thành công, thoát khỏi vòng lặp retry
             break;
+        } else if ((httpCode == HTTP_CODE_SERVICE_UNAVAILABLE || httpCode == HTTP_CODE_TOO_MANY_REQUESTS) &&
+                   http.header("Retry-After").length() > 0) {
+            // Server quá tải và hẹn giờ quay lại: không retry ngay, cộng thêm phần lệch riêng của thiết bị
+            uint32_t waitMs = retryAfterMs(http.header("Retry-After"), http.header("Date"));
+            waitMs += deviceHash % (waitMs / 4 + 1000);
+            backoffUntil = millis() + waitMs;
+            if (backoffUntil == 0) backoffUntil = 1;
+            serverBackoffs++;
+            lastError = "Server busy (HTTP " + String(httpCode) + "), retry in " + String(waitMs / 1000) + "s";
+            Serial.printf("⏸️ [OTA] %s\n", lastError.c_str());
+            http.end();
+            return valid;
         } else {
             // Request thất bại
             lastError = "HTTP error: " + String(httpCode);
-            Serial.printf("❌ [OTA] %s (Attempt %d/%d)\n", lastError.c_str(), attempt, MAX_RETRIES);
+            if (httpCode < 0 && serverUrl.startsWith("/")) {
+                // Không kết nối được (khác với server trả lỗi) -> có thể backend đã đổi địa chỉ
+                ServiceDiscovery::getInstance().reportFailure("OTA");
+            }
+            Serial.printf("❌ [OTA] %s (Attempt %d/%d)\n", lastError.c_str(), attempt, attempts);
             http.end();
             
             // Nếu chưa hết số lần thử, chờ và thử lại
-            if (attempt < MAX_RETRIES) {
-                Serial.printf("⏳ [OTA] Waiting %d seconds before retry...\n", RETRY_DELAY_MS / 1000);
-                delay(RETRY_DELAY_MS);
+            if (attempt < attempts) {
+                uint32_t waitMs = retryDelayMs(attempt);
+                Serial.printf("⏳ [OTA] Waiting %.1f seconds before retry...\n", waitMs / 1000.0);
+                delay(waitMs);
             }
         }
     }
 
-    // Kiểm tra kết quả sau khi retry
+    if (httpCode == HTTP_CODE_NOT_MODIFIED) {
+        lease.release(true);        // 304 không có body
+        if (xSemaphoreTake(manifestMutex, portMAX_DELAY) == pdTRUE) {
+            manifest.fetchedAt = millis();
+            manifestNotModified++;
+            xSemaphoreGive(manifestMutex);
+        }
+        Serial.printf("✅ [OTA] Manifest not modified (ETag %s)\n", etag.c_str());
+        return true;
+    }
     if (httpCode == HTTP_CODE_OK) {
-        String payload = http.getString();
-        Serial.printf("📦 [OTA] Server response: %s\n", payload.c_str());
+        return fetchManifest(lease, valid);
+    }
 
-        // Parse JSON response - tăng kích thước nếu cần (tùy dữ liệu trả về)
-        const size_t capacity = 6 * 256; // chỉnh nếu cần
-        DynamicJsonDocument doc(capacity);
-        DeserializationError error = deserializeJson(doc, payload);
+    // Sau attempts lần vẫn thất bại
+    lastError = "HTTP error after " + String(attempts) + " attempts: " + String(httpCode);
+    Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+    if (valid) {
+        Serial.println("⚠️ [OTA] Using stale manifest");
+        return true;
+    }
+    return false;
+}
 
-        if (error) {
-            lastError = "JSON parse error: " + String(error.c_str());
-            Serial.printf("❌ [OTA] %s\n", lastError.c_str());
-            http.end();
-            return false;
-        }
+bool OTAUpdate::fetchManifest(HttpLease& lease, bool haveManifest) {
+    HTTPClient& http = lease.http();
+    String etag = http.header("ETag");
 
-        // Kiểm tra trường success
-        bool success = doc["success"] | false;
+    // Chỉ giữ lại các trường dùng tới, parse thẳng từ socket (không qua String body)
+    StaticJsonDocument<OTA_JSON_FILTER_SIZE> filter;
+    filter["success"] = true;
+    filter["broker_server"] = true;
+    filter["broker_port"] = true;
+    filter["ws_url"] = true;
+    filter["master_link"] = true;
+    filter["master_version"] = true;
+    filter["slave_link"] = true;
+    filter["slave_version"] = true;
+    filter["master_patch_from"] = true;
+    filter["master_patch_link"] = true;
+    filter["slave_patch_from"] = true;
+    filter["slave_patch_link"] = true;
+    filter["master_compression"] = true;
+    filter["master_compressed_link"] = true;
+    filter["slave_compression"] = true;
+    filter["slave_compressed_link"] = true;
+    filter["master_sha256"] = true;
+    filter["master_signature"] = true;
+    filter["slave_sha256"] = true;
+    filter["slave_signature"] = true;
+    filter["slave_origin_link"] = true;
+    filter["master_rollout"] = true;
+    filter["slave_rollout"] = true;
 
-        if (!success) {
-            lastError = "Server reported success=false";
-            Serial.printf("❌ [OTA] %s\n", lastError.c_str());
-            http.end();
-            return false;
-        }
+    uint32_t heapBefore = ESP.getFreeHeap();
+    DynamicJsonDocument doc(OTA_JSON_DOC_SIZE);
+    HttpBodyReader body(http);
+    DeserializationError error = deserializeJson(doc, body, DeserializationOption::Filter(filter));
+    // Heap doc + reader còn giữ sau parse (không phải đỉnh: IDF 4.4 chỉ có mức thấp nhất từ lúc boot,
+    // không reset được quanh 1 lần parse -> in kèm "min free" để so)
+    uint32_t heapHeld = heapBefore - ESP.getFreeHeap();
+    lease.release(!error && body.drain());  // Đã đọc hết body -> trả kết nối về pool
+    Serial.printf("📊 [OTA] JSON: %d/%d B streamed, doc %u/%u B, heap held %u B, min free since boot %u B\n",
+                  body.consumed(), body.size(), doc.memoryUsage(), OTA_JSON_DOC_SIZE,
+                  heapHeld, ESP.getMinFreeHeap());
 
-        // Lấy các trường từ JSON (theo mẫu bạn cung cấp)
-        String brokerServer = doc["broker_server"] | "";
-        int    brokerPort   = doc["broker_port"] | 0;
-        String wsURL = doc["ws_url"] | "";
-
-        String masterLink    = doc["master_link"] | "";
-        String masterVersion = doc["master_version"] | "";
-
-        String slaveLink     = doc["slave_link"] | "";
-        String slaveVersion  = doc["slave_version"] | "";
-
-        savemqttInfo(brokerServer , brokerPort , wsURL, clientID);
-         // In log chi tiết
-        Serial.println("🎉 [OTA] Update info received:");
-        Serial.printf("   📌 Broker server: %s\n", brokerServer.c_str());
-        Serial.printf("   📌 Broker port: %d\n", brokerPort);
-        Serial.printf("   📌 wsURL: %s\n", wsURL.c_str());
-        Serial.printf("   📌 Master version: %s\n", masterVersion.c_str());
-        Serial.printf("   📌 Master link: %s\n", masterLink.c_str());
-        Serial.printf("   📌 Slave version: %s\n", slaveVersion.c_str());
-        Serial.printf("   📌 Slave link: %s\n", slaveLink.c_str());
-        // Chọn dùng master làm nguồn update chính (bạn có thể đổi logic nếu muốn)
-        bool isMasterDevice = currentVersion.indexOf("Master") >= 0 || 
-                      currentVersion.indexOf("master") >= 0;
-
-        if (isMasterDevice) {
-            // Device này là Master
-            if (masterVersion.length() > 0 && masterLink.length() > 0 && masterVersion > currentVersion) {
-                newVersion = masterVersion;
-                downloadUrl = masterLink;
-                Serial.println("📌 [OTA] Using MASTER firmware");
-            } else {
-                isNewVersion = false;
-                lastError = "Master firmware info is empty";
-                Serial.printf("❌ [OTA] %s\n", lastError.c_str());
-                http.end();
-                return false;
-            }
-        } else {
-            // Device này là Slave
-            if (slaveVersion.length() > 0 && slaveLink.length() > 0 && slaveVersion > currentVersion) {
-                newVersion = slaveVersion;
-                downloadUrl = slaveLink;
-                Serial.println("📌 [OTA] Using SLAVE firmware");
-            } else {
-                isNewVersion = false;
-                lastError = "Slave firmware info is empty";
-                Serial.printf("❌ [OTA] %s\n", lastError.c_str());
-                http.end();
-                return false;
-            }
-        }
-        if (newVersion == currentVersion) {
-            Serial.println("✅ [OTA] Already running latest version");
-            isNewVersion = false;
-            http.end();
-            return false;
-        }
-        isNewVersion = true;
-        http.end();
-        return true;
-    } else {
-        // Sau MAX_RETRIES lần vẫn thất bại
-        lastError = "HTTP error after " + String(MAX_RETRIES) + " attempts: " + String(httpCode);
+    if (error) {
+        lastError = "JSON parse error: " + String(error.c_str());
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        return haveManifest;
+    }
+    if (doc.overflowed()) {
+        Serial.printf("⚠️ [OTA] JSON doc overflowed (%u B), some fields dropped\n", OTA_JSON_DOC_SIZE);
+    }
+
+    // Kiểm tra trường success
+    bool success = doc["success"] | false;
+
+    if (!success) {
+        lastError = "Server reported success=false";
         Serial.printf("❌ [OTA] %s\n", lastError.c_str());
-        http.end();
         return false;
     }
+
+    // Lấy các trường từ JSON (theo mẫu bạn cung cấp) vào bản tạm, chỉ lock khi thay manifest
+    Manifest fresh;
+    fresh.brokerServer  = doc["broker_server"] | "";
+    fresh.brokerPort    = doc["broker_port"] | 0;
+    fresh.wsURL         = doc["ws_url"] | "";
+    fresh.masterLink    = doc["master_link"] | "";
+    fresh.masterVersion = doc["master_version"] | "";
+    fresh.slaveLink     = doc["slave_link"] | "";
+    fresh.slaveVersion  = doc["slave_version"] | "";
+    fresh.masterPatchFrom = doc["master_patch_from"] | "";
+    fresh.masterPatchLink = doc["master_patch_link"] | "";
+    fresh.slavePatchFrom  = doc["slave_patch_from"] | "";
+    fresh.slavePatchLink  = doc["slave_patch_link"] | "";
+    // Chỉ nhận ảnh nén dạng firmware giải nén được (OtaInflater)
+    fresh.masterCompressedLink = strcmp(doc["master_compression"] | "", "zlib") == 0
+        ? String(doc["master_compressed_link"] | "") : String();
+    fresh.slaveCompressedLink  = strcmp(doc["slave_compression"] | "", "zlib") == 0
+        ? String(doc["slave_compressed_link"] | "") : String();
+    fresh.masterSha256    = doc["master_sha256"] | "";
+    fresh.masterSignature = doc["master_signature"] | "";
+    fresh.slaveSha256     = doc["slave_sha256"] | "";
+    fresh.slaveSignature  = doc["slave_signature"] | "";
+    fresh.slaveOriginLink = doc["slave_origin_link"] | "";
+    fresh.masterRollout   = doc["master_rollout"] | 100;
+    fresh.slaveRollout    = doc["slave_rollout"] | 100;
+    fresh.etag = etag;
+    fresh.valid = true;
+    fresh.fetchedAt = millis();
+    if (xSemaphoreTake(manifestMutex, portMAX_DELAY) != pdTRUE) {
+        return haveManifest;
+    }
+    manifest = fresh;
+    manifestFetches++;
+    saveManifest();
+    xSemaphoreGive(manifestMutex);
+
+    savemqttInfo(fresh.brokerServer, fresh.brokerPort, fresh.wsURL, clientID);
+     // In log chi tiết
+    Serial.println("🎉 [OTA] Update info received:");
+    Serial.printf("   📌 Broker server: %s\n", fresh.brokerServer.c_str());
+    Serial.printf("   📌 Broker port: %d\n", fresh.brokerPort);
+    Serial.printf("   📌 wsURL: %s\n", fresh.wsURL.c_str());
+    Serial.printf("   📌 Master version: %s\n", fresh.masterVersion.c_str());
+    Serial.printf("   📌 Master link: %s\n", fresh.masterLink.c_str());
+    Serial.printf("   📌 Slave version: %s\n", fresh.slaveVersion.c_str());
+    Serial.printf("   📌 Slave link: %s\n", fresh.slaveLink.c_str());
+    if (fresh.masterPatchLink.length() > 0 || fresh.slavePatchLink.length() > 0) {
+        Serial.printf("   📌 Patch: master from %s, slave from %s\n",
+                      fresh.masterPatchFrom.c_str(), fresh.slavePatchFrom.c_str());
+    }
+    if (fresh.masterCompressedLink.length() > 0 || fresh.slaveCompressedLink.length() > 0) {
+        Serial.printf("   📌 Compressed: master %s, slave %s\n",
+                      fresh.masterCompressedLink.length() ? "yes" : "no",
+                      fresh.slaveCompressedLink.length() ? "yes" : "no");
+    }
+    Serial.printf("   📌 ETag: %s\n", etag.length() ? etag.c_str() : "(none)");
+    return true;
 }
+
+// Chỉ ghi những key thực sự đổi: manifest 200 thường vẫn mang broker / ws_url cũ
 void OTAUpdate::savemqttInfo(String brokerServer , int brokerPort ,String wsURL, String clientID) {
     Settings settings("mqtt", true);
 
-    settings.setString("broker", brokerServer);
-    settings.setInt("port", brokerPort);
-    settings.setString("clientId", clientID);
-    settings.setString("url", wsURL);
+    int changed = 0;
+    if (settings.getString("broker") != brokerServer) {
+        settings.setString("broker", brokerServer);
+        changed++;
+    }
+    if (settings.getInt("port") != brokerPort) {
+        settings.setInt("port", brokerPort);
+        changed++;
+    }
+    if (settings.getString("clientId") != clientID) {
+        settings.setString("clientId", clientID);
+        changed++;
+    }
+    if (settings.getString("url") != wsURL) {
+        settings.setString("url", wsURL);
+        changed++;
+    }
+    if (changed > 0) {
+        Serial.printf("💾 [OTA] MQTT settings updated (%d keys)\n", changed);
+    }
+}
+
+// Manifest lưu kèm ETag: sau khi reboot lần check đầu chỉ cần 304.
+// Broker / ws_url đã nằm trong namespace "mqtt" nên lấy lại từ đó.
+void OTAUpdate::loadManifest() {
+    Settings mf("ota_mf", false);
+    Settings mqttSettings("mqtt", false);
+    manifest.etag          = mf.getString("etag");
+    manifest.masterLink    = mf.getString("m_link");
+    manifest.masterVersion = mf.getString("m_ver");
+    manifest.slaveLink     = mf.getString("s_link");
+    manifest.slaveVersion  = mf.getString("s_ver");
+    manifest.masterPatchFrom = mf.getString("m_pfrom");
+    manifest.masterPatchLink = mf.getString("m_plink");
+    manifest.slavePatchFrom  = mf.getString("s_pfrom");
+    manifest.slavePatchLink  = mf.getString("s_plink");
+    manifest.masterCompressedLink = mf.getString("m_zlink");
+    manifest.slaveCompressedLink  = mf.getString("s_zlink");
+    manifest.masterSha256    = mf.getString("m_sha");
+    manifest.masterSignature = mf.getString("m_sig");
+    manifest.slaveSha256     = mf.getString("s_sha");
+    manifest.slaveSignature  = mf.getString("s_sig");
+    manifest.slaveOriginLink = mf.getString("s_olink");
+    manifest.masterRollout   = mf.getInt("m_roll", 100);
+    manifest.slaveRollout    = mf.getInt("s_roll", 100);
+    manifest.brokerServer  = mqttSettings.getString("broker");
+    manifest.brokerPort    = mqttSettings.getInt("port");
+    manifest.wsURL         = mqttSettings.getString("url");
+    manifest.valid = manifest.etag.length() > 0;
+    manifest.fetchedAt = 0;     // Chưa được server xác nhận -> lần check đầu luôn revalidate
+    if (manifest.valid) {
+        Serial.printf("📖 [OTA] Cached manifest: ETag %s\n", manifest.etag.c_str());
+    }
+}
+
+void OTAUpdate::saveManifest() {
+    Settings mf("ota_mf", true);
+    const char* keys[]   = {"etag", "m_link", "m_ver", "s_link", "s_ver",
+                            "m_pfrom", "m_plink", "s_pfrom", "s_plink", "m_zlink", "s_zlink",
+                            "m_sha", "m_sig", "s_sha", "s_sig", "s_olink"};
+    const String* vals[] = {&manifest.etag, &manifest.masterLink, &manifest.masterVersion,
+                            &manifest.slaveLink, &manifest.slaveVersion,
+                            &manifest.masterPatchFrom, &manifest.masterPatchLink,
+                            &manifest.slavePatchFrom, &manifest.slavePatchLink,
+                            &manifest.masterCompressedLink, &manifest.slaveCompressedLink,
+                            &manifest.masterSha256, &manifest.masterSignature,
+                            &manifest.slaveSha256, &manifest.slaveSignature,
+                            &manifest.slaveOriginLink};
+    for (int i = 0; i < 16; i++) {
+        if (mf.getString(keys[i]) != *vals[i]) {
+            mf.setString(keys[i], *vals[i]);
+        }
+    }
+    if (mf.getInt("m_roll", 100) != manifest.masterRollout) mf.setInt("m_roll", manifest.masterRollout);
+    if (mf.getInt("s_roll", 100) != manifest.slaveRollout) mf.setInt("s_roll", manifest.slaveRollout);
 }
 // Download and update firmware
-bool OTAUpdate::downloadAndUpdate(const String& url) {
-    if (WiFi.status() != WL_CONNECTED) {
+bool OTAUpdate::downloadAndUpdate(const UpdateTarget& target, const String& url, OtaFormat format) {
+    if (!WiFiStation::getInstance().isConnected()) {
         lastError = "WiFi not connected";
         if (onErrorCallback) onErrorCallback(lastError.c_str());
         return false;
     }
+
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == NULL) {
+        lastError = "No OTA partition";
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        if (onErrorCallback) onErrorCallback(lastError.c_str());
+        return false;
+    }
+
+    // Chỉ ảnh đầy đủ tải tiếp được (patch / ảnh nén phải giải mã từ đầu stream).
+    // Các dạng khác ghi đè cùng partition nên phần đã tải dở không còn dùng được.
+    ResumeState resume;
+    bool resuming = false;
+    if (format == OTA_FORMAT_IMAGE) {
+        resuming = loadResume(resume) && resume.url == url && resume.partition == partition->address
+                   && resume.offset > 0 && resume.offset < resume.size && resume.size <= partition->size;
+    } else {
+        clearResume();
+    }
     
-    HTTPClient http;
-    http.begin(url);
-    
-    Serial.printf("📥 [OTA] Starting firmware download from: %s\n", url.c_str());
+    HttpLease lease(url);
+    HTTPClient& http = lease.http();
     
-    int httpCode = http.GET();
+    static const char* formatNames[] = {"firmware", "patch", "compressed firmware"};
+    Serial.printf("📥 [OTA] Starting %s download from: %s\n", formatNames[format], url.c_str());
+    if (format != OTA_FORMAT_IMAGE) {
+        // Patch / ảnh nén nằm trên backend, cần xác thực như get_info_update
+        http.addHeader("Authorization", "Bearer " + clientID);
+    }
+    if (resuming) {
+        Serial.printf("⏯️ [OTA] Resuming at %u/%u bytes\n", resume.offset, resume.size);
+        http.addHeader("Range", "bytes=" + String(resume.offset) + "-");
+        if (resume.etag.length() > 0) {
+            http.addHeader("If-Range", resume.etag);
+        }
+    }
+    const char* headerKeys[] = {"ETag", "Content-Range"};
+    http.collectHeaders(headerKeys, 2);
     
-    if (httpCode == HTTP_CODE_OK) {
-        int contentLength = http.getSize();
-        
-        if (contentLength <= 0) {
-            lastError = "Invalid content length";
+    int httpCode = lease.GET();
+
+    // 206: server tiếp tục từ offset; 200: không hỗ trợ Range hoặc ảnh đã đổi (If-Range) -> tải lại từ đầu
+    if (resuming && httpCode == HTTP_CODE_PARTIAL_CONTENT) {
+        String range = http.header("Content-Range");        // "bytes <start>-<end>/<total>"
+        uint32_t start = range.substring(range.indexOf(' ') + 1).toInt();
+        uint32_t total = range.substring(range.indexOf('/') + 1).toInt();
+        if (start != resume.offset || total != resume.size) {
+            lastError = "Resume mismatch: " + range;
             Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+            clearResume();
             if (onErrorCallback) onErrorCallback(lastError.c_str());
             http.end();
             return false;
         }
-        
-        Serial.printf("📦 [OTA] Firmware size: %d bytes\n", contentLength);
-        
-        bool canBegin = Update.begin(contentLength);
-        
-        if (!canBegin) {
-            lastError = "Not enough space for OTA";
+        httpCode = HTTP_CODE_OK;
+    } else if (resuming) {
+        Serial.printf("⚠️ [OTA] Server did not resume (HTTP %d), restarting from 0\n", httpCode);
+        resuming = false;
+        if (httpCode != HTTP_CODE_OK) clearResume();
+    }
+    
+    if (httpCode != HTTP_CODE_OK) {
+        lastError = "HTTP error: " + String(httpCode);
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        if (onErrorCallback) onErrorCallback(lastError.c_str());
+        http.end();
+        return false;
+    }
+
+    int contentLength = http.getSize();
+    
+    if (contentLength <= 0) {
+        lastError = "Invalid content length";
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        if (onErrorCallback) onErrorCallback(lastError.c_str());
+        http.end();
+        return false;
+    }
+    
+    // Patch: kiểm tra ảnh đang chạy đúng là ảnh gốc trước khi ghi partition OTA
+    OtaDelta delta;
+    OtaInflater inflater;
+    int imageSize = contentLength;
+    uint32_t startOffset = 0;
+    if (format == OTA_FORMAT_DELTA) {
+        if (!delta.begin(http.getStreamPtr(), contentLength, esp_ota_get_running_partition())) {
+            lastError = String("Delta: ") + delta.error();
             Serial.printf("❌ [OTA] %s\n", lastError.c_str());
             if (onErrorCallback) onErrorCallback(lastError.c_str());
             http.end();
             return false;
         }
-        
-        // Callback when start
-        if (onStartCallback) onStartCallback();
-        
-        WiFiClient* stream = http.getStreamPtr();
-        
-        size_t written = 0;
-        uint8_t buff[128] = { 0 };
-        
-        Serial.println("🔄 [OTA] Writing firmware...");
-        
-        while (http.connected() && (written < contentLength)) {
-            size_t available = stream->available();
-            
-            if (available) {
-                int c = stream->readBytes(buff, min(available, sizeof(buff)));
-                
-                if (c > 0) {
-                    written += Update.write(buff, c);
-                    
-                    // Update progress
-                    updateProgress = (written * 100) / contentLength;
-                    
-                    // Callback progress
-                    if (onProgressCallback) {
-                        onProgressCallback(updateProgress);
-                    }
-                    
-                    // Print progress every 10%
-                    static int lastPrintedProgress = 0;
-                    if (updateProgress - lastPrintedProgress >= 10) {
-                        Serial.printf("📊 [OTA] Progress: %d%%\n", updateProgress);
-                        lastPrintedProgress = updateProgress;
-                    }
-                }
-            }
-            
-            delay(1);
-        }
-        
-        Serial.printf("✅ [OTA] Written %d bytes\n", written);
-        
-        if (written == contentLength) {
-            Serial.println("✅ [OTA] All data written");
-        } else {
-            lastError = "Written bytes mismatch";
-            Serial.printf("❌ [OTA] %s: written=%d, expected=%d\n", 
-                         lastError.c_str(), written, contentLength);
-            Update.abort();
+        imageSize = delta.newSize();
+        Serial.printf("📦 [OTA] Patch size: %d bytes -> firmware %d bytes\n", contentLength, imageSize);
+    } else if (format == OTA_FORMAT_ZLIB) {
+        if (!inflater.begin(http.getStreamPtr(), contentLength)) {
+            lastError = String("Inflate: ") + inflater.error();
+            Serial.printf("❌ [OTA] %s\n", lastError.c_str());
             if (onErrorCallback) onErrorCallback(lastError.c_str());
             http.end();
             return false;
         }
-        
-        if (Update.end()) {
-            if (Update.isFinished()) {
-                Serial.println("🎉 [OTA] Update successfully completed!");
-                
-                // Save OTA info
-                saveOTAInfo(currentVersion, String(millis() / 1000));
-                
-                // Callback when end
-                if (onEndCallback) onEndCallback(true);
-                
-                Serial.println("🔄 [OTA] Rebooting in 3 seconds...");
-                delay(3000);
-                ESP.restart();
-                
-                return true;
+        imageSize = inflater.imageSize();
+        Serial.printf("📦 [OTA] Compressed size: %d bytes -> firmware %d bytes\n", contentLength, imageSize);
+    } else if (resuming) {
+        startOffset = resume.offset;
+        imageSize = resume.size;
+        Serial.printf("📦 [OTA] Firmware size: %d bytes, %d remaining\n", imageSize, contentLength);
+    } else {
+        Serial.printf("📦 [OTA] Firmware size: %d bytes\n", contentLength);
+        resume.url = url;
+        resume.etag = http.header("ETag");
+        resume.size = contentLength;
+        resume.offset = 0;
+        resume.partition = partition->address;
+        saveResume(resume);
+    }
+    
+    if ((uint32_t)imageSize > partition->size) {
+        lastError = "Not enough space for OTA";
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        if (onErrorCallback) onErrorCallback(lastError.c_str());
+        http.end();
+        return false;
+    }
+
+    // sha256 tính dần trên từng block đã ghi; tải tiếp thì hash lại phần đã có trong flash 1 lần
+    OtaVerifier verifier;
+    verifier.begin();
+    if (startOffset > 0 && !verifier.resumeFrom(partition, startOffset)) {
+        lastError = String("Verify: ") + verifier.error();
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        if (onErrorCallback) onErrorCallback(lastError.c_str());
+        http.end();
+        return false;
+    }
+
+    resumedFrom = startOffset;
+    bytesWritten = startOffset;
+    downloadStart = millis();
+
+    // Dựng pipeline: 2 block 4 KB + writer task
+    OtaPipeline pipe = {};
+    pipe.ota = this;
+    pipe.total = imageSize;
+    pipe.partition = partition;
+    pipe.offset = startOffset;
+    pipe.savedOffset = startOffset;
+    pipe.resumable = format == OTA_FORMAT_IMAGE;
+    pipe.verifier = &verifier;
+    pipe.freeBlocks = xQueueCreate(OTA_PIPELINE_BUFFERS, sizeof(uint8_t));
+    pipe.fullBlocks = xQueueCreate(OTA_PIPELINE_BUFFERS + 1, sizeof(OtaBlock));    // +1 chỗ cho block kết thúc
+    pipe.done = xSemaphoreCreateBinary();
+    bool ready = pipe.freeBlocks && pipe.fullBlocks && pipe.done;
+    for (uint8_t i = 0; i < OTA_PIPELINE_BUFFERS && ready; i++) {
+        pipe.buffers[i] = (uint8_t*)malloc(OTA_BLOCK_SIZE);
+        ready = pipe.buffers[i] != nullptr;
+        if (ready) xQueueSend(pipe.freeBlocks, &i, 0);
+    }
+    TaskHandle_t writerHandle = NULL;
+    if (ready) {
+        // Core 0: task download (core 1) vẫn đọc socket trong lúc writer chờ erase / ghi flash
+        ready = xTaskCreatePinnedToCore(flashWriterTask, "OTAWriter", OTA_WRITER_STACK,
+                                        &pipe, 2, &writerHandle, 0) == pdPASS;
+    }
+    if (!ready) {
+        lastError = "Not enough memory for OTA pipeline";
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+    }
+
+    uint32_t waitMs = 0;            // Thời gian chờ writer trả block (flash chậm hơn mạng)
+    size_t received = startOffset;
+    WiFiClient* stream = http.getStreamPtr();
+
+    // Callback when start
+    if (ready && onStartCallback) onStartCallback();
+    if (ready) Serial.printf("🔄 [OTA] Writing firmware to %s (%d x %d B pipeline)...\n",
+                             partition->label, OTA_PIPELINE_BUFFERS, OTA_BLOCK_SIZE);
+
+    while (ready && received < (size_t)imageSize && !pipe.failed) {
+        uint8_t index;
+        uint32_t waitStart = millis();
+        if (xQueueReceive(pipe.freeBlocks, &index, pdMS_TO_TICKS(OTA_STALL_TIMEOUT_MS)) != pdTRUE) {
+            lastError = "Flash writer stalled";
+            break;
+        }
+        waitMs += millis() - waitStart;
+
+        // Đổ đầy block (block cuối có thể ngắn hơn); readBytes chờ tới timeout của HTTPClient
+        size_t want = min((size_t)OTA_BLOCK_SIZE, imageSize - received);
+        size_t filled = 0;
+        if (format == OTA_FORMAT_DELTA) {
+            filled = delta.read(pipe.buffers[index], want);
+        } else if (format == OTA_FORMAT_ZLIB) {
+            filled = inflater.read(pipe.buffers[index], want);
+        }
+        uint32_t lastData = millis();
+        while (format == OTA_FORMAT_IMAGE && filled < want && millis() - lastData < OTA_STALL_TIMEOUT_MS) {
+            size_t n = stream->readBytes(pipe.buffers[index] + filled, want - filled);
+            if (n > 0) {
+                filled += n;
+                lastData = millis();
+            } else if (!http.connected()) {
+                break;
+            }
+        }
+        if (filled < want) {
+            if (format == OTA_FORMAT_DELTA) {
+                lastError = String("Delta: ") + delta.error();
+            } else if (format == OTA_FORMAT_ZLIB) {
+                lastError = String("Inflate: ") + inflater.error();
             } else {
-                lastError = "Update not finished";
-                Serial.printf("❌ [OTA] %s\n", lastError.c_str());
-                if (onErrorCallback) onErrorCallback(lastError.c_str());
-                if (onEndCallback) onEndCallback(false);
+                lastError = "Connection lost";
             }
+            xQueueSend(pipe.freeBlocks, &index, 0);
+            break;
+        }
+        received += filled;
+        OtaBlock block = {index, (uint16_t)filled};
+        xQueueSend(pipe.fullBlocks, &block, portMAX_DELAY);
+    }
+
+    // Báo writer kết thúc và chờ nó ghi xong các block còn lại
+    if (writerHandle != NULL) {
+        OtaBlock endBlock = {0, 0};
+        xQueueSend(pipe.fullBlocks, &endBlock, portMAX_DELAY);
+        xSemaphoreTake(pipe.done, portMAX_DELAY);
+    }
+    for (uint8_t i = 0; i < OTA_PIPELINE_BUFFERS; i++) {
+        free(pipe.buffers[i]);
+    }
+    if (pipe.freeBlocks) vQueueDelete(pipe.freeBlocks);
+    if (pipe.fullBlocks) vQueueDelete(pipe.fullBlocks);
+    if (pipe.done) vSemaphoreDelete(pipe.done);
+
+    size_t written = bytesWritten;
+    uint32_t durationMs = millis() - downloadStart;
+    uint32_t kbps = throughputKBps();
+    if (ready) {
+        Serial.printf("✅ [OTA] Written %d bytes\n", written - startOffset);
+        Serial.printf("📊 [OTA] %u KB in %u.%u s (%u KB/s), flash %u ms, sha256 %u ms, waited on flash %u ms\n",
+                      (written - startOffset) / 1024, durationMs / 1000, (durationMs % 1000) / 100, kbps,
+                      pipe.flashUs / 1000, verifier.hashUs() / 1000, waitMs);
+        if (format == OTA_FORMAT_DELTA) {
+            Serial.printf("📊 [OTA] Delta: %u B downloaded for %u B image\n", delta.patchRead(), written);
+        } else if (format == OTA_FORMAT_ZLIB) {
+            Serial.printf("📊 [OTA] Compressed: %u B downloaded for %u B image\n", inflater.compressedRead(), written);
+        } else if (startOffset > 0) {
+            Serial.printf("📊 [OTA] Resumed: skipped %u B already in flash\n", startOffset);
+        }
+    }
+
+    if (!ready) {
+        if (onErrorCallback) onErrorCallback(lastError.c_str());
+    } else if (written == (size_t)imageSize && format == OTA_FORMAT_DELTA && !delta.verify()) {
+        // Ảnh dựng lại sai (patch hỏng / sai ảnh gốc): không đổi partition boot
+        lastError = String("Delta: ") + delta.error();
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        if (onErrorCallback) onErrorCallback(lastError.c_str());
+    } else if (written == (size_t)imageSize && format == OTA_FORMAT_ZLIB && !inflater.finish()) {
+        // Stream nén hỏng (adler32 sai / bị cắt): không đổi partition boot
+        lastError = String("Inflate: ") + inflater.error();
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        if (onErrorCallback) onErrorCallback(lastError.c_str());
+    } else if (written == (size_t)imageSize && !verifier.verify(target.sha256, target.signature)) {
+        // Ảnh không khớp sha256 / chữ ký trong manifest: không đổi partition boot, lần sau tải lại từ đầu
+        lastError = String("Verify: ") + verifier.error();
+        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        clearResume();
+        if (onErrorCallback) onErrorCallback(lastError.c_str());
+        if (onEndCallback) onEndCallback(false);
+    } else if (written == (size_t)imageSize) {
+        Serial.println("✅ [OTA] All data written");
+        clearResume();
+        
+        // esp_ota_set_boot_partition kiểm tra cả ảnh (header, checksum, sha256) trước khi đổi boot
+        esp_err_t err = esp_ota_set_boot_partition(partition);
+        if (err == ESP_OK) {
+            Serial.println("🎉 [OTA] Update successfully completed!");
+            
+            // Save OTA info
+            saveOTAInfo(currentVersion, String(millis() / 1000), durationMs, kbps);
+            
+            // Callback when end
+            if (onEndCallback) onEndCallback(true);
+            
+            Serial.println("🔄 [OTA] Rebooting in 3 seconds...");
+            delay(3000);
+            ESP.restart();
+            
+            return true;
         } else {
-            lastError = "Update error: " + String(Update.errorString());
+            lastError = "Image validation failed: " + String(esp_err_to_name(err));
             Serial.printf("❌ [OTA] %s\n", lastError.c_str());
             if (onErrorCallback) onErrorCallback(lastError.c_str());
             if (onEndCallback) onEndCallback(false);
         }
     } else {
-        lastError = "HTTP error: " + String(httpCode);
-        Serial.printf("❌ [OTA] %s\n", lastError.c_str());
+        if (pipe.failed) {
+            lastError = "Flash write error: " + String(esp_err_to_name(pipe.error));
+            clearResume();
+        } else if (lastError.length() == 0) {
+            lastError = "Written bytes mismatch";
+        }
+        if (pipe.resumable && !pipe.failed && pipe.offset > pipe.savedOffset) {
+            // Mất kết nối: lưu hết phần đã ghi để lần sau tải tiếp từ đây
+            saveResumeOffset(pipe.offset);
+        }
+        Serial.printf("❌ [OTA] %s: written=%d, expected=%d\n", 
+                     lastError.c_str(), written, imageSize);
         if (onErrorCallback) onErrorCallback(lastError.c_str());
     }
     
@@ -374,6 +932,100 @@ bool OTAUpdate::downloadAndUpdate(const String& url) {
     return false;
 }
 
+// Xóa sector rồi ghi block vào partition OTA theo thứ tự nhận, trả block về cho task download.
+// Mỗi block = 1 sector (OTA_BLOCK_SIZE), nên offset luôn thẳng hàng sector kể cả khi tải tiếp.
+void OTAUpdate::flashWriterTask(void* parameter) {
+    OtaPipeline* pipe = (OtaPipeline*)parameter;
+    OTAUpdate* ota = pipe->ota;
+    int lastPrintedProgress = ota->bytesWritten * 100 / pipe->total;
+    OtaBlock block;
+
+    while (xQueueReceive(pipe->fullBlocks, &block, portMAX_DELAY) == pdTRUE && block.length > 0) {
+        if (!pipe->failed) {
+            uint8_t* data = pipe->buffers[block.index];
+            uint32_t start = micros();
+            if (pipe->offset == 0 && data[0] != ESP_IMAGE_HEADER_MAGIC) {
+                pipe->error = ESP_ERR_OTA_VALIDATE_FAILED;      // Không phải ảnh firmware ESP32
+            } else {
+                pipe->error = esp_partition_erase_range(pipe->partition, pipe->offset, OTA_BLOCK_SIZE);
+            }
+            if (pipe->error == ESP_OK) {
+                pipe->error = esp_partition_write(pipe->partition, pipe->offset, data, block.length);
+            }
+            pipe->flashUs += micros() - start;
+            if (pipe->error != ESP_OK) {
+                pipe->failed = true;    // Task download dừng ở block kế tiếp
+            } else {
+                pipe->verifier->update(data, block.length);
+                pipe->offset += block.length;
+                ota->bytesWritten += block.length;
+                if (pipe->resumable && pipe->offset - pipe->savedOffset >= OTA_RESUME_SAVE_BYTES) {
+                    ota->saveResumeOffset(pipe->offset);
+                    pipe->savedOffset = pipe->offset;
+                }
+                int progress = (uint64_t)ota->bytesWritten * 100 / pipe->total;
+                if (progress != ota->updateProgress) {
+                    ota->updateProgress = progress;
+                    if (ota->onProgressCallback) {
+                        ota->onProgressCallback(progress);
+                    }
+                }
+                // Print progress every 10%
+                if (progress - lastPrintedProgress >= 10) {
+                    Serial.printf("📊 [OTA] Progress: %d%% (%u KB/s)\n", progress, ota->throughputKBps());
+                    lastPrintedProgress = progress;
+                }
+            }
+        }
+        xQueueSend(pipe->freeBlocks, &block.index, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(pipe->done);
+    vTaskDelete(NULL);
+}
+
+// ======= Resume state (NVS "ota_rs") =======
+bool OTAUpdate::loadResume(ResumeState& state) {
+    Settings rs("ota_rs", false);
+    state.url       = rs.getString("url");
+    state.etag      = rs.getString("etag");
+    state.size      = rs.getInt("size");
+    state.offset    = rs.getInt("offset");
+    state.partition = rs.getInt("part");
+    return state.url.length() > 0;
+}
+
+void OTAUpdate::saveResume(const ResumeState& state) {
+    Settings rs("ota_rs", true);
+    rs.setString("url", state.url);
+    rs.setString("etag", state.etag);
+    rs.setInt("size", state.size);
+    rs.setInt("offset", state.offset);
+    rs.setInt("part", state.partition);
+}
+
+void OTAUpdate::saveResumeOffset(uint32_t offset) {
+    Settings rs("ota_rs", true);
+    rs.setInt("offset", offset);
+}
+
+void OTAUpdate::clearResume() {
+    Settings rs("ota_rs", true);
+    if (rs.getString("url").length() > 0) {
+        rs.eraseAll();
+    }
+}
+
+uint32_t OTAUpdate::resumeOffset(const String& url) {
+    ResumeState state;
+    return loadResume(state) && state.url == url ? state.offset : 0;
+}
+
+uint32_t OTAUpdate::throughputKBps() {
+    uint32_t elapsed = millis() - downloadStart;
+    return elapsed ? (uint64_t)(bytesWritten - resumedFrom) * 1000 / 1024 / elapsed : 0;
+}
+
 // Perform update
 bool OTAUpdate::performUpdate(bool forceUpdate ) {
     if (xSemaphoreTake(mutex, portMAX_DELAY) != pdTRUE) {
@@ -388,16 +1040,65 @@ bool OTAUpdate::performUpdate(bool forceUpdate ) {
     
     isUpdating = true;
     updateProgress = 0;
+    downloadStart = 0;
+    bytesWritten = 0;
+    resumedFrom = 0;
     lastError = "";
     
     xSemaphoreGive(mutex);
     
-    String newVersion, downloadUrl;
+    UpdateTarget target;
     
-    if (checkForUpdate(newVersion, downloadUrl)) {
+    if (checkForUpdate(target)) {
         if (forceUpdate) {
             Serial.println("🚀 [OTA] Force update initiated...");
-            bool result = downloadAndUpdate(downloadUrl);
+            bool result = false;
+            if (resumeOffset(target.url) > 0) {
+                // Ảnh đầy đủ đang tải dở (mất kết nối / reboot): tải tiếp thay vì thử patch / ảnh nén,
+                // vì 2 cách đó ghi đè partition từ đầu
+                Serial.println("⏯️ [OTA] Unfinished download found, resuming full image");
+                target.patchUrl = "";
+                target.compressedUrl = "";
+            }
+            if (target.patchUrl.length() > 0) {
+                // Thành công thì đã restart; lỗi (patch hỏng, ảnh gốc khác...) -> tải ảnh đầy đủ
+                Serial.printf("🧩 [OTA] Delta update %s -> %s\n", currentVersion.c_str(), target.version.c_str());
+                result = downloadAndUpdate(target, target.patchUrl, OTA_FORMAT_DELTA);
+                if (!result) {
+                    Serial.println("⚠️ [OTA] Delta update failed, falling back to full image");
+                }
+            }
+            if (!result && target.originUrl.length() > 0) {
+                // url là cache của master trong LAN: tải ảnh đầy đủ ở tốc độ LAN, lỗi thì quay về server
+                Serial.println("🏠 [OTA] Downloading from master's LAN cache");
+                result = downloadAndUpdate(target, target.url);
+                if (!result) {
+                    Serial.println("⚠️ [OTA] LAN cache failed, falling back to server");
+                    target.url = target.originUrl;
+                }
+            }
+            if (!result && target.compressedUrl.length() > 0) {
+                // Ảnh đầy đủ nhưng nén: ít byte qua WiFi hơn, ghi flash vẫn theo pipeline
+                result = downloadAndUpdate(target, target.compressedUrl, OTA_FORMAT_ZLIB);
+                if (!result) {
+                    Serial.println("⚠️ [OTA] Compressed update failed, falling back to raw image");
+                }
+            }
+            // Mất kết nối giữa chừng: thử lại, mỗi lần tải tiếp từ offset đã lưu (Range).
+            // Dừng khi 1 lần thử không ghi thêm được byte nào.
+            for (int attempt = 1; !result && attempt <= MAX_RETRIES; attempt++) {
+                uint32_t before = resumeOffset(target.url);
+                result = downloadAndUpdate(target, target.url);
+                if (!result && resumeOffset(target.url) <= before) {
+                    break;
+                }
+                if (!result && attempt < MAX_RETRIES) {
+                    uint32_t waitMs = retryDelayMs(attempt);
+                    Serial.printf("⏳ [OTA] Retrying in %.1f seconds (attempt %d/%d)...\n",
+                                  waitMs / 1000.0, attempt + 1, MAX_RETRIES);
+                    delay(waitMs);
+                }
+            }
             
             if (xSemaphoreTake(mutex, portMAX_DELAY) == pdTRUE) {
                 isUpdating = false;
@@ -426,10 +1127,30 @@ bool OTAUpdate::performUpdate(bool forceUpdate ) {
     return false;
 }
 
+bool OTAUpdate::getSlaveImage(String& version, String& url, String& sha256, String& signature) {
+    if (xSemaphoreTake(manifestMutex, portMAX_DELAY) != pdTRUE) {
+        return false;
+    }
+    version   = manifest.slaveVersion;
+    url       = manifest.slaveOriginLink.length() > 0 ? manifest.slaveOriginLink : manifest.slaveLink;
+    sha256    = manifest.slaveSha256;
+    signature = manifest.slaveSignature;
+    bool valid = manifest.valid;
+    xSemaphoreGive(manifestMutex);
+    url = resolveLink(url);
+    return valid && version.length() > 0 && url.length() > 0;
+}
+
+bool OTAUpdate::hasPendingDownload() {
+    ResumeState state;
+    return loadResume(state);
+}
+
 // Check if has new version
-bool OTAUpdate::hasNewVersion() {
-    String newVersion, downloadUrl;
-    return checkForUpdate(newVersion, downloadUrl);
+bool OTAUpdate::hasNewVersion(bool revalidate) {
+    UpdateTarget target;
+    // Hỏi lại theo yêu cầu (OTA:CK / OTA:UP trong MQTT callback) chỉ thử 1 lần, lỗi thì dùng manifest cũ
+    return checkForUpdate(target, revalidate, revalidate ? 1 : MAX_RETRIES);
 }
 
 // OTA monitor task
@@ -441,9 +1162,12 @@ void OTAUpdate::otaMonitorTask(void* parameter) {
     while (true) {
         unsigned long currentTime = millis();
         
-        // Check if it's time to check for updates
-        if (currentTime - ota->lastCheck >= ota->checkInterval) {
+        // Check if it's time to check for updates (pha riêng của thiết bị, server hẹn lùi thì chờ)
+        if ((long)(currentTime - ota->nextCheck) >= 0 && !ota->backoffActive()) {
             ota->lastCheck = currentTime;
+            while ((long)(currentTime - ota->nextCheck) >= 0) {
+                ota->nextCheck += ota->checkInterval;
+            }
             
             Serial.println("⏰ [OTA] Periodic update check...");
             
@@ -468,11 +1192,36 @@ void OTAUpdate::otaMonitorTask(void* parameter) {
     }
 }
 
+// Sau khi bật nguồn: hỏi server đúng lúc bootCheckAt (setup đã chạy bằng manifest NVS), rồi tự xóa
+void OTAUpdate::deferredCheckTask(void* parameter) {
+    OTAUpdate* ota = (OTAUpdate*)parameter;
+    long waitMs = (long)(ota->bootCheckAt - millis());
+    if (waitMs > 0) {
+        vTaskDelay(pdMS_TO_TICKS(waitMs));
+    }
+    ota->bootCheckAt = 0;
+    WiFiStation::getInstance().waitUntilConnected(WIFI_WAIT_FOREVER);
+    for (int attempt = 1; attempt <= MAX_RETRIES; attempt++) {
+        UpdateTarget target;
+        ota->checkForUpdate(target, true);
+        if (!ota->backoffActive()) {
+            break;
+        }
+        long remaining = (long)(ota->backoffUntil - millis());     // Hẹn đã qua thì hỏi lại ngay
+        if (remaining > 0) {
+            vTaskDelay(pdMS_TO_TICKS(remaining));
+        }
+    }
+    vTaskDelete(NULL);
+}
+
 // Save OTA info to NVS
-void OTAUpdate::saveOTAInfo(const String& version, const String& updateTime) {
+void OTAUpdate::saveOTAInfo(const String& version, const String& updateTime, uint32_t durationMs, uint32_t kbps) {
     Settings otaSettings("ota", true);
     otaSettings.setString("last_version", version);
     otaSettings.setString("last_update", updateTime);
+    otaSettings.setInt("last_ms", durationMs);
+    otaSettings.setInt("last_kbps", kbps);
     Serial.println("💾 [OTA] Saved OTA info to NVS");
 }
 
@@ -534,7 +1283,7 @@ void OTAUpdate::enableAutoCheck(bool enable) {
         }
     }
 }
-String OTAUpdate::Getinfo4mqtt(){
+String OTAUpdate::Getinfo4mqtt(bool revalidate){
     String info = "";
     bool updating = false;
     int progress = 0;
@@ -549,18 +1298,23 @@ String OTAUpdate::Getinfo4mqtt(){
     }
     
     // Early return nếu đang update
+    // OTA:UPDATING@<progress>@<KB/s>@<giây đã chạy>
     if (updating) {
-        return "OTA:UPDATING@" + String(progress);
+        uint32_t elapsed = downloadStart ? (millis() - downloadStart) / 1000 : 0;
+        return "OTA:UPDATING@" + String(progress) + "@" + String(throughputKBps()) + "@" + String(elapsed);
     }
     
     // Lấy thông tin từ NVS
     Settings otaSettings("ota", true);
     String lastVersion = otaSettings.getString("last_version", "unknown");
     String lastUpdate = otaSettings.getString("last_update", "unknown");
-    hasNewVersion();
-    // Build result
+    int32_t lastDuration = otaSettings.getInt("last_ms", 0);
+    int32_t lastKbps = otaSettings.getInt("last_kbps", 0);
+    hasNewVersion(revalidate);
+    // Build result (2 trường cuối: thời gian + tốc độ lần update trước, 0 nếu chưa có)
     return "OTA:INFO@" + lastVersion + "@" + lastUpdate + "@" + 
-    String(autoUpdateEnabled ? 1 : 0) + "@" + String(isNewVersion ? 1 : 0) + "@" + currentVersion;
+    String(autoUpdateEnabled ? 1 : 0) + "@" + String(isNewVersion ? 1 : 0) + "@" + currentVersion +
+    "@" + String(lastDuration) + "@" + String(lastKbps);
 }
 // Print OTA info
 void OTAUpdate::printInfo() {
@@ -576,6 +1330,14 @@ void OTAUpdate::printInfo() {
     Serial.printf("║ Last Error:       %-20s ║\n", 
                   lastError.length() > 0 ? lastError.c_str() : "None");
     Serial.printf("║ Free Heap:        %-17d KB ║\n", ESP.getFreeHeap() / 1024);
+    Serial.printf("║ Manifest:  %3u cache / %3u 304 / %3u 200 ║\n",
+                  manifestHits, manifestNotModified, manifestFetches);
+    Serial.printf("║ Check phase:      %-18lu s ║\n", (unsigned long)(deviceHash % checkInterval) / 1000);
+    Serial.printf("║ Server backoffs:  %-20u ║\n", serverBackoffs);
+    ResumeState resume;
+    if (loadResume(resume)) {
+        Serial.printf("║ Resume at:  %7u / %7u bytes      ║\n", resume.offset, resume.size);
+    }
     Serial.println("╚════════════════════════════════════════╝\n");
 }
 
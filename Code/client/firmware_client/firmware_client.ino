@@ -7,15 +7,22 @@
 #include <freertos/queue.h>
 #include <freertos/semphr.h>
 #include "OTAUpdate.h"
+#include "telemetry.h"
+#include "telemetryBatch.h"
+#include "telemetryJournal.h"
+#include "bootSequencer.h"
 #include "DHT.h"
 #define CLIENT_ID "066420c45a4e819437bbfbea63b83739"
 #define version  "Slave_1.0.1"
-#define OTA_SERVER_URL "http://10.1.0.32:8000/ota/get_info_update"
+#define BACKEND_DEFAULT_URL "http://10.1.0.32:8000"   // Chỉ dùng khi chưa tìm được backend qua mDNS
+#define OTA_SERVER_URL "/ota/get_info_update"          // Path trên backend (ServiceDiscovery)
 // ======= Global References =======
 WiFiStation* wifi;
 MQTTProtocol* mqtt;
 GPIOManager* gpio;
 OTAUpdate* ota;
+TelemetryBatcher* batcher;
+TelemetryJournal* journal;
 #define DHTPIN 5
 #define DHTTYPE DHT11
 DHT dht(DHTPIN, DHTTYPE);
@@ -25,16 +32,9 @@ QueueHandle_t commandQueue;
 
 
 // ======= Data Structures =======
-#define MAX_VALUE_LEN 128  // Độ dài tối đa cho value string
+// deviceDataQueue chứa TelemetryRecord (telemetry.h) thay cho DeviceData 128-byte string
 #define MAX_MSG_LEN 64     // Độ dài tối đa cho message string
-
-struct DeviceData {
-    int pin;
-    int VirtualPin;
-    char value[MAX_VALUE_LEN];  // Thay String bằng char array
-    unsigned long timestamp;
-    bool isNC;
-};
+#define SENSOR_QUEUE_WAIT_MS 5000   // Chờ chỗ trong deviceDataQueue tối đa (< chu kỳ đọc 8 s)
 
 struct CommandData {
     int VirtualPin;
@@ -55,64 +55,61 @@ void mqttTask(void* parameter);
 void gpioTask(void* parameter);
 void ReadDataTask(void* parameter);
 void otaTask(void* parameter);  // Task xử lý OTA update
+void otaProgress(int progress);     // Gửi OTA:UPDATING lên server mỗi 10%
+
+// ======= Boot Phases =======
+void bootNvs();                     // NVS + thông tin thiết bị
+void bootOtaCheck();                // Chờ WiFi, check manifest OTA, cập nhật broker
+void bootGpio();                    // GPIO / DHT + GPIOTask, SensorTask
 
 // ======= MQTT Callback =======
 void mqttCallback(char* topic, byte* payload, unsigned int length);
 
+// ======= Telemetry Helpers =======
+void queueNotification(const char* message, bool toFront = false);
+bool publishRecord(const TelemetryRecord& record);
+void spillRecord(const TelemetryRecord& record);
+
 // ======= Setup Function =======
+// setup() chỉ làm phần đọc NVS rồi trả về ngay: WiFi kết nối trong wifiTask, MQTT chạy bằng
+// broker đã lưu trong NVS, check OTA và khởi tạo GPIO / DHT chạy song song (BootSequencer)
 void setup() {
     Serial.begin(115200);
-    delay(2000);
-    Settings deviceSettings("device", true);
-    deviceSettings.setString("clientId", CLIENT_ID);
-    deviceSettings.setString("slave_version", version);
+    BootSequencer& boot = BootSequencer::getInstance();
 
     Serial.println("🚀 Starting ESP32 Multi-Thread IoT Device...");
     Serial.printf("📊 Free heap at start: %d bytes\n", ESP.getFreeHeap());
     
-    // Initialize NVS
-    Settings::initializeNVS();
-    
-    // Kiểm tra dung lượng NVS (có thể xóa nếu không cần)
-    Settings::printNVSInfo();
+    boot.run("nvs", bootNvs);
     
     // Get singleton references
     wifi = &WiFiStation::getInstance();
     mqtt = &MQTTProtocol::getInstance();
     gpio = &GPIOManager::getInstance();
     ota = &OTAUpdate::getInstance();
-    // Initialize WiFi (blocking until connected)
-    wifi->begin();
-    ota->begin( // nó sẽ tạo luồng mới để chạy nên có thể là broker server sẽ không được update kịp thời 
+    batcher = &TelemetryBatcher::getInstance();
+    journal = &TelemetryJournal::getInstance();
+    ServiceDiscovery::getInstance().begin(BACKEND_DEFAULT_URL);  // Endpoint cache trong NVS, resolve lại ngầm
+    TlsSessionCache::getInstance().begin();  // CA + session TLS dùng chung cho OTA / MQTT / audio
+    HttpPool::getInstance().begin();         // Kết nối HTTP keep-alive dùng chung cho OTA / audio
+    ota->begin(
         OTA_SERVER_URL,     // Server URL
         version,      // Current version
         CLIENT_ID,          // Device ID
         3600000            // Check interval (1 hour)
     );
-    if (ota->hasNewVersion()) { // bắt buộc phả check version trước khi bắt đầu kết nối mqtt 
-        Serial.println("🔄 [OTA] New version available!");
-        // Serial.printf("   📌 New Version: %s\n", ota->newVersion.c_str());
-        // Serial.printf("   📌 Download URL: %s\n", ota->downloadUrl.c_str());
-        // Serial.printf("   📌 Changelog: %s\n", ota->changelog.c_str());
-    }
-    else {
-        Serial.println("✅ [OTA] No new version available!");
-    }
-    // Initialize MQTT
-    // mqtt->updateConfig("10.1.1.20", 1883, CLIENT_ID); // Laáy broker sau khi OTA check update xong 
+    ota->setOnProgressCallback(otaProgress);
+    
+    // Initialize MQTT - broker lấy từ NVS (manifest OTA lần trước), check OTA xong mà đổi thì reloadConfig()
+    boot.begin("mqtt_cfg");
     mqtt->begin();
     mqtt->setCallback(mqttCallback);
-    
-    // Initialize GPIO
-    gpio->begin();
-    gpio->setOutputPin(4, true);
-    gpio->setInputPin(5, false);
-    gpio->saveGPIOConfig(); // luu cau hinh GPIO vao NVS
-    dht.begin(); // chan 5 lam cam bien nhiet do 
+    batcher->begin();
+    journal->begin();   // Mount LittleFS, khôi phục telemetry chưa gửi từ lần mất kết nối trước
+    boot.end("mqtt_cfg");
 
-    // Initialize OTA
     // Create FreeRTOS objects
-    deviceDataQueue = xQueueCreate(10, sizeof(DeviceData));
+    deviceDataQueue = xQueueCreate(10, sizeof(TelemetryRecord));
     commandQueue = xQueueCreate(10, sizeof(CommandData));
     
     if (deviceDataQueue == NULL || commandQueue == NULL) {
@@ -124,7 +121,7 @@ void setup() {
     xTaskCreatePinnedToCore(
         wifiTask,           // Task function
         "WiFiTask",         // Task name
-        4096,               // Stack size
+        6144,               // Stack size (wifi->begin() + config portal chạy trong task này)
         NULL,               // Parameters
         2,                  // Priority
         &wifiTaskHandle,    // Task handle
@@ -134,13 +131,72 @@ void setup() {
     xTaskCreatePinnedToCore(
         mqttTask,           // Task function
         "MQTTTask",         // Task name
-        4096,               // Stack size
+        6144,               // Stack size (LittleFS write khi spill journal)
         NULL,               // Parameters
         3,                  // Priority
         &mqttTaskHandle,    // Task handle
         1                   // Core 1
     );
     
+    // OTA Task - KHÔNG tạo ở đây, sẽ tạo động khi cần để tiết kiệm 16KB RAM
+    // otaTaskHandle sẽ được tạo trong mqttCallback khi nhận "OTA:UP"
+    
+    // ======= Check OTA (chờ WiFi) và GPIO / DHT song song với WiFi / MQTT =======
+    boot.runAsync("ota", bootOtaCheck, 8192, 1, 1);
+    boot.runAsync("gpio", bootGpio, 4096, 2, 0);
+    
+    Serial.println("✅ All tasks created successfully!");
+    Serial.printf("📊 Free heap after setup: %d bytes\n", ESP.getFreeHeap());
+    
+    // Subscribe to MQTT topics
+    // Mutex đã được xử lý bên trong mqtt->subscribe()
+    // phải đăng kí các topic trước khi gửi nhận mới được .
+    mqtt->registerVirtualpin(REG_CT, 4);
+    mqtt->registerVirtualpin(REG_SS, 5);
+    mqtt->registerVirtualpin(REG_NC, 0);
+    // mqtt->subscribe("device/gpio");
+    // mqtt->subscribe("device/led");
+    
+    Serial.println("🎉 Setup completed successfully!");
+    Serial.println("Code test ota=================================================");
+}
+
+// ======= Boot Phases =======
+void bootNvs() {
+    // Initialize NVS
+    Settings::initializeNVS();
+    Settings deviceSettings("device", true);
+    deviceSettings.setString("clientId", CLIENT_ID);
+    deviceSettings.setString("slave_version", version);
+    
+    // Kiểm tra dung lượng NVS (có thể xóa nếu không cần)
+    Settings::printNVSInfo();
+}
+
+void bootOtaCheck() {
+    BootSequencer& boot = BootSequencer::getInstance();
+    while (!boot.waitFor("wifi", 60000)) {
+        Serial.println("⏳ [Boot] OTA check waiting for WiFi...");
+    }
+    if (ota->hasNewVersion()) {
+        Serial.println("🔄 [OTA] New version available!");
+    }
+    else {
+        Serial.println("✅ [OTA] No new version available!");
+    }
+    // Manifest có thể mang broker mới (hoặc lần boot đầu NVS chưa có gì)
+    mqtt->reloadConfig();
+}
+
+void bootGpio() {
+    // Initialize GPIO
+    gpio->begin();
+    gpio->setOutputPin(4, true);
+    gpio->setInputPin(5, false);
+    gpio->saveGPIOConfig(); // luu cau hinh GPIO vao NVS
+    dht.begin(); // chan 5 lam cam bien nhiet do 
+    
+    // GPIO / DHT sẵn sàng mới chạy 2 task dùng chúng
     xTaskCreatePinnedToCore(
         gpioTask,           // Task function
         "GPIOTask",         // Task name
@@ -160,24 +216,6 @@ void setup() {
         &readTaskHandle,  // Task handle
         1                   // Core 1
     );
-    
-    // OTA Task - KHÔNG tạo ở đây, sẽ tạo động khi cần để tiết kiệm 16KB RAM
-    // otaTaskHandle sẽ được tạo trong mqttCallback khi nhận "OTA:UP"
-    
-    Serial.println("✅ All tasks created successfully!");
-    Serial.printf("📊 Free heap after setup: %d bytes\n", ESP.getFreeHeap());
-    
-    // Subscribe to MQTT topics
-    // Mutex đã được xử lý bên trong mqtt->subscribe()
-    // phải đăng kí các topic trước khi gửi nhận mới được .
-    mqtt->registerVirtualpin(REG_CT, 4);
-    mqtt->registerVirtualpin(REG_SS, 5);
-    mqtt->registerVirtualpin(REG_NC, 0);
-    // mqtt->subscribe("device/gpio");
-    // mqtt->subscribe("device/led");
-    
-    Serial.println("🎉 Setup completed successfully!");
-    Serial.println("Code test ota=================================================");
 }
 
 // ======= Loop Function =======
@@ -188,45 +226,110 @@ void loop() {
     
     Serial.printf("📊 System Status - Free heap: %d bytes, Uptime: %d seconds\n", 
                   ESP.getFreeHeap(), millis() / 1000);
+    wifi->printStats();
+    mqtt->printStats();
+    if (journal->pending() > 0) {
+        journal->printStats();
+    }
+    TlsSessionCache::getInstance().printStats();
+    HttpPool::getInstance().printStats();
+    ServiceDiscovery::getInstance().printStats();
 }
 
 // ======= WiFi Task (Core 0) =======
 void wifiTask(void* parameter) {
     Serial.println("📡 [WiFiTask] Started on Core 0");
+    // Initialize WiFi (blocking until connected) - chỉ chặn task này, không chặn setup()
+    BootSequencer::getInstance().begin("wifi");
+    wifi->begin();
+    BootSequencer::getInstance().end("wifi");
     
     while (true) {
+        // Chặn tới khi có event mất kết nối rồi tự kết nối lại (config mode: phục vụ portal)
         wifi->loop();
-        
-        // Check WiFi status
-        if (!wifi->isConnected()) {
-            Serial.println("⚠️ [WiFiTask] WiFi disconnected!");
-        }
-        
-        vTaskDelay(pdMS_TO_TICKS(1000)); // 1 second
     }
 }
 
 // ======= MQTT Task (Core 1) =======
 void mqttTask(void* parameter) {
     Serial.println("📨 [MQTTTask] Started on Core 1");
+    uint32_t lastReplay = 0;
+    bool wasOnline = false;
+    TelemetryRecord pendingNotification;
+    bool hasPendingNotification = false;
     
     while (true) {
+        bool online = false;
         if (wifi->isConnected()) {
             // Mutex đã được xử lý bên trong mqtt->loop()
             mqtt->loop();
+            online = mqtt->connected();
+        }
+        if (online != wasOnline) {
+            Serial.println(online ? "📼 [Journal] Online, replaying stored telemetry"
+                                  : "📼 [Journal] Offline, spilling telemetry to flash");
+            wasOnline = online;
+            // Lần đầu kết nối MQTT: in timeline boot và gửi lên server
+            if (online && !BootSequencer::getInstance().done("mqtt")) {
+                BootSequencer& boot = BootSequencer::getInstance();
+                boot.mark("mqtt");
+                boot.printTimeline();
+                queueNotification(boot.report().c_str(), true);
+            }
+        }
+        
+        uint32_t now = millis();
+        if (online) {
+            // Batch mode: hết cửa sổ (hoặc đầy) thì publish 1 document CBOR
+            if (batcher->shouldFlush(now)) {
+                static uint8_t cbor[TLM_BATCH_BUF_SIZE];
+                size_t len = batcher->encode(cbor, sizeof(cbor), now);
+                // Encode / gửi lỗi thì giữ nguyên batch, thử lại ở vòng sau
+                if (len > 0 && mqtt->sendBatch(cbor, len)) {
+                    batcher->clear();
+                }
+            }
             
-            // Process sensor data queue
-            DeviceData deviceData;
-            if (xQueueReceive(deviceDataQueue, &deviceData, 0) == pdTRUE) {
-                if(deviceData.isNC){
-                    mqtt->send(deviceData.VirtualPin, String(deviceData.value), false, true);
+            // Replay journal theo thứ tự, giới hạn JRN_REPLAY_BURST record / JRN_REPLAY_INTERVAL_MS
+            if (journal->pending() > 0 && now - lastReplay >= JRN_REPLAY_INTERVAL_MS) {
+                lastReplay = now;
+                TelemetryRecord record;
+                for (int i = 0; i < JRN_REPLAY_BURST && journal->peek(record); i++) {
+                    if (!publishRecord(record)) break;
+                    journal->pop();
                 }
-                else{
-                    mqtt->send(deviceData.VirtualPin, String(deviceData.value), false, false);
+                if (journal->pending() == 0) {
+                    Serial.println("✅ [Journal] Replay completed");
+                    journal->printStats();
                 }
             }
         }
         
+        // Process sensor data queue - format sang text 1 lần duy nhất ở đây.
+        // Mất kết nối hoặc journal còn dữ liệu cũ (giữ đúng thứ tự) -> ghi vào journal.
+        // Notification gửi lỗi lúc vẫn online (in-flight window đầy) -> giữ ở
+        // pendingNotification, thử lại vòng sau; chỉ bỏ khi thực sự offline.
+        TelemetryRecord record;
+        bool haveRecord = hasPendingNotification;
+        if (haveRecord) {
+            record = pendingNotification;
+            hasPendingNotification = false;
+        } else {
+            haveRecord = xQueueReceive(deviceDataQueue, &record, 0) == pdTRUE;
+        }
+        if (haveRecord) {
+            bool inOrder = (record.flags & TLM_FLAG_NC) || journal->pending() == 0;
+            if (online && inOrder && publishRecord(record)) {
+                telemetryRelease(record);
+            } else if (online && (record.flags & TLM_FLAG_NC)) {
+                pendingNotification = record;       // Giữ slot arena tới lần thử sau
+                hasPendingNotification = true;
+            } else {
+                spillRecord(record);
+                telemetryRelease(record);
+            }
+        }
+        
         vTaskDelay(pdMS_TO_TICKS(100)); // 100ms
     }
 }
@@ -263,15 +366,12 @@ void ReadDataTask(void* parameter) {
          t = dht.readTemperature();
         //222222
         // Read sensors and send data
-        DeviceData deviceData;
-        
-        // Read digital pins
-        deviceData.pin = 5;
-        deviceData.VirtualPin = 5;
-        snprintf(deviceData.value, MAX_VALUE_LEN, "%.2f", t);
-        deviceData.timestamp = millis();
-        deviceData.isNC = false;
-        xQueueSend(deviceDataQueue, &deviceData, pdMS_TO_TICKS(10));
+        // Luôn đi qua deviceDataQueue: mqttTask quyết định publish hay ghi journal theo đúng
+        // thứ tự. Queue đầy (mqttTask đang kẹt reconnect) -> chờ thêm, quá SENSOR_QUEUE_WAIT_MS thì bỏ mẫu.
+        TelemetryRecord record = telemetryFloat(5, t);
+        if (xQueueSend(deviceDataQueue, &record, pdMS_TO_TICKS(SENSOR_QUEUE_WAIT_MS)) != pdTRUE) {
+            Serial.printf("❌ [SensorTask] Queue full, reading V%u lost\n", record.virtualPin);
+        }
         
         // sensorData.sensorName = "pin_4";
         // sensorData.value = String(gpio->readDigital(4));
@@ -346,28 +446,14 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
             //     ERROR : lỗi khi cập nhật phiên bản mới nhất từ server về 
 
             if(message.substring(4, 6) == "CK") { //"OTA:CK" // đây là yêu cầu kiểm tra từ server về phiên bản mới nhất 
-                String info = ota->Getinfo4mqtt();
-                DeviceData deviceData;
-                deviceData.VirtualPin = 0;
-                deviceData.pin = 0;
-                strncpy(deviceData.value, info.c_str(), MAX_VALUE_LEN - 1);
-                deviceData.value[MAX_VALUE_LEN - 1] = '\0';
-                deviceData.timestamp = millis();
-                deviceData.isNC = true;
-                xQueueSend(deviceDataQueue, &deviceData, pdMS_TO_TICKS(10));
+                String info = ota->Getinfo4mqtt(true);  // Người dùng bấm kiểm tra -> hỏi lại server (thường chỉ 304)
+                queueNotification(info.c_str());
             }
             if(message.substring(4, 6) == "UP") { //"OTA:UP" 
                 // Chỉ set flag, OTA task sẽ thực hiện update
                 // (tránh stack overflow vì HTTPS cần stack rất lớn)
-                if(ota->hasNewVersion()){
-                    DeviceData deviceData;
-                    deviceData.VirtualPin = 0;
-                    deviceData.pin = 0;
-                    strncpy(deviceData.value, "OTA:UPDATING@0", MAX_VALUE_LEN - 1);
-                    deviceData.value[MAX_VALUE_LEN - 1] = '\0';
-                    deviceData.timestamp = millis();
-                    deviceData.isNC = true;
-                    xQueueSend(deviceDataQueue, &deviceData, pdMS_TO_TICKS(10));
+                if(ota->hasNewVersion(true)){  // performUpdate() trong OTA task dùng lại manifest này
+                    queueNotification("OTA:UPDATING@0");
                     
                     // Tạo OTA task ĐỘNG khi cần (tiết kiệm 16KB RAM)
                     if (otaTaskHandle == NULL) {
@@ -386,14 +472,7 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
                     }
                 }
                 else{
-                    DeviceData deviceData;
-                    deviceData.VirtualPin = 0;
-                    deviceData.pin = 0;
-                    strncpy(deviceData.value, "OTA:ERROR@ da co phien ban moi nhat", MAX_VALUE_LEN - 1);
-                    deviceData.value[MAX_VALUE_LEN - 1] = '\0';
-                    deviceData.timestamp = millis();
-                    deviceData.isNC = true;
-                    xQueueSend(deviceDataQueue, &deviceData, pdMS_TO_TICKS(10));
+                    queueNotification("OTA:ERROR@ da co phien ban moi nhat");
                     Serial.println("OTA:ERROR@ da co phien ban moi nhat");
                 }
             } 
@@ -401,17 +480,74 @@ void mqttCallback(char* topic, byte* payload, unsigned int length) {
                 ota->setAutoUpdate(!(ota->getAutoUpdate()));
                 String info = ota->Getinfo4mqtt();
                 Serial.println(info.c_str());
-                DeviceData deviceData;
-                deviceData.VirtualPin = 0;
-                deviceData.pin = 0;
-                strncpy(deviceData.value, info.c_str(), MAX_VALUE_LEN - 1);
-                deviceData.value[MAX_VALUE_LEN - 1] = '\0';
-                deviceData.timestamp = millis();
-                deviceData.isNC = true;
-                xQueueSend(deviceDataQueue, &deviceData, pdMS_TO_TICKS(10));
+                queueNotification(info.c_str());
             }
         }   
-        
+        if(message.substring(0, 3) == "TLM") {
+            // TLM:BATCH@<window_ms> : bật batch CBOR với cửa sổ window_ms, 0 = tắt
+            if(message.substring(4, 9) == "BATCH") {
+                uint32_t windowMs = message.substring(10).toInt();
+                batcher->configure(windowMs);
+                char info[32];
+                snprintf(info, sizeof(info), "TLM:INFO@%d@%u", batcher->isEnabled() ? 1 : 0, batcher->getWindow());
+                queueNotification(info);
+            }
+            // TLM:JRN : trạng thái journal -> TLM:JRN@pending@capacity@dropped@wraps
+            if(message.substring(4, 7) == "JRN") {
+                char info[48];
+                snprintf(info, sizeof(info), "TLM:JRN@%u@%u@%u@%u", journal->pending(), journal->capacity(),
+                         journal->getDropped(), journal->getWraps());
+                queueNotification(info);
+                journal->printStats();
+            }
+        }
+    }
+}
+
+// ======= Telemetry Helpers =======
+void queueNotification(const char* message, bool toFront) {
+    TelemetryRecord record;
+    if (!telemetryString(record, 0, message, true)) {
+        return;     // Arena đầy / chuỗi quá dài: bỏ message thay vì gửi một phần
+    }
+    BaseType_t queued = toFront
+        ? xQueueSendToFront(deviceDataQueue, &record, pdMS_TO_TICKS(100))
+        : xQueueSend(deviceDataQueue, &record, pdMS_TO_TICKS(10));
+    if (queued != pdTRUE) {
+        telemetryRelease(record);  // Queue đầy -> trả slot arena
+    }
+}
+
+// Gửi 1 record: vào batch nếu batch mode nhận, không thì publish text ngay.
+// false = chưa gửi được (batch đầy / MQTT lỗi), caller giữ lại record.
+bool publishRecord(const TelemetryRecord& record) {
+    if (batcher->accepts(record)) {
+        return batcher->add(record);
+    }
+    char text[TLM_TEXT_BUF_LEN];
+    const char* payload = telemetryText(record, text, sizeof(text));
+    return mqtt->send(record.virtualPin, payload, false, (record.flags & TLM_FLAG_NC) != 0);
+}
+
+// Lưu record vào journal trên flash để replay khi có kết nối lại.
+// Notification chỉ có ý nghĩa lúc online nên bị bỏ. Caller vẫn phải telemetryRelease().
+void spillRecord(const TelemetryRecord& record) {
+    if (record.flags & TLM_FLAG_NC) {
+        Serial.println("⚠️ [Journal] Notification dropped while offline");
+        return;
+    }
+    if (!journal->append(record)) {
+        Serial.printf("❌ [Journal] Reading V%u lost\n", record.virtualPin);
+    }
+}
+
+// Gọi từ OTA writer task mỗi khi % thay đổi; queueNotification thread-safe
+void otaProgress(int progress) {
+    static int lastReported = 0;
+    if (progress < lastReported) lastReported = 0;    // Lần update mới
+    if (progress - lastReported >= 10) {
+        lastReported = progress;
+        queueNotification(ota->Getinfo4mqtt().c_str());    // OTA:UPDATING@<%>@<KB/s>@<giây>
     }
 }
 
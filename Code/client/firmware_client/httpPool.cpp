@@ -0,0 +1,222 @@
+#include "httpPool.h"
+
+// Tách scheme / host / port từ URL dạng http(s)://host[:port]/path
+static bool parseOrigin(const String& url, char* host, size_t hostLen, uint16_t& port, bool& secure) {
+    int start;
+    if (url.startsWith("https://")) {
+        secure = true;
+        port = 443;
+        start = 8;
+    } else if (url.startsWith("http://")) {
+        secure = false;
+        port = 80;
+        start = 7;
+    } else {
+        return false;
+    }
+    int end = url.indexOf('/', start);
+    if (end < 0) end = url.length();
+    int colon = url.indexOf(':', start);
+    int hostEnd = (colon > 0 && colon < end) ? colon : end;
+    if (hostEnd - start <= 0 || (size_t)(hostEnd - start) >= hostLen) return false;
+    memcpy(host, url.c_str() + start, hostEnd - start);
+    host[hostEnd - start] = '\0';
+    if (hostEnd == colon) {
+        port = url.substring(colon + 1, end).toInt();
+    }
+    return port != 0;
+}
+
+// ======= HTTP Pool =======
+HttpPool::HttpPool()
+    : _mutex(NULL), _requests(0), _reuseHits(0), _staleRetries(0), _overflow(0),
+      _reusedMs(0), _freshMs(0) {
+    for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+        _slots[i].host[0] = '\0';
+        _slots[i].port = 0;
+        _slots[i].secure = false;
+        _slots[i].inUse = false;
+        _slots[i].pooled = true;
+        _slots[i].lastUsed = 0;
+    }
+}
+
+void HttpPool::begin() {
+    if (_mutex == NULL) {
+        _mutex = xSemaphoreCreateMutex();
+    }
+}
+
+HttpPool::Slot* HttpPool::acquire(const char* host, uint16_t port, bool secure) {
+    Slot* chosen = nullptr;
+    if (_mutex != NULL && xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        uint32_t now = millis();
+        Slot* match = nullptr;
+        Slot* empty = nullptr;
+        Slot* oldest = nullptr;
+        for (int i = 0; i < HTTP_POOL_SIZE; i++) {
+            Slot& slot = _slots[i];
+            if (slot.inUse) continue;
+            if (slot.port != 0 && now - slot.lastUsed > HTTP_POOL_IDLE_MS) {
+                // Server sắp tự đóng kết nối này, đóng trước để không gửi request vào socket chết
+                slot.client().stop();
+                slot.port = 0;
+            }
+            if (slot.port == port && slot.secure == secure && strcmp(slot.host, host) == 0) {
+                if (match == nullptr || slot.client().connected()) match = &slot;
+            } else if (slot.port == 0) {
+                if (empty == nullptr) empty = &slot;
+            } else if (oldest == nullptr || slot.lastUsed < oldest->lastUsed) {
+                oldest = &slot;
+            }
+        }
+        chosen = match ? match : (empty ? empty : oldest);
+        if (chosen != nullptr) {
+            if (chosen != match) {
+                // Slot đang giữ kết nối tới host khác
+                chosen->client().stop();
+            }
+            chosen->inUse = true;
+        } else {
+            _overflow++;
+        }
+        xSemaphoreGive(_mutex);
+    }
+
+    if (chosen == nullptr) {
+        chosen = new Slot();
+        chosen->pooled = false;
+        chosen->inUse = true;
+    }
+    strncpy(chosen->host, host, sizeof(chosen->host) - 1);
+    chosen->host[sizeof(chosen->host) - 1] = '\0';
+    chosen->port = port;
+    chosen->secure = secure;
+    return chosen;
+}
+
+void HttpPool::release(Slot* slot, bool keepAlive) {
+    // Server trả "Connection: close" thì end() tự đóng socket
+    slot->http.end();
+    if (!keepAlive) {
+        slot->client().stop();
+    }
+    if (!slot->pooled) {
+        delete slot;
+        return;
+    }
+    if (_mutex != NULL && xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        slot->inUse = false;
+        slot->lastUsed = millis();
+        xSemaphoreGive(_mutex);
+    }
+}
+
+void HttpPool::record(bool reused, bool staleRetry, uint32_t ms) {
+    if (_mutex == NULL || !xSemaphoreTake(_mutex, portMAX_DELAY)) return;
+    _requests++;
+    if (staleRetry) _staleRetries++;
+    if (reused) {
+        _reuseHits++;
+        _reusedMs += ms;
+    } else {
+        _freshMs += ms;
+    }
+    xSemaphoreGive(_mutex);
+}
+
+void HttpPool::printStats() {
+    if (_requests == 0) return;
+    uint32_t fresh = _requests - _reuseHits;
+    Serial.printf("🌐 [HTTP] Requests: %u, reused: %u (%u%%), stale: %u, overflow: %u, avg %u ms reused / %u ms new\n",
+                  _requests, _reuseHits, _reuseHits * 100 / _requests, _staleRetries, _overflow,
+                  _reuseHits ? _reusedMs / _reuseHits : 0, fresh ? _freshMs / fresh : 0);
+}
+
+// ======= HTTP Lease =======
+HttpLease::HttpLease() : _slot(nullptr), _reused(false) {}
+
+HttpLease::HttpLease(const String& url) : HttpLease() {
+    open(url);
+}
+
+HttpLease::~HttpLease() {
+    release(false);
+}
+
+bool HttpLease::open(const String& url) {
+    char host[HTTP_POOL_HOST_LEN];
+    uint16_t port;
+    bool secure;
+    if (!parseOrigin(url, host, sizeof(host), port, secure)) {
+        Serial.printf("❌ [HTTP] Invalid URL: %s\n", url.c_str());
+        // Vẫn mượn slot để http() hợp lệ, GET() sẽ trả lỗi
+        host[0] = '\0';
+        port = 80;
+        secure = false;
+    }
+    if (_slot != nullptr &&
+        (_slot->port != port || _slot->secure != secure || strcmp(_slot->host, host) != 0)) {
+        release(false);
+    }
+    if (_slot == nullptr) {
+        _slot = HttpPool::getInstance().acquire(host, port, secure);
+    }
+    _slot->http.setReuse(true);
+    return _slot->http.begin(_slot->client(), url);
+}
+
+int HttpLease::GET() {
+    uint32_t start = millis();
+    _reused = _slot->client().connected();
+    int code = _slot->http.GET();
+    bool staleRetry = false;
+    if (code < 0 && _reused) {
+        // Server đã đóng kết nối keep-alive -> kết nối lại, header đã add vẫn được giữ
+        Serial.printf("⚠️ [HTTP] Keep-alive connection to %s lost (%d), reconnecting\n", _slot->host, code);
+        _slot->client().stop();
+        code = _slot->http.GET();
+        _reused = false;
+        staleRetry = true;
+    }
+    HttpPool::getInstance().record(_reused, staleRetry, millis() - start);
+    return code;
+}
+
+void HttpLease::release(bool keepAlive) {
+    if (_slot == nullptr) return;
+    HttpPool::getInstance().release(_slot, keepAlive);
+    _slot = nullptr;
+}
+
+// ======= HTTP Body Reader =======
+HttpBodyReader::HttpBodyReader(HTTPClient& http)
+    : _stream(http.getStreamPtr()), _size(http.getSize()), _consumed(0) {}
+
+int HttpBodyReader::read() {
+    char c;
+    return readBytes(&c, 1) == 1 ? (uint8_t)c : -1;
+}
+
+size_t HttpBodyReader::readBytes(char* buffer, size_t length) {
+    if (_stream == nullptr) return 0;
+    if (_size >= 0) {
+        size_t remaining = _size - _consumed;
+        if (length > remaining) length = remaining;
+    }
+    if (length == 0) return 0;
+    // Stream::readBytes chờ dữ liệu tới timeout của HTTPClient, WiFiClient::read() thì không
+    size_t n = _stream->readBytes(buffer, length);
+    _consumed += n;
+    return n;
+}
+
+bool HttpBodyReader::drain() {
+    if (_size < 0) return false;
+    if (_size - _consumed > HTTP_BODY_DRAIN_MAX) return false;     // Còn nhiều -> đóng rẻ hơn đọc bỏ
+    char scratch[32];
+    while (_consumed < _size) {
+        if (readBytes(scratch, sizeof(scratch)) == 0) return false;
+    }
+    return true;
+}
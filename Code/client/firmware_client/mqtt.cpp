@@ -1,7 +1,6 @@
 #include "mqtt.h"
 #include <Arduino.h>
 #include <WiFiClient.h>
-#include <PubSubClient.h>
 #include <freertos/semphr.h>
 // #define REG_SS 0
 // #define REG_CT 1
@@ -11,7 +10,45 @@
 // Mutex được quản lý bởi module MQTT
 SemaphoreHandle_t mqttMutex = NULL;
 
-MQTTProtocol::MQTTProtocol() : _mqttClient(_wifiClient) {}
+MQTTProtocol::MQTTProtocol() : _mqttClient(_wifiClient) {
+  _topicSS[0] = _topicNC[0] = _topicBatch[0] = _topicHandle[0] = _handle[0] = '\0';
+}
+
+void MQTTProtocol::buildTopics() {
+  // Topic publish dùng handle ngắn nếu broker đã cấp (3.1.1), topic subscribe luôn dùng clientId
+  char device[MQTT_TOPIC_MAX_LEN];
+  if (_handle[0] != '\0') {
+    snprintf(device, sizeof(device), "%c%s", DEVICE_HANDLE_MARK, _handle);
+  } else {
+    snprintf(device, sizeof(device), "%s", _clientId.c_str());
+  }
+  snprintf(_topicSS, sizeof(_topicSS), "SS/%s", device);
+  snprintf(_topicNC, sizeof(_topicNC), "NC/%s", device);
+  snprintf(_topicBatch, sizeof(_topicBatch), "SS/%s%s", device, TOPIC_BATCH_SUFFIX);
+  snprintf(_topicHandle, sizeof(_topicHandle), "%s%s", TOPIC_HANDLE_PREFIX, _clientId.c_str());
+  for (uint8_t i = 0; i < _pinTopicCount; i++) {
+    snprintf(_pinTopics[i].ss, sizeof(_pinTopics[i].ss), "%s/%d", _topicSS, _pinTopics[i].pin);
+  }
+}
+
+MQTTProtocol::PinTopic* MQTTProtocol::findPin(int virtualPin) {
+  for (uint8_t i = 0; i < _pinTopicCount; i++) {
+    if (_pinTopics[i].pin == virtualPin) return &_pinTopics[i];
+  }
+  if (_pinTopicCount >= MQTT_MAX_PIN_TOPICS) return nullptr;
+  PinTopic& entry = _pinTopics[_pinTopicCount++];
+  entry.pin = virtualPin;
+  entry.regMask = 0;
+  snprintf(entry.ss, sizeof(entry.ss), "%s/%d", _topicSS, virtualPin);
+  return &entry;
+}
+
+const char* MQTTProtocol::topicFor(int virtualPin) {
+  PinTopic* entry = findPin(virtualPin);
+  if (entry != nullptr) return entry->ss;
+  snprintf(_topicScratch, sizeof(_topicScratch), "%s/%d", _topicSS, virtualPin);
+  return _topicScratch;
+}
 
 void MQTTProtocol::begin() {
   // Tạo mutex nếu chưa có
@@ -23,16 +60,17 @@ void MQTTProtocol::begin() {
     }
     Serial.println("✅ [MQTT] Mutex created successfully");
   }
-  
-  // Load cấu hình từ NVS
+  loadConfig();
+}
+
+// Gọi khi đang giữ mqttMutex, hoặc trước khi mqttTask chạy
+void MQTTProtocol::loadConfig() {
   Settings mqttSettings("mqtt", true);
   
   _broker = mqttSettings.getString("broker", "");
   _port = mqttSettings.getInt("port", 1883);
   _clientId = mqttSettings.getString("clientId", "");
-  _topicSS = String("SS/") + _clientId;
-  _topicCT = String("CT/") + _clientId;
-  _topicNC = String("NC/") + _clientId;
+  buildTopics();
 
   if (_broker.length() == 0) {
     Serial.println("⚠️ [MQTT] No broker configuration found in NVS!");
@@ -40,14 +78,60 @@ void MQTTProtocol::begin() {
     return;
   }
   _mqttClient.setServer(_broker.c_str(), _port);
+  _mqttClient.setBufferSize(MQTT_BUFFER_SIZE);
+  // Tắt Nagle: các PUBLISH trong in-flight window và PUBACK phải đi ngay
+  _wifiClient.setNoDelay(true);
+  _tlsClient.setNoDelay(true);
+  // mqtts: session TLS được resume khi reconnect nên không phải handshake đầy đủ mỗi lần mất mạng
+  bool useTls = mqttSettings.getBool("tls", false);
+  _mqttClient.setClient(useTls ? (Client&)_tlsClient : (Client&)_wifiClient);
+  _mqttClient.setInflightWindow(mqttSettings.getInt("inflight", MQTT_DEFAULT_INFLIGHT));
+  _mqttClient.setProtocolVersion(mqttSettings.getInt("proto", MQTT_DEFAULT_PROTOCOL));
 
-  Serial.printf("🔧 [MQTT] Loaded config from NVS: host=%s, port=%u\n", _broker.c_str(), _port);
+  Serial.printf("🔧 [MQTT] Loaded config from NVS: host=%s, port=%u%s\n", _broker.c_str(), _port, useTls ? " (TLS)" : "");
   if (_user.length() > 0)
     Serial.printf("   [MQTT] user=%s\n", _user.c_str());
 }
 
+bool MQTTProtocol::reloadConfig() {
+  if (mqttMutex == NULL) return false;
+  Settings mqttSettings("mqtt", false);
+  if (mqttSettings.getString("broker", "") == _broker && mqttSettings.getInt("port", 1883) == _port &&
+      mqttSettings.getString("clientId", "") == _clientId) {
+    return false;
+  }
+  if (!xSemaphoreTake(mqttMutex, portMAX_DELAY)) return false;
+  if (_mqttClient.connected()) {
+    _mqttClient.disconnect();
+  }
+  loadConfig();
+  _lastReconnectAttempt = 0;      // Kết nối tới broker mới ngay ở vòng loop() kế tiếp
+  xSemaphoreGive(mqttMutex);
+  Serial.printf("🔁 [MQTT] Broker config changed, reconnecting to %s:%u\n", _broker.c_str(), _port);
+  return true;
+}
+
 void MQTTProtocol::setCallback(MQTT_CALLBACK_SIGNATURE) {
-  _mqttClient.setCallback(callback);
+  this->callback = callback;
+  _mqttClient.setCallback([this](char* topic, uint8_t* payload, unsigned int length) {
+    handleMessage(topic, payload, length);
+  });
+}
+
+void MQTTProtocol::handleMessage(char* topic, uint8_t* payload, unsigned int length) {
+  // Chạy trong _mqttClient.loop() (mutex đang được giữ) nên đổi topic ở đây an toàn với send()
+  if (strcmp(topic, _topicHandle) != 0) {
+    if (callback) callback(topic, payload, length);
+    return;
+  }
+  if (length == 0 || length > MQTT_HANDLE_MAX_LEN) {
+    Serial.printf("⚠️ [MQTT] Ignoring invalid device handle (%u bytes)\n", length);
+    return;
+  }
+  memcpy(_handle, payload, length);
+  _handle[length] = '\0';
+  buildTopics();
+  Serial.printf("🏷️ [MQTT] Broker assigned handle '%s', publishing on %s/<pin>\n", _handle, _topicSS);
 }
 
 void MQTTProtocol::updateConfig(const String& broker, uint16_t port, const String& clientId) {
@@ -60,6 +144,7 @@ void MQTTProtocol::updateConfig(const String& broker, uint16_t port, const Strin
   // Cập nhật biến thành viên
   _broker = broker;
   _port = port;
+  buildTopics();
   
   // Cập nhật server cho MQTT client
   _mqttClient.setServer(_broker.c_str(), _port);
@@ -81,20 +166,36 @@ void MQTTProtocol::loop() {
 
 void MQTTProtocol::reconnect() {
   if (_mqttClient.connected()) return;
+  if (_broker.length() == 0) return;    // Chưa có broker (lần boot đầu), chờ reloadConfig()
+
+  // Không chặn trong vòng lặp: mỗi lần gọi chỉ thử 1 lần, cách nhau MQTT_RECONNECT_INTERVAL_MS.
+  // mqttTask vẫn chạy tiếp để đẩy telemetry vào journal trong lúc mất kết nối.
+  unsigned long now = millis();
+  if (_lastReconnectAttempt != 0 && now - _lastReconnectAttempt < MQTT_RECONNECT_INTERVAL_MS) return;
+  _lastReconnectAttempt = now;
 
-  Serial.printf("🔄 Reconnecting to MQTT broker %s:%u...\n", _broker.c_str(), _port);
+  Serial.printf("🔄 Reconnecting to MQTT broker %s:%u (MQTT %s)...\n", _broker.c_str(), _port,
+                _mqttClient.getProtocolVersion() == MQTT_PROTOCOL_V5 ? "5" : "3.1.1");
+
+  // Handle chỉ có hiệu lực trong kết nối broker đã cấp, chờ broker gửi lại
+  if (_handle[0] != '\0') {
+    _handle[0] = '\0';
+    buildTopics();
+  }
 
   // Note: reconnect() được gọi từ loop() đã có mutex protection
-  while (!_mqttClient.connected()) {
-    bool ok = _mqttClient.connect(_clientId.c_str());
-
-    if (ok) {
-      Serial.println("✅ MQTT connected!");
-      break;
-    } else {
-      Serial.printf("❌ Failed, rc=%d. Retry in 5s...\n", _mqttClient.state());
-      delay(5000);
-    }
+  if (_mqttClient.connect(_clientId.c_str())) {
+    Serial.printf("✅ MQTT connected! (topic alias max %u)\n", _mqttClient.getTopicAliasMax());
+    _lastReconnectAttempt = 0;
+    resubscribe();
+  } else if (_mqttClient.state() == MQTT_CONNECT_BAD_PROTOCOL &&
+             _mqttClient.getProtocolVersion() == MQTT_PROTOCOL_V5) {
+    // Broker không hỗ trợ MQTT 5 -> thử lại ngay bằng 3.1.1 (dùng handle ngắn thay topic alias)
+    Serial.println("⚠️ [MQTT] Broker rejected MQTT 5, falling back to 3.1.1");
+    _mqttClient.setProtocolVersion(MQTT_PROTOCOL_V311);
+    _lastReconnectAttempt = 0;
+  } else {
+    Serial.printf("❌ Failed, rc=%d. Retry in %us...\n", _mqttClient.state(), MQTT_RECONNECT_INTERVAL_MS / 1000);
   }
 }
 
@@ -105,35 +206,78 @@ void MQTTProtocol::publish(const char* topic, const String &payload, bool retain
       xSemaphoreGive(mqttMutex);
       return;
     }
-    _mqttClient.publish(topic, payload.c_str(), retained);
+    _mqttClient.publish(topic, payload.c_str(), retained, MQTT_PUBLISH_QOS);
     Serial.printf("📤 Published [%s] => %s\n", topic, payload.c_str());
     xSemaphoreGive(mqttMutex);
   } else {
     Serial.println("⚠️ [MQTT] Could not acquire mutex for publish");
   }
 }
-void MQTTProtocol::send(int virtualPin, const String &payload , bool retained , bool isnotification) {
+bool MQTTProtocol::send(int virtualPin, const String &payload , bool retained , bool isnotification) {
+  return send(virtualPin, payload.c_str(), retained, isnotification);
+}
+
+bool MQTTProtocol::send(int virtualPin, const char* payload , bool retained , bool isnotification) {
+  bool ok = false;
   if (mqttMutex != NULL && xSemaphoreTake(mqttMutex, pdMS_TO_TICKS(100))) {
     if (!_mqttClient.connected()) {
       Serial.println("⚠️ MQTT not connected, cannot send");
       xSemaphoreGive(mqttMutex);
-      return;
-    }
-    String topic;
-    if(isnotification) {
-      topic = _topicNC;
-    } else {
-      topic = _topicSS + "/" + virtualPin;
+      return false;
     }
-    _mqttClient.publish(topic.c_str(), payload.c_str(), retained);
-    Serial.printf("📤 Sent [%s] => %s\n", topic.c_str(), payload.c_str());
+    const char* topic = isnotification ? _topicNC : topicFor(virtualPin);
+    ok = _mqttClient.publish(topic, payload, retained, MQTT_PUBLISH_QOS);
+    Serial.printf("📤 Sent [%s] => %s%s\n", topic, payload, ok ? "" : " (FAILED)");
     xSemaphoreGive(mqttMutex);
   }
   else {
     Serial.println("⚠️ [MQTT] Could not acquire mutex for send");
   }
+  return ok;
 } 
 
+bool MQTTProtocol::sendBatch(const uint8_t* data, size_t len) {
+  bool ok = false;
+  if (mqttMutex != NULL && xSemaphoreTake(mqttMutex, pdMS_TO_TICKS(100))) {
+    if (!_mqttClient.connected()) {
+      Serial.println("⚠️ MQTT not connected, cannot send batch");
+      xSemaphoreGive(mqttMutex);
+      return false;
+    }
+    ok = _mqttClient.publish(_topicBatch, data, len, false, MQTT_PUBLISH_QOS);
+    Serial.printf("📤 Sent batch [%s] => %u bytes%s\n", _topicBatch, (unsigned)len, ok ? "" : " (FAILED)");
+    xSemaphoreGive(mqttMutex);
+  } else {
+    Serial.println("⚠️ [MQTT] Could not acquire mutex for batch");
+  }
+  return ok;
+}
+
+bool MQTTProtocol::beginSend(int virtualPin, size_t len, bool isnotification) {
+  if (mqttMutex == NULL || !xSemaphoreTake(mqttMutex, pdMS_TO_TICKS(100))) {
+    Serial.println("⚠️ [MQTT] Could not acquire mutex for send");
+    return false;
+  }
+  const char* topic = isnotification ? _topicNC : topicFor(virtualPin);
+  if (!_mqttClient.beginPublish(topic, len, false, MQTT_PUBLISH_QOS)) {
+    Serial.printf("⚠️ [MQTT] Cannot start publish [%s] (%u bytes)\n", topic, (unsigned)len);
+    xSemaphoreGive(mqttMutex);
+    return false;
+  }
+  // Mutex được giữ cho tới endSend()
+  return true;
+}
+
+size_t MQTTProtocol::write(const uint8_t* data, size_t len) {
+  return _mqttClient.write(data, len);
+}
+
+bool MQTTProtocol::endSend() {
+  bool ok = _mqttClient.endPublish();
+  xSemaphoreGive(mqttMutex);
+  return ok;
+}
+
 void MQTTProtocol::subscribe(const char* topic) {
   if (mqttMutex != NULL && xSemaphoreTake(mqttMutex, pdMS_TO_TICKS(100))) {
     if (!_mqttClient.connected()) {
@@ -149,18 +293,58 @@ void MQTTProtocol::subscribe(const char* topic) {
   }
 }
 void MQTTProtocol::registerVirtualpin(int type , int virtualPin) {
-    if(type == REG_SS) {
-      subscribe((String("SS/") + _clientId + "/" + virtualPin).c_str());
-    } else if(type == REG_CT) {
-      subscribe((String("CT/") + _clientId + "/" + virtualPin).c_str());
+    char topic[MQTT_TOPIC_MAX_LEN];
+    if(type == REG_SS || type == REG_CT) {
+      PinTopic* entry = findPin(virtualPin);
+      if (entry != nullptr) {
+        entry->regMask |= (1 << type);
+      } else {
+        Serial.printf("⚠️ [MQTT] Topic cache full, V%d will not be resubscribed\n", virtualPin);
+      }
+      snprintf(topic, sizeof(topic), "%s/%s/%d", type == REG_SS ? "SS" : "CT", _clientId.c_str(), virtualPin);
+      subscribe(topic);
     } else if(type == REG_NC) {
-      subscribe((String("NC/") + _clientId).c_str());
+      _ncSubscribed = true;
+      snprintf(topic, sizeof(topic), "NC/%s", _clientId.c_str());
+      subscribe(topic);
     }
     else {
       Serial.println("⚠️ [MQTT] Invalid type");
     }
 }
 
+void MQTTProtocol::resubscribe() {
+  // Broker không giữ subscription qua clean session -> đăng ký lại mọi topic đã register.
+  // Gọi từ reconnect() (mutex đang được giữ) nên dùng thẳng _mqttClient
+  char topic[MQTT_TOPIC_MAX_LEN];
+  uint8_t count = 0;
+  if (_mqttClient.getProtocolVersion() == MQTT_PROTOCOL_V311) {
+    // Không có topic alias -> xin broker handle ngắn, trả về trên chính topic này
+    _mqttClient.subscribe(_topicHandle);
+  }
+  for (uint8_t i = 0; i < _pinTopicCount; i++) {
+    const PinTopic& entry = _pinTopics[i];
+    if (entry.regMask & (1 << REG_SS)) {
+      snprintf(topic, sizeof(topic), "SS/%s/%d", _clientId.c_str(), entry.pin);
+      _mqttClient.subscribe(topic);
+      count++;
+    }
+    if (entry.regMask & (1 << REG_CT)) {
+      snprintf(topic, sizeof(topic), "CT/%s/%d", _clientId.c_str(), entry.pin);
+      _mqttClient.subscribe(topic);
+      count++;
+    }
+  }
+  if (_ncSubscribed) {
+    snprintf(topic, sizeof(topic), "NC/%s", _clientId.c_str());
+    _mqttClient.subscribe(topic);
+    count++;
+  }
+  if (count > 0) {
+    Serial.printf("📡 [MQTT] Resubscribed %u topic(s)\n", count);
+  }
+}
+
 bool MQTTProtocol::connected() {
   bool result = false;
   if (mqttMutex != NULL && xSemaphoreTake(mqttMutex, pdMS_TO_TICKS(100))) {
@@ -169,3 +353,33 @@ bool MQTTProtocol::connected() {
   }
   return result;
 }
+
+bool MQTTProtocol::setInflightWindow(uint8_t window) {
+  bool ok = false;
+  if (mqttMutex != NULL && xSemaphoreTake(mqttMutex, pdMS_TO_TICKS(100))) {
+    // Message đang chờ PUBACK được giữ lại; thu nhỏ window dưới số message đó sẽ bị từ chối
+    ok = _mqttClient.setInflightWindow(window);
+    xSemaphoreGive(mqttMutex);
+  }
+  if (ok) {
+    Settings mqttSettings("mqtt", true);
+    mqttSettings.setInt("inflight", window);
+    Serial.printf("✅ [MQTT] In-flight window set to %u\n", window);
+  } else {
+    Serial.printf("⚠️ [MQTT] Cannot set in-flight window to %u\n", window);
+  }
+  return ok;
+}
+
+void MQTTProtocol::printStats() {
+  Serial.printf("📈 [MQTT] QoS%d window %u/%u, published %u, acked %u (avg %u ms), retransmits %u, window full %u, dup dropped %u, downgraded %u\n",
+                MQTT_PUBLISH_QOS, _mqttClient.inflight(), _mqttClient.getInflightWindow(),
+                _mqttClient.getPublished(), _mqttClient.getAcked(), _mqttClient.getAvgAckMs(),
+                _mqttClient.getRetransmits(), _mqttClient.getWindowFull(), _mqttClient.getDuplicatesDropped(),
+                _mqttClient.getDowngraded());
+  uint32_t count = _mqttClient.getPublishCount();
+  Serial.printf("📏 [MQTT] MQTT %s, topic alias max %u, handle '%s', %u publish, avg %u bytes/publish\n",
+                _mqttClient.getProtocolVersion() == MQTT_PROTOCOL_V5 ? "5" : "3.1.1",
+                _mqttClient.getTopicAliasMax(), _handle, count,
+                count ? _mqttClient.getPublishBytes() / count : 0);
+}
@@ -0,0 +1,237 @@
+#include "otaDelta.h"
+
+OtaDelta::OtaDelta()
+    : _patch(nullptr), _patchSize(0), _patchRead(0), _base(nullptr),
+      _oldSize(0), _newSize(0), _state(STATE_CONTROL), _produced(0), _oldPos(0),
+      _diffLeft(0), _extraLeft(0), _seek(0), _zeroLeft(0), _litLeft(0), _error(nullptr),
+      _inPos(0), _inLen(0), _oldBufStart(0), _oldBufLen(0) {
+    mbedtls_sha256_init(&_sha);
+}
+
+OtaDelta::~OtaDelta() {
+    mbedtls_sha256_free(&_sha);
+}
+
+void OtaDelta::fail(const char* error) {
+    if (_error == nullptr) {
+        _error = error;
+        Serial.printf("❌ [OTA Delta] %s (new %u/%u, patch %u/%u)\n",
+                      error, _produced, _newSize, _patchRead, _patchSize);
+    }
+    _state = STATE_DONE;
+}
+
+bool OtaDelta::begin(WiFiClient* patch, size_t patchSize, const esp_partition_t* base) {
+    _patch = patch;
+    _patchSize = patchSize;
+    _base = base;
+    if (_base == nullptr) {
+        fail("No running partition");
+        return false;
+    }
+
+    uint8_t header[OTA_DELTA_HEADER_SIZE];
+    if (!readPatch(header, sizeof(header))) return false;
+    if (memcmp(header, OTA_DELTA_MAGIC, 4) != 0) {
+        fail("Bad patch magic");
+        return false;
+    }
+    memcpy(&_oldSize, header + 4, 4);
+    memcpy(&_newSize, header + 8, 4);
+    memcpy(_newSha, header + 44, 32);
+    if (_oldSize > _base->size) {
+        fail("Base image larger than partition");
+        return false;
+    }
+
+    // Patch chỉ đúng khi ảnh đang chạy là đúng ảnh gốc: kiểm tra trước khi tải phần còn lại
+    uint32_t start = millis();
+    mbedtls_sha256_context baseSha;
+    mbedtls_sha256_init(&baseSha);
+    mbedtls_sha256_starts(&baseSha, 0);
+    for (uint32_t offset = 0; offset < _oldSize; offset += OTA_DELTA_OLD_BUF) {
+        size_t n = min((uint32_t)OTA_DELTA_OLD_BUF, _oldSize - offset);
+        if (esp_partition_read(_base, offset, _old, n) != ESP_OK) {
+            mbedtls_sha256_free(&baseSha);
+            fail("Base partition read failed");
+            return false;
+        }
+        mbedtls_sha256_update(&baseSha, _old, n);
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&baseSha, digest);
+    mbedtls_sha256_free(&baseSha);
+    if (memcmp(digest, header + 12, 32) != 0) {
+        fail("Running image does not match patch base");
+        return false;
+    }
+
+    mbedtls_sha256_starts(&_sha, 0);
+    Serial.printf("🧩 [OTA Delta] Patch %u B: %u -> %u B, base verified in %lu ms\n",
+                  _patchSize, _oldSize, _newSize, millis() - start);
+    return true;
+}
+
+bool OtaDelta::readPatch(uint8_t* out, size_t length) {
+    while (length > 0) {
+        if (_inPos == _inLen) {
+            size_t want = min((size_t)OTA_DELTA_IN_BUF, _patchSize - _patchRead);
+            if (want == 0) {
+                fail("Patch truncated");
+                return false;
+            }
+            // readBytes chờ tới timeout của HTTPClient; thử lại tới OTA_DELTA_TIMEOUT_MS
+            uint32_t waitStart = millis();
+            size_t n = 0;
+            while (n == 0 && millis() - waitStart < OTA_DELTA_TIMEOUT_MS) {
+                n = _patch->readBytes(_in, want);
+                if (n == 0 && !_patch->connected()) break;
+            }
+            if (n == 0) {
+                fail("Patch download stalled");
+                return false;
+            }
+            _patchRead += n;
+            _inPos = 0;
+            _inLen = n;
+        }
+        size_t n = min(length, _inLen - _inPos);
+        memcpy(out, _in + _inPos, n);
+        _inPos += n;
+        out += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool OtaDelta::readVarint(uint32_t& value) {
+    value = 0;
+    for (int shift = 0; shift <= 28; shift += 7) {
+        uint8_t byte;
+        if (!readPatch(&byte, 1)) return false;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    fail("Varint too long");
+    return false;
+}
+
+bool OtaDelta::readOld(uint8_t* out, size_t length) {
+    // seek âm quá đầu ảnh làm _oldPos quay vòng -> cũng bị chặn ở đây
+    if (_oldPos > _oldSize || length > _oldSize - _oldPos) {
+        fail("Patch reads past base image");
+        return false;
+    }
+    while (length > 0) {
+        if (_oldPos < _oldBufStart || _oldPos >= _oldBufStart + _oldBufLen) {
+            _oldBufStart = _oldPos;
+            _oldBufLen = min((uint32_t)OTA_DELTA_OLD_BUF, _oldSize - _oldPos);
+            if (esp_partition_read(_base, _oldBufStart, _old, _oldBufLen) != ESP_OK) {
+                fail("Base partition read failed");
+                return false;
+            }
+        }
+        size_t offset = _oldPos - _oldBufStart;
+        size_t n = min(length, _oldBufLen - offset);
+        memcpy(out, _old + offset, n);
+        _oldPos += n;
+        out += n;
+        length -= n;
+    }
+    return true;
+}
+
+size_t OtaDelta::read(uint8_t* out, size_t length) {
+    size_t produced = 0;
+    while (produced < length && _state != STATE_DONE) {
+        if (_produced + produced == _newSize && _state == STATE_CONTROL) {
+            _state = STATE_DONE;
+            break;
+        }
+        switch (_state) {
+            case STATE_CONTROL: {
+                uint32_t seek;
+                if (!readVarint(_diffLeft) || !readVarint(_extraLeft) || !readVarint(seek)) break;
+                _seek = (seek & 1) ? -(int32_t)((seek + 1) >> 1) : (int32_t)(seek >> 1);   // zigzag
+                // So sánh từng phần để diff_len + extra_len (varint 32 bit) không tràn số
+                uint32_t remaining = _newSize - (_produced + produced);
+                if (_diffLeft > remaining || _extraLeft > remaining - _diffLeft) {
+                    fail("Patch record exceeds image size");
+                    break;
+                }
+                _zeroLeft = 0;
+                _litLeft = 0;
+                _state = STATE_DIFF;
+                break;
+            }
+            case STATE_DIFF: {
+                if (_diffLeft == 0) {
+                    _state = STATE_EXTRA;
+                    break;
+                }
+                if (_zeroLeft == 0 && _litLeft == 0) {
+                    if (!readVarint(_zeroLeft) || !readVarint(_litLeft)) break;
+                    if ((_zeroLeft == 0 && _litLeft == 0) || _zeroLeft > _diffLeft ||
+                        _litLeft > _diffLeft - _zeroLeft) {
+                        fail("Bad diff token");
+                    }
+                    break;
+                }
+                bool literal = _zeroLeft == 0;
+                uint32_t run = literal ? _litLeft : _zeroLeft;
+                size_t n = min((size_t)run, length - produced);
+                uint8_t* dst = out + produced;
+                if (!readOld(dst, n)) break;
+                if (literal) {
+                    // Ảnh cũ + chênh lệch từng byte (mod 256)
+                    for (size_t i = 0; i < n; i++) {
+                        uint8_t delta;
+                        if (!readPatch(&delta, 1)) break;
+                        dst[i] += delta;
+                    }
+                    if (failed()) break;
+                    _litLeft -= n;
+                } else {
+                    _zeroLeft -= n;
+                }
+                _diffLeft -= n;
+                produced += n;
+                break;
+            }
+            case STATE_EXTRA: {
+                if (_extraLeft == 0) {
+                    _oldPos += _seek;
+                    _state = STATE_CONTROL;
+                    break;
+                }
+                size_t n = min((size_t)_extraLeft, length - produced);
+                if (!readPatch(out + produced, n)) break;
+                _extraLeft -= n;
+                produced += n;
+                break;
+            }
+            case STATE_DONE:
+                break;
+        }
+    }
+    if (failed()) return 0;
+    mbedtls_sha256_update(&_sha, out, produced);
+    _produced += produced;
+    return produced;
+}
+
+bool OtaDelta::verify() {
+    if (failed()) return false;
+    if (_produced != _newSize) {
+        fail("Patch ended early");
+        return false;
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&_sha, digest);
+    if (memcmp(digest, _newSha, 32) != 0) {
+        fail("New image hash mismatch");
+        return false;
+    }
+    Serial.printf("✅ [OTA Delta] Image rebuilt from %u B patch, sha256 OK\n", _patchRead);
+    return true;
+}
@@ -0,0 +1,83 @@
+#ifndef OTA_DELTA_H
+#define OTA_DELTA_H
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+// ======= OTA Delta Configuration =======
+#define OTA_DELTA_MAGIC         "EDP1"
+#define OTA_DELTA_HEADER_SIZE   76      // magic + old_size + new_size + 2 x sha256
+#define OTA_DELTA_IN_BUF        512     // Buffer đọc patch từ socket
+#define OTA_DELTA_OLD_BUF       512     // Cửa sổ đọc ảnh cũ từ flash
+#define OTA_DELTA_TIMEOUT_MS    10000   // Không nhận được byte patch nào trong khoảng này -> lỗi
+
+// ======= OTA Delta Decoder =======
+/**
+ * Áp patch delta (format "EDP1", tạo bởi backend app/services/ota_delta.py) theo luồng:
+ * đọc patch từ socket, đọc ảnh cũ từ partition đang chạy, trả ra từng đoạn ảnh mới
+ * để ghi vào partition OTA. RAM cố định ~1 KB, không phụ thuộc kích thước ảnh.
+ *
+ *   OtaDelta delta;
+ *   delta.begin(stream, patchSize, esp_ota_get_running_partition());   // kiểm tra hash ảnh cũ
+ *   Update.begin(delta.newSize());
+ *   while ((n = delta.read(buf, sizeof(buf))) > 0) Update.write(buf, n);
+ *   if (delta.verify()) Update.end();                                  // hash ảnh mới
+ */
+class OtaDelta {
+public:
+    OtaDelta();
+    ~OtaDelta();
+
+    // Đọc header + kiểm tra ảnh đang chạy đúng là ảnh gốc của patch
+    bool begin(WiFiClient* patch, size_t patchSize, const esp_partition_t* base);
+    // Dựng tiếp tối đa length byte ảnh mới; 0 khi xong hoặc lỗi (xem failed())
+    size_t read(uint8_t* out, size_t length);
+    // Đã dựng đủ new_size byte và sha256 khớp header
+    bool verify();
+
+    size_t newSize() const { return _newSize; }
+    size_t produced() const { return _produced; }
+    size_t patchRead() const { return _patchRead; }
+    bool failed() const { return _error != nullptr; }
+    const char* error() const { return _error ? _error : ""; }
+
+private:
+    enum State { STATE_CONTROL, STATE_DIFF, STATE_EXTRA, STATE_DONE };
+
+    bool readPatch(uint8_t* out, size_t length);
+    bool readVarint(uint32_t& value);
+    bool readOld(uint8_t* out, size_t length);
+    void fail(const char* error);
+
+    WiFiClient* _patch;
+    size_t _patchSize;
+    size_t _patchRead;
+    const esp_partition_t* _base;
+
+    uint32_t _oldSize;
+    uint32_t _newSize;
+    uint8_t _newSha[32];
+
+    State _state;
+    size_t _produced;
+    uint32_t _oldPos;
+    uint32_t _diffLeft;         // Còn bao nhiêu byte của đoạn diff hiện tại
+    uint32_t _extraLeft;
+    int32_t _seek;
+    uint32_t _zeroLeft;         // Token diff: số byte giữ nguyên ảnh cũ
+    uint32_t _litLeft;          // Token diff: số byte cộng thêm chênh lệch
+    const char* _error;
+
+    uint8_t _in[OTA_DELTA_IN_BUF];
+    size_t _inPos;
+    size_t _inLen;
+    uint8_t _old[OTA_DELTA_OLD_BUF];
+    uint32_t _oldBufStart;
+    size_t _oldBufLen;
+
+    mbedtls_sha256_context _sha;
+};
+
+#endif
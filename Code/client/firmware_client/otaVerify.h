@@ -0,0 +1,52 @@
+#ifndef OTA_VERIFY_H
+#define OTA_VERIFY_H
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+// ======= OTA Verify Configuration =======
+// Khóa công khai ECDSA P-256 (PEM) ứng với OTA_SIGNING_KEY của backend.
+// Rỗng: chỉ kiểm tra sha256 trong manifest. Khác rỗng: bắt buộc manifest có chữ ký hợp lệ.
+#ifndef OTA_SIGNING_PUBKEY
+#define OTA_SIGNING_PUBKEY ""
+#endif
+#define OTA_VERIFY_READ_BUF     1024    // Buffer đọc lại phần đã ghi khi tải tiếp
+
+// ======= OTA Verifier =======
+/**
+ * Hash ảnh mới theo từng block ngay khi ghi vào partition OTA, nên kiểm tra không cần
+ * đọc lại flash lần 2. Trước khi đổi partition boot so với sha256 (và chữ ký) trong manifest
+ * (backend app/services/ota_sign.py).
+ *
+ *   OtaVerifier verifier;
+ *   verifier.begin();
+ *   verifier.update(block, n);                      // mỗi block đã ghi, đúng thứ tự
+ *   if (verifier.verify(sha256Hex, signatureB64)) esp_ota_set_boot_partition(...);
+ */
+class OtaVerifier {
+public:
+    OtaVerifier();
+    ~OtaVerifier();
+
+    void begin();
+    void update(const uint8_t* data, size_t length);
+    // Tải tiếp bằng Range: hash phần [0, length) đã có sẵn trong partition
+    bool resumeFrom(const esp_partition_t* partition, size_t length);
+    // Rỗng expectedSha256 = server chưa có sha256 cho ảnh này (chỉ chấp nhận khi không cấu hình khóa)
+    bool verify(const String& expectedSha256, const String& signature);
+
+    size_t hashed() const { return _hashed; }
+    uint32_t hashUs() const { return _hashUs; }
+    const char* error() const { return _error ? _error : ""; }
+
+private:
+    bool verifySignature(const uint8_t digest[32], const String& signature);
+
+    mbedtls_sha256_context _sha;
+    size_t _hashed;
+    uint32_t _hashUs;
+    const char* _error;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "telemetry.h"
+
+// ======= Record Builders =======
+static TelemetryRecord telemetryBase(int virtualPin, uint8_t type) {
+    TelemetryRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.timestamp = millis();
+    rec.virtualPin = (uint16_t)virtualPin;
+    rec.type = type;
+    return rec;
+}
+
+TelemetryRecord telemetryInt(int virtualPin, int32_t value) {
+    TelemetryRecord rec = telemetryBase(virtualPin, TLM_INT);
+    rec.value.i = value;
+    return rec;
+}
+
+TelemetryRecord telemetryFloat(int virtualPin, float value) {
+    TelemetryRecord rec = telemetryBase(virtualPin, TLM_FLOAT);
+    rec.value.f = value;
+    return rec;
+}
+
+TelemetryRecord telemetryBool(int virtualPin, bool value) {
+    TelemetryRecord rec = telemetryBase(virtualPin, TLM_BOOL);
+    rec.value.b = value;
+    return rec;
+}
+
+bool telemetryString(TelemetryRecord& rec, int virtualPin, const char* value, bool isNotification) {
+    rec = telemetryBase(virtualPin, TLM_STR);
+    if (isNotification) {
+        rec.flags |= TLM_FLAG_NC;
+    }
+
+    size_t len = strlen(value);
+    if (len < TLM_SHORT_STR_LEN) {
+        memcpy(rec.value.s, value, len + 1);
+        return true;
+    }
+    // Phần đầu của "OTA:INFO@..." là message sai, không phải message ngắn hơn -> bỏ hẳn
+    if (len >= TLM_ARENA_SLOT_SIZE) {
+        Serial.printf("⚠️ [Telemetry] String too long (%u B), dropped\n", (unsigned)len);
+        return false;
+    }
+
+    int slot = TelemetryArena::getInstance().alloc(value, len);
+    if (slot < 0) {
+        Serial.println("⚠️ [Telemetry] Arena full, string dropped");
+        return false;
+    }
+    rec.type = TLM_BLOB;
+    rec.value.blob.handle = (uint16_t)slot;
+    rec.value.blob.len = (uint16_t)len;
+    return true;
+}
+
+// ======= Serialization =======
+const char* telemetryText(const TelemetryRecord& rec, char* scratch, size_t scratchLen) {
+    switch (rec.type) {
+        case TLM_INT:
+            snprintf(scratch, scratchLen, "%ld", (long)rec.value.i);
+            return scratch;
+        case TLM_FLOAT:
+            snprintf(scratch, scratchLen, "%.2f", rec.value.f);
+            return scratch;
+        case TLM_BOOL:
+            snprintf(scratch, scratchLen, "%d", rec.value.b ? 1 : 0);
+            return scratch;
+        case TLM_STR:
+            return rec.value.s;
+        case TLM_BLOB: {
+            const char* data = TelemetryArena::getInstance().get(rec.value.blob.handle);
+            return data ? data : "";
+        }
+    }
+    scratch[0] = '\0';
+    return scratch;
+}
+
+void telemetryRelease(const TelemetryRecord& rec) {
+    if (rec.type == TLM_BLOB) {
+        TelemetryArena::getInstance().release(rec.value.blob.handle);
+    }
+}
+
+// ======= Telemetry Arena =======
+TelemetryArena::TelemetryArena() : _usedMask(0), _allocFailures(0) {
+    _mutex = xSemaphoreCreateMutex();
+}
+
+int TelemetryArena::alloc(const char* data, size_t len) {
+    int slot = -1;
+    if (xSemaphoreTake(_mutex, pdMS_TO_TICKS(10)) != pdTRUE) {
+        _allocFailures++;
+        return -1;
+    }
+    for (int i = 0; i < TLM_ARENA_SLOTS; i++) {
+        if (!(_usedMask & (1 << i))) {
+            _usedMask |= (1 << i);
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        _allocFailures++;
+    }
+    xSemaphoreGive(_mutex);
+
+    if (slot >= 0) {
+        size_t n = min(len, (size_t)(TLM_ARENA_SLOT_SIZE - 1));
+        memcpy(_slots[slot], data, n);
+        _slots[slot][n] = '\0';
+    }
+    return slot;
+}
+
+const char* TelemetryArena::get(uint16_t handle) {
+    if (handle >= TLM_ARENA_SLOTS) return nullptr;
+    return _slots[handle];
+}
+
+void TelemetryArena::release(uint16_t handle) {
+    if (handle >= TLM_ARENA_SLOTS) return;
+    if (xSemaphoreTake(_mutex, portMAX_DELAY) == pdTRUE) {
+        _usedMask &= ~(1 << handle);
+        xSemaphoreGive(_mutex);
+    }
+}
+
+uint8_t TelemetryArena::inUse() {
+    uint8_t count = 0;
+    for (int i = 0; i < TLM_ARENA_SLOTS; i++) {
+        if (_usedMask & (1 << i)) count++;
+    }
+    return count;
+}
@@ -0,0 +1,101 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// ======= Telemetry Configuration =======
+#define TLM_SHORT_STR_LEN   16     // Chuỗi ngắn (AU:ON, OTA:UPDATING@0...) nằm ngay trong record
+#define TLM_ARENA_SLOTS     4      // Số chuỗi dài (notification) có thể chờ gửi cùng lúc
+#define TLM_ARENA_SLOT_SIZE 128    // Độ dài tối đa 1 chuỗi dài (giữ bằng MAX_VALUE_LEN cũ)
+#define TLM_TEXT_BUF_LEN    24     // Buffer đủ cho int/float/bool/short-string khi format ra text
+
+// ======= Record Types =======
+enum TelemetryType : uint8_t {
+    TLM_INT,        // value.i
+    TLM_FLOAT,      // value.f
+    TLM_BOOL,       // value.b
+    TLM_STR,        // value.s (NUL-terminated, <= TLM_SHORT_STR_LEN - 1 ký tự)
+    TLM_BLOB        // value.blob -> chuỗi dài nằm trong TelemetryArena
+};
+
+// Flags
+#define TLM_FLAG_NC        0x01    // Gửi lên topic NC/<clientId> thay vì SS/<clientId>/<pin>
+#define TLM_FLAG_PREV_BOOT 0x02    // Replay từ journal của lần boot trước, timestamp không còn ý nghĩa
+
+// ======= Telemetry Record =======
+// Thay cho DeviceData (~148 bytes): 24 bytes, copy qua queue rẻ hơn ~6 lần.
+// Giá trị được giữ ở dạng nhị phân, chỉ format thành text 1 lần lúc publish.
+struct TelemetryRecord {
+    uint32_t timestamp;     // millis() lúc đo
+    uint16_t virtualPin;
+    uint8_t type;           // TelemetryType
+    uint8_t flags;          // TLM_FLAG_*
+    union {
+        int32_t i;
+        float f;
+        bool b;
+        char s[TLM_SHORT_STR_LEN];
+        struct {
+            uint16_t handle;    // Slot trong TelemetryArena
+            uint16_t len;
+        } blob;
+    } value;
+};
+
+// ======= Record Builders =======
+TelemetryRecord telemetryInt(int virtualPin, int32_t value);
+TelemetryRecord telemetryFloat(int virtualPin, float value);
+TelemetryRecord telemetryBool(int virtualPin, bool value);
+
+/**
+ * @brief Tạo record chuỗi. Chuỗi ngắn nằm ngay trong record, chuỗi dài được
+ *        copy vào TelemetryArena.
+ * @return false nếu arena hết slot hoặc chuỗi dài quá TLM_ARENA_SLOT_SIZE - 1:
+ *         caller bỏ message, không bao giờ gửi một phần chuỗi
+ */
+bool telemetryString(TelemetryRecord& rec, int virtualPin, const char* value, bool isNotification);
+
+/**
+ * @brief Lấy text để publish. Với TLM_BLOB trả về con trỏ thẳng vào arena,
+ *        các kiểu khác được format vào scratch (>= TLM_TEXT_BUF_LEN bytes).
+ */
+const char* telemetryText(const TelemetryRecord& rec, char* scratch, size_t scratchLen);
+
+/**
+ * @brief Trả slot arena (nếu có) sau khi record đã được gửi hoặc bị bỏ.
+ */
+void telemetryRelease(const TelemetryRecord& rec);
+
+// ======= Telemetry Arena =======
+// Vùng nhớ cố định cho các chuỗi notification dài (OTA:INFO@...), hiếm khi dùng
+// nên không cần phình to mọi record trong queue.
+class TelemetryArena {
+public:
+    static TelemetryArena& getInstance() {
+        static TelemetryArena instance;
+        return instance;
+    }
+
+    // Trả về slot index, -1 nếu hết slot
+    int alloc(const char* data, size_t len);
+    const char* get(uint16_t handle);
+    void release(uint16_t handle);
+
+    uint8_t inUse();
+    uint32_t getAllocFailures() const { return _allocFailures; }
+
+    TelemetryArena(const TelemetryArena&) = delete;
+    TelemetryArena& operator=(const TelemetryArena&) = delete;
+
+private:
+    TelemetryArena();
+
+    SemaphoreHandle_t _mutex;
+    uint8_t _usedMask;
+    uint32_t _allocFailures;
+    char _slots[TLM_ARENA_SLOTS][TLM_ARENA_SLOT_SIZE];
+};
+
+#endif
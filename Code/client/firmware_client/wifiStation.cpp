@@ -1,7 +1,14 @@
 #include "wifiStation.h"
 
 WiFiStation::WiFiStation() 
-    : _server(80), _dnsServer(), _isConfigMode(false), _isConnected(false), _lastCheck(0) {
+    : _server(80), _dnsServer(), _isConfigMode(false), _isConnected(false), _eventsRegistered(false),
+      _reconnectDelayMs(0), _disconnects(0), _disconnectedAt(0), _lastOutageMs(0), _lastReason(0),
+      _cachedChannel(0), _cachedIp(0), _cachedGateway(0), _cachedMask(0), _cachedDns(0),
+      _fastConnects(0), _fastFailures(0), _fastTotalMs(0),
+      _fullConnects(0), _fullFailures(0), _fullTotalMs(0), _lastConnectMs(0) {
+    memset(_cachedBssid, 0, sizeof(_cachedBssid));
+    _events = xEventGroupCreate();
+    xEventGroupSetBits(_events, WIFI_DISCONNECTED_BIT);
     _apSSID = "ESP32_Config_" + String(random(1000, 9999));
     _apPassword = "";  // Không cần mật khẩu
 }
@@ -9,6 +16,13 @@ WiFiStation::WiFiStation()
 void WiFiStation::begin() {
     Serial.println("🚀 [WiFiStation] Starting WiFi Station...");
     
+    if (!_eventsRegistered) {
+        _eventsRegistered = true;
+        WiFi.onEvent([this](WiFiEvent_t event, WiFiEventInfo_t info) { onWiFiEvent(event, info); });
+    }
+    // Kết nối lại do loop() làm (fast path + backoff), không để driver tự begin() lại song song
+    WiFi.setAutoReconnect(false);
+    
     // Load cấu hình WiFi từ NVS
     loadWiFiConfig();
     
@@ -41,18 +55,83 @@ void WiFiStation::loop() {
     if (_isConfigMode) {
         _dnsServer.processNextRequest();
         _server.handleClient();
+        vTaskDelay(pdMS_TO_TICKS(WIFI_PORTAL_POLL_MS));
+        return;
+    }
+    
+    // Ngủ tới khi event báo mất kết nối; timeout chỉ để đối chiếu với driver phòng khi lỡ event
+    EventBits_t bits = xEventGroupWaitBits(_events, WIFI_DISCONNECTED_BIT, pdFALSE, pdFALSE,
+                                           pdMS_TO_TICKS(WIFI_WATCHDOG_MS));
+    if (!(bits & WIFI_DISCONNECTED_BIT)) {
+        if (WiFi.status() == WL_CONNECTED) return;
+        Serial.println("⚠️ [WiFiStation] Missed disconnect event");
+        setConnected(false);
+    }
+    
+    Serial.println("⚠️ [WiFiStation] WiFi disconnected, attempting reconnect...");
+    connectToWiFi();
+    if (isConnected()) {
+        _reconnectDelayMs = 0;
+        return;
+    }
+    // AP chưa lên lại: lùi dần, GOT_IP trong lúc chờ sẽ đánh thức sớm
+    _reconnectDelayMs = _reconnectDelayMs == 0 ? WIFI_RETRY_DELAY_MS
+                                               : min(_reconnectDelayMs * 2, (uint32_t)WIFI_RECONNECT_MAX_MS);
+    Serial.printf("⏳ [WiFiStation] Next reconnect in %lu ms\n", (unsigned long)_reconnectDelayMs);
+    waitUntilConnected(_reconnectDelayMs);
+}
+
+// ======= WiFi Events =======
+void WiFiStation::onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
+    switch (event) {
+        case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+            setConnected(true);
+            break;
+        case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+            _lastReason = info.wifi_sta_disconnected.reason;
+            setConnected(false);
+            break;
+        case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+            setConnected(false);
+            break;
+        default:
+            break;
+    }
+}
+
+void WiFiStation::setConnected(bool connected) {
+    if (connected) {
+        xEventGroupClearBits(_events, WIFI_DISCONNECTED_BIT);
+        xEventGroupSetBits(_events, WIFI_CONNECTED_BIT);
     } else {
-        // Kiểm tra kết nối WiFi định kỳ
-        if (millis() - _lastCheck > 30000) { // Mỗi 30 giây
-            _lastCheck = millis();
-            if (WiFi.status() != WL_CONNECTED) {
-                Serial.println("⚠️ [WiFiStation] WiFi disconnected, attempting reconnect...");
-                connectToWiFi();
-            }
+        xEventGroupClearBits(_events, WIFI_CONNECTED_BIT);
+        xEventGroupSetBits(_events, WIFI_DISCONNECTED_BIT);
+    }
+    if (_isConnected.exchange(connected) == connected) return;     // Lần connect thử thất bại cũng báo DISCONNECTED
+    
+    if (connected) {
+        if (_disconnectedAt != 0) {
+            _lastOutageMs = millis() - _disconnectedAt;
+            _disconnectedAt = 0;
+            Serial.printf("✅ [WiFiStation] WiFi back after %lu ms\n", (unsigned long)_lastOutageMs);
         }
+    } else {
+        _disconnects++;
+        _disconnectedAt = millis();
+        Serial.printf("⚠️ [WiFiStation] WiFi lost (reason %u)\n", _lastReason);
     }
 }
 
+bool WiFiStation::waitUntilConnected(uint32_t timeoutMs) {
+    if (_isConnected) return true;
+    TickType_t ticks = timeoutMs == WIFI_WAIT_FOREVER ? portMAX_DELAY : pdMS_TO_TICKS(timeoutMs);
+    return (xEventGroupWaitBits(_events, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, ticks) & WIFI_CONNECTED_BIT) != 0;
+}
+
+EventGroupHandle_t WiFiStation::getEventGroup() {
+    return _events;
+}
+
 void WiFiStation::waitForConnection() {
     Serial.println("⏳ [WiFiStation] Waiting for WiFi connection...");
     Serial.println("📱 [WiFiStation] Please connect to WiFi and configure if needed");
@@ -69,7 +148,6 @@ void WiFiStation::waitForConnection() {
             Serial.println("✅ [WiFiStation] WiFi connected successfully!");
             Serial.printf("📡 [WiFiStation] SSID: %s\n", WiFi.SSID().c_str());
             Serial.printf("🌐 [WiFiStation] IP: %s\n", WiFi.localIP().toString().c_str());
-            _isConnected = true;
             break;
         }
         
@@ -78,7 +156,6 @@ void WiFiStation::waitForConnection() {
 }
 
 bool WiFiStation::isConnected() {
-    _isConnected = (WiFi.status() == WL_CONNECTED);
     return _isConnected;
 }
 
@@ -95,6 +172,9 @@ String WiFiStation::getIP() {
 }
 
 void WiFiStation::setWiFiConfig(const String& ssid, const String& password) {
+    if (ssid != _configSSID) {
+        clearConnectionCache();     // BSSID / lease của mạng cũ không dùng được
+    }
     _configSSID = ssid;
     _configPassword = password;
     saveWiFiConfig();
@@ -144,6 +224,7 @@ void WiFiStation::loadWiFiConfig() {
     _configPassword = wifiSettings.getString("password", "");
     
     Serial.printf("📖 [WiFiStation] Loaded config: SSID=%s\n", _configSSID.c_str());
+    loadConnectionCache();
 }
 
 void WiFiStation::saveWiFiConfig() {
@@ -158,24 +239,13 @@ void WiFiStation::saveWiFiConfig() {
 void WiFiStation::connectToWiFi() {
     Serial.printf("🔗 [WiFiStation] Connecting to %s...\n", _configSSID.c_str());
     
-    WiFi.mode(WIFI_STA);
-    WiFi.begin(_configSSID.c_str(), _configPassword.c_str());
-    
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-        delay(500);
-        Serial.print(".");
-        attempts++;
-    }
-    
-    if (WiFi.status() == WL_CONNECTED) {
-        Serial.println("\n✅ [WiFiStation] WiFi connected!");
+    bool connected = connectFast() || connectFull();
+    if (connected) {
+        Serial.println("✅ [WiFiStation] WiFi connected!");
         Serial.printf("📡 [WiFiStation] SSID: %s\n", WiFi.SSID().c_str());
         Serial.printf("🌐 [WiFiStation] IP: %s\n", WiFi.localIP().toString().c_str());
-        _isConnected = true;
     } else {
-        Serial.println("\n❌ [WiFiStation] WiFi connection failed!");
-        _isConnected = false;
+        Serial.println("❌ [WiFiStation] WiFi connection failed!");
     }
 }
 
@@ -185,35 +255,166 @@ bool WiFiStation::connectToWiFiWithRetry(int maxRetries) {
     for (int attempt = 1; attempt <= maxRetries; attempt++) {
         Serial.printf("🔗 [WiFiStation] Attempt %d/%d: Connecting to %s...\n", attempt, maxRetries, _configSSID.c_str());
         
-        WiFi.mode(WIFI_STA);
-        WiFi.begin(_configSSID.c_str(), _configPassword.c_str());
+        // Fast path chỉ thử ở lần đầu: trượt thì cache nhiều khả năng đã cũ
+        bool connected = (attempt == 1 && connectFast()) || connectFull();
         
-        // Chờ kết nối trong 10 giây
-        unsigned long startTime = millis();
-        while (WiFi.status() != WL_CONNECTED && (millis() - startTime) < 10000) {
-            delay(100);
-        }
-        
-        if (WiFi.status() == WL_CONNECTED) {
+        if (connected) {
             Serial.printf("✅ [WiFiStation] WiFi connected on attempt %d!\n", attempt);
             Serial.printf("📡 [WiFiStation] SSID: %s\n", WiFi.SSID().c_str());
             Serial.printf("🌐 [WiFiStation] IP: %s\n", WiFi.localIP().toString().c_str());
-            _isConnected = true;
             return true;
         } else {
             Serial.printf("❌ [WiFiStation] Attempt %d failed (Status: %d)\n", attempt, WiFi.status());
             if (attempt < maxRetries) {
-                Serial.printf("⏳ [WiFiStation] Waiting 2 seconds before retry...\n");
-                delay(2000);
+                Serial.printf("⏳ [WiFiStation] Waiting %d seconds before retry...\n", WIFI_RETRY_DELAY_MS / 1000);
+                delay(WIFI_RETRY_DELAY_MS);
             }
         }
     }
     
     Serial.printf("❌ [WiFiStation] All %d attempts failed!\n", maxRetries);
-    _isConnected = false;
     return false;
 }
 
+// ======= Fast / Full Connect =======
+bool WiFiStation::connectFast() {
+    if (_cachedChannel == 0) return false;
+    
+    Serial.printf("⚡ [WiFiStation] Fast connect: BSSID %02X:%02X:%02X:%02X:%02X:%02X, channel %d\n",
+                  _cachedBssid[0], _cachedBssid[1], _cachedBssid[2], _cachedBssid[3], _cachedBssid[4],
+                  _cachedBssid[5], _cachedChannel);
+    WiFi.mode(WIFI_STA);
+#if WIFI_REUSE_LEASE
+    if (_cachedIp != 0) {
+        WiFi.config(IPAddress(_cachedIp), IPAddress(_cachedGateway), IPAddress(_cachedMask), IPAddress(_cachedDns));
+    }
+#endif
+    WiFi.begin(_configSSID.c_str(), _configPassword.c_str(), _cachedChannel, _cachedBssid, true);
+    
+    uint32_t elapsedMs;
+    if (waitConnected(WIFI_FAST_TIMEOUT_MS, elapsedMs)) {
+        _fastConnects++;
+        _fastTotalMs += elapsedMs;
+        _lastConnectMs = elapsedMs;
+        Serial.printf("⚡ [WiFiStation] Fast connect in %lu ms\n", (unsigned long)elapsedMs);
+        saveConnectionCache();
+        return true;
+    }
+    
+    _fastFailures++;
+    Serial.printf("⚠️ [WiFiStation] Fast connect failed after %lu ms, falling back to full scan\n",
+                  (unsigned long)elapsedMs);
+    WiFi.disconnect();
+#if WIFI_REUSE_LEASE
+    WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));   // Về lại DHCP
+#endif
+    return false;
+}
+
+bool WiFiStation::connectFull() {
+    WiFi.mode(WIFI_STA);
+    // Scan đủ kênh rồi chọn AP mạnh nhất cùng SSID (mặc định là AP đầu tiên tìm thấy)
+    WiFi.setScanMethod(WIFI_ALL_CHANNEL_SCAN);
+    WiFi.setSortMethod(WIFI_CONNECT_AP_BY_SIGNAL);
+    WiFi.begin(_configSSID.c_str(), _configPassword.c_str());
+    
+    uint32_t elapsedMs;
+    if (waitConnected(WIFI_FULL_TIMEOUT_MS, elapsedMs)) {
+        _fullConnects++;
+        _fullTotalMs += elapsedMs;
+        _lastConnectMs = elapsedMs;
+        Serial.printf("🔍 [WiFiStation] Full scan connect in %lu ms\n", (unsigned long)elapsedMs);
+        saveConnectionCache();
+        return true;
+    }
+    _fullFailures++;
+    return false;
+}
+
+bool WiFiStation::waitConnected(uint32_t timeoutMs, uint32_t& elapsedMs) {
+    unsigned long startTime = millis();
+    bool connected = waitUntilConnected(timeoutMs);     // GOT_IP đánh thức ngay
+    elapsedMs = millis() - startTime;
+    return connected;
+}
+
+// ======= Connection Cache (NVS) =======
+void WiFiStation::loadConnectionCache() {
+    Settings wifiSettings("wifi", false);
+    String bssid = wifiSettings.getString("bssid", "");
+    _cachedChannel = wifiSettings.getInt("channel", 0);
+    if (bssid.length() != 12 || _cachedChannel <= 0 ||
+        sscanf(bssid.c_str(), "%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx", &_cachedBssid[0], &_cachedBssid[1],
+               &_cachedBssid[2], &_cachedBssid[3], &_cachedBssid[4], &_cachedBssid[5]) != 6) {
+        _cachedChannel = 0;
+        return;
+    }
+    _cachedIp = (uint32_t)wifiSettings.getInt("ip", 0);
+    _cachedGateway = (uint32_t)wifiSettings.getInt("gw", 0);
+    _cachedMask = (uint32_t)wifiSettings.getInt("mask", 0);
+    _cachedDns = (uint32_t)wifiSettings.getInt("dns", 0);
+    Serial.printf("📖 [WiFiStation] Cached AP: %s, channel %d\n", bssid.c_str(), _cachedChannel);
+}
+
+void WiFiStation::saveConnectionCache() {
+    uint8_t* bssid = WiFi.BSSID();
+    int32_t channel = WiFi.channel();
+    uint32_t ip = WiFi.localIP();
+    uint32_t gateway = WiFi.gatewayIP();
+    uint32_t mask = WiFi.subnetMask();
+    uint32_t dns = WiFi.dnsIP(0);
+    if (bssid == NULL || channel <= 0) return;
+    if (channel == _cachedChannel && memcmp(bssid, _cachedBssid, 6) == 0 && ip == _cachedIp &&
+        gateway == _cachedGateway && mask == _cachedMask && dns == _cachedDns) {
+        return;
+    }
+    
+    memcpy(_cachedBssid, bssid, 6);
+    _cachedChannel = channel;
+    _cachedIp = ip;
+    _cachedGateway = gateway;
+    _cachedMask = mask;
+    _cachedDns = dns;
+    
+    char hex[13];
+    snprintf(hex, sizeof(hex), "%02x%02x%02x%02x%02x%02x",
+             bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+    Settings wifiSettings("wifi", true);
+    wifiSettings.setString("bssid", hex);
+    wifiSettings.setInt("channel", channel);
+    wifiSettings.setInt("ip", (int32_t)ip);
+    wifiSettings.setInt("gw", (int32_t)gateway);
+    wifiSettings.setInt("mask", (int32_t)mask);
+    wifiSettings.setInt("dns", (int32_t)dns);
+    Serial.printf("💾 [WiFiStation] Cached AP %s, channel %d, IP %s\n", hex, channel,
+                  WiFi.localIP().toString().c_str());
+}
+
+void WiFiStation::clearConnectionCache() {
+    Settings wifiSettings("wifi", true);
+    wifiSettings.eraseKey("bssid");
+    wifiSettings.eraseKey("channel");
+    wifiSettings.eraseKey("ip");
+    wifiSettings.eraseKey("gw");
+    wifiSettings.eraseKey("mask");
+    wifiSettings.eraseKey("dns");
+    _cachedChannel = 0;
+    _cachedIp = 0;
+}
+
+void WiFiStation::printStats() {
+    Serial.printf("📶 [WiFiStation] fast %lu ok / %lu failed (avg %lu ms), full %lu ok / %lu failed (avg %lu ms), last %lu ms\n",
+                  (unsigned long)_fastConnects, (unsigned long)_fastFailures,
+                  (unsigned long)(_fastConnects ? _fastTotalMs / _fastConnects : 0),
+                  (unsigned long)_fullConnects, (unsigned long)_fullFailures,
+                  (unsigned long)(_fullConnects ? _fullTotalMs / _fullConnects : 0),
+                  (unsigned long)_lastConnectMs);
+    if (_disconnects > 0) {
+        Serial.printf("📶 [WiFiStation] %lu disconnects, last outage %lu ms (reason %u)\n",
+                      (unsigned long)_disconnects, (unsigned long)_lastOutageMs, _lastReason);
+    }
+}
+
 void WiFiStation::handleRoot() {
     String html = generateHTML();
     _server.send(200, "text/html", html);
@@ -241,7 +442,6 @@ void WiFiStation::handleConfig() {
         
         if (connected) {
             Serial.println("✅ [WiFiStation] WiFi connected successfully!");
-            _isConnected = true;
         } else {
             Serial.println("❌ [WiFiStation] Failed to connect, returning to config mode...");
             startConfigMode();
@@ -5,8 +5,29 @@
 #include <WiFi.h>
 #include <WebServer.h>
 #include <DNSServer.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
 #include "settings.h"
 
+// ======= WiFi Connect Configuration =======
+// Fast path: kết nối thẳng tới BSSID + channel lần trước (bỏ qua scan), không được thì scan đủ kênh
+#define WIFI_FAST_TIMEOUT_MS    3000    // Fast path thường xong < 1 s, quá thì coi như AP / kênh đã đổi
+#define WIFI_FULL_TIMEOUT_MS    10000
+#define WIFI_RETRY_DELAY_MS     2000
+#define WIFI_RECONNECT_MAX_MS   30000   // Backoff tối đa giữa 2 lần tự kết nối lại khi AP mất hẳn
+#define WIFI_WATCHDOG_MS        30000   // Đối chiếu với driver phòng khi lỡ event
+#define WIFI_PORTAL_POLL_MS     10
+#define WIFI_WAIT_FOREVER       UINT32_MAX
+// 1 = dùng lại IP / gateway / DNS của lần DHCP trước làm IP tĩnh ở fast path (bỏ luôn DHCP).
+// Chỉ bật khi router giữ IP cố định theo MAC, nếu không có thể trùng IP với máy khác
+#define WIFI_REUSE_LEASE        0
+
+// ======= WiFi Event Bits =======
+// State cập nhật từ WiFi.onEvent; task khác chờ trên event group thay vì hỏi driver
+#define WIFI_CONNECTED_BIT      (1 << 0)   // Đã có IP
+#define WIFI_DISCONNECTED_BIT   (1 << 1)
+
 class WiFiStation {
 public:
     // ======= Singleton Accessor =======
@@ -17,14 +38,18 @@ public:
 
     // ======= Public API =======
     void begin();
-    void loop();
+    void loop();    // Gọi liên tục từ wifiTask: ngủ tới khi mất kết nối (hoặc phục vụ config portal)
     void waitForConnection();  // Chặn code cho đến khi WiFi kết nối thành công
     
-    // Kiểm tra trạng thái WiFi
+    // Kiểm tra trạng thái WiFi (đọc state từ event, không hỏi driver)
     bool isConnected();
+    // Chặn task gọi tới khi có IP; false nếu hết timeoutMs (WIFI_WAIT_FOREVER = chờ mãi)
+    bool waitUntilConnected(uint32_t timeoutMs);
+    EventGroupHandle_t getEventGroup();
     bool isConfigMode();
     String getSSID();
     String getIP();
+    void printStats();
     
     // Cấu hình WiFi từ code
     void setWiFiConfig(const String& ssid, const String& password);
@@ -53,14 +78,40 @@ private:
     String _apPassword;
     
     bool _isConfigMode;
-    bool _isConnected;
-    unsigned long _lastCheck;
+    std::atomic<bool> _isConnected;
+    EventGroupHandle_t _events;
+    bool _eventsRegistered;
+    uint32_t _reconnectDelayMs;
+    
+    // Mất kết nối: số lần, thời điểm, lý do (wifi_err_reason_t), thời gian mất lần gần nhất
+    uint32_t _disconnects;
+    uint32_t _disconnectedAt;
+    uint32_t _lastOutageMs;
+    uint8_t _lastReason;
+    
+    // Lần kết nối tốt gần nhất (NVS "wifi": bssid, channel, ip, gw, mask, dns)
+    uint8_t _cachedBssid[6];
+    int32_t _cachedChannel;             // 0 = chưa có cache
+    uint32_t _cachedIp, _cachedGateway, _cachedMask, _cachedDns;
+    
+    // Thống kê thời gian kết nối (ms từ WiFi.begin() tới khi có IP)
+    uint32_t _fastConnects, _fastFailures, _fastTotalMs;
+    uint32_t _fullConnects, _fullFailures, _fullTotalMs;
+    uint32_t _lastConnectMs;
     
     // ======= Private methods =======
     void loadWiFiConfig();
     void saveWiFiConfig();
     void connectToWiFi();
     bool connectToWiFiWithRetry(int maxRetries);
+    bool connectFast();                 // false nếu chưa có cache hoặc hết WIFI_FAST_TIMEOUT_MS
+    bool connectFull();
+    bool waitConnected(uint32_t timeoutMs, uint32_t& elapsedMs);
+    void loadConnectionCache();
+    void saveConnectionCache();         // Chỉ ghi NVS khi BSSID / channel / lease thay đổi
+    void clearConnectionCache();
+    void onWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info);     // Chạy trên task event của Arduino
+    void setConnected(bool connected);
     void handleRoot();
     void handleConfig();
     void handleScan();
@@ -143,33 +143,36 @@ bool AudioPlayer::writeI2S(uint8_t* data, size_t len) {
 bool AudioPlayer::openStream(const String& url) {
     Serial.printf("[AudioPlayer] Opening stream: %s\n", url.c_str());
     
-    if (WiFi.status() != WL_CONNECTED) {
+    if (!WiFiStation::getInstance().isConnected()) {
         Serial.println("[AudioPlayer] ERROR: WiFi not connected!");
         return false;
     }
     
-    http.begin(url);
-    int httpCode = http.GET();
+    lease.open(url);
+    int httpCode = lease.GET();
     
     if (httpCode != HTTP_CODE_OK) {
         Serial.printf("[AudioPlayer] HTTP error: %d\n", httpCode);
-        http.end();
+        lease.release(false);
         return false;
     }
     
-    stream = http.getStreamPtr();
+    stream = lease.http().getStreamPtr();
     if (!stream) {
         Serial.println("[AudioPlayer] ERROR: Failed to get stream!");
-        http.end();
+        lease.release(false);
         return false;
     }
     
-    Serial.printf("[AudioPlayer] Stream opened, size: %d bytes\n", http.getSize());
+    dataRemaining = UINT32_MAX;     // Chưa đọc WAV header: đóng stream lúc này thì không giữ kết nối
+    Serial.printf("[AudioPlayer] Stream opened, size: %d bytes%s\n",
+                  lease.http().getSize(), lease.reused() ? " (reused connection)" : "");
     return true;
 }
 
 void AudioPlayer::closeStream() {
-    http.end();
+    // Phát hết file -> body đã đọc hết, giữ kết nối cho câu trả lời sau
+    lease.release(dataRemaining == 0);
     stream = nullptr;
     Serial.println("[AudioPlayer] Stream closed");
 }
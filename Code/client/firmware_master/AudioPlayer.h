@@ -5,6 +5,8 @@
 #include <driver/i2s.h>
 #include <HTTPClient.h>
 #include <WiFi.h>
+#include "httpPool.h"
+#include "wifiStation.h"
 
 // ======= I2S Configuration for MAX98357A =======
 #ifndef SPEAKER_I2S_BCLK
@@ -130,8 +132,8 @@ private:
     int pinLRC;
     int pinDOUT;
     
-    // HTTP client
-    HTTPClient http;
+    // HTTP client mượn từ HttpPool (https:// dùng TLS, resume session từ lần phát trước)
+    HttpLease lease;
     WiFiClient* stream;
     
     // WAV info
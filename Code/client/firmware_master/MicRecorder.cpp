@@ -15,6 +15,21 @@ MicRecorder::MicRecorder() {
     recordStartTime = 0;
     chunksRecorded = 0;
     chunksSent = 0;
+    bytesSent = 0;
+    coalesceFrames = AUDIO_COALESCE_MIN_FRAMES;
+    fastSends = 0;
+    dropping = false;
+    captureStartMs = 0;
+    samplesCaptured = 0;
+    framesDropped = 0;
+    sendUsTotal = 0;
+    sendUsMax = 0;
+    coalesceUps = 0;
+    coalesceDowns = 0;
+    maxLagMs = 0;
+    transport = TRANSPORT_WEBSOCKET;
+    rtpCodec = RTP_DEFAULT_CODEC;
+    rtpRedundancy = RTP_DEFAULT_REDUNDANCY;
     
     micRecorderInstance = this;
 }
@@ -36,13 +51,18 @@ bool MicRecorder::begin() {
     Serial.println("[MicRecorder] Initializing...");
     
     // Allocate audio buffer
-    audioBuffer = (uint8_t*)malloc(AUDIO_BUFFER_SIZE);
+    audioBuffer = (uint8_t*)malloc(WS_FRAME_HEADROOM + MIC_SEND_BUFFER_SIZE);
     if (!audioBuffer) {
         Serial.println("[MicRecorder] ERROR: Failed to allocate audio buffer!");
         state = RECORDER_ERROR;
         return false;
     }
     
+#if WS_FRAMING_BENCHMARK
+    AudioWebSocket::benchmark(I2S_READ_LEN);
+    AudioWebSocket::benchmark(MIC_SEND_BUFFER_SIZE);
+#endif
+    
     // Setup record button
     pinMode(RECORD_BUTTON_PIN, BUTTON_ACTIVE_LOW ? INPUT_PULLUP : INPUT_PULLDOWN);
     
@@ -61,6 +81,11 @@ bool MicRecorder::begin() {
         Serial.println("[MicRecorder] WebSocket URL: Not set (will use default)");
     }
     
+    // Codec / redundancy cho RTP transport
+    Settings audioSettings("audio", false);
+    rtpCodec = (RtpCodec)audioSettings.getInt("codec", RTP_DEFAULT_CODEC);
+    rtpRedundancy = audioSettings.getInt("red", RTP_DEFAULT_REDUNDANCY);
+    
     state = RECORDER_IDLE;
     return true;
 }
@@ -157,6 +182,9 @@ bool MicRecorder::connectWebSocket(const String& url) {
     Serial.printf("[MicRecorder] Connecting to WebSocket: %s\n", url.c_str());
     // ws://localhost:8000/audio_stream/ws/
     // Parse URL: ws://host:port/path
+    // wss://: thư viện WebSockets tự giữ socket TLS riêng nên không dùng chung TlsSessionCache,
+    // bù lại kết nối được giữ mở giữa các lần ghi âm (không disconnect sau mỗi lần)
+    bool secure = url.startsWith("wss://");
     String urlCopy = url;
     urlCopy.replace("ws://", "");
     urlCopy.replace("wss://", "");
@@ -165,7 +193,7 @@ bool MicRecorder::connectWebSocket(const String& url) {
     int slashPos = urlCopy.indexOf('/');
     
     String host;
-    uint16_t port = 80;
+    uint16_t port = secure ? 443 : 80;
     String path = "/";
     
     if (colonPos > 0 && slashPos > colonPos) {
@@ -180,16 +208,24 @@ bool MicRecorder::connectWebSocket(const String& url) {
     }
     Serial.printf("[MicRecorder] Host: %s, Port: %d, Path: %s\n", host.c_str(), port, path.c_str());
     
-    webSocket.begin(host, port, path);
+    if (secure) {
+        webSocket.beginSSL(host, port, path);
+    } else {
+        webSocket.begin(host, port, path);
+    }
     webSocket.onEvent(webSocketEvent);
     webSocket.setReconnectInterval(1000);
     
-    // Wait for connection (with timeout)
+    // Wait for connection (with timeout), handshake TLS đầy đủ cần lâu hơn
     unsigned long startTime = millis();
-    while (!wsConnected && (millis() - startTime < 1000)) {
+    unsigned long timeout = secure ? TLS_HANDSHAKE_TIMEOUT_MS : 1000;
+    while (!wsConnected && (millis() - startTime < timeout)) {
         webSocket.loop();
         delay(10);
     }
+    if (wsConnected) {
+        Serial.printf("[MicRecorder] WebSocket%s connected in %lu ms\n", secure ? " (TLS)" : "", millis() - startTime);
+    }
     
     return wsConnected;
 }
@@ -200,13 +236,78 @@ void MicRecorder::disconnectWebSocket() {
     Serial.println("[MicRecorder] WebSocket disconnected");
 }
 
-void MicRecorder::sendAudioChunk(uint8_t* data, size_t len) {
-    if (wsConnected && len > 0) {
-        webSocket.sendBIN(data, len);
+void MicRecorder::sendAudioChunk(uint8_t* frame, size_t len) {
+    // frame có WS_FRAME_HEADROOM byte trống ở đầu: header + mask ghi thẳng vào buffer, không copy
+    if (wsConnected && len > 0 && webSocket.sendBinaryInPlace(frame, len)) {
         chunksSent++;
+        bytesSent += len;
     }
 }
 
+// ======= Adaptive Coalescing =======
+void MicRecorder::flushAudio() {
+    if (bufferIndex == 0) return;
+    uint32_t start = micros();
+    sendAudioChunk(audioBuffer, bufferIndex);
+    uint32_t sendUs = micros() - start;
+    sendUsTotal += sendUs;
+    if (sendUs > sendUsMax) sendUsMax = sendUs;
+    adaptCoalescing(sendUs, bufferIndex);
+    bufferIndex = 0;
+}
+
+void MicRecorder::adaptCoalescing(uint32_t sendUs, size_t len) {
+    // sendBIN ghi thẳng vào socket TCP: bị chặn lâu nghĩa là cửa sổ gửi đầy / WiFi đang retry
+    uint32_t audioUs = (uint64_t)(len / 2) * 1000000 / I2S_SAMPLE_RATE;
+    if (sendUs * 2 > audioUs) {
+        // Gửi mất hơn nửa thời lượng audio -> gộp gấp đôi, bớt overhead header WS / TCP / airtime mỗi gói
+        fastSends = 0;
+        if (coalesceFrames < AUDIO_COALESCE_MAX_FRAMES) {
+            coalesceFrames = min(coalesceFrames * 2, AUDIO_COALESCE_MAX_FRAMES);
+            coalesceUps++;
+            Serial.printf("[MicRecorder] Slow send (%u us for %u ms audio), coalescing %u frames\n",
+                          sendUs, audioUs / 1000, coalesceFrames);
+        }
+    } else if (sendUs * 10 < audioUs) {
+        // Mạng ổn định một lúc mới giảm dần từng frame, tránh dao động
+        if (++fastSends >= AUDIO_COALESCE_RELAX_SENDS && coalesceFrames > AUDIO_COALESCE_MIN_FRAMES) {
+            coalesceFrames--;
+            coalesceDowns++;
+            fastSends = 0;
+        }
+    } else {
+        fastSends = 0;
+    }
+}
+
+void MicRecorder::sendEndOfStream() {
+    // Text frame đi sau chunk cuối trên cùng kết nối -> server chốt STT ngay, không chờ AU:OFF qua MQTT
+    if (!wsConnected) return;
+    char message[96];
+    snprintf(message, sizeof(message), "{\"type\":\"eos\",\"frames\":%u,\"bytes\":%u,\"dropped\":%u}",
+             chunksSent, bytesSent, framesDropped);
+    webSocket.sendTXT(message);
+}
+
+// ======= RTP Functions =======
+bool MicRecorder::startRtp(const String& url) {
+    // rtp://host[:port], bỏ qua phần path nếu có
+    String hostPort = url.substring(6);
+    int slashPos = hostPort.indexOf('/');
+    if (slashPos >= 0) {
+        hostPort = hostPort.substring(0, slashPos);
+    }
+    uint16_t port = RTP_DEFAULT_PORT;
+    int colonPos = hostPort.indexOf(':');
+    String host = hostPort;
+    if (colonPos > 0) {
+        host = hostPort.substring(0, colonPos);
+        port = hostPort.substring(colonPos + 1).toInt();
+    }
+    // Backend nhận biết thiết bị qua RTCP CNAME thay vì path như WebSocket
+    return rtp.begin(host, port, clientId, rtpCodec, rtpRedundancy);
+}
+
 // ======= Recording Control =======
 bool MicRecorder::startRecording(const String& serverUrl, const String& clientId) {
     if (state == RECORDER_RECORDING) {
@@ -218,6 +319,7 @@ bool MicRecorder::startRecording(const String& serverUrl, const String& clientId
     
     state = RECORDER_CONNECTING;
     this->clientId = clientId;
+    transport = serverUrl.startsWith("rtp://") ? TRANSPORT_RTP : TRANSPORT_WEBSOCKET;
     
     // Build WebSocket URL with client ID
     String wsUrl = serverUrl;
@@ -232,8 +334,16 @@ bool MicRecorder::startRecording(const String& serverUrl, const String& clientId
         return false;
     }
     
-    // Connect to WebSocket
-    if (!connectWebSocket(wsUrl)) {
+    if (transport == TRANSPORT_RTP) {
+        // UDP không có bước kết nối, chỉ cần resolve host
+        if (!startRtp(serverUrl)) {
+            Serial.println("[MicRecorder] Failed to start RTP stream!");
+            deinitI2S();
+            state = RECORDER_ERROR;
+            return false;
+        }
+    } else if (!connectWebSocket(wsUrl)) {
+        // Connect to WebSocket
         Serial.println("[MicRecorder] Failed to connect WebSocket!");
         deinitI2S();
         state = RECORDER_ERROR;
@@ -244,6 +354,18 @@ bool MicRecorder::startRecording(const String& serverUrl, const String& clientId
     bufferIndex = 0;
     chunksRecorded = 0;
     chunksSent = 0;
+    bytesSent = 0;
+    coalesceFrames = AUDIO_COALESCE_MIN_FRAMES;
+    fastSends = 0;
+    dropping = false;
+    captureStartMs = 0;
+    samplesCaptured = 0;
+    framesDropped = 0;
+    sendUsTotal = 0;
+    sendUsMax = 0;
+    coalesceUps = 0;
+    coalesceDowns = 0;
+    maxLagMs = 0;
     recordStartTime = millis();
     
     state = RECORDER_RECORDING;
@@ -262,13 +384,14 @@ void MicRecorder::stopRecording() {
     state = RECORDER_STOPPING;
     
     // Send remaining buffer
-    if (bufferIndex > 0) {
-        sendAudioChunk(audioBuffer, bufferIndex);
-        bufferIndex = 0;
-    }
+    flushAudio();
     
-    // Small delay to ensure last chunk is sent
-    delay(100);
+    // Báo kết thúc luồng ngay sau chunk cuối
+    if (transport == TRANSPORT_RTP) {
+        rtp.end();      // RTCP BYE báo backend luồng đã kết thúc
+    } else {
+        sendEndOfStream();
+    }
     
     // Disconnect and cleanup
     // disconnectWebSocket();
@@ -276,8 +399,13 @@ void MicRecorder::stopRecording() {
     
     unsigned long duration = millis() - recordStartTime;
     Serial.printf("[MicRecorder] ✓ Recording stopped!\n");
-    Serial.printf("[MicRecorder] Duration: %lu ms, Chunks: %u recorded, %u sent\n", 
-                  duration, chunksRecorded, chunksSent);
+    Serial.printf("[MicRecorder] Duration: %lu ms, Chunks: %u recorded, %u sent (%u bytes)\n", 
+                  duration, chunksRecorded, chunksSent, bytesSent);
+    if (transport == TRANSPORT_WEBSOCKET && chunksSent > 0) {
+        Serial.printf("[MicRecorder] Send avg %u us / max %u us, coalescing up %u / down %u, dropped %u frames, max lag %d ms\n",
+                      sendUsTotal / chunksSent, sendUsMax, coalesceUps, coalesceDowns, framesDropped, maxLagMs);
+        webSocket.printStats();
+    }
     
     state = RECORDER_IDLE;
     isDeviceRecording = false;
@@ -291,7 +419,7 @@ void MicRecorder::update() {
     }
     
     // Read and send audio data
-    if (state == RECORDER_RECORDING && wsConnected) {
+    if (state == RECORDER_RECORDING && transport == TRANSPORT_RTP) {
         size_t bytesRead = 0;
         uint8_t tempBuffer[I2S_READ_LEN];
         
@@ -300,11 +428,56 @@ void MicRecorder::update() {
         
         if (err == ESP_OK && bytesRead > 0) {
             chunksRecorded++;
+            // 1 frame I2S = 1 gói RTP, gửi lỗi thì bỏ frame (không chặn vòng đọc I2S)
+            if (rtp.sendFrame((int16_t*)tempBuffer, bytesRead / 2)) {
+                chunksSent++;
+                bytesSent += bytesRead;
+            }
+        }
+    } else if (state == RECORDER_RECORDING && wsConnected) {
+        size_t bytesRead = 0;
+        
+        // Đọc thẳng vào sau phần đang gom trong audioBuffer
+        esp_err_t err = i2s_read(I2S_MIC_PORT, audioBuffer + WS_FRAME_HEADROOM + bufferIndex, I2S_READ_LEN,
+                                 &bytesRead, pdMS_TO_TICKS(10));
+        
+        if (err == ESP_OK && bytesRead > 0) {
+            chunksRecorded++;
+            
+            // Độ trễ so với thời gian thực = thời gian đã trôi - thời lượng audio đã đọc khỏi DMA
+            if (samplesCaptured == 0) {
+                captureStartMs = millis();
+            }
+            samplesCaptured += bytesRead / 2;
+            int32_t lagMs = (int32_t)(millis() - captureStartMs) - (int32_t)((uint64_t)samplesCaptured * 1000 / I2S_SAMPLE_RATE);
+            if (lagMs > maxLagMs) maxLagMs = lagMs;
+            if (lagMs > AUDIO_DMA_MS) {
+                // DMA đã tràn: phần vượt quá đã bị driver ghi đè, tính là mất và dời mốc thời gian
+                framesDropped += (lagMs - AUDIO_DMA_MS) / 32;
+                captureStartMs += lagMs - AUDIO_DMA_MS;
+                lagMs = AUDIO_DMA_MS;
+            }
+            
+            if (!dropping && lagMs > AUDIO_MAX_LAG_MS) {
+                // Mạng không theo kịp: bỏ audio cũ (cả phần đang gom) để giữ độ trễ có giới hạn,
+                // thay vì để DMA tự ghi đè ngẫu nhiên
+                dropping = true;
+                framesDropped += bufferIndex / I2S_READ_LEN;
+                bufferIndex = 0;
+                Serial.printf("[MicRecorder] Falling behind by %d ms, dropping audio\n", lagMs);
+            } else if (dropping && lagMs < AUDIO_RESUME_LAG_MS) {
+                dropping = false;
+                Serial.printf("[MicRecorder] Caught up, %u frames dropped so far\n", framesDropped);
+            }
+            if (dropping) {
+                framesDropped++;
+                return;
+            }
             
-            // Gửi trực tiếp từ tempBuffer - không cần copy qua audioBuffer
-            // Vì I2S_READ_LEN = 1024 bytes = đúng kích thước API yêu cầu
-            sendAudioChunk(tempBuffer, bytesRead);
-            chunksSent++;
+            bufferIndex += bytesRead;
+            if (bufferIndex >= (size_t)coalesceFrames * I2S_READ_LEN) {
+                flushAudio();
+            }
         }
     }
 }
@@ -353,9 +526,14 @@ void MicRecorder::printStatus() {
     }
     Serial.printf("WebSocket URL: %s\n", wsServerUrl.c_str());
     Serial.printf("Client ID: %s\n", clientId.c_str());
+    Serial.printf("Transport: %s\n", transport == TRANSPORT_RTP ? "RTP" : "WebSocket");
     Serial.printf("WS Connected: %s\n", wsConnected ? "YES" : "NO");
     Serial.printf("Chunks Recorded: %u\n", chunksRecorded);
     Serial.printf("Chunks Sent: %u\n", chunksSent);
+    Serial.printf("Coalescing: %u frames (%u ms), dropped: %u frames\n",
+                  coalesceFrames, coalesceFrames * 32, framesDropped);
+    webSocket.printStats();
+    rtp.printStats();
     Serial.printf("I2S Pins - WS:%d, SCK:%d, SD:%d\n", MIC_I2S_WS, MIC_I2S_SCK, MIC_I2S_SD);
     Serial.printf("Button Pin: GPIO%d\n", RECORD_BUTTON_PIN);
     Serial.println("==============================\n");
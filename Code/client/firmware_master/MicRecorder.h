@@ -4,7 +4,10 @@
 #include <Arduino.h>
 #include <driver/i2s.h>
 #include <WebSocketsClient.h>
+#include "audioWebSocket.h"
 #include "settings.h"
+#include "tlsClient.h"
+#include "rtpAudio.h"
 // ======= Pin Definitions (User configurable) =======
 // INMP441 Microphone I2S pins
 #ifndef MIC_I2S_WS
@@ -41,7 +44,24 @@
 #define I2S_SAMPLE_BITS     16      // 16-bit audio
 #define I2S_CHANNEL_NUM     1       // Mono
 #define I2S_READ_LEN        1024    // 1024 bytes = 512 samples (32ms at 16kHz)
-#define AUDIO_BUFFER_SIZE   1024    // Send immediately after I2S read (512 samples = 1024 bytes)
+
+// Gom nhiều frame I2S vào 1 WebSocket message khi mạng chậm (luôn là bội số 32 ms: VAD backend cần 512 mẫu)
+#define AUDIO_COALESCE_MIN_FRAMES   1       // 32 ms - mạng tốt, độ trễ thấp nhất
+#define AUDIO_COALESCE_MAX_FRAMES   5       // 160 ms
+#define AUDIO_COALESCE_RELAX_SENDS  16      // Số lần gửi nhanh liên tiếp trước khi giảm 1 frame
+#define AUDIO_DMA_MS                512     // dma_buf_count 8 x dma_buf_len 1024 mẫu ở 16 kHz
+#define AUDIO_MAX_LAG_MS            320     // Chậm hơn thời gian thực quá mức này -> bỏ audio cũ
+#define AUDIO_RESUME_LAG_MS         160
+#define MIC_SEND_BUFFER_SIZE        (I2S_READ_LEN * AUDIO_COALESCE_MAX_FRAMES)
+
+// 1 = in benchmark đóng frame WebSocket (thư viện vs in-place) lúc begin()
+#ifndef WS_FRAMING_BENCHMARK
+#define WS_FRAMING_BENCHMARK 0
+#endif
+
+// RTP transport (URL rtp://host[:port]), cấu hình lưu trong NVS "audio"
+#define RTP_DEFAULT_CODEC       RTP_CODEC_DVI4
+#define RTP_DEFAULT_REDUNDANCY  1
 
 // I2S port numbers
 #define I2S_MIC_PORT    I2S_NUM_0   // Port 0 for microphone
@@ -56,6 +76,11 @@ enum RecorderState {
     RECORDER_ERROR          // Error state
 };
 
+enum AudioTransport {
+    TRANSPORT_WEBSOCKET,    // ws:// / wss:// - TCP, backend STT nhận trực tiếp
+    TRANSPORT_RTP           // rtp:// - UDP, độ trễ thấp, mất gói thay vì chờ gửi lại
+};
+
 // ======= MicRecorder Class =======
 class MicRecorder {
 public:
@@ -84,6 +109,7 @@ public:
     void onButtonReleased();
     
     // Configuration
+    // URL rtp://host[:port] -> gửi qua RTP/UDP, còn lại dùng WebSocket
     void setWebSocketUrl(const String& url);
     String getWebSocketUrl();
     
@@ -105,7 +131,13 @@ private:
     // WebSocket
     bool connectWebSocket(const String& url);
     void disconnectWebSocket();
-    void sendAudioChunk(uint8_t* data, size_t len);
+    void sendAudioChunk(uint8_t* frame, size_t len);
+    void flushAudio();
+    void adaptCoalescing(uint32_t sendUs, size_t len);
+    void sendEndOfStream();
+    
+    // RTP
+    bool startRtp(const String& url);
     
     // WebSocket event handler
     static void webSocketEvent(WStype_t type, uint8_t* payload, size_t length);
@@ -115,16 +147,27 @@ private:
     volatile bool buttonPressed;
     bool wsConnected;
     
-    // Audio buffer
+    // Audio buffer (gom frame trước khi gửi WebSocket), WS_FRAME_HEADROOM byte đầu dành cho header
     uint8_t* audioBuffer;
     size_t bufferIndex;
+    uint8_t coalesceFrames;     // Số frame 32 ms mỗi message hiện tại
+    uint8_t fastSends;
+    bool dropping;              // Đang bỏ audio để đuổi kịp thời gian thực
+    uint32_t captureStartMs;
+    uint32_t samplesCaptured;
     
     // Configuration
     String wsServerUrl;
     String clientId;
     
     // WebSocket client
-    WebSocketsClient webSocket;
+    AudioWebSocket webSocket;
+    
+    // RTP transport
+    AudioTransport transport;
+    RtpAudioSender rtp;
+    RtpCodec rtpCodec;
+    uint8_t rtpRedundancy;
     
     // Timing
     unsigned long lastSendTime;
@@ -133,6 +176,13 @@ private:
     // Statistics
     uint32_t chunksRecorded;
     uint32_t chunksSent;
+    uint32_t bytesSent;
+    uint32_t framesDropped;
+    uint32_t sendUsTotal;
+    uint32_t sendUsMax;
+    uint32_t coalesceUps;
+    uint32_t coalesceDowns;
+    int32_t maxLagMs;
 };
 
 // Global pointer for ISR access
@@ -3,20 +3,42 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <HTTPClient.h>
-#include <Update.h>
 #include <ArduinoJson.h>
 #include "settings.h"
+#include "httpPool.h"
+#include "serviceDiscovery.h"
+#include "wifiStation.h"
+#include "otaDelta.h"
+#include "otaInflate.h"
+#include "otaVerify.h"
+#include <esp_ota_ops.h>
+#include <esp_image_format.h>
+#include <esp_system.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/semphr.h>
+#include <freertos/queue.h>
 #define MAX_RETRIES 5
-#define RETRY_DELAY_MS 6000 
+#define RETRY_DELAY_MS 6000         // Retry thứ n chờ khoảng RETRY_DELAY_MS * 2^(n-1) (có jitter)
+#define OTA_RETRY_MAX_DELAY_MS 60000
+#define OTA_BOOT_SPREAD_MS 300000   // Bật nguồn lại (mất điện cả site): hỏi server ở 1 thời điểm riêng trong 5 phút đầu
+#define OTA_MAX_BACKOFF_MS 3600000  // Giới hạn Retry-After của server
+#define OTA_DEFAULT_BACKOFF_MS 60000    // Retry-After không đọc được (không phải số giây / HTTP-date hợp lệ)
+#define OTA_JSON_FILTER_SIZE JSON_OBJECT_SIZE(23)
+#define OTA_JSON_DOC_SIZE (JSON_OBJECT_SIZE(23) + 1536) // 23 trường đã lọc + chuỗi (link firmware / patch / ảnh nén, sha256, chữ ký, ws_url, broker)
+#define OTA_BLOCK_SIZE 4096         // = sector flash: mỗi block là 1 lần xóa + ghi đúng 1 sector
+#define OTA_PIPELINE_BUFFERS 2      // Double buffer: tải block sau trong khi ghi block trước
+#define OTA_WRITER_STACK 4096
+#define OTA_STALL_TIMEOUT_MS 10000  // Không nhận được byte nào / writer không trả buffer -> hủy
+#define OTA_RESUME_SAVE_BYTES 65536    // Ghi offset đã tải vào NVS mỗi 64 KB (mất điện chỉ mất tối đa chừng này)
+#define OTA_MANIFEST_TTL_MS 300000  // Trong 5 phút các lần check trả lời từ cache, quá hạn thì GET có If-None-Match
 /**
  * @brief Class quản lý OTA (Over-The-Air) update cho ESP32
  * 
  * Tính năng:
  * - Kiểm tra phiên bản firmware mới từ server
  * - Download và cập nhật firmware tự động
+ * - Mất kết nối / reboot giữa chừng thì tải tiếp từ offset đã lưu (HTTP Range)
  * - Rollback nếu update thất bại
  * - Tích hợp với FreeRTOS
  * - Lưu trữ thông tin version vào NVS
@@ -25,7 +47,7 @@ class OTAUpdate {
 private:
     static OTAUpdate* instance;
     // Configuration
-    String serverUrl;           // URL của OTA server
+    String serverUrl;           // URL của OTA server, hoặc path ("/ota/...") trên backend tìm bằng ServiceDiscovery
     String currentVersion;      // Phiên bản hiện tại
     String clientID;            // ID của thiết bị
     int checkInterval;          // Khoảng thời gian kiểm tra (milliseconds)
@@ -36,7 +58,101 @@ private:
     int updateProgress;         // Tiến trình update (0-100%)
     String lastError;           // Lỗi gần nhất
     unsigned long lastCheck;    // Lần kiểm tra cuối cùng
+
+    // Lịch check dàn đều theo thiết bị: FNV-1a(clientID) cố định nên mỗi thiết bị luôn có cùng "pha"
+    uint32_t deviceHash;
+    unsigned long nextCheck;        // millis() lần check định kỳ kế tiếp (otaMonitorTask)
+    unsigned long bootCheckAt;      // > 0: sau khi bật nguồn, dùng manifest NVS tới thời điểm này rồi mới hỏi server
+    unsigned long backoffUntil;     // Server trả 503/429 + Retry-After: không gửi request tới lúc này
+    uint32_t serverBackoffs;
+
+    // Manifest cache: bản get_info_update gần nhất (RAM + NVS "ota_mf"), revalidate bằng ETag
+    struct Manifest {
+        String brokerServer;
+        int brokerPort;
+        String wsURL;
+        String masterLink;
+        String masterVersion;
+        String slaveLink;
+        String slaveVersion;
+        String masterPatchFrom;     // Có patch delta từ phiên bản này sang masterVersion
+        String masterPatchLink;     // Path trên backend ("/ota/patch/...")
+        String slavePatchFrom;
+        String slavePatchLink;
+        String masterCompressedLink;    // Ảnh nén zlib ("/ota/image/..."), rỗng nếu server chưa nén xong
+        String slaveCompressedLink;
+        String masterSha256;        // sha256 ảnh master mới (hex), rỗng nếu server chưa có
+        String masterSignature;     // ECDSA P-256 trên sha256 (base64), rỗng nếu backend không ký
+        String slaveSha256;
+        String slaveSignature;
+        String slaveOriginLink;     // Khác rỗng: slaveLink là cache của master trong LAN, đây là link gốc
+        int masterRollout;          // % thiết bị được nhận bản master mới (mặc định 100)
+        int slaveRollout;
+        String etag;
+        bool valid;
+        unsigned long fetchedAt;    // millis() lần server xác nhận (200 hoặc 304), 0 = chưa xác nhận từ lúc boot
+    };
+    Manifest manifest;
+    SemaphoreHandle_t manifestMutex;
+    uint32_t manifestHits;          // Trả lời từ cache, không gửi request
+    uint32_t manifestNotModified;   // Server trả 304
+    uint32_t manifestFetches;       // Server trả 200 (body đầy đủ)
+
+    // Kết quả checkForUpdate: bản mới, các nguồn tải và hash để kiểm tra ảnh
+    struct UpdateTarget {
+        String version;
+        String url;                 // Ảnh đầy đủ
+        String originUrl;           // Link gốc khi url là cache LAN của master, rỗng nếu không
+        String patchUrl;            // Patch delta từ đúng phiên bản đang chạy, rỗng nếu không có
+        String compressedUrl;       // Ảnh nén, rỗng nếu không có
+        String sha256;
+        String signature;
+    };
+
+    // Dạng dữ liệu tải về trong downloadAndUpdate
+    enum OtaFormat {
+        OTA_FORMAT_IMAGE,           // Ảnh firmware nguyên bản
+        OTA_FORMAT_DELTA,           // Patch delta, dựng ảnh mới từ partition đang chạy (OtaDelta)
+        OTA_FORMAT_ZLIB             // Ảnh nén, giải nén theo luồng (OtaInflater)
+    };
     
+    // Tiến trình download đang chạy (đọc bởi Getinfo4mqtt)
+    unsigned long downloadStart;    // millis() lúc bắt đầu download
+    volatile uint32_t bytesWritten; // Đã ghi vào flash
+    uint32_t resumedFrom;           // Offset bắt đầu của lần download này (> 0 khi tải tiếp bằng Range)
+
+    // Download ảnh đầy đủ còn dở (NVS "ota_rs"): lần sau tải tiếp bằng Range vào cùng partition
+    struct ResumeState {
+        String url;
+        String etag;                // Gửi lại trong If-Range: ảnh trên server đổi -> server trả 200, tải lại từ đầu
+        uint32_t size;              // Kích thước ảnh đầy đủ
+        uint32_t offset;            // Đã ghi chắc chắn vào partition, bội số của OTA_BLOCK_SIZE
+        uint32_t partition;         // Địa chỉ partition OTA đang ghi
+    };
+
+    // Pipeline download -> flash: task gọi downloadAndUpdate đọc socket vào block trống,
+    // flashWriterTask ghi block đầy vào Update rồi trả lại
+    struct OtaBlock {
+        uint8_t index;
+        uint16_t length;            // 0 = hết dữ liệu, writer kết thúc
+    };
+    struct OtaPipeline {
+        uint8_t* buffers[OTA_PIPELINE_BUFFERS];
+        const esp_partition_t* partition;
+        uint32_t offset;            // Vị trí block kế tiếp trong partition
+        uint32_t savedOffset;       // Offset đã lưu vào NVS gần nhất
+        bool resumable;             // Ảnh đầy đủ: lưu offset để tải tiếp được
+        OtaVerifier* verifier;      // Hash từng block sau khi ghi
+        QueueHandle_t freeBlocks;   // index block trống
+        QueueHandle_t fullBlocks;   // OtaBlock chờ ghi
+        SemaphoreHandle_t done;     // Writer đã thoát
+        OTAUpdate* ota;
+        size_t total;
+        volatile bool failed;       // Xóa / ghi flash lỗi, do writer set
+        esp_err_t error;
+        uint32_t flashUs;           // Tổng thời gian xóa + ghi flash
+    };
+
     // FreeRTOS
     SemaphoreHandle_t mutex;    // Mutex để bảo vệ shared resources
     TaskHandle_t otaTaskHandle; // Task handle cho OTA monitoring
@@ -57,20 +173,48 @@ private:
     void savemqttInfo(String brokerServer , int brokerPort , String wsURL , String clientID);
     /**
      * @brief Lấy thông tin firmware mới từ server
-     * @param newVersion Output: Phiên bản mới
-     * @param downloadUrl Output: URL download firmware
-     * @param changelog Output: Changelog
+     * @param target Output: phiên bản mới, URL ảnh đầy đủ / patch / ảnh nén, sha256 + chữ ký
+     * @param revalidate true: bỏ qua TTL, hỏi lại server (If-None-Match, thường chỉ nhận 304)
+     * @param attempts Số lần gửi request tối đa nếu server lỗi
      * @return true nếu có version mới, false nếu không
      */
-    bool checkForUpdate(String& newVersion, String& downloadUrl);
+    bool checkForUpdate(UpdateTarget& target, bool revalidate = false, int attempts = MAX_RETRIES);
+    /**
+     * @brief Đảm bảo manifest còn hiệu lực: trong TTL dùng cache, quá hạn thì conditional GET
+     * @return true nếu có manifest dùng được (kể cả bản cũ khi server không trả lời)
+     */
+    bool refreshManifest(bool revalidate, int attempts);
+    bool fetchManifest(HttpLease& lease, bool haveManifest);  // Parse body 200 rồi thay manifest
+    void loadManifest();
+    void saveManifest();
+    String endpointUrl();       // URL đầy đủ để check update
+    String resolveLink(const String& link);    // Path "/ota/..." trong manifest -> URL trên backend
+    bool isMasterRole();        // Theo currentVersion ("Master_...") -> dùng master_* trong manifest
+    static uint32_t fnv1a(const String& text);     // Giống ota_schedule.fnv1a của backend
+    uint8_t rolloutBucket(const String& version);  // 0-99, cố định theo thiết bị + phiên bản
+    uint32_t retryDelayMs(int attempt);             // Backoff mũ + jitter
+    bool backoffActive();
+    static uint32_t retryAfterMs(const String& retryAfter, const String& date);
+    static bool parseHttpDate(const String& text, int64_t& epoch);
+    static void deferredCheckTask(void* parameter); // Hỏi server 1 lần lúc bootCheckAt rồi tự xóa
     
     /**
      * @brief Download và cài đặt firmware mới
-     * @param url URL của firmware binary
+     * @param target Bản cần cài (sha256 / chữ ký để kiểm tra ảnh trước khi đổi partition boot)
+     * @param url URL của firmware binary (hoặc của patch delta / ảnh nén)
+     * @param format Dạng dữ liệu ở url, xem OtaFormat
      * @return true nếu thành công, false nếu thất bại
      */
-    bool downloadAndUpdate(const String& url);
+    bool downloadAndUpdate(const UpdateTarget& target, const String& url, OtaFormat format = OTA_FORMAT_IMAGE);
     
+    static void flashWriterTask(void* parameter);
+    bool loadResume(ResumeState& state);
+    void saveResume(const ResumeState& state);
+    void saveResumeOffset(uint32_t offset);
+    void clearResume();
+    uint32_t resumeOffset(const String& url);   // Offset đã lưu cho url, 0 nếu không có
+    uint32_t throughputKBps();      // KB/s của lần download đang chạy
+
     /**
      * @brief Callback khi có tiến trình download
      */
@@ -84,7 +228,7 @@ private:
     /**
      * @brief Lưu thông tin OTA vào NVS
      */
-    void saveOTAInfo(const String& version, const String& updateTime);
+    void saveOTAInfo(const String& version, const String& updateTime, uint32_t durationMs = 0, uint32_t kbps = 0);
     
     /**
      * @brief Đọc thông tin OTA từ NVS
@@ -99,7 +243,8 @@ public:
     
     /**
      * @brief Khởi tạo OTA Update
-     * @param serverUrl URL của OTA server (ví dụ: "http://192.168.1.100:8080/ota")
+     * @param serverUrl URL của OTA server (ví dụ: "http://192.168.1.100:8080/ota"),
+     *                  hoặc chỉ path (ví dụ: "/ota/get_info_update") để dùng backend do ServiceDiscovery tìm
      * @param currentVersion Phiên bản hiện tại của firmware
      * @param deviceId ID của thiết bị
      * @param checkInterval Khoảng thời gian tự động kiểm tra (ms), mặc định 3600000 (1 giờ)
@@ -121,10 +266,23 @@ public:
     bool performUpdate(bool forceUpdate = false);
     
     /**
-     * @brief Kiểm tra xem có phiên bản mới không
+     * @brief Kiểm tra xem có phiên bản mới không (dùng manifest cache, xem OTA_MANIFEST_TTL_MS)
+     * @param revalidate true: hỏi lại server dù cache chưa hết hạn (1 lần, không retry)
      * @return true nếu có phiên bản mới
      */
-    bool hasNewVersion();
+    bool hasNewVersion(bool revalidate = false);
+    
+    /**
+     * @brief Ảnh slave mới nhất theo manifest đang cache (không gửi request), cho master làm cache LAN
+     * @param url Link gốc trên server, kể cả khi manifest đã trỏ slave_link về master
+     * @return false nếu manifest chưa có ảnh slave
+     */
+    bool getSlaveImage(String& version, String& url, String& sha256, String& signature);
+
+    /**
+     * @brief Có download ảnh đầy đủ đang dở (sẽ tải tiếp vào partition OTA)
+     */
+    bool hasPendingDownload();
     
     /**
      * @brief Lấy phiên bản hiện tại
@@ -192,8 +350,9 @@ public:
     void printInfo();
     /**
      * @brief Lấy thông tin OTA cho MQTT
+     * @param revalidate true: hỏi lại server trước khi trả lời (OTA:CK)
      */
-    String Getinfo4mqtt();
+    String Getinfo4mqtt(bool revalidate = false);
     
     void loadsettingInNVS();
     
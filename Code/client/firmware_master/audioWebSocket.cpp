@@ -0,0 +1,118 @@
+#include "audioWebSocket.h"
+
+AudioWebSocket::AudioWebSocket()
+    : _frames(0), _cyclesTotal(0), _cyclesMax(0), _writeErrors(0) {}
+
+size_t AudioWebSocket::writeHeader(uint8_t* payload, size_t length, uint32_t maskKey) {
+    // Header client -> server luôn có mask (RFC 6455 5.3), ghi lùi từ payload
+    size_t headerLen = length < 126 ? 6 : (length <= 0xFFFF ? 8 : 14);
+    uint8_t* header = payload - headerLen;
+    header[0] = 0x82;                           // FIN + opcode binary
+    if (length < 126) {
+        header[1] = 0x80 | length;
+    } else if (length <= 0xFFFF) {
+        header[1] = 0x80 | 126;
+        header[2] = length >> 8;
+        header[3] = length & 0xFF;
+    } else {
+        header[1] = 0x80 | 127;
+        for (int i = 0; i < 8; i++) {
+            header[2 + i] = (uint64_t)length >> (56 - 8 * i);
+        }
+    }
+    // Byte của key trên dây theo đúng thứ tự trong bộ nhớ -> XOR cả word không phụ thuộc endian
+    memcpy(header + headerLen - 4, &maskKey, 4);
+    return headerLen;
+}
+
+void AudioWebSocket::maskInPlace(uint8_t* payload, size_t length, uint32_t maskKey) {
+    size_t i = 0;
+    if (((uintptr_t)payload & 3) == 0) {
+        uint32_t* words = (uint32_t*)payload;
+        size_t wordCount = length / 4;
+        for (size_t w = 0; w < wordCount; w++) {
+            words[w] ^= maskKey;
+        }
+        i = wordCount * 4;
+    }
+    // Phần lẻ cuối (hoặc payload không căn 4 byte)
+    const uint8_t* key = (const uint8_t*)&maskKey;
+    for (; i < length; i++) {
+        payload[i] ^= key[i & 3];
+    }
+}
+
+bool AudioWebSocket::sendBinaryInPlace(uint8_t* frame, size_t length) {
+    if (!isConnected()) return false;
+
+    uint32_t start = ESP.getCycleCount();
+    uint8_t* payload = frame + WS_FRAME_HEADROOM;
+    uint32_t maskKey = esp_random();
+    size_t headerLen = writeHeader(payload, length, maskKey);
+    maskInPlace(payload, length, maskKey);
+    uint32_t cycles = ESP.getCycleCount() - start;
+
+    _frames++;
+    _cyclesTotal += cycles;
+    if (cycles > _cyclesMax) _cyclesMax = cycles;
+
+    size_t total = headerLen + length;
+    if (write(&_client, payload - headerLen, total) != total) {
+        _writeErrors++;
+        return false;
+    }
+    return true;
+}
+
+void AudioWebSocket::benchmark(size_t length) {
+    uint8_t* frame = (uint8_t*)malloc(WS_FRAME_HEADROOM + length);
+    if (frame == nullptr) {
+        Serial.println("[AudioWS] Benchmark: out of memory");
+        return;
+    }
+    uint8_t* payload = frame + WS_FRAME_HEADROOM;
+    for (size_t i = 0; i < length; i++) {
+        payload[i] = i * 31;
+    }
+
+    // Đường thư viện (sendFrame, length < 1400, đủ heap): buffer tạm + copy + mask từng byte
+    uint32_t heapUsed = 0;
+    uint32_t start = ESP.getCycleCount();
+    for (int round = 0; round < WS_BENCHMARK_ROUNDS; round++) {
+        uint32_t heapBefore = ESP.getFreeHeap();
+        uint8_t* copy = (uint8_t*)malloc(length + WEBSOCKETS_MAX_HEADER_SIZE);
+        if (copy == nullptr) break;
+        heapUsed = heapBefore - ESP.getFreeHeap();
+        memcpy(copy + WEBSOCKETS_MAX_HEADER_SIZE, payload, length);
+        uint8_t maskKey[4];
+        for (int x = 0; x < 4; x++) {
+            maskKey[x] = random(0xFF);
+        }
+        for (size_t i = 0; i < length; i++) {
+            copy[WEBSOCKETS_MAX_HEADER_SIZE + i] ^= maskKey[i % 4];
+        }
+        free(copy);
+    }
+    uint32_t libraryCycles = (ESP.getCycleCount() - start) / WS_BENCHMARK_ROUNDS;
+
+    // Đường in-place: header vào headroom + mask theo word
+    uint32_t heapBefore = ESP.getFreeHeap();
+    start = ESP.getCycleCount();
+    for (int round = 0; round < WS_BENCHMARK_ROUNDS; round++) {
+        uint32_t maskKey = esp_random();
+        writeHeader(payload, length, maskKey);
+        maskInPlace(payload, length, maskKey);
+    }
+    uint32_t inPlaceCycles = (ESP.getCycleCount() - start) / WS_BENCHMARK_ROUNDS;
+    uint32_t inPlaceHeap = heapBefore - ESP.getFreeHeap();
+    free(frame);
+
+    Serial.printf("[AudioWS] Framing %u B: library %u cycles + %u B heap/frame, in-place %u cycles + %u B heap/frame (%u MHz)\n",
+                  length, libraryCycles, heapUsed, inPlaceCycles, inPlaceHeap, ESP.getCpuFreqMHz());
+}
+
+void AudioWebSocket::printStats() {
+    if (_frames == 0) return;
+    Serial.printf("[AudioWS] Frames: %u, framing avg %u / max %u cycles, write errors: %u\n",
+                  _frames, _cyclesTotal / _frames, _cyclesMax, _writeErrors);
+}
@@ -0,0 +1,47 @@
+#ifndef AUDIO_WEBSOCKET_H
+#define AUDIO_WEBSOCKET_H
+
+#include <Arduino.h>
+#include <WebSocketsClient.h>
+
+// ======= Audio WebSocket Configuration =======
+#define WS_FRAME_HEADROOM       16      // >= header tối đa (14 byte), giữ payload căn 4 byte cho vòng mask 32-bit
+#define WS_BENCHMARK_ROUNDS     200
+
+// ======= Audio WebSocket =======
+/**
+ * WebSocketsClient với đường gửi binary không copy cho audio mic.
+ *
+ * sendBIN() của thư viện với frame < 1400 byte: malloc(len + 14), memcpy payload, mask từng byte
+ * rồi free, mỗi frame. Frame lớn hơn (khi MicRecorder gộp nhiều frame) bị ghi 2 lần
+ * (header rồi payload) và dùng mask key 0.
+ *
+ * sendBinaryInPlace() yêu cầu buffer có sẵn WS_FRAME_HEADROOM byte trống trước payload
+ * (buffer ghi âm cấp phát 1 lần trong MicRecorder::begin): header được ghi ngay trước payload,
+ * payload được mask tại chỗ theo từng word 32-bit với key ngẫu nhiên, cả frame đi ra socket
+ * trong 1 lần write. Sau khi gửi payload đã bị mask, không dùng lại được.
+ */
+class AudioWebSocket : public WebSocketsClient {
+public:
+    AudioWebSocket();
+
+    // frame: đầu vùng headroom, payload bắt đầu tại frame + WS_FRAME_HEADROOM
+    bool sendBinaryInPlace(uint8_t* frame, size_t length);
+
+    // So sánh chi phí đóng frame (CPU cycles + heap) của thư viện và đường in-place, in ra Serial
+    static void benchmark(size_t length);
+
+    void printStats();
+
+private:
+    static size_t writeHeader(uint8_t* payload, size_t length, uint32_t maskKey);
+    static void maskInPlace(uint8_t* payload, size_t length, uint32_t maskKey);
+
+    // Metrics
+    uint32_t _frames;
+    uint32_t _cyclesTotal;      // Chỉ phần header + mask, không gồm thời gian ghi socket
+    uint32_t _cyclesMax;
+    uint32_t _writeErrors;
+};
+
+#endif
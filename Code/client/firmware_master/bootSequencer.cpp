@@ -0,0 +1,143 @@
+#include "bootSequencer.h"
+
+BootSequencer::BootSequencer() : _count(0) {
+    _mutex = xSemaphoreCreateMutex();
+    _doneBits = xEventGroupCreate();
+}
+
+int BootSequencer::find(const char* name) {
+    int index = -1;
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    for (int i = 0; i < _count; i++) {
+        if (strcmp(_phases[i].name, name) == 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0 && _count < BOOT_MAX_PHASES) {
+        index = _count++;
+        _phases[index] = {name, 0, 0, false, false};
+    }
+    xSemaphoreGive(_mutex);
+    if (index < 0) {
+        Serial.printf("⚠️ [Boot] Too many phases, '%s' not tracked\n", name);
+    }
+    return index;
+}
+
+void BootSequencer::begin(const char* name) {
+    int i = find(name);
+    if (i < 0) return;
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    _phases[i].startMs = millis();
+    _phases[i].started = true;
+    xSemaphoreGive(_mutex);
+}
+
+void BootSequencer::end(const char* name) {
+    int i = find(name);
+    if (i < 0) return;
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    uint32_t endMs = millis();
+    uint32_t startMs = _phases[i].startMs;
+    _phases[i].endMs = endMs;
+    _phases[i].finished = true;
+    xSemaphoreGive(_mutex);
+    Serial.printf("⏱️ [Boot] %s done at %lu ms (%lu ms)\n", name,
+                  (unsigned long)endMs, (unsigned long)(endMs - startMs));
+    xEventGroupSetBits(_doneBits, 1 << i);
+}
+
+void BootSequencer::mark(const char* name) {
+    begin(name);
+    end(name);
+}
+
+void BootSequencer::run(const char* name, BootStep step) {
+    begin(name);
+    step();
+    end(name);
+}
+
+void BootSequencer::runAsync(const char* name, BootStep step, uint32_t stackSize,
+                             UBaseType_t priority, BaseType_t core) {
+    AsyncStep* async = new AsyncStep{name, step};
+    begin(name);
+    if (xTaskCreatePinnedToCore(stepTask, name, stackSize, async, priority, NULL, core) != pdPASS) {
+        // Không đủ RAM cho task -> chạy luôn trên đường boot
+        Serial.printf("⚠️ [Boot] No task for '%s', running inline\n", name);
+        delete async;
+        step();
+        end(name);
+    }
+}
+
+void BootSequencer::stepTask(void* parameter) {
+    AsyncStep* async = (AsyncStep*)parameter;
+    async->step();
+    BootSequencer::getInstance().end(async->name);
+    delete async;
+    vTaskDelete(NULL);
+}
+
+bool BootSequencer::waitFor(const char* name, uint32_t timeoutMs) {
+    int i = find(name);
+    if (i < 0) return false;
+    EventBits_t bits = xEventGroupWaitBits(_doneBits, 1 << i, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeoutMs));
+    return (bits & (1 << i)) != 0;
+}
+
+bool BootSequencer::done(const char* name) {
+    int i = find(name);
+    if (i < 0) return false;
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    bool finished = _phases[i].finished;
+    xSemaphoreGive(_mutex);
+    return finished;
+}
+
+// Copy các phase dưới mutex để in / gửi mà không giữ lock trong lúc Serial chạy
+int BootSequencer::snapshot(Phase* out) {
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    int count = _count;
+    memcpy(out, _phases, count * sizeof(Phase));
+    xSemaphoreGive(_mutex);
+    return count;
+}
+
+void BootSequencer::printTimeline() {
+    Phase phases[BOOT_MAX_PHASES];
+    int count = snapshot(phases);
+    Serial.println("=== Boot Timeline ===");
+    for (int i = 0; i < count; i++) {
+        const Phase& p = phases[i];
+        if (!p.started) continue;
+        if (p.finished) {
+            Serial.printf("  %-10s %6lu -> %6lu ms (%lu ms)\n", p.name, (unsigned long)p.startMs,
+                          (unsigned long)p.endMs, (unsigned long)(p.endMs - p.startMs));
+        } else {
+            Serial.printf("  %-10s %6lu -> running\n", p.name, (unsigned long)p.startMs);
+        }
+    }
+    Serial.println("=====================");
+}
+
+// Phase chưa xong không có "+<thời lượng>"; chuỗi dài hơn BOOT_REPORT_LEN thì bỏ các phase cuối
+String BootSequencer::report() {
+    Phase phases[BOOT_MAX_PHASES];
+    int count = snapshot(phases);
+    uint32_t lastEnd = 0;
+    for (int i = 0; i < count; i++) {
+        if (phases[i].finished && phases[i].endMs > lastEnd) lastEnd = phases[i].endMs;
+    }
+    String out = "BOOT:" + String(lastEnd);
+    for (int i = 0; i < count; i++) {
+        const Phase& p = phases[i];
+        if (!p.started) continue;
+        String item = "@" + String(p.name) + "=" + String(p.startMs);
+        if (p.finished) item += "+" + String(p.endMs - p.startMs);
+        if (out.length() + item.length() >= BOOT_REPORT_LEN) break;
+        out += item;
+    }
+    return out;
+}
@@ -0,0 +1,77 @@
+#ifndef BOOT_SEQUENCER_H
+#define BOOT_SEQUENCER_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <freertos/event_groups.h>
+
+// ======= Boot Sequencer Configuration =======
+#define BOOT_MAX_PHASES     16      // Mỗi phase 1 bit trong event group (tối đa 24)
+#define BOOT_REPORT_LEN     128     // = TLM_ARENA_SLOT_SIZE: gửi được qua queueNotification
+
+// ======= Boot Sequencer =======
+/**
+ * Chia setup() thành các phase có đo thời gian; phase không phụ thuộc nhau chạy song song
+ * trong task riêng thay vì nối tiếp nhau trên đường boot:
+ *
+ *   BootSequencer& boot = BootSequencer::getInstance();
+ *   boot.run("nvs", initNvs);                              // Chạy ngay trong setup()
+ *   boot.runAsync("ota", bootOtaCheck, 8192, 1, 1);        // Task riêng, tự xóa khi xong
+ *   boot.waitFor("wifi", 60000);                           // Trong phase khác: chờ phase "wifi" xong
+ *   boot.mark("mqtt");                                     // Mốc (vd lần đầu kết nối MQTT)
+ *
+ * Timeline (ms kể từ lúc chip chạy app) in ra Serial và gửi lên server dạng
+ * "BOOT:<ms tới mốc cuối>@<phase>=<bắt đầu>+<thời lượng>@..." (report()).
+ */
+class BootSequencer {
+public:
+    typedef void (*BootStep)();
+
+    static BootSequencer& getInstance() {
+        static BootSequencer instance;
+        return instance;
+    }
+
+    void run(const char* name, BootStep step);
+    void runAsync(const char* name, BootStep step, uint32_t stackSize, UBaseType_t priority, BaseType_t core);
+    void begin(const char* name);
+    void end(const char* name);
+    void mark(const char* name);
+    // false nếu hết timeoutMs mà phase chưa xong
+    bool waitFor(const char* name, uint32_t timeoutMs);
+    bool done(const char* name);
+
+    void printTimeline();
+    String report();
+
+    BootSequencer(const BootSequencer&) = delete;
+    BootSequencer& operator=(const BootSequencer&) = delete;
+
+private:
+    BootSequencer();
+
+    struct Phase {
+        const char* name;           // Chuỗi hằng của caller
+        uint32_t startMs;
+        uint32_t endMs;
+        bool started;
+        bool finished;
+    };
+    struct AsyncStep {
+        const char* name;
+        BootStep step;
+    };
+
+    static void stepTask(void* parameter);
+    int find(const char* name);     // Tạo phase mới nếu chưa có, -1 khi hết chỗ
+    int snapshot(Phase* out);       // Copy _phases dưới _mutex, trả số phase
+
+    Phase _phases[BOOT_MAX_PHASES];
+    uint8_t _count;
+    SemaphoreHandle_t _mutex;
+    EventGroupHandle_t _doneBits;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef HTTP_POOL_H
+#define HTTP_POOL_H
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <HTTPClient.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include "tlsClient.h"
+
+// ======= HTTP Pool Configuration =======
+#define HTTP_POOL_SIZE          3       // OTA task + audio URL + audio stream có thể chạy cùng lúc
+#define HTTP_POOL_HOST_LEN      64
+#define HTTP_POOL_IDLE_MS       25000   // Nhỏ hơn keep-alive của backend (uvicorn timeout_keep_alive=30)
+#define HTTP_BODY_DRAIN_MAX     512     // Phần đuôi body tối đa đọc bỏ để vẫn giữ được kết nối keep-alive
+
+class HttpLease;
+
+// ======= HTTP Connection Pool =======
+/**
+ * Pool kết nối HTTP/1.1 keep-alive theo host, dùng chung cho OTA, lấy audio URL và phát audio.
+ *
+ * Mỗi slot giữ nguyên HTTPClient + socket (TCP hoặc TLS) sau khi request xong; request sau
+ * tới cùng host (scheme + host + port) mượn lại slot đó và bỏ qua bước kết nối TCP / handshake TLS.
+ * Kết nối chỉ được giữ lại khi body đã đọc hết (HttpLease::release(true)), nếu không sẽ bị đóng
+ * để phần body còn lại không lẫn vào response sau.
+ * Pool hết slot -> HttpLease dùng 1 kết nối tạm, đóng khi trả về.
+ */
+class HttpPool {
+public:
+    static HttpPool& getInstance() {
+        static HttpPool instance;
+        return instance;
+    }
+
+    void begin();
+    void printStats();
+
+    HttpPool(const HttpPool&) = delete;
+    HttpPool& operator=(const HttpPool&) = delete;
+
+private:
+    friend class HttpLease;
+
+    struct Slot {
+        WiFiClient plain;
+        TlsClient tls;
+        HTTPClient http;        // Khai báo sau client: hủy http trước (destructor của http gọi stop())
+        char host[HTTP_POOL_HOST_LEN];
+        uint16_t port;
+        bool secure;
+        bool inUse;
+        bool pooled;            // false = slot tạm khi pool đầy
+        uint32_t lastUsed;
+
+        WiFiClient& client() { return secure ? (WiFiClient&)tls : plain; }
+    };
+
+    HttpPool();
+    Slot* acquire(const char* host, uint16_t port, bool secure);
+    void release(Slot* slot, bool keepAlive);
+    void record(bool reused, bool staleRetry, uint32_t ms);
+
+    Slot _slots[HTTP_POOL_SIZE];
+    SemaphoreHandle_t _mutex;
+
+    // Metrics
+    uint32_t _requests;
+    uint32_t _reuseHits;        // Request chạy trên kết nối keep-alive có sẵn
+    uint32_t _staleRetries;     // Kết nối keep-alive đã bị server đóng, phải kết nối lại
+    uint32_t _overflow;         // Pool đầy, dùng kết nối tạm
+    uint32_t _reusedMs;
+    uint32_t _freshMs;
+};
+
+// ======= HTTP Lease =======
+/**
+ * Mượn 1 kết nối từ HttpPool trong phạm vi 1 request (hoặc 1 stream).
+ *
+ *   HttpLease lease(url);
+ *   HTTPClient& http = lease.http();
+ *   http.addHeader(...);
+ *   int code = lease.GET();
+ *   String body = http.getString();
+ *   lease.release(true);    // body đã đọc hết -> giữ kết nối cho request sau
+ *
+ * Hủy lease mà chưa release(true) thì kết nối bị đóng.
+ */
+class HttpLease {
+public:
+    HttpLease();
+    explicit HttpLease(const String& url);
+    ~HttpLease();
+
+    // Mượn kết nối tới host của url rồi http.begin(). Gọi lại để bắt đầu request mới
+    bool open(const String& url);
+    // GET; kết nối keep-alive đã bị server đóng thì tự kết nối lại và gửi lại 1 lần
+    int GET();
+    void release(bool keepAlive);
+
+    HTTPClient& http() { return _slot->http; }
+    bool active() const { return _slot != nullptr; }
+    bool reused() const { return _reused; }
+
+    HttpLease(const HttpLease&) = delete;
+    HttpLease& operator=(const HttpLease&) = delete;
+
+private:
+    HttpPool::Slot* _slot;
+    bool _reused;
+};
+
+// ======= HTTP Body Reader =======
+/**
+ * Đọc body của response hiện tại thẳng từ socket, giới hạn theo Content-Length.
+ * Dùng làm nguồn cho deserializeJson (ArduinoJson gọi read() / readBytes()) để parse
+ * không cần http.getString() giữ cả body trên heap:
+ *
+ *   HttpBodyReader body(lease.http());
+ *   DeserializationError error = deserializeJson(doc, body, DeserializationOption::Filter(filter));
+ *   lease.release(body.drain());    // chỉ giữ kết nối khi body đã đọc hết
+ *
+ * Không có Content-Length (chunked / đóng kết nối để kết thúc) -> đọc tới khi socket hết dữ liệu,
+ * drain() trả false để kết nối không được đưa lại vào pool. Backend (FastAPI) luôn gửi
+ * Content-Length cho response JSON.
+ */
+class HttpBodyReader {
+public:
+    explicit HttpBodyReader(HTTPClient& http);
+
+    int read();
+    size_t readBytes(char* buffer, size_t length);
+
+    // Đọc bỏ phần còn lại (khoảng trắng sau JSON...), true nếu body đã hết -> giữ được keep-alive
+    bool drain();
+
+    int size() const { return _size; }
+    int consumed() const { return _consumed; }
+
+private:
+    WiFiClient* _stream;
+    int _size;                  // -1 = không biết độ dài
+    int _consumed;
+};
+
+#endif
@@ -5,9 +5,20 @@
 #define REG_NC 2
 #define SEND_NC true
 #define SEND_SS_CT false
+#define MQTT_BUFFER_SIZE 512   // PubSubClient mặc định 256, batch CBOR cần lớn hơn
+#define TOPIC_BATCH_SUFFIX "/batch"
+#define MQTT_RECONNECT_INTERVAL_MS 5000
+#define MQTT_PUBLISH_QOS 1     // SS / NC / batch đều cần PUBACK, không mất khi TCP reset
+#define MQTT_TOPIC_MAX_LEN 56  // "SS/" + clientId (32 hex) + "/batch" hoặc "/<pin>"
+#define MQTT_MAX_PIN_TOPICS 16 // Số virtual pin được cache sẵn topic
+#define MQTT_DEFAULT_PROTOCOL MQTT_PROTOCOL_V5  // Broker chỉ hỗ trợ 3.1.1 -> tự lùi về 3.1.1
+#define TOPIC_HANDLE_PREFIX "HD/"  // MQTT 3.1.1: subscribe HD/<clientId>, broker trả handle ngắn của thiết bị
+#define DEVICE_HANDLE_MARK '~'     // SS/~<handle>/<pin> thay cho SS/<clientId>/<pin>
+#define MQTT_HANDLE_MAX_LEN 8
 #include <Arduino.h>
 #include <WiFiClient.h>
-#include <PubSubClient.h>
+#include "mqttClient.h"
+#include "tlsClient.h"
 #include "settings.h"
 
 class MQTTProtocol {
@@ -29,12 +40,26 @@ public:
   void publish(const char* topic, const String &payload, bool retained = false);
   void subscribe(const char* topic);
   void registerVirtualpin(int type , int virtualPin);
-  void send(int virtualPin, const String &payload , bool retained , bool isnotification);
+  bool send(int virtualPin, const String &payload , bool retained , bool isnotification);
+  bool send(int virtualPin, const char* payload , bool retained , bool isnotification);
+  bool sendBatch(const uint8_t* data, size_t len);  // CBOR batch -> SS/<clientId>/batch
+  // Streaming: beginSend() giữ mqttMutex tới endSend(), ghi payload bằng write() từng phần.
+  // Payload không bị giới hạn bởi MQTT_BUFFER_SIZE (packet lớn gửi QoS 0)
+  bool beginSend(int virtualPin, size_t len, bool isnotification);
+  size_t write(const uint8_t* data, size_t len);
+  bool endSend();
   String getBroker() const { return _broker; }
   uint16_t getPort() const { return _port; }
   
   // Thêm phương thức để cập nhật cấu hình
   void updateConfig(const String& broker, uint16_t port, const String& clientId);
+  // Broker / port / clientId trong NVS "mqtt" đã đổi (manifest OTA lưu sau khi MQTT đã chạy)
+  // -> ngắt kết nối cũ, nạp lại cấu hình. false nếu không có gì thay đổi
+  bool reloadConfig();
+  // Số QoS 1 publish chờ PUBACK cùng lúc (1..MQTT_MAX_INFLIGHT), lưu NVS "mqtt"/"inflight".
+  // Không gọi từ MQTT callback (mqttMutex đang bị loop() giữ)
+  bool setInflightWindow(uint8_t window);
+  void printStats();
 
   // Cấm copy & gán
   MQTTProtocol(const MQTTProtocol&) = delete;
@@ -44,16 +69,39 @@ private:
   // ======= Private constructor =======
   MQTTProtocol();
 
+  // Topic SS/<clientId>/<pin> dựng sẵn lúc registerVirtualpin, send() không phải ghép String
+  struct PinTopic {
+    int16_t pin;
+    uint8_t regMask;            // bit REG_SS / REG_CT đã subscribe, dùng để subscribe lại khi reconnect
+    char ss[MQTT_TOPIC_MAX_LEN];
+  };
+
+  void buildTopics();
+  void loadConfig();
+  void handleMessage(char* topic, uint8_t* payload, unsigned int length);
+  PinTopic* findPin(int virtualPin);
+  const char* topicFor(int virtualPin);
+  void resubscribe();
+
   WiFiClient _wifiClient;
-  PubSubClient _mqttClient;
+  TlsClient _tlsClient;                     // Dùng khi NVS "mqtt"/"tls" = true
+  MqttClient _mqttClient;
   String _broker;
   uint16_t _port;
   String _user;
   String _password;
   String _clientId;
-  String _topicSS;
-  String _topicCT;
-  String _topicNC;
+  char _topicSS[MQTT_TOPIC_MAX_LEN];
+  char _topicNC[MQTT_TOPIC_MAX_LEN];
+  char _topicBatch[MQTT_TOPIC_MAX_LEN];
+  char _topicScratch[MQTT_TOPIC_MAX_LEN];   // Pin chưa đăng ký khi bảng cache đã đầy
+  char _topicHandle[MQTT_TOPIC_MAX_LEN];
+  char _handle[MQTT_HANDLE_MAX_LEN + 1];    // Rỗng = publish bằng clientId đầy đủ
+  MQTT_CALLBACK_SIGNATURE = nullptr;
+  PinTopic _pinTopics[MQTT_MAX_PIN_TOPICS];
+  uint8_t _pinTopicCount = 0;
+  bool _ncSubscribed = false;
+  unsigned long _lastReconnectAttempt = 0;
 };
 
 #endif
@@ -0,0 +1,830 @@
+#include "mqttClient.h"
+
+// Đọc Variable Byte Integer (MQTT 5 mục 1.5.5) trong buffer đã nhận
+static bool readVarInt(const uint8_t* buf, size_t len, size_t& pos, uint32_t& value) {
+    value = 0;
+    for (uint8_t i = 0; i < 4 && pos < len; i++) {
+        uint8_t digit = buf[pos++];
+        value |= (uint32_t)(digit & 0x7F) << (7 * i);
+        if ((digit & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+// Kích thước giá trị của 1 property MQTT 5, -1 nếu không biết (buộc dừng parse)
+static int propertySize(uint8_t id, const uint8_t* buf, size_t len, size_t pos) {
+    switch (id) {
+        case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+            return 1;
+        case 0x13: case 0x21: case 0x22: case 0x23:
+            return 2;
+        case 0x02: case 0x11: case 0x18: case 0x27:
+            return 4;
+        case 0x0B: {
+            size_t p = pos;
+            uint32_t v;
+            return readVarInt(buf, len, p, v) ? (int)(p - pos) : -1;
+        }
+        case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+            if (pos + 2 > len) return -1;
+            return 2 + ((buf[pos] << 8) | buf[pos + 1]);
+        case 0x26: {
+            // User property: 2 chuỗi UTF-8 liên tiếp
+            if (pos + 2 > len) return -1;
+            size_t keyLen = 2 + ((buf[pos] << 8) | buf[pos + 1]);
+            if (pos + keyLen + 2 > len) return -1;
+            return keyLen + 2 + ((buf[pos + keyLen] << 8) | buf[pos + keyLen + 1]);
+        }
+        default:
+            return -1;
+    }
+}
+
+// Reason code MQTT 5 -> mã CONNACK của 3.1.1 để state() giữ nghĩa như cũ
+static int connackState(uint8_t rc) {
+    switch (rc) {
+        case 0x84: return MQTT_CONNECT_BAD_PROTOCOL;
+        case 0x85: return MQTT_CONNECT_BAD_CLIENT_ID;
+        case 0x88: case 0x89: case 0x97: return MQTT_CONNECT_UNAVAILABLE;
+        case 0x86: return MQTT_CONNECT_BAD_CREDENTIALS;
+        case 0x87: return MQTT_CONNECT_UNAUTHORIZED;
+        default: return rc;
+    }
+}
+
+MqttClient::MqttClient(Client& net)
+    : _net(&net), _port(1883), callback(nullptr),
+      _rxBuffer(nullptr), _inflightPool(nullptr),
+      _bufferSize(MQTT_DEFAULT_BUFFER_SIZE), _window(MQTT_DEFAULT_INFLIGHT),
+      _keepAliveSec(MQTT_DEFAULT_KEEPALIVE), _lastInActivity(0), _lastOutActivity(0),
+      _pingOutstanding(false), _state(MQTT_DISCONNECTED), _lastPacketId(0), _recentPos(0),
+      _protocol(MQTT_PROTOCOL_V311), _aliasMax(0), _aliasCount(0),
+      _streamActive(false), _streamDirect(false), _streamOk(false), _streamBuf(nullptr),
+      _streamSlot(nullptr), _streamPos(0), _streamRemaining(0), _streamPacketId(0),
+      _streamAlias(0), _streamTopicOmitted(false), _streamLen(0),
+      _published(0), _acked(0), _retransmits(0), _dupDropped(0), _windowFull(0), _ackTimeTotal(0),
+      _downgraded(0), _publishCount(0), _publishBytes(0), _bytesSent(0) {
+    memset(_slots, 0, sizeof(_slots));
+    memset(_recentIds, 0, sizeof(_recentIds));
+    memset(_aliases, 0, sizeof(_aliases));
+}
+
+MqttClient::~MqttClient() {
+    freeBuffers();
+}
+
+void MqttClient::setServer(const char* host, uint16_t port) {
+    _host = host;
+    _port = port;
+}
+
+void MqttClient::setClient(Client& net) {
+    if (_net == &net) return;
+    if (_net->connected()) {
+        _net->stop();
+        _state = MQTT_DISCONNECTED;
+    }
+    _net = &net;
+}
+
+void MqttClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
+    this->callback = callback;
+}
+
+bool MqttClient::setBufferSize(uint16_t size) {
+    if (size == 0) return false;
+    return resizeBuffers(size, _window);
+}
+
+bool MqttClient::setInflightWindow(uint8_t window) {
+    if (window == 0 || window > MQTT_MAX_INFLIGHT) return false;
+    return resizeBuffers(_bufferSize, window);
+}
+
+void MqttClient::setProtocolVersion(uint8_t version) {
+    if (version != MQTT_PROTOCOL_V5) version = MQTT_PROTOCOL_V311;
+    if (version == _protocol) return;
+    if (inflight() > 0) {
+        Serial.printf("⚠️ [MqttClient] Protocol changed, dropping %u unacked message(s)\n", inflight());
+    }
+    _protocol = version;
+    _aliasCount = 0;
+    memset(_aliases, 0, sizeof(_aliases));
+    if (_inflightPool != nullptr) resetInflight();
+}
+
+// ======= Buffers =======
+bool MqttClient::allocBuffers() {
+    freeBuffers();
+    _rxBuffer = (uint8_t*)malloc(_bufferSize);
+    // Mỗi slot in-flight giữ nguyên packet đã encode để gửi lại khi cần
+    _inflightPool = (uint8_t*)malloc((size_t)_bufferSize * _window);
+    if (_rxBuffer == nullptr || _inflightPool == nullptr) {
+        Serial.println("❌ [MqttClient] Failed to allocate buffers");
+        freeBuffers();
+        return false;
+    }
+    resetInflight();
+    return true;
+}
+
+bool MqttClient::resizeBuffers(uint16_t size, uint8_t window) {
+    if (size == _bufferSize && window == _window) return true;
+    // Chưa cấp phát: connect() sẽ cấp phát theo kích thước mới
+    if (_rxBuffer == nullptr) {
+        _bufferSize = size;
+        _window = window;
+        return true;
+    }
+    if (_streamActive) return false;
+
+    // Message chờ PUBACK được chuyển sang buffer mới; không đủ chỗ thì giữ nguyên cấu hình cũ
+    uint8_t pending = 0;
+    for (uint8_t i = 0; i < _window; i++) {
+        if (!_slots[i].used) continue;
+        if (_slots[i].len > size) {
+            Serial.printf("⚠️ [MqttClient] Buffer %u too small for unacked %u-byte message, keeping %u\n",
+                          size, _slots[i].len, _bufferSize);
+            return false;
+        }
+        pending++;
+    }
+    if (pending > window) {
+        Serial.printf("⚠️ [MqttClient] %u unacked message(s) do not fit window %u, keeping %u\n",
+                      pending, window, _window);
+        return false;
+    }
+
+    uint8_t* rx = (uint8_t*)malloc(size);
+    uint8_t* pool = (uint8_t*)malloc((size_t)size * window);
+    if (rx == nullptr || pool == nullptr) {
+        Serial.println("❌ [MqttClient] Failed to allocate buffers");
+        free(rx);
+        free(pool);
+        return false;
+    }
+
+    InflightSlot old[MQTT_MAX_INFLIGHT];
+    memcpy(old, _slots, sizeof(_slots));
+    memset(_slots, 0, sizeof(_slots));
+    for (uint8_t i = 0; i < window; i++) {
+        _slots[i].data = pool + (size_t)i * size;
+    }
+    uint8_t next = 0;
+    for (uint8_t i = 0; i < _window; i++) {
+        if (!old[i].used) continue;
+        uint8_t* data = _slots[next].data;
+        memcpy(data, old[i].data, old[i].len);
+        _slots[next] = old[i];
+        _slots[next].data = data;
+        next++;
+    }
+
+    free(_rxBuffer);
+    free(_inflightPool);
+    _rxBuffer = rx;
+    _inflightPool = pool;
+    _bufferSize = size;
+    _window = window;
+    return true;
+}
+
+void MqttClient::freeBuffers() {
+    free(_rxBuffer);
+    free(_inflightPool);
+    _rxBuffer = nullptr;
+    _inflightPool = nullptr;
+    memset(_slots, 0, sizeof(_slots));
+}
+
+void MqttClient::resetInflight() {
+    memset(_slots, 0, sizeof(_slots));
+    for (uint8_t i = 0; i < _window; i++) {
+        _slots[i].data = _inflightPool + (size_t)i * _bufferSize;
+    }
+}
+
+// ======= Connection =======
+bool MqttClient::connect(const char* clientId) {
+    if (connected()) return true;
+    if (_rxBuffer == nullptr && !allocBuffers()) return false;
+
+    if (!_net->connect(_host.c_str(), _port)) {
+        _state = MQTT_CONNECT_FAILED;
+        return false;
+    }
+
+    // CONNECT (clean session, không will / user / password, MQTT 5 không gửi property)
+    size_t idLen = strlen(clientId);
+    bool v5 = _protocol == MQTT_PROTOCOL_V5;
+    uint32_t remaining = 10 + (v5 ? 1 : 0) + 2 + idLen;
+    if (remaining + 5 > _bufferSize) {
+        _state = MQTT_CONNECT_BAD_CLIENT_ID;
+        _net->stop();
+        return false;
+    }
+    uint8_t* p = _rxBuffer;
+    size_t pos = writeHeader(p, MQTT_PKT_CONNECT, remaining);
+    const uint8_t variableHeader[] = {0x00, 0x04, 'M', 'Q', 'T', 'T', _protocol, 0x02,
+                                      (uint8_t)(_keepAliveSec >> 8), (uint8_t)_keepAliveSec};
+    memcpy(p + pos, variableHeader, sizeof(variableHeader));
+    pos += sizeof(variableHeader);
+    if (v5) p[pos++] = 0x00;
+    p[pos++] = (uint8_t)(idLen >> 8);
+    p[pos++] = (uint8_t)idLen;
+    memcpy(p + pos, clientId, idLen);
+    pos += idLen;
+
+    uint16_t len = 0;
+    if (!writePacket(p, pos) || !waitForPacket(MQTT_PKT_CONNACK, MQTT_SOCKET_TIMEOUT_MS, len)) {
+        _state = MQTT_CONNECTION_TIMEOUT;
+        _net->stop();
+        return false;
+    }
+    if (!handleConnack(len)) {
+        _net->stop();
+        return false;
+    }
+
+    _state = MQTT_CONNECTED;
+    _pingOutstanding = false;
+    _lastInActivity = _lastOutActivity = millis();
+
+    // Alias của kết nối trước không còn hiệu lực
+    for (uint8_t i = 0; i < _aliasCount; i++) {
+        _aliases[i].announced = false;
+    }
+
+    // Clean start: broker không giữ session cũ, mọi QoS 1 chưa có PUBACK
+    // được gửi lại như publish mới trên phiên này (giữ DUP + packet id để lọc trùng)
+    uint8_t pending = 0;
+    for (uint8_t i = 0; i < _window; i++) {
+        if (_slots[i].used) {
+            retransmit(_slots[i]);
+            pending++;
+        }
+    }
+    if (pending > 0) {
+        Serial.printf("🔁 [MqttClient] Re-sent %u unacked message(s) on new clean session\n", pending);
+    }
+    return true;
+}
+
+bool MqttClient::handleConnack(uint16_t len) {
+    if (len < 2) {
+        _state = MQTT_CONNECT_BAD_PROTOCOL;
+        return false;
+    }
+    uint8_t rc = _rxBuffer[1];
+    _aliasMax = 0;
+    if (_protocol != MQTT_PROTOCOL_V5) {
+        _state = rc;
+        return rc == 0;
+    }
+
+    // Broker chỉ hiểu 3.1.1 trả CONNACK 2 byte (rc 1 hoặc bỏ qua version) -> không dùng được MQTT 5
+    if (len == 2) {
+        _state = MQTT_CONNECT_BAD_PROTOCOL;
+        return false;
+    }
+    if (rc != 0) {
+        _state = connackState(rc);
+        return false;
+    }
+
+    size_t pos = 2;
+    uint32_t propsLen;
+    if (!readVarInt(_rxBuffer, len, pos, propsLen)) {
+        _state = MQTT_CONNECT_BAD_PROTOCOL;
+        return false;
+    }
+    size_t end = min((size_t)len, pos + propsLen);
+    while (pos < end) {
+        uint8_t id = _rxBuffer[pos++];
+        int size = propertySize(id, _rxBuffer, end, pos);
+        if (size < 0 || pos + size > end) break;
+        if (id == MQTT_PROP_TOPIC_ALIAS_MAX) {
+            _aliasMax = (_rxBuffer[pos] << 8) | _rxBuffer[pos + 1];
+        }
+        pos += size;
+    }
+    _state = MQTT_CONNECTED;
+    return true;
+}
+
+void MqttClient::disconnect() {
+    const uint8_t packet[] = {MQTT_PKT_DISCONNECT, 0x00};
+    if (_net->connected()) {
+        _net->write(packet, sizeof(packet));
+    }
+    _net->stop();
+    _state = MQTT_DISCONNECTED;
+}
+
+bool MqttClient::connected() {
+    if (_net->connected()) {
+        return _state == MQTT_CONNECTED;
+    }
+    if (_state == MQTT_CONNECTED) {
+        _state = MQTT_CONNECTION_LOST;
+        _net->stop();
+    }
+    return false;
+}
+
+bool MqttClient::loop() {
+    if (!connected()) return false;
+
+    uint32_t now = millis();
+    uint32_t keepAliveMs = (uint32_t)_keepAliveSec * 1000;
+    if (now - _lastInActivity > keepAliveMs || now - _lastOutActivity > keepAliveMs) {
+        if (_pingOutstanding) {
+            _state = MQTT_CONNECTION_TIMEOUT;
+            _net->stop();
+            return false;
+        }
+        const uint8_t ping[] = {MQTT_PKT_PINGREQ, 0x00};
+        writePacket(ping, sizeof(ping));
+        _lastInActivity = now;
+        _pingOutstanding = true;
+    }
+
+    uint8_t header;
+    uint16_t len;
+    while (_net->available()) {
+        if (!readPacket(header, len)) break;
+        _lastInActivity = millis();
+        handlePacket(header, len);
+    }
+
+#if MQTT_RETRY_ON_LIVE_V311
+    // MQTT 5 cấm gửi lại trên kết nối còn sống, chỉ 3.1.1 mới được bật
+    if (_protocol == MQTT_PROTOCOL_V311) {
+        retransmitExpired(millis());
+    }
+#endif
+    return connected();
+}
+
+// ======= Publish / Subscribe =======
+bool MqttClient::publish(const char* topic, const char* payload, bool retained, uint8_t qos) {
+    return publish(topic, (const uint8_t*)payload, strlen(payload), retained, qos);
+}
+
+bool MqttClient::publish(const char* topic, const uint8_t* payload, size_t len, bool retained, uint8_t qos) {
+    if (!beginPublish(topic, len, retained, qos)) return false;
+    write(payload, len);
+    return endPublish();
+}
+
+bool MqttClient::beginPublish(const char* topic, size_t payloadLen, bool retained, uint8_t qos) {
+    if (_streamActive || !connected()) return false;
+
+    size_t topicLen = strlen(topic);
+    bool v5 = _protocol == MQTT_PROTOCOL_V5;
+    uint8_t alias = v5 ? topicAlias(topic) : 0;
+    bool omitTopic = alias != 0 && _aliases[alias - 1].announced;
+    size_t wireTopicLen = omitTopic ? 0 : topicLen;
+    size_t propsLen = v5 ? (alias != 0 ? 4 : 1) : 0;
+
+    uint32_t remaining = 2 + wireTopicLen + (qos > 0 ? 2 : 0) + propsLen + payloadLen;
+    if (qos > 0 && remaining + 5 > _bufferSize) {
+        // Không giữ được bản sao để gửi lại -> QoS 0
+        Serial.printf("⚠️ [MqttClient] %u-byte payload larger than in-flight slot, sending at QoS 0\n",
+                      (unsigned)payloadLen);
+        qos = 0;
+        remaining -= 2;
+        _downgraded++;
+    }
+    if (5 + 2 + wireTopicLen + 2 + propsLen > _bufferSize) return false;
+
+    _streamSlot = nullptr;
+    _streamBuf = _rxBuffer;     // QoS 0: dùng chung buffer như PubSubClient
+    _streamDirect = remaining + 5 > _bufferSize;
+    if (qos > 0) {
+        int index = acquireSlot();
+        if (index < 0) return false;
+        _streamSlot = &_slots[index];
+        _streamBuf = _streamSlot->data;
+    }
+
+    uint8_t flags = (qos > 0 ? MQTT_FLAG_QOS1 : 0) | (retained ? MQTT_FLAG_RETAIN : 0);
+    size_t pos = writeHeader(_streamBuf, MQTT_PKT_PUBLISH | flags, remaining);
+    _streamBuf[pos++] = (uint8_t)(wireTopicLen >> 8);
+    _streamBuf[pos++] = (uint8_t)wireTopicLen;
+    memcpy(_streamBuf + pos, topic, wireTopicLen);
+    pos += wireTopicLen;
+    _streamPacketId = 0;
+    if (qos > 0) {
+        _streamPacketId = nextPacketId();
+        _streamBuf[pos++] = (uint8_t)(_streamPacketId >> 8);
+        _streamBuf[pos++] = (uint8_t)_streamPacketId;
+    }
+    if (v5) {
+        if (alias != 0) {
+            const uint8_t props[] = {0x03, MQTT_PROP_TOPIC_ALIAS, 0x00, alias};
+            memcpy(_streamBuf + pos, props, sizeof(props));
+            pos += sizeof(props);
+        } else {
+            _streamBuf[pos++] = 0x00;
+        }
+    }
+    _streamAlias = alias;
+    _streamTopicOmitted = omitTopic;
+    _streamLen = pos + payloadLen;
+
+    _streamOk = true;
+    if (_streamDirect) {
+        // Packet lớn: gửi header ngay, payload đi thẳng từ write() ra socket
+        _streamOk = writePacket(_streamBuf, pos);
+        if (_streamOk && alias != 0) _aliases[alias - 1].announced = true;
+        pos = 0;
+    }
+    _streamPos = pos;
+    _streamRemaining = payloadLen;
+    _streamActive = true;
+    return true;
+}
+
+size_t MqttClient::write(uint8_t b) {
+    return write(&b, 1);
+}
+
+size_t MqttClient::write(const uint8_t* data, size_t len) {
+    if (!_streamActive) return 0;
+    if (len > _streamRemaining) len = _streamRemaining;
+    if (len == 0) return 0;
+
+    if (_streamDirect) {
+        _streamOk = _streamOk && writePacket(data, len);
+    } else {
+        memcpy(_streamBuf + _streamPos, data, len);
+        _streamPos += len;
+    }
+    _streamRemaining -= len;
+    return len;
+}
+
+bool MqttClient::endPublish() {
+    if (!_streamActive) return false;
+    _streamActive = false;
+
+    if (_streamRemaining != 0) {
+        Serial.printf("❌ [MqttClient] Publish ended with %u bytes missing\n", (unsigned)_streamRemaining);
+        if (_streamDirect) {
+            // Header đã báo độ dài khác -> stream MQTT hỏng, phải ngắt kết nối
+            _net->stop();
+            _state = MQTT_CONNECTION_LOST;
+        }
+        return false;
+    }
+    _publishCount++;
+    _publishBytes += _streamLen;
+    if (_streamDirect) {
+        return _streamOk;
+    }
+
+    bool written = writePacket(_streamBuf, _streamPos);
+    if (written && _streamAlias != 0) {
+        _aliases[_streamAlias - 1].announced = true;
+    }
+    if (_streamSlot == nullptr) {
+        return written;
+    }
+
+    // QoS 1: dù ghi socket lỗi vẫn giữ slot, sẽ gửi lại khi reconnect
+    uint32_t now = millis();
+    _streamSlot->used = true;
+    _streamSlot->packetId = _streamPacketId;
+    _streamSlot->len = (uint16_t)_streamPos;
+    _streamSlot->firstSentAt = now;
+    _streamSlot->lastSentAt = now;
+    _streamSlot->alias = _streamAlias;
+    _streamSlot->topicOmitted = _streamTopicOmitted;
+    _published++;
+    return true;
+}
+
+bool MqttClient::subscribe(const char* topic, uint8_t qos) {
+    if (!connected()) return false;
+
+    size_t topicLen = strlen(topic);
+    bool v5 = _protocol == MQTT_PROTOCOL_V5;
+    uint32_t remaining = 2 + (v5 ? 1 : 0) + 2 + topicLen + 1;
+    if (remaining + 5 > _bufferSize) return false;
+
+    uint8_t* p = _rxBuffer;
+    size_t pos = writeHeader(p, MQTT_PKT_SUBSCRIBE | 0x02, remaining);
+    uint16_t packetId = nextPacketId();
+    p[pos++] = (uint8_t)(packetId >> 8);
+    p[pos++] = (uint8_t)packetId;
+    if (v5) p[pos++] = 0x00;
+    p[pos++] = (uint8_t)(topicLen >> 8);
+    p[pos++] = (uint8_t)topicLen;
+    memcpy(p + pos, topic, topicLen);
+    pos += topicLen;
+    p[pos++] = qos;
+    return writePacket(p, pos);
+}
+
+uint8_t MqttClient::inflight() const {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < _window; i++) {
+        if (_slots[i].used) count++;
+    }
+    return count;
+}
+
+// ======= Receive =======
+bool MqttClient::readByte(uint8_t& b) {
+    uint32_t start = millis();
+    while (!_net->available()) {
+        if (millis() - start >= MQTT_SOCKET_TIMEOUT_MS || !_net->connected()) return false;
+        delay(1);
+    }
+    b = (uint8_t)_net->read();
+    return true;
+}
+
+bool MqttClient::readPacket(uint8_t& header, uint16_t& len) {
+    if (!readByte(header)) return false;
+
+    uint32_t remaining = 0;
+    uint32_t multiplier = 1;
+    uint8_t digit;
+    do {
+        if (!readByte(digit)) return false;
+        remaining += (digit & 0x7F) * multiplier;
+        multiplier *= 128;
+    } while ((digit & 0x80) && multiplier <= 128 * 128 * 128);
+
+    // Packet lớn hơn buffer -> đọc bỏ để không lệch stream
+    bool fits = remaining <= _bufferSize;
+    for (uint32_t i = 0; i < remaining; i++) {
+        if (!readByte(digit)) return false;
+        if (fits) _rxBuffer[i] = digit;
+    }
+    if (!fits) {
+        Serial.printf("⚠️ [MqttClient] Dropped %u-byte packet (buffer %u)\n", (unsigned)remaining, _bufferSize);
+        return false;
+    }
+    len = (uint16_t)remaining;
+    return true;
+}
+
+void MqttClient::handlePacket(uint8_t header, uint16_t len) {
+    switch (header & 0xF0) {
+        case MQTT_PKT_PUBLISH: {
+            if (len < 2) return;
+            uint8_t qos = (header >> 1) & 0x03;
+            uint16_t topicLen = (_rxBuffer[0] << 8) | _rxBuffer[1];
+            size_t offset = 2 + topicLen;
+            if (offset + (qos > 0 ? 2 : 0) > len) return;
+
+            if (qos > 0) {
+                uint16_t packetId = (_rxBuffer[offset] << 8) | _rxBuffer[offset + 1];
+                offset += 2;
+                const uint8_t puback[] = {MQTT_PKT_PUBACK, 0x02, (uint8_t)(packetId >> 8), (uint8_t)packetId};
+                writePacket(puback, sizeof(puback));
+                if ((header & MQTT_FLAG_DUP) && isRecentId(packetId)) {
+                    _dupDropped++;
+                    return;
+                }
+                _recentIds[_recentPos] = packetId;
+                _recentPos = (_recentPos + 1) % MQTT_RECENT_IDS;
+            }
+            if (_protocol == MQTT_PROTOCOL_V5) {
+                // Bỏ qua property (client không khai báo topic alias cho chiều broker -> thiết bị)
+                uint32_t propsLen;
+                if (!readVarInt(_rxBuffer, len, offset, propsLen) || offset + propsLen > len) return;
+                offset += propsLen;
+            }
+
+            // Dời topic lên 1 byte để có chỗ cho '\0' (payload phía sau giữ nguyên)
+            memmove(_rxBuffer + 1, _rxBuffer + 2, topicLen);
+            _rxBuffer[1 + topicLen] = '\0';
+            if (callback) {
+                callback((char*)_rxBuffer + 1, _rxBuffer + offset, len - offset);
+            }
+            break;
+        }
+        case MQTT_PKT_PUBACK:
+            if (len >= 2) {
+                handlePuback((_rxBuffer[0] << 8) | _rxBuffer[1]);
+            }
+            break;
+        case MQTT_PKT_PINGRESP:
+            _pingOutstanding = false;
+            break;
+        default:
+            // CONNACK / SUBACK: không cần xử lý thêm
+            break;
+    }
+}
+
+bool MqttClient::waitForPacket(uint8_t type, uint32_t timeoutMs, uint16_t& len) {
+    uint32_t start = millis();
+    uint8_t header;
+    while (millis() - start < timeoutMs) {
+        if (!_net->available()) {
+            if (!_net->connected()) return false;
+            delay(10);
+            continue;
+        }
+        if (!readPacket(header, len)) return false;
+        if ((header & 0xF0) == type) return true;
+        handlePacket(header, len);
+    }
+    return false;
+}
+
+void MqttClient::handlePuback(uint16_t packetId) {
+    for (uint8_t i = 0; i < _window; i++) {
+        if (_slots[i].used && _slots[i].packetId == packetId) {
+            _slots[i].used = false;
+            _acked++;
+            _ackTimeTotal += millis() - _slots[i].firstSentAt;
+            return;
+        }
+    }
+    // PUBACK trễ cho packet đã được gửi lại và ack trước đó -> bỏ qua
+}
+
+bool MqttClient::isRecentId(uint16_t packetId) const {
+    for (uint8_t i = 0; i < MQTT_RECENT_IDS; i++) {
+        if (_recentIds[i] == packetId) return true;
+    }
+    return false;
+}
+
+// ======= Send Helpers =======
+size_t MqttClient::writeHeader(uint8_t* buf, uint8_t header, uint32_t remaining) {
+    size_t pos = 0;
+    buf[pos++] = header;
+    do {
+        uint8_t digit = remaining % 128;
+        remaining /= 128;
+        if (remaining > 0) digit |= 0x80;
+        buf[pos++] = digit;
+    } while (remaining > 0);
+    return pos;
+}
+
+bool MqttClient::writePacket(const uint8_t* buf, size_t len) {
+    size_t written = _net->write(buf, len);
+    _lastOutActivity = millis();
+    _bytesSent += written;
+    return written == len;
+}
+
+void MqttClient::retransmit(InflightSlot& slot) {
+    slot.data[0] |= MQTT_FLAG_DUP;
+    // Alias chỉ hợp lệ nếu CONNACK của kết nối hiện tại còn cho phép số đó
+    bool aliasAllowed = slot.alias != 0 && slot.alias <= _aliasMax;
+    if (slot.topicOmitted && (!aliasAllowed || !_aliases[slot.alias - 1].announced)) {
+        retransmitWithTopic(slot);
+    } else if (slot.alias != 0 && !aliasAllowed) {
+        retransmitWithoutAlias(slot);
+    } else {
+        writePacket(slot.data, slot.len);
+        if (slot.alias != 0) _aliases[slot.alias - 1].announced = true;
+    }
+    slot.lastSentAt = millis();
+    _retransmits++;
+}
+
+void MqttClient::retransmitWithTopic(InflightSlot& slot) {
+    // Packet chỉ mang alias của kết nối trước -> chèn lại topic đầy đủ.
+    // Layout trong slot: [header][remaining][00 00][packet id][03 23 00 alias][payload]
+    size_t headerLen = 1;
+    uint32_t remaining = 0;
+    uint8_t digit;
+    uint8_t shift = 0;
+    do {
+        digit = slot.data[headerLen++];
+        remaining |= (uint32_t)(digit & 0x7F) << shift;
+        shift += 7;
+    } while (digit & 0x80);
+
+    TopicAlias& entry = _aliases[slot.alias - 1];
+    size_t topicLen = strlen(entry.topic);
+    const uint8_t* packetId = slot.data + headerLen + 2;
+    const uint8_t* payload = packetId + 2 + 4;
+    size_t payloadLen = slot.len - (payload - slot.data);
+    // Broker mới không cho alias -> gửi bản không có property alias
+    bool keepAlias = slot.alias <= _aliasMax;
+
+    uint8_t head[5 + 2 + MQTT_ALIAS_TOPIC_LEN];
+    size_t pos = writeHeader(head, slot.data[0], remaining + topicLen - (keepAlias ? 0 : 3));
+    head[pos++] = (uint8_t)(topicLen >> 8);
+    head[pos++] = (uint8_t)topicLen;
+    memcpy(head + pos, entry.topic, topicLen);
+    pos += topicLen;
+    writePacket(head, pos);
+    writePacket(packetId, 2);
+    if (keepAlias) {
+        writePacket(packetId + 2, 4);
+        entry.announced = true;
+    } else {
+        const uint8_t noProps = 0x00;
+        writePacket(&noProps, 1);
+    }
+    writePacket(payload, payloadLen);
+}
+
+void MqttClient::retransmitWithoutAlias(InflightSlot& slot) {
+    // Packet có cả topic lẫn alias nhưng broker mới cho ít alias hơn -> bỏ property alias.
+    // Layout trong slot: [header][remaining][topic len][topic][packet id][03 23 00 alias][payload]
+    size_t headerLen = 1;
+    uint32_t remaining = 0;
+    uint8_t digit;
+    uint8_t shift = 0;
+    do {
+        digit = slot.data[headerLen++];
+        remaining |= (uint32_t)(digit & 0x7F) << shift;
+        shift += 7;
+    } while (digit & 0x80);
+
+    const uint8_t* topicAndId = slot.data + headerLen;
+    size_t topicLen = ((size_t)topicAndId[0] << 8) | topicAndId[1];
+    size_t topicAndIdLen = 2 + topicLen + 2;
+    const uint8_t* payload = topicAndId + topicAndIdLen + 4;
+    size_t payloadLen = slot.len - (payload - slot.data);
+
+    uint8_t head[5];
+    size_t pos = writeHeader(head, slot.data[0], remaining - 3);
+    writePacket(head, pos);
+    writePacket(topicAndId, topicAndIdLen);
+    const uint8_t noProps = 0x00;
+    writePacket(&noProps, 1);
+    writePacket(payload, payloadLen);
+}
+
+uint8_t MqttClient::topicAlias(const char* topic) {
+    for (uint8_t i = 0; i < _aliasCount; i++) {
+        if (strcmp(_aliases[i].topic, topic) == 0) {
+            return i + 1 <= _aliasMax ? i + 1 : 0;
+        }
+    }
+    // Gán alias mới nếu broker còn cho phép; bảng không bị thay thế nên alias của 1 topic luôn cố định
+    size_t topicLen = strlen(topic);
+    if (_aliasCount >= MQTT_MAX_TOPIC_ALIASES || _aliasCount >= _aliasMax ||
+        topicLen == 0 || topicLen >= MQTT_ALIAS_TOPIC_LEN) {
+        return 0;
+    }
+    TopicAlias& entry = _aliases[_aliasCount++];
+    memcpy(entry.topic, topic, topicLen + 1);
+    entry.announced = false;
+    return _aliasCount;
+}
+
+void MqttClient::retransmitExpired(uint32_t now) {
+    for (uint8_t i = 0; i < _window; i++) {
+        if (_slots[i].used && now - _slots[i].lastSentAt >= MQTT_RETRY_INTERVAL_MS) {
+            retransmit(_slots[i]);
+        }
+    }
+}
+
+uint16_t MqttClient::nextPacketId() {
+    // Packet id != 0 và không trùng message đang chờ PUBACK
+    while (true) {
+        if (++_lastPacketId == 0) _lastPacketId = 1;
+        bool inUse = false;
+        for (uint8_t i = 0; i < _window; i++) {
+            if (_slots[i].used && _slots[i].packetId == _lastPacketId) {
+                inUse = true;
+                break;
+            }
+        }
+        if (!inUse) return _lastPacketId;
+    }
+}
+
+int MqttClient::acquireSlot() {
+    // Window đầy -> xử lý PUBACK đang tới trong tối đa MQTT_INFLIGHT_WAIT_MS
+    int index = freeSlot();
+    uint32_t start = millis();
+    while (index < 0 && millis() - start < MQTT_INFLIGHT_WAIT_MS && connected()) {
+        uint8_t header;
+        uint16_t len;
+        if (_net->available() && readPacket(header, len)) {
+            _lastInActivity = millis();
+            handlePacket(header, len);
+        } else {
+            delay(1);
+        }
+        index = freeSlot();
+    }
+    if (index < 0) {
+        _windowFull++;
+    }
+    return index;
+}
+
+int MqttClient::freeSlot() const {
+    for (uint8_t i = 0; i < _window; i++) {
+        if (!_slots[i].used) return i;
+    }
+    return -1;
+}
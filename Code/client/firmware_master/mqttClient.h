@@ -0,0 +1,229 @@
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include <functional>
+
+// ======= MQTT Client Configuration =======
+#define MQTT_DEFAULT_BUFFER_SIZE    256
+#define MQTT_DEFAULT_KEEPALIVE      15      // giây (giống PubSubClient)
+#define MQTT_SOCKET_TIMEOUT_MS      15000
+#define MQTT_DEFAULT_INFLIGHT       4       // Số QoS 1 publish chờ PUBACK cùng lúc
+#define MQTT_MAX_INFLIGHT           8
+#define MQTT_RETRY_ON_LIVE_V311     0       // 1 = MQTT 3.1.1 gửi lại (DUP) cả khi kết nối còn sống
+#define MQTT_RETRY_INTERVAL_MS      10000   // Chỉ dùng khi MQTT_RETRY_ON_LIVE_V311 = 1
+#define MQTT_INFLIGHT_WAIT_MS       100     // Window đầy -> chờ PUBACK tối đa trước khi báo lỗi
+#define MQTT_RECENT_IDS             8       // Số packet id QoS 1 nhận gần nhất để lọc bản DUP
+#define MQTT_MAX_TOPIC_ALIASES      16      // Số topic alias tối đa client tự gán (MQTT 5)
+#define MQTT_ALIAS_TOPIC_LEN        64      // Topic dài hơn thì không dùng alias
+
+// ======= Protocol Version =======
+#define MQTT_PROTOCOL_V311           4
+#define MQTT_PROTOCOL_V5             5
+
+// ======= Connection State (giữ giá trị giống PubSubClient::state()) =======
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED               0
+#define MQTT_CONNECT_BAD_PROTOCOL    1
+#define MQTT_CONNECT_BAD_CLIENT_ID   2
+#define MQTT_CONNECT_UNAVAILABLE     3
+#define MQTT_CONNECT_BAD_CREDENTIALS 4
+#define MQTT_CONNECT_UNAUTHORIZED    5
+
+// ======= Packet Types =======
+#define MQTT_PKT_CONNECT     0x10
+#define MQTT_PKT_CONNACK     0x20
+#define MQTT_PKT_PUBLISH     0x30
+#define MQTT_PKT_PUBACK      0x40
+#define MQTT_PKT_SUBSCRIBE   0x80
+#define MQTT_PKT_SUBACK      0x90
+#define MQTT_PKT_PINGREQ     0xC0
+#define MQTT_PKT_PINGRESP    0xD0
+#define MQTT_PKT_DISCONNECT  0xE0
+
+#define MQTT_FLAG_DUP        0x08
+#define MQTT_FLAG_QOS1       0x02
+#define MQTT_FLAG_RETAIN     0x01
+
+// ======= MQTT 5 Properties =======
+#define MQTT_PROP_TOPIC_ALIAS_MAX   0x22
+#define MQTT_PROP_TOPIC_ALIAS       0x23
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+// ======= MQTT Client =======
+/**
+ * Client MQTT 3.1.1 tối giản thay cho PubSubClient (vốn chỉ publish được QoS 0).
+ *
+ * - publish QoS 0 / QoS 1. Với QoS 1, packet được giữ trong in-flight window
+ *   (tối đa MQTT_MAX_INFLIGHT) cho tới khi nhận PUBACK đúng packet id.
+ * - Chỉ gửi lại sau khi reconnect, không gửi lại trên kết nối còn sống
+ *   (MQTT 5 cấm [MQTT-4.4.0-1]). CONNECT dùng clean start nên broker không giữ
+ *   session: bản gửi lại là publish mới trên phiên mới (vẫn cờ DUP + packet id
+ *   cũ để phía nhận lọc trùng), không phải resume session.
+ * - MQTT_RETRY_ON_LIVE_V311 = 1 bật lại timer MQTT_RETRY_INTERVAL_MS, chỉ áp
+ *   dụng cho MQTT 3.1.1.
+ * - QoS 1 nhận từ broker: trả PUBACK, bản DUP của packet id vừa nhận thì bỏ qua.
+ * - Streaming publish (beginPublish / write / print / endPublish): payload ghi
+ *   thẳng vào slot in-flight hoặc socket, không cần ghép String hay buffer riêng.
+ *   Packet lớn hơn buffer vẫn gửi được (stream thẳng ra socket, QoS 0).
+ * - MQTT 5: mỗi topic publish được gán 1 topic alias (trong giới hạn broker báo
+ *   ở CONNACK). Lần đầu gửi topic + alias, các lần sau topic rỗng + alias 2 byte.
+ *   Alias chỉ sống trong 1 kết nối nên message gửi lại sau reconnect kèm lại topic.
+ *
+ * API giữ giống PubSubClient (setServer / connect / loop / state...) để
+ * MQTTProtocol đổi sang ít thay đổi nhất.
+ */
+class MqttClient : public Print {
+public:
+    explicit MqttClient(Client& net);
+    ~MqttClient();
+
+    void setServer(const char* host, uint16_t port);
+    // Đổi transport (vd. TlsClient cho mqtts), áp dụng từ lần connect() sau
+    void setClient(Client& net);
+    void setCallback(MQTT_CALLBACK_SIGNATURE);
+    void setKeepAlive(uint16_t seconds) { _keepAliveSec = seconds; }
+    // Không đổi thì không cấp phát lại. Message đang chờ PUBACK được giữ lại;
+    // trả false (giữ cấu hình cũ) nếu chúng không vừa buffer / window mới
+    bool setBufferSize(uint16_t size);
+    bool setInflightWindow(uint8_t window);
+    // MQTT_PROTOCOL_V5 / MQTT_PROTOCOL_V311, áp dụng từ lần connect() sau.
+    // Đổi version sẽ xóa các message đang chờ PUBACK (packet đã encode theo version cũ)
+    void setProtocolVersion(uint8_t version);
+    uint8_t getProtocolVersion() const { return _protocol; }
+    uint16_t getTopicAliasMax() const { return _aliasMax; }     // Broker cho phép, 0 = không dùng alias
+
+    bool connect(const char* clientId);
+    void disconnect();
+    bool connected();
+    int state() const { return _state; }
+    bool loop();
+
+    bool publish(const char* topic, const uint8_t* payload, size_t len, bool retained, uint8_t qos = 0);
+    bool publish(const char* topic, const char* payload, bool retained, uint8_t qos = 0);
+    bool subscribe(const char* topic, uint8_t qos = 0);
+
+    // ======= Streaming Publish =======
+    // beginPublish() -> write()/print() đúng payloadLen byte -> endPublish().
+    // QoS 1 mà packet không vừa 1 slot in-flight sẽ bị hạ xuống QoS 0.
+    bool beginPublish(const char* topic, size_t payloadLen, bool retained, uint8_t qos = 0);
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t* data, size_t len) override;
+    bool endPublish();
+
+    uint16_t getBufferSize() const { return _bufferSize; }
+    uint8_t getInflightWindow() const { return _window; }
+    uint8_t inflight() const;
+
+    // ======= Metrics =======
+    uint32_t getPublished() const { return _published; }          // QoS 1 đã gửi lần đầu
+    uint32_t getAcked() const { return _acked; }
+    uint32_t getRetransmits() const { return _retransmits; }
+    uint32_t getDuplicatesDropped() const { return _dupDropped; }  // Bản DUP nhận từ broker bị bỏ
+    uint32_t getWindowFull() const { return _windowFull; }         // Publish bị từ chối vì window đầy
+    uint32_t getAvgAckMs() const { return _acked ? _ackTimeTotal / _acked : 0; }
+    uint32_t getDowngraded() const { return _downgraded; }      // QoS 1 quá lớn, gửi QoS 0
+    uint32_t getPublishCount() const { return _publishCount; }  // Mọi PUBLISH gửi lần đầu (QoS 0 + 1)
+    uint32_t getPublishBytes() const { return _publishBytes; }  // Byte MQTT của các PUBLISH đó
+    uint32_t getBytesSent() const { return _bytesSent; }        // Toàn bộ byte ghi ra socket
+
+    MqttClient(const MqttClient&) = delete;
+    MqttClient& operator=(const MqttClient&) = delete;
+
+private:
+    struct InflightSlot {
+        bool used;
+        uint16_t packetId;
+        uint16_t len;
+        uint32_t firstSentAt;
+        uint32_t lastSentAt;
+        uint8_t* data;          // Packet PUBLISH đã encode (nằm trong _inflightPool)
+        uint8_t alias;          // Topic alias đã dùng (0 = không)
+        bool topicOmitted;      // Packet chỉ có alias, không có topic
+    };
+
+    struct TopicAlias {
+        char topic[MQTT_ALIAS_TOPIC_LEN];
+        bool announced;         // Broker đã biết alias này trong kết nối hiện tại
+    };
+
+    bool allocBuffers();
+    bool resizeBuffers(uint16_t size, uint8_t window);
+    void freeBuffers();
+    void resetInflight();
+
+    bool readByte(uint8_t& b);
+    bool readPacket(uint8_t& header, uint16_t& len);
+    void handlePacket(uint8_t header, uint16_t len);
+    bool waitForPacket(uint8_t type, uint32_t timeoutMs, uint16_t& len);
+    bool handleConnack(uint16_t len);
+    void handlePuback(uint16_t packetId);
+    bool isRecentId(uint16_t packetId) const;
+
+    size_t writeHeader(uint8_t* buf, uint8_t header, uint32_t remaining);
+    bool writePacket(const uint8_t* buf, size_t len);
+    void retransmit(InflightSlot& slot);
+    void retransmitWithTopic(InflightSlot& slot);
+    void retransmitWithoutAlias(InflightSlot& slot);
+    uint8_t topicAlias(const char* topic);
+    void retransmitExpired(uint32_t now);
+    uint16_t nextPacketId();
+    int freeSlot() const;
+    int acquireSlot();
+
+    Client* _net;
+    String _host;
+    uint16_t _port;
+    MQTT_CALLBACK_SIGNATURE;
+
+    uint8_t* _rxBuffer;
+    uint8_t* _inflightPool;
+    uint16_t _bufferSize;
+    uint8_t _window;
+    InflightSlot _slots[MQTT_MAX_INFLIGHT];
+
+    uint16_t _keepAliveSec;
+    uint32_t _lastInActivity;
+    uint32_t _lastOutActivity;
+    bool _pingOutstanding;
+    int _state;
+    uint16_t _lastPacketId;
+    uint16_t _recentIds[MQTT_RECENT_IDS];
+    uint8_t _recentPos;
+
+    uint8_t _protocol;
+    uint16_t _aliasMax;
+    TopicAlias _aliases[MQTT_MAX_TOPIC_ALIASES];
+    uint8_t _aliasCount;
+
+    // Streaming publish đang mở
+    bool _streamActive;
+    bool _streamDirect;         // true: payload ghi thẳng ra socket (packet lớn hơn buffer)
+    bool _streamOk;
+    uint8_t* _streamBuf;        // Slot in-flight (QoS 1) hoặc _rxBuffer (QoS 0)
+    InflightSlot* _streamSlot;
+    size_t _streamPos;
+    size_t _streamRemaining;
+    uint16_t _streamPacketId;
+    uint8_t _streamAlias;
+    bool _streamTopicOmitted;
+    size_t _streamLen;
+
+    uint32_t _published;
+    uint32_t _acked;
+    uint32_t _retransmits;
+    uint32_t _dupDropped;
+    uint32_t _windowFull;
+    uint32_t _ackTimeTotal;
+    uint32_t _downgraded;
+    uint32_t _publishCount;
+    uint32_t _publishBytes;
+    uint32_t _bytesSent;
+};
+
+#endif
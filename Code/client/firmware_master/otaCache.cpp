@@ -0,0 +1,403 @@
+#include "otaCache.h"
+#include "httpPool.h"
+#include "serviceDiscovery.h"
+#include "settings.h"
+#include <ArduinoJson.h>
+#include <esp_image_format.h>
+#include <new>
+
+OtaCache::OtaCache()
+    : _server(OTA_CACHE_PORT), _task(NULL), _mutex(NULL), _partition(nullptr), _sharesOtaSlot(false), _serving(0),
+      _valid(false), _verified(false), _abort(false), _refresh(false),
+      _size(0), _firstByte(0), _lastCheck(0), _announced(false),
+      _syncs(0), _wanBytes(0), _served(0), _lanBytes(0) {
+}
+
+void OtaCache::begin(const String& clientId) {
+    if (_task != NULL) {
+        return;
+    }
+    _clientId = clientId;
+    _mutex = xSemaphoreCreateMutex();
+    _partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                          (esp_partition_subtype_t)OTA_CACHE_PARTITION_SUBTYPE, OTA_CACHE_PARTITION);
+#if OTA_CACHE_USE_OTA_SLOT
+    if (_partition == nullptr) {
+        _partition = esp_ota_get_next_update_partition(NULL);
+        _sharesOtaSlot = _partition != nullptr && _partition != esp_ota_get_running_partition();
+        if (_sharesOtaSlot) {
+            Serial.println("⚠️ [OTA Cache] Using the spare OTA partition: master rollback disabled");
+        } else {
+            _partition = nullptr;
+        }
+    }
+#endif
+    if (_mutex == NULL || _partition == nullptr) {
+        Serial.println("❌ [OTA Cache] No \"" OTA_CACHE_PARTITION "\" partition (partitions.csv), cache disabled");
+        return;
+    }
+    if (_partition->size < OTA_CACHE_SLAVE_SLOT) {
+        Serial.printf("⚠️ [OTA Cache] Partition %s is %u B, slave images above that are not cached\n",
+                      _partition->label, _partition->size);
+    }
+    loadMeta();
+
+    const char* headerKeys[] = {"Range", "If-Range"};
+    _server.collectHeaders(headerKeys, 2);
+    _server.on(OTA_CACHE_PATH, HTTP_GET, [this]() { handleImage(); });
+    _server.onNotFound([this]() { _server.send(404, "text/plain", "Not found"); });
+    _server.begin();
+
+    xTaskCreatePinnedToCore(cacheTask, "OtaCacheTask", OTA_CACHE_TASK_STACK, this, 1, &_task, 0);
+    Serial.printf("📦 [OTA Cache] Serving on :%d%s from partition %s\n",
+                  OTA_CACHE_PORT, OTA_CACHE_PATH, _partition->label);
+}
+
+void OtaCache::refresh() {
+    _refresh = true;
+}
+
+void OtaCache::invalidate() {
+    if (_sharesOtaSlot) {
+        drop();
+    }
+}
+
+void OtaCache::drop() {
+    if (_mutex == NULL) {
+        return;
+    }
+    _abort = true;          // sync() đang chạy dừng ở block kế tiếp
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    bool wasValid = _valid;
+    _valid = false;
+    _version = "";
+    _sha256 = "";
+    saveMeta();
+    xSemaphoreGive(_mutex);
+    if (wasValid) {
+        Serial.println("⚠️ [OTA Cache] Cached slave image dropped");
+    }
+}
+
+void OtaCache::cacheTask(void* parameter) {
+    OtaCache* cache = (OtaCache*)parameter;
+    while (true) {
+        cache->_server.handleClient();
+        if (!cache->_verified) {
+            // Ảnh trong flash có thể đã hỏng / bị ghi dở khi mất điện -> hash lại 1 lần trước khi phục vụ
+            cache->_verified = true;
+            if (cache->_valid && !cache->verifyStored()) {
+                cache->drop();
+                cache->_abort = false;
+            }
+        }
+        bool due = cache->_lastCheck == 0 || millis() - cache->_lastCheck >= OTA_CACHE_CHECK_MS;
+        if ((due || cache->_refresh) && WiFiStation::getInstance().isConnected()) {
+            cache->_refresh = false;
+            cache->_lastCheck = millis();
+            cache->check();
+        }
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+}
+
+void OtaCache::check() {
+    OTAUpdate& ota = OTAUpdate::getInstance();
+    String version, url, sha256, signature;
+    if (ota.isUpdateInProgress() || !ota.getSlaveImage(version, url, sha256, signature)) {
+        return;
+    }
+    if (_valid && version == _version && sha256.equalsIgnoreCase(_sha256)) {
+        announce(true);         // Báo lại để backend không hết hạn (OTA_CACHE_TTL_S)
+        return;
+    }
+    if (sha256.length() == 0) {
+        // Slave không kiểm tra được ảnh lấy từ master -> không cache
+        Serial.println("⚠️ [OTA Cache] Slave image has no sha256 in manifest, not caching");
+        if (_announced) announce(false);
+        return;
+    }
+    if (_sharesOtaSlot && ota.hasPendingDownload()) {
+        // Partition đang giữ phần master tải dở, để dành cho lần tải tiếp
+        Serial.println("⏸️ [OTA Cache] Master download pending, cache postponed");
+        return;
+    }
+
+    if (_valid || _announced) {
+        drop();
+        announce(false);
+    }
+    _abort = false;
+    bool ok = sync(version, url, sha256, signature);
+    _abort = false;
+    if (ok) {
+        announce(true);
+    }
+}
+
+bool OtaCache::sync(const String& version, const String& url, const String& sha256, const String& signature) {
+    Serial.printf("📥 [OTA Cache] Caching slave %s from %s\n", version.c_str(), url.c_str());
+    HttpLease lease(url);
+    HTTPClient& http = lease.http();
+    int httpCode = lease.GET();
+    if (httpCode != HTTP_CODE_OK) {
+        Serial.printf("❌ [OTA Cache] HTTP error: %d\n", httpCode);
+        return false;
+    }
+    int size = http.getSize();
+    if (size <= 0 || (uint32_t)size > _partition->size) {
+        Serial.printf("❌ [OTA Cache] Bad image size %d (partition %u B)\n", size, _partition->size);
+        return false;
+    }
+
+    uint8_t* buf = (uint8_t*)malloc(OTA_CACHE_BLOCK);
+    if (buf == nullptr) {
+        Serial.println("❌ [OTA Cache] Not enough memory");
+        return false;
+    }
+    OtaVerifier verifier;
+    verifier.begin();
+    WiFiClient* stream = http.getStreamPtr();
+    uint8_t firstByte = 0;
+    uint32_t start = millis();
+    const char* error = nullptr;
+
+    for (uint32_t offset = 0; offset < (uint32_t)size && error == nullptr; offset += OTA_CACHE_BLOCK) {
+        size_t want = min((size_t)OTA_CACHE_BLOCK, (size_t)(size - offset));
+        size_t filled = 0;
+        uint32_t lastData = millis();
+        while (filled < want && millis() - lastData < OTA_CACHE_STALL_MS) {
+            size_t n = stream->readBytes(buf + filled, want - filled);
+            if (n > 0) {
+                filled += n;
+                lastData = millis();
+            } else if (!http.connected()) {
+                break;
+            }
+        }
+        if (filled < want) {
+            error = "Connection lost";
+            break;
+        }
+        verifier.update(buf, filled);       // Hash ảnh gốc, trước khi giấu byte đầu
+        if (offset == 0) {
+            if (buf[0] != ESP_IMAGE_HEADER_MAGIC) {
+                error = "Not a firmware image";
+                break;
+            }
+            firstByte = buf[0];
+            buf[0] = OTA_CACHE_HIDDEN_MAGIC;
+        }
+
+        xSemaphoreTake(_mutex, portMAX_DELAY);
+        if (_abort || (_sharesOtaSlot && OTAUpdate::getInstance().isUpdateInProgress())) {
+            error = "Aborted by master update";
+        } else if (esp_partition_erase_range(_partition, offset, OTA_CACHE_BLOCK) != ESP_OK ||
+                   esp_partition_write(_partition, offset, buf, filled) != ESP_OK) {
+            error = "Flash write failed";
+        }
+        xSemaphoreGive(_mutex);
+        _wanBytes += filled;
+        _server.handleClient();             // Trả 503 cho slave hỏi trong lúc tải
+    }
+    free(buf);
+    lease.release(error == nullptr);
+
+    if (error == nullptr && !verifier.verify(sha256, signature)) {
+        error = verifier.error();
+    }
+    if (error != nullptr) {
+        Serial.printf("❌ [OTA Cache] %s\n", error);
+        return false;
+    }
+
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    if (!_abort) {
+        _version = version;
+        _sha256 = sha256;
+        _signature = signature;
+        _size = size;
+        _firstByte = firstByte;
+        _valid = true;
+        saveMeta();
+    }
+    bool ok = _valid;
+    xSemaphoreGive(_mutex);
+    if (ok) {
+        _syncs++;
+        Serial.printf("✅ [OTA Cache] Slave %s cached (%d B in %lu ms)\n", version.c_str(), size, millis() - start);
+    }
+    return ok;
+}
+
+bool OtaCache::verifyStored() {
+    uint8_t* buf = (uint8_t*)malloc(OTA_CACHE_BLOCK);
+    if (buf == nullptr) {
+        return false;
+    }
+    OtaVerifier verifier;
+    verifier.begin();
+    bool readOk = true;
+    for (uint32_t offset = 0; offset < _size && readOk; offset += OTA_CACHE_BLOCK) {
+        size_t n = min((size_t)OTA_CACHE_BLOCK, (size_t)(_size - offset));
+        xSemaphoreTake(_mutex, portMAX_DELAY);
+        readOk = !_abort && esp_partition_read(_partition, offset, buf, n) == ESP_OK;
+        xSemaphoreGive(_mutex);
+        if (offset == 0) buf[0] = _firstByte;
+        if (readOk) verifier.update(buf, n);
+    }
+    free(buf);
+    if (!readOk || !verifier.verify(_sha256, _signature)) {
+        Serial.printf("❌ [OTA Cache] Stored slave %s invalid: %s\n",
+                      _version.c_str(), readOk ? verifier.error() : "read failed");
+        return false;
+    }
+    Serial.printf("✅ [OTA Cache] Stored slave %s verified\n", _version.c_str());
+    return true;
+}
+
+// Slave tải ảnh từ master; Range "bytes=N-" để slave tải tiếp sau khi mất kết nối.
+// Chỉ gửi header ở đây, body do serveTask gửi để cacheTask quay lại handleClient() ngay
+void OtaCache::handleImage() {
+    if (!_valid) {
+        _server.send(503, "text/plain", "Cache not ready");
+        return;
+    }
+    if (_serving >= OTA_CACHE_MAX_SERVES) {
+        _server.sendHeader("Retry-After", "5");
+        _server.send(503, "text/plain", "Busy");
+        return;
+    }
+    String etag = "\"" + _sha256 + "\"";
+    uint32_t start = 0;
+    String range = _server.header("Range");
+    String ifRange = _server.header("If-Range");
+    if (range.startsWith("bytes=") && (ifRange.length() == 0 || ifRange == etag)) {
+        start = range.substring(6).toInt();
+    }
+    if (start >= _size) {
+        _server.sendHeader("Content-Range", "bytes */" + String(_size));
+        _server.send(416, "text/plain", "Range not satisfiable");
+        return;
+    }
+
+    _server.setContentLength(_size - start);
+    _server.sendHeader("ETag", etag);
+    _server.sendHeader("Accept-Ranges", "bytes");
+    if (start > 0) {
+        _server.sendHeader("Content-Range",
+                           "bytes " + String(start) + "-" + String(_size - 1) + "/" + String(_size));
+        _server.send(206, "application/octet-stream", "");
+    } else {
+        _server.send(200, "application/octet-stream", "");
+    }
+
+    ServeJob* job = new (std::nothrow) ServeJob{_server.client(), start};
+    if (job == nullptr) {
+        return;                 // Slave thấy body thiếu và tải tiếp / quay về link gốc
+    }
+    _serving++;
+    if (xTaskCreatePinnedToCore(serveTask, "OtaCacheServe", OTA_CACHE_SERVE_STACK, job, 1, NULL, 0) != pdPASS) {
+        _serving--;
+        delete job;
+    }
+}
+
+void OtaCache::serveTask(void* parameter) {
+    ServeJob* job = (ServeJob*)parameter;
+    OtaCache& cache = OtaCache::getInstance();
+    cache.serve(job->client, job->start);
+    job->client.stop();
+    delete job;
+    cache._serving--;
+    vTaskDelete(NULL);
+}
+
+void OtaCache::serve(WiFiClient& client, uint32_t start) {
+    uint8_t* buf = (uint8_t*)malloc(OTA_CACHE_BLOCK);
+    if (buf == nullptr) {
+        return;
+    }
+    uint32_t offset = start;
+    while (offset < _size && client.connected()) {
+        size_t n = min((size_t)OTA_CACHE_BLOCK, (size_t)(_size - offset));
+        xSemaphoreTake(_mutex, portMAX_DELAY);
+        bool ok = _valid && esp_partition_read(_partition, offset, buf, n) == ESP_OK;
+        xSemaphoreGive(_mutex);
+        if (!ok) {
+            break;              // Ảnh bị bỏ giữa chừng (re-sync / master update)
+        }
+        if (offset == 0) buf[0] = _firstByte;
+        if (client.write(buf, n) != n) {
+            break;
+        }
+        offset += n;
+    }
+    free(buf);
+    xSemaphoreTake(_mutex, portMAX_DELAY);
+    _served++;
+    _lanBytes += offset - start;
+    xSemaphoreGive(_mutex);
+    Serial.printf("📤 [OTA Cache] Served slave %s: %u/%u B\n", _version.c_str(), offset - start, _size - start);
+}
+
+// Backend (app/services/ota_cache.py) ghép IP public của request này với slave cùng site
+void OtaCache::announce(bool available) {
+    StaticJsonDocument<256> doc;
+    doc["version"] = available ? _version : String();     // Rỗng = backend bỏ cache
+    doc["sha256"] = available ? _sha256 : String();
+    doc["ip"] = WiFi.localIP().toString();
+    doc["port"] = OTA_CACHE_PORT;
+    String body;
+    serializeJson(doc, body);
+
+    String url = ServiceDiscovery::getInstance().url(OTA_CACHE_ANNOUNCE_PATH);
+    HttpLease lease(url);
+    HTTPClient& http = lease.http();
+    http.addHeader("Content-Type", "application/json");
+    http.addHeader("Authorization", "Bearer " + _clientId);
+    int httpCode = http.POST(body);
+    if (httpCode == HTTP_CODE_OK) {
+        _announced = available;
+        http.getString();
+        lease.release(true);
+    } else {
+        Serial.printf("⚠️ [OTA Cache] Announce failed: HTTP %d\n", httpCode);
+    }
+}
+
+void OtaCache::loadMeta() {
+    Settings meta("ota_cache", false);
+    _version   = meta.getString("ver");
+    _sha256    = meta.getString("sha");
+    _signature = meta.getString("sig");
+    _size      = meta.getInt("size");
+    _firstByte = meta.getInt("first");
+    // Master đã update (partition đổi vai) hoặc ghi đè -> meta không còn đúng
+    _valid = _version.length() > 0 && _size > 0 && _size <= _partition->size &&
+             (uint32_t)meta.getInt("part") == _partition->address;
+}
+
+void OtaCache::saveMeta() {
+    Settings meta("ota_cache", true);
+    if (!_valid) {
+        meta.eraseAll();
+        return;
+    }
+    meta.setString("ver", _version);
+    meta.setString("sha", _sha256);
+    meta.setString("sig", _signature);
+    meta.setInt("size", _size);
+    meta.setInt("first", _firstByte);
+    meta.setInt("part", _partition->address);
+}
+
+void OtaCache::printStats() {
+    Serial.println("=== OTA Cache Stats ===");
+    Serial.printf("Cached slave: %s (%u B)\n", _valid ? _version.c_str() : "none", _valid ? _size : 0);
+    Serial.printf("Announced: %s\n", _announced ? "yes" : "no");
+    Serial.printf("Syncs: %u, WAN: %u B\n", _syncs, _wanBytes);
+    Serial.printf("Served: %u, LAN: %u B\n", _served, _lanBytes);
+    Serial.println("=======================");
+}
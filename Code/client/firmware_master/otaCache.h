@@ -0,0 +1,113 @@
+#ifndef OTA_CACHE_H
+#define OTA_CACHE_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WebServer.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "OTAUpdate.h"
+#include "otaVerify.h"
+
+// ======= OTA Cache Configuration =======
+#define OTA_CACHE_PORT          8080
+#define OTA_CACHE_PATH          "/ota/cache/slave.bin"
+#define OTA_CACHE_ANNOUNCE_PATH "/ota/cache"            // Backend: slave cùng site nhận link LAN
+#define OTA_CACHE_CHECK_MS      600000                  // Kiểm tra manifest + báo lại backend mỗi 10 phút
+#define OTA_CACHE_BLOCK         4096                    // = sector flash
+#define OTA_CACHE_STALL_MS      10000
+#define OTA_CACHE_TASK_STACK    6144
+#define OTA_CACHE_PARTITION     "slavecache"            // partitions.csv: data, subtype 0x40
+#define OTA_CACHE_PARTITION_SUBTYPE 0x40
+#define OTA_CACHE_SLAVE_SLOT    0x140000                // Slot app của slave (bảng mặc định): partition nhỏ hơn thì ảnh lớn bị từ chối
+// 1 = không có partition "slavecache" thì mượn partition OTA không chạy của master.
+// Partition đó giữ bản master trước (đích rollback duy nhất) -> bật lên là mất rollback.
+#define OTA_CACHE_USE_OTA_SLOT  0
+#define OTA_CACHE_MAX_SERVES    2                       // Số slave tải cùng lúc, mỗi slave 1 task
+#define OTA_CACHE_SERVE_STACK   4096
+#define OTA_CACHE_HIDDEN_MAGIC  0xFF                    // Byte đầu lưu trong flash, trả lại 0xE9 khi phục vụ
+
+// ======= OTA Cache (Master) =======
+/**
+ * Master tải ảnh firmware slave 1 lần qua WAN rồi phục vụ cho các slave trong LAN:
+ *
+ * - Lưu trong partition data riêng OTA_CACHE_PARTITION (partitions.csv), app0/app1 không bị đụng.
+ *   OTA_CACHE_USE_OTA_SLOT = 1 thì mượn partition OTA không chạy (mất rollback của master); khi đó
+ *   byte đầu ảnh được đổi thành OTA_CACHE_HIDDEN_MAGIC để bootloader không bao giờ boot nhầm ảnh slave.
+ * - Chỉ cache ảnh có sha256 trong manifest; sha256 kiểm tra khi tải về và khi boot lại.
+ * - GET http://<ip master>:OTA_CACHE_PORT/ota/cache/slave.bin, hỗ trợ Range (slave tải tiếp được).
+ *   Body gửi trong task riêng (tối đa OTA_CACHE_MAX_SERVES) để web server vẫn nhận slave khác.
+ * - POST /ota/cache lên backend: get_info_update trả slave_link về master cho slave cùng IP public,
+ *   kèm slave_origin_link để slave quay về server khi master không phục vụ được.
+ * - Mượn partition OTA: master tự update (invalidate() từ callback start của OTA) được ưu tiên, cache bị hủy.
+ */
+class OtaCache {
+public:
+    static OtaCache& getInstance() {
+        static OtaCache instance;
+        return instance;
+    }
+
+    void begin(const String& clientId);
+    // Manifest vừa đổi (OTA:CK) -> kiểm tra lại ngay thay vì chờ OTA_CACHE_CHECK_MS
+    void refresh();
+    // Master sắp ghi partition OTA: dừng tải cache, ngừng phục vụ (chỉ khi mượn partition OTA)
+    void invalidate();
+    void printStats();
+
+    OtaCache(const OtaCache&) = delete;
+    OtaCache& operator=(const OtaCache&) = delete;
+
+private:
+    OtaCache();
+
+    struct ServeJob {
+        WiFiClient client;          // Giữ socket sau khi WebServer bỏ client hiện tại
+        uint32_t start;
+    };
+
+    static void cacheTask(void* parameter);
+    static void serveTask(void* parameter);
+    void serve(WiFiClient& client, uint32_t start);
+    void drop();                    // Bỏ ảnh đang cache (re-sync / ảnh hỏng / master update)
+    void check();
+    bool sync(const String& version, const String& url, const String& sha256, const String& signature);
+    bool verifyStored();
+    void announce(bool available);
+    void handleImage();
+    void saveMeta();
+    void loadMeta();
+
+    WebServer _server;
+    TaskHandle_t _task;
+    SemaphoreHandle_t _mutex;       // Giữ trong lúc ghi / đọc 1 block của partition
+    String _clientId;
+    const esp_partition_t* _partition;
+    bool _sharesOtaSlot;            // Đang mượn partition OTA của master
+    std::atomic<uint8_t> _serving;
+
+    // Ảnh đang cache
+    bool _valid;
+    bool _verified;                 // Đã kiểm tra lại ảnh trong flash sau khi boot
+    volatile bool _abort;           // Master đang tự update
+    volatile bool _refresh;
+    String _version;
+    String _sha256;
+    String _signature;
+    uint32_t _size;
+    uint8_t _firstByte;             // Byte đầu thật của ảnh
+    uint32_t _lastCheck;
+    bool _announced;
+
+    // Metrics
+    uint32_t _syncs;
+    uint32_t _wanBytes;             // Tải từ server
+    uint32_t _served;               // Số lần phục vụ slave
+    uint32_t _lanBytes;             // Đã gửi cho slave
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "otaInflate.h"
+
+OtaInflater::OtaInflater()
+    : _stream(nullptr), _compressedSize(0), _compressedRead(0), _imageSize(0), _produced(0),
+      _done(false), _error(nullptr), _tinfl(nullptr), _window(nullptr), _windowPos(0),
+      _pendingStart(0), _pendingLen(0), _inPos(0), _inLen(0) {
+}
+
+OtaInflater::~OtaInflater() {
+    free(_tinfl);
+    free(_window);
+}
+
+void OtaInflater::fail(const char* error) {
+    if (_error == nullptr) {
+        _error = error;
+        Serial.printf("❌ [OTA Inflate] %s (image %u/%u, compressed %u/%u)\n",
+                      error, _produced, _imageSize, _compressedRead, _compressedSize);
+    }
+}
+
+bool OtaInflater::begin(WiFiClient* stream, size_t compressedSize) {
+    _stream = stream;
+    _compressedSize = compressedSize;
+
+    uint8_t header[OTA_ZLIB_HEADER_SIZE];
+    for (size_t i = 0; i < sizeof(header); i++) {
+        if (_inPos == _inLen && !fill()) return false;
+        header[i] = _in[_inPos++];
+    }
+    if (memcmp(header, OTA_ZLIB_MAGIC, 4) != 0) {
+        fail("Bad image magic");
+        return false;
+    }
+    memcpy(&_imageSize, header + 4, 4);
+    if (_imageSize == 0) {
+        fail("Empty image");
+        return false;
+    }
+
+    _tinfl = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+    _window = (uint8_t*)malloc(OTA_ZLIB_WINDOW);
+    if (_tinfl == nullptr || _window == nullptr) {
+        fail("Not enough memory for inflater");
+        return false;
+    }
+    tinfl_init(_tinfl);
+    Serial.printf("🗜️ [OTA Inflate] %u B compressed -> %u B image (%u%%), %u B RAM\n",
+                  _compressedSize, _imageSize, (uint32_t)((uint64_t)_compressedSize * 100 / _imageSize),
+                  sizeof(tinfl_decompressor) + OTA_ZLIB_WINDOW + OTA_ZLIB_IN_BUF);
+    return true;
+}
+
+bool OtaInflater::fill() {
+    size_t want = min((size_t)OTA_ZLIB_IN_BUF, _compressedSize - _compressedRead);
+    if (want == 0) {
+        fail("Compressed image truncated");
+        return false;
+    }
+    // readBytes chờ tới timeout của HTTPClient; thử lại tới OTA_ZLIB_TIMEOUT_MS
+    uint32_t waitStart = millis();
+    size_t n = 0;
+    while (n == 0 && millis() - waitStart < OTA_ZLIB_TIMEOUT_MS) {
+        n = _stream->readBytes(_in, want);
+        if (n == 0 && !_stream->connected()) break;
+    }
+    if (n == 0) {
+        fail("Compressed download stalled");
+        return false;
+    }
+    _compressedRead += n;
+    _inPos = 0;
+    _inLen = n;
+    return true;
+}
+
+size_t OtaInflater::read(uint8_t* out, size_t length) {
+    size_t produced = 0;
+    while (produced < length && !failed()) {
+        // Trả hết phần đã giải nén trước khi cho tinfl ghi tiếp vào buffer vòng
+        if (_pendingLen > 0) {
+            size_t n = min(length - produced, _pendingLen);
+            memcpy(out + produced, _window + _pendingStart, n);
+            _pendingStart += n;
+            _pendingLen -= n;
+            produced += n;
+            continue;
+        }
+        if (_done) {
+            if (_produced + produced < _imageSize) fail("Compressed image ended early");
+            break;
+        }
+        if (_inPos == _inLen && _compressedRead < _compressedSize && !fill()) break;
+
+        size_t inAvail = _inLen - _inPos;
+        size_t outAvail = OTA_ZLIB_WINDOW - _windowPos;
+        mz_uint32 flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
+        if (_compressedRead < _compressedSize) flags |= TINFL_FLAG_HAS_MORE_INPUT;
+        tinfl_status status = tinfl_decompress(_tinfl, _in + _inPos, &inAvail, _window,
+                                               _window + _windowPos, &outAvail, flags);
+        _inPos += inAvail;
+        _pendingStart = _windowPos;
+        _pendingLen = outAvail;
+        _windowPos = (_windowPos + outAvail) & (OTA_ZLIB_WINDOW - 1);
+
+        if (status == TINFL_STATUS_DONE) {
+            _done = true;
+        } else if (status == TINFL_STATUS_ADLER32_MISMATCH) {
+            fail("Adler32 mismatch");
+        } else if (status < 0) {
+            // Kể cả stream nén với cửa sổ > OTA_ZLIB_WINDOW (tinfl từ chối ngay ở header zlib)
+            fail(_compressedRead < _compressedSize ? "Corrupt zlib stream" : "Compressed image truncated");
+        }
+    }
+    if (_produced + produced > _imageSize) {
+        fail("Image larger than header size");
+    }
+    if (failed()) return 0;
+    _produced += produced;
+    return produced;
+}
+
+bool OtaInflater::finish() {
+    if (failed()) return false;
+    if (!_done || _pendingLen > 0) {
+        fail("Compressed image ended early");
+        return false;
+    }
+    if (_produced != _imageSize) {
+        fail("Image size mismatch");
+        return false;
+    }
+    Serial.printf("✅ [OTA Inflate] Image inflated from %u B, adler32 OK\n", _compressedRead);
+    return true;
+}
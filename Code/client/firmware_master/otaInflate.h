@@ -0,0 +1,68 @@
+#ifndef OTA_INFLATE_H
+#define OTA_INFLATE_H
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <esp32/rom/miniz.h>
+
+// ======= OTA Inflate Configuration =======
+#define OTA_ZLIB_MAGIC          "EDZ1"
+#define OTA_ZLIB_HEADER_SIZE    8       // magic + image_size
+#define OTA_ZLIB_WINDOW         4096    // = cửa sổ nén của backend (wbits=12), phải là lũy thừa của 2
+#define OTA_ZLIB_IN_BUF         512     // Buffer đọc ảnh nén từ socket
+#define OTA_ZLIB_TIMEOUT_MS     10000   // Không nhận được byte nào trong khoảng này -> lỗi
+
+// ======= OTA Inflater =======
+/**
+ * Giải nén ảnh firmware (format "EDZ1", tạo bởi backend app/services/ota_compress.py)
+ * theo luồng bằng tinfl trong ROM: đọc ảnh nén từ socket, trả ra từng đoạn ảnh gốc để
+ * ghi vào partition OTA. Output của tinfl là 1 buffer vòng 4 KB (đúng bằng cửa sổ nén),
+ * tổng RAM ~15 KB cấp phát trong begin(), không phụ thuộc kích thước ảnh.
+ *
+ *   OtaInflater inflater;
+ *   inflater.begin(stream, compressedSize);        // đọc header -> imageSize()
+ *   Update.begin(inflater.imageSize());
+ *   while ((n = inflater.read(buf, sizeof(buf))) > 0) Update.write(buf, n);
+ *   if (inflater.finish()) Update.end();           // hết stream, adler32 + kích thước khớp
+ */
+class OtaInflater {
+public:
+    OtaInflater();
+    ~OtaInflater();
+
+    bool begin(WiFiClient* stream, size_t compressedSize);
+    // Giải nén tiếp tối đa length byte; 0 khi xong hoặc lỗi (xem failed())
+    size_t read(uint8_t* out, size_t length);
+    // Stream zlib kết thúc đúng (adler32 do tinfl kiểm tra) và đủ image_size byte
+    bool finish();
+
+    size_t imageSize() const { return _imageSize; }
+    size_t produced() const { return _produced; }
+    size_t compressedRead() const { return _compressedRead; }
+    bool failed() const { return _error != nullptr; }
+    const char* error() const { return _error ? _error : ""; }
+
+private:
+    bool fill();                // Đọc thêm ảnh nén vào _in khi đã dùng hết
+    void fail(const char* error);
+
+    WiFiClient* _stream;
+    size_t _compressedSize;
+    size_t _compressedRead;
+    uint32_t _imageSize;
+    size_t _produced;
+    bool _done;                 // tinfl trả TINFL_STATUS_DONE
+    const char* _error;
+
+    tinfl_decompressor* _tinfl;
+    uint8_t* _window;           // Buffer vòng OTA_ZLIB_WINDOW byte
+    size_t _windowPos;          // Vị trí tinfl ghi tiếp
+    size_t _pendingStart;       // Đoạn đã giải nén nhưng chưa trả ra cho read()
+    size_t _pendingLen;
+
+    uint8_t _in[OTA_ZLIB_IN_BUF];
+    size_t _inPos;
+    size_t _inLen;
+};
+
+#endif
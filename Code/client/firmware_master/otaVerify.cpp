@@ -0,0 +1,103 @@
+#include "otaVerify.h"
+#include <mbedtls/pk.h>
+#include <mbedtls/base64.h>
+
+OtaVerifier::OtaVerifier() : _hashed(0), _hashUs(0), _error(nullptr) {
+    mbedtls_sha256_init(&_sha);
+}
+
+OtaVerifier::~OtaVerifier() {
+    mbedtls_sha256_free(&_sha);
+}
+
+void OtaVerifier::begin() {
+    mbedtls_sha256_starts(&_sha, 0);
+    _hashed = 0;
+    _hashUs = 0;
+    _error = nullptr;
+}
+
+void OtaVerifier::update(const uint8_t* data, size_t length) {
+    uint32_t start = micros();
+    mbedtls_sha256_update(&_sha, data, length);
+    _hashUs += micros() - start;
+    _hashed += length;
+}
+
+bool OtaVerifier::resumeFrom(const esp_partition_t* partition, size_t length) {
+    uint8_t* buf = (uint8_t*)malloc(OTA_VERIFY_READ_BUF);
+    if (buf == nullptr) {
+        _error = "Not enough memory to rehash";
+        return false;
+    }
+    uint32_t start = millis();
+    for (size_t offset = 0; offset < length; offset += OTA_VERIFY_READ_BUF) {
+        size_t n = min((size_t)OTA_VERIFY_READ_BUF, length - offset);
+        if (esp_partition_read(partition, offset, buf, n) != ESP_OK) {
+            free(buf);
+            _error = "Partition read failed";
+            return false;
+        }
+        update(buf, n);
+    }
+    free(buf);
+    Serial.printf("🔐 [OTA Verify] Rehashed %u B already in flash in %lu ms\n", length, millis() - start);
+    return true;
+}
+
+bool OtaVerifier::verify(const String& expectedSha256, const String& signature) {
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&_sha, digest);
+    char hex[65];
+    for (int i = 0; i < 32; i++) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+
+    bool signingRequired = strlen(OTA_SIGNING_PUBKEY) > 0;
+    if (expectedSha256.length() == 0) {
+        if (signingRequired) {
+            _error = "Manifest has no sha256";
+            return false;
+        }
+        Serial.printf("⚠️ [OTA Verify] No sha256 in manifest, image sha256 %s\n", hex);
+        return true;
+    }
+    if (!expectedSha256.equalsIgnoreCase(hex)) {
+        _error = "sha256 mismatch";
+        Serial.printf("❌ [OTA Verify] sha256 %s, expected %s\n", hex, expectedSha256.c_str());
+        return false;
+    }
+    if (signingRequired && !verifySignature(digest, signature)) {
+        return false;
+    }
+    Serial.printf("✅ [OTA Verify] sha256 OK%s (%u B hashed in %u ms)\n",
+                  signingRequired ? ", signature OK" : "", _hashed, _hashUs / 1000);
+    return true;
+}
+
+// sha256 đã khớp manifest; chữ ký chứng minh chính sha256 đó do backend giữ khóa riêng tạo ra
+bool OtaVerifier::verifySignature(const uint8_t digest[32], const String& signature) {
+    if (signature.length() == 0) {
+        _error = "Manifest has no signature";
+        return false;
+    }
+    uint8_t der[80];        // ECDSA P-256 DER tối đa 72 B
+    size_t derLen = 0;
+    if (mbedtls_base64_decode(der, sizeof(der), &derLen,
+                              (const unsigned char*)signature.c_str(), signature.length()) != 0) {
+        _error = "Bad signature encoding";
+        return false;
+    }
+
+    mbedtls_pk_context pk;
+    mbedtls_pk_init(&pk);
+    int ret = mbedtls_pk_parse_public_key(&pk, (const unsigned char*)OTA_SIGNING_PUBKEY,
+                                          strlen(OTA_SIGNING_PUBKEY) + 1);   // PEM: tính cả '\0'
+    if (ret != 0) {
+        _error = "Bad OTA_SIGNING_PUBKEY";
+    } else if (mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, digest, 32, der, derLen) != 0) {
+        _error = "Signature invalid";
+    }
+    mbedtls_pk_free(&pk);
+    return _error == nullptr;
+}
@@ -0,0 +1,249 @@
+#include "rtpAudio.h"
+
+// ======= IMA ADPCM =======
+static const int16_t imaStepTable[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t imaIndexTable[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+RtpAudioSender::RtpAudioSender()
+    : _port(RTP_DEFAULT_PORT), _active(false), _codec(RTP_CODEC_DVI4), _redundancy(0),
+      _ssrc(0), _seq(0), _timestamp(0), _marker(false), _lastRtcpMs(0),
+      _predictor(0), _stepIndex(0), _head(0), _framesEncoded(0),
+      _packetsSent(0), _bytesSent(0), _sendErrors(0), _sendUsTotal(0), _sendUsMax(0) {
+    memset(_frameLen, 0, sizeof(_frameLen));
+    memset(_frameTs, 0, sizeof(_frameTs));
+}
+
+bool RtpAudioSender::begin(const String& host, uint16_t port, const String& cname, RtpCodec codec, uint8_t redundancy) {
+    if (!_remoteIp.fromString(host.c_str()) && !WiFi.hostByName(host.c_str(), _remoteIp)) {
+        Serial.printf("❌ [RTP] Cannot resolve %s\n", host.c_str());
+        return false;
+    }
+    _port = port;
+    _cname = cname;
+    _codec = codec;
+    // Frame L16 (1024 byte) vượt giới hạn 1023 byte/khối của RFC 2198 và đã gấp 4 lần DVI4
+    _redundancy = codec == RTP_CODEC_DVI4 ? min(redundancy, (uint8_t)RTP_MAX_REDUNDANCY) : 0;
+    if (redundancy > 0 && _redundancy == 0) {
+        Serial.println("⚠️ [RTP] Redundancy needs DVI4 codec, disabled");
+    }
+
+    // SSRC, sequence và timestamp ban đầu ngẫu nhiên theo RFC 3550
+    _ssrc = esp_random();
+    _seq = (uint16_t)esp_random();
+    _timestamp = esp_random();
+    _marker = true;
+    _predictor = 0;
+    _stepIndex = 0;
+    _head = 0;
+    _framesEncoded = 0;
+    _packetsSent = 0;
+    _bytesSent = 0;
+    _sendErrors = 0;
+    _sendUsTotal = 0;
+    _sendUsMax = 0;
+    _active = true;
+
+    sendRtcp(false);
+    Serial.printf("📡 [RTP] Streaming to %s:%u, %s, redundancy %u, SSRC %08x\n", _remoteIp.toString().c_str(), _port,
+                  codec == RTP_CODEC_DVI4 ? "DVI4" : "L16", _redundancy, _ssrc);
+    return true;
+}
+
+size_t RtpAudioSender::writeHeader(uint8_t payloadType) {
+    _packet[0] = 0x80;                                      // V=2, không padding / extension / CSRC
+    _packet[1] = (_marker ? 0x80 : 0x00) | payloadType;
+    _packet[2] = _seq >> 8;
+    _packet[3] = _seq & 0xFF;
+    _packet[4] = _timestamp >> 24;
+    _packet[5] = (_timestamp >> 16) & 0xFF;
+    _packet[6] = (_timestamp >> 8) & 0xFF;
+    _packet[7] = _timestamp & 0xFF;
+    _packet[8] = _ssrc >> 24;
+    _packet[9] = (_ssrc >> 16) & 0xFF;
+    _packet[10] = (_ssrc >> 8) & 0xFF;
+    _packet[11] = _ssrc & 0xFF;
+    return RTP_HEADER_LEN;
+}
+
+size_t RtpAudioSender::encodeDvi4(const int16_t* samples, size_t count, uint8_t* out) {
+    // Header DVI4: predictor (big-endian) + step index trước khi mã hóa mẫu đầu tiên
+    out[0] = (uint16_t)_predictor >> 8;
+    out[1] = (uint16_t)_predictor & 0xFF;
+    out[2] = _stepIndex;
+    out[3] = 0;
+
+    int32_t predictor = _predictor;
+    int index = _stepIndex;
+    uint8_t* data = out + 4;
+    for (size_t i = 0; i < count; i++) {
+        int step = imaStepTable[index];
+        int diff = samples[i] - predictor;
+        uint8_t code = 0;
+        if (diff < 0) {
+            code = 8;
+            diff = -diff;
+        }
+        int delta = step >> 3;
+        if (diff >= step) { code |= 4; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { code |= 2; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { code |= 1; delta += step; }
+
+        predictor += (code & 8) ? -delta : delta;
+        if (predictor > 32767) predictor = 32767;
+        else if (predictor < -32768) predictor = -32768;
+        index += imaIndexTable[code];
+        if (index < 0) index = 0;
+        else if (index > 88) index = 88;
+
+        // RFC 3551: mẫu đầu tiên nằm ở 4 bit cao
+        if ((i & 1) == 0) {
+            data[i >> 1] = code << 4;
+        } else {
+            data[i >> 1] |= code;
+        }
+    }
+    _predictor = predictor;
+    _stepIndex = index;
+    return 4 + (count + 1) / 2;
+}
+
+bool RtpAudioSender::sendFrame(const int16_t* samples, size_t count) {
+    if (!_active || count == 0 || count > RTP_MAX_FRAME_SAMPLES) return false;
+
+    size_t len;
+    if (_codec == RTP_CODEC_L16) {
+        len = writeHeader(RTP_PT_L16_16K);
+        for (size_t i = 0; i < count; i++) {
+            _packet[len++] = (uint16_t)samples[i] >> 8;
+            _packet[len++] = (uint16_t)samples[i] & 0xFF;
+        }
+    } else {
+        _frameLen[_head] = encodeDvi4(samples, count, _frames[_head]);
+        _frameTs[_head] = _timestamp;
+        _framesEncoded++;
+
+        uint8_t blocks = min((uint32_t)_redundancy, _framesEncoded - 1);
+        if (blocks == 0) {
+            len = writeHeader(RTP_PT_DVI4_16K);
+        } else {
+            len = writeHeader(RTP_PT_RED);
+            // Header RFC 2198: F | PT | timestamp offset (14 bit) | block length (10 bit), frame cũ nhất trước
+            for (uint8_t k = blocks; k > 0; k--) {
+                uint8_t slot = (_head + RTP_MAX_REDUNDANCY + 1 - k) % (RTP_MAX_REDUNDANCY + 1);
+                uint32_t offset = _timestamp - _frameTs[slot];
+                _packet[len++] = 0x80 | RTP_PT_DVI4_16K;
+                _packet[len++] = (offset >> 6) & 0xFF;
+                _packet[len++] = ((offset & 0x3F) << 2) | ((_frameLen[slot] >> 8) & 0x03);
+                _packet[len++] = _frameLen[slot] & 0xFF;
+            }
+            _packet[len++] = RTP_PT_DVI4_16K;
+            for (uint8_t k = blocks; k > 0; k--) {
+                uint8_t slot = (_head + RTP_MAX_REDUNDANCY + 1 - k) % (RTP_MAX_REDUNDANCY + 1);
+                memcpy(_packet + len, _frames[slot], _frameLen[slot]);
+                len += _frameLen[slot];
+            }
+        }
+        memcpy(_packet + len, _frames[_head], _frameLen[_head]);
+        len += _frameLen[_head];
+        _head = (_head + 1) % (RTP_MAX_REDUNDANCY + 1);
+    }
+
+    uint32_t start = micros();
+    bool ok = _udp.beginPacket(_remoteIp, _port) && _udp.write(_packet, len) == len && _udp.endPacket();
+    uint32_t elapsed = micros() - start;
+    _sendUsTotal += elapsed;
+    if (elapsed > _sendUsMax) _sendUsMax = elapsed;
+    if (ok) {
+        _packetsSent++;
+        _bytesSent += len;
+    } else {
+        // Hàng đợi lwIP đầy: bỏ frame này, không chờ (phía nhận coi như mất gói)
+        _sendErrors++;
+    }
+
+    _seq++;
+    _timestamp += count;
+    _marker = false;
+
+    if (millis() - _lastRtcpMs >= RTCP_REPORT_MS) {
+        sendRtcp(false);
+    }
+    return ok;
+}
+
+void RtpAudioSender::sendRtcp(bool bye) {
+    uint8_t packet[64];
+    size_t len = 0;
+    auto put32 = [&](uint32_t value) {
+        packet[len++] = value >> 24;
+        packet[len++] = (value >> 16) & 0xFF;
+        packet[len++] = (value >> 8) & 0xFF;
+        packet[len++] = value & 0xFF;
+    };
+
+    // RR rỗng (gói compound phải bắt đầu bằng SR / RR)
+    packet[len++] = 0x80;
+    packet[len++] = 201;
+    packet[len++] = 0;
+    packet[len++] = 1;
+    put32(_ssrc);
+
+    // SDES: CNAME = client ID (32 ký tự hex), độ dài chunk làm tròn lên bội số 4 byte
+    size_t cnameLen = min(_cname.length(), (unsigned int)RTCP_CNAME_MAX);
+    size_t sdesStart = len;
+    packet[len++] = 0x81;
+    packet[len++] = 202;
+    len += 2;
+    put32(_ssrc);
+    packet[len++] = 1;
+    packet[len++] = cnameLen;
+    memcpy(packet + len, _cname.c_str(), cnameLen);
+    len += cnameLen;
+    do {
+        packet[len++] = 0;
+    } while (len % 4 != 0);
+    uint16_t words = (len - sdesStart) / 4 - 1;
+    packet[sdesStart + 2] = words >> 8;
+    packet[sdesStart + 3] = words & 0xFF;
+
+    if (bye) {
+        packet[len++] = 0x81;
+        packet[len++] = 203;
+        packet[len++] = 0;
+        packet[len++] = 1;
+        put32(_ssrc);
+    }
+
+    if (!(_udp.beginPacket(_remoteIp, _port + 1) && _udp.write(packet, len) == len && _udp.endPacket())) {
+        Serial.println("⚠️ [RTP] Failed to send RTCP");
+    }
+    _lastRtcpMs = millis();
+}
+
+void RtpAudioSender::end() {
+    if (!_active) return;
+    sendRtcp(true);
+    _active = false;
+    printStats();
+    _udp.stop();
+}
+
+void RtpAudioSender::printStats() {
+    uint32_t attempts = _packetsSent + _sendErrors;
+    if (attempts == 0) return;
+    Serial.printf("📡 [RTP] Packets: %u (%u bytes, avg %u B), send errors: %u, send avg %u us / max %u us\n",
+                  _packetsSent, _bytesSent, _packetsSent ? _bytesSent / _packetsSent : 0, _sendErrors,
+                  _sendUsTotal / attempts, _sendUsMax);
+}
@@ -0,0 +1,93 @@
+#ifndef RTP_AUDIO_H
+#define RTP_AUDIO_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+
+// ======= RTP Audio Configuration =======
+#define RTP_DEFAULT_PORT        5004    // RTCP dùng port + 1 (RFC 3550)
+#define RTP_CLOCK_RATE          16000   // Giống I2S_SAMPLE_RATE
+#define RTP_PT_DVI4_16K         6       // RFC 3551: IMA ADPCM (DVI4) 16 kHz, 4 bit/mẫu
+#define RTP_PT_L16_16K          96      // Dynamic: PCM 16-bit big-endian 16 kHz mono
+#define RTP_PT_RED              98      // Dynamic: RFC 2198 redundant audio (chỉ dùng với DVI4)
+#define RTP_MAX_FRAME_SAMPLES   512     // 32 ms ở 16 kHz
+#define RTP_MAX_REDUNDANCY      2       // Số frame cũ gửi kèm tối đa
+#define RTP_HEADER_LEN          12
+#define RTP_DVI4_FRAME_MAX      (4 + RTP_MAX_FRAME_SAMPLES / 2)
+#define RTP_PACKET_MAX          (RTP_HEADER_LEN + RTP_MAX_FRAME_SAMPLES * 2)   // L16 là trường hợp lớn nhất
+#define RTCP_REPORT_MS          5000
+#define RTCP_CNAME_MAX          32
+
+enum RtpCodec : uint8_t {
+    RTP_CODEC_L16 = 0,
+    RTP_CODEC_DVI4 = 1
+};
+
+// ======= RTP Audio Sender =======
+/**
+ * Gửi audio mic dạng RTP qua UDP, dùng thay WebSocket khi cần độ trễ thấp và ổn định:
+ * mất gói không làm dừng cả luồng như TCP (head-of-line blocking + retransmit), gói mất
+ * chỉ là 1 khoảng lặng 32 ms ở phía nhận.
+ *
+ * - Mỗi frame I2S (512 mẫu = 32 ms) là 1 gói RTP, timestamp tính theo số mẫu.
+ * - DVI4: IMA ADPCM theo RFC 3551, 1024 byte PCM -> 260 byte. Mỗi frame mang sẵn trạng thái
+ *   bộ mã hóa trong header nên frame sau vẫn giải mã được khi frame trước bị mất.
+ * - redundancy > 0 (chỉ với DVI4): mỗi gói gửi kèm 1-2 frame trước đó theo RFC 2198,
+ *   phía nhận khôi phục được frame mất lẻ tẻ mà không cần gửi lại.
+ * - RTCP (port + 1): SDES CNAME = client ID lúc bắt đầu và định kỳ, BYE khi dừng để backend
+ *   biết SSRC thuộc thiết bị nào và khi nào luồng kết thúc.
+ */
+class RtpAudioSender {
+public:
+    RtpAudioSender();
+
+    bool begin(const String& host, uint16_t port, const String& cname, RtpCodec codec, uint8_t redundancy);
+    // Gửi 1 frame PCM 16-bit little-endian (tối đa RTP_MAX_FRAME_SAMPLES mẫu)
+    bool sendFrame(const int16_t* samples, size_t count);
+    void end();
+
+    bool isActive() const { return _active; }
+    void printStats();
+
+private:
+    size_t writeHeader(uint8_t payloadType);
+    size_t encodeDvi4(const int16_t* samples, size_t count, uint8_t* out);
+    void sendRtcp(bool bye);
+
+    WiFiUDP _udp;
+    IPAddress _remoteIp;
+    uint16_t _port;
+    bool _active;
+    String _cname;
+    RtpCodec _codec;
+    uint8_t _redundancy;
+
+    uint32_t _ssrc;
+    uint16_t _seq;
+    uint32_t _timestamp;
+    bool _marker;               // Gói đầu tiên của luồng (talkspurt)
+    uint32_t _lastRtcpMs;
+
+    // Trạng thái IMA ADPCM, nối tiếp giữa các frame
+    int16_t _predictor;
+    uint8_t _stepIndex;
+
+    // Các frame DVI4 gần nhất cho redundancy (vòng tròn, _head = frame hiện tại)
+    uint8_t _frames[RTP_MAX_REDUNDANCY + 1][RTP_DVI4_FRAME_MAX];
+    uint16_t _frameLen[RTP_MAX_REDUNDANCY + 1];
+    uint32_t _frameTs[RTP_MAX_REDUNDANCY + 1];
+    uint8_t _head;
+    uint32_t _framesEncoded;
+
+    uint8_t _packet[RTP_PACKET_MAX];
+
+    // Metrics
+    uint32_t _packetsSent;
+    uint32_t _bytesSent;
+    uint32_t _sendErrors;
+    uint32_t _sendUsTotal;
+    uint32_t _sendUsMax;
+};
+
+#endif
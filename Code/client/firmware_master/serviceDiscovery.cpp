@@ -0,0 +1,160 @@
+#include "serviceDiscovery.h"
+
+ServiceDiscovery::ServiceDiscovery()
+    : _mutex(NULL), _task(NULL), _mdnsStarted(false), _cached(false),
+      _scheme("http"), _port(80),
+      _resolves(0), _resolveFailures(0), _changes(0), _failureReports(0), _lastResolveMs(0) {}
+
+void ServiceDiscovery::begin(const char* fallbackUrl) {
+    if (_mutex == NULL) {
+        _mutex = xSemaphoreCreateMutex();
+    }
+
+    Settings discoverySettings("discovery", false);
+    String host = discoverySettings.getString("host", "");
+    if (host.length() > 0) {
+        _cached = true;
+        setEndpoint(discoverySettings.getString("scheme", "http"), host,
+                    discoverySettings.getInt("port", 80), false);
+        Serial.printf("🧭 [Discovery] Using cached backend %s\n", baseUrl().c_str());
+    } else {
+        // Tách scheme://host[:port] từ URL mặc định
+        String url = fallbackUrl;
+        int schemeEnd = url.indexOf("://");
+        String scheme = schemeEnd > 0 ? url.substring(0, schemeEnd) : "http";
+        String rest = schemeEnd > 0 ? url.substring(schemeEnd + 3) : url;
+        int slash = rest.indexOf('/');
+        if (slash >= 0) rest = rest.substring(0, slash);
+        int colon = rest.indexOf(':');
+        uint16_t port = scheme == "https" ? 443 : 80;
+        if (colon > 0) {
+            port = rest.substring(colon + 1).toInt();
+            rest = rest.substring(0, colon);
+        }
+        setEndpoint(scheme, rest, port, false);
+        Serial.printf("🧭 [Discovery] No cached backend, using default %s\n", baseUrl().c_str());
+    }
+
+    if (_task == NULL) {
+        xTaskCreatePinnedToCore(discoveryTask, "DiscoveryTask", DISCOVERY_TASK_STACK, this, 1, &_task, 0);
+    }
+}
+
+void ServiceDiscovery::setEndpoint(const String& scheme, const String& host, uint16_t port, bool persist) {
+    if (_mutex == NULL || !xSemaphoreTake(_mutex, portMAX_DELAY)) return;
+    _scheme = scheme;
+    _host = host;
+    _port = port;
+    xSemaphoreGive(_mutex);
+
+    if (persist) {
+        Settings discoverySettings("discovery", true);
+        discoverySettings.setString("scheme", scheme);
+        discoverySettings.setString("host", host);
+        discoverySettings.setInt("port", port);
+        _cached = true;
+    }
+}
+
+String ServiceDiscovery::baseUrl() {
+    String result;
+    if (_mutex != NULL && xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        result = _scheme + "://" + _host + ":" + String(_port);
+        xSemaphoreGive(_mutex);
+    }
+    return result;
+}
+
+String ServiceDiscovery::url(const String& path) {
+    return baseUrl() + path;
+}
+
+String ServiceDiscovery::wsUrl(const String& path) {
+    String base = baseUrl();
+    if (base.startsWith("https://")) {
+        return "wss://" + base.substring(8) + path;
+    }
+    return "ws://" + base.substring(7) + path;
+}
+
+void ServiceDiscovery::reportFailure(const char* who) {
+    _failureReports++;
+    Serial.printf("🧭 [Discovery] %s could not reach %s, re-resolving\n", who, baseUrl().c_str());
+    if (_task != NULL) {
+        xTaskNotifyGive(_task);
+    }
+}
+
+// Scheme (TXT "scheme") và IP của kết quả thứ index trong lần queryService() gần nhất
+static void resultAt(int index, String& scheme, String& host) {
+#if ESP_ARDUINO_VERSION_MAJOR >= 3
+    host = MDNS.address(index).toString();
+#else
+    host = MDNS.IP(index).toString();
+#endif
+    scheme = MDNS.hasTxt(index, "scheme") ? MDNS.txt(index, "scheme") : "http";
+}
+
+bool ServiceDiscovery::resolve() {
+    if (!_mdnsStarted) {
+        char hostname[24];
+        snprintf(hostname, sizeof(hostname), "esp32-%06x", (uint32_t)(ESP.getEfuseMac() & 0xFFFFFF));
+        _mdnsStarted = MDNS.begin(hostname);
+        if (!_mdnsStarted) {
+            Serial.println("❌ [Discovery] Failed to start mDNS");
+            return false;
+        }
+    }
+
+    uint32_t start = millis();
+    int count = MDNS.queryService(DISCOVERY_SERVICE, DISCOVERY_PROTO);
+    _lastResolveMs = millis() - start;
+    _resolves++;
+    if (count <= 0) {
+        _resolveFailures++;
+        Serial.printf("⚠️ [Discovery] No _%s._%s service found (%u ms)\n",
+                      DISCOVERY_SERVICE, DISCOVERY_PROTO, _lastResolveMs);
+        return false;
+    }
+
+    // Endpoint đang dùng vẫn còn quảng bá -> giữ nguyên, tránh đổi qua lại giữa nhiều backend
+    String current = baseUrl();
+    String scheme, host;
+    for (int i = 0; i < count; i++) {
+        resultAt(i, scheme, host);
+        if (current == scheme + "://" + host + ":" + String(MDNS.port(i))) {
+            if (!_cached) setEndpoint(scheme, host, MDNS.port(i), true);
+            return true;
+        }
+    }
+
+    resultAt(0, scheme, host);
+    setEndpoint(scheme, host, MDNS.port(0), true);
+    _changes++;
+    Serial.printf("🧭 [Discovery] Backend %s -> %s (%s, %u ms)\n", current.c_str(), baseUrl().c_str(),
+                  MDNS.hostname(0).c_str(), _lastResolveMs);
+    return true;
+}
+
+void ServiceDiscovery::discoveryTask(void* parameter) {
+    ServiceDiscovery* self = (ServiceDiscovery*)parameter;
+    // Chưa có cache thì resolve ngay, có rồi thì chỉ làm mới định kỳ hoặc khi có lỗi
+    uint32_t waitMs = self->_cached ? DISCOVERY_REFRESH_MS : 0;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
+        // Chưa có IP thì ngủ tới event GOT_IP thay vì thử lại mỗi DISCOVERY_RETRY_MS
+        WiFiStation::getInstance().waitUntilConnected(WIFI_WAIT_FOREVER);
+        self->resolve();
+        waitMs = DISCOVERY_REFRESH_MS;
+        // Nhiều module cùng báo lỗi trong 1 lần mất kết nối chỉ gây thêm tối đa 1 lần resolve
+        vTaskDelay(pdMS_TO_TICKS(DISCOVERY_RETRY_MS));
+    }
+}
+
+void ServiceDiscovery::printStats() {
+    if (_resolves == 0 && _failureReports == 0) return;
+    Serial.printf("🧭 [Discovery] Backend %s%s, resolves: %u (failed %u), changes: %u, failure reports: %u, last %u ms\n",
+                  baseUrl().c_str(), _cached ? " (cached)" : " (default)", _resolves, _resolveFailures,
+                  _changes, _failureReports, _lastResolveMs);
+}
@@ -0,0 +1,73 @@
+#ifndef SERVICE_DISCOVERY_H
+#define SERVICE_DISCOVERY_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <ESPmDNS.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "settings.h"
+#include "wifiStation.h"
+
+// ======= Discovery Configuration =======
+#define DISCOVERY_SERVICE           "iot-backend"   // DNS-SD: _iot-backend._tcp
+#define DISCOVERY_PROTO             "tcp"
+#define DISCOVERY_REFRESH_MS        1800000         // Làm mới ngầm mỗi 30 phút
+#define DISCOVERY_RETRY_MS          10000           // Khoảng nghỉ tối thiểu giữa 2 lần resolve
+#define DISCOVERY_TASK_STACK        4096
+
+// ======= Service Discovery =======
+/**
+ * Tìm endpoint của backend (OTA, audio URL, WebSocket) bằng mDNS / DNS-SD thay cho IP cố định.
+ *
+ * - Endpoint đã resolve được lưu trong NVS "discovery" (scheme / host / port). Lúc boot dùng
+ *   ngay giá trị này, không chờ mDNS; chưa có thì dùng fallbackUrl build sẵn trong firmware.
+ * - Task nền resolve lại mỗi DISCOVERY_REFRESH_MS, hoặc sớm hơn khi module nào đó gọi
+ *   reportFailure() (không kết nối được backend).
+ * - TXT record "scheme" (http / https) tùy chọn, mặc định http.
+ */
+class ServiceDiscovery {
+public:
+    static ServiceDiscovery& getInstance() {
+        static ServiceDiscovery instance;
+        return instance;
+    }
+
+    void begin(const char* fallbackUrl);
+
+    String baseUrl();                           // vd. http://10.1.0.32:8000
+    String url(const String& path);             // baseUrl() + path
+    String wsUrl(const String& path);           // Như url() nhưng ws:// / wss://
+    // Gọi khi request tới backend lỗi kết nối -> task nền resolve lại
+    void reportFailure(const char* who);
+    void printStats();
+
+    ServiceDiscovery(const ServiceDiscovery&) = delete;
+    ServiceDiscovery& operator=(const ServiceDiscovery&) = delete;
+
+private:
+    ServiceDiscovery();
+
+    static void discoveryTask(void* parameter);
+    bool resolve();
+    void setEndpoint(const String& scheme, const String& host, uint16_t port, bool persist);
+
+    SemaphoreHandle_t _mutex;
+    TaskHandle_t _task;
+    bool _mdnsStarted;
+    bool _cached;               // Endpoint lấy từ NVS (đã từng resolve được)
+
+    String _scheme;
+    String _host;
+    uint16_t _port;
+
+    // Metrics
+    uint32_t _resolves;
+    uint32_t _resolveFailures;
+    uint32_t _changes;          // Số lần endpoint đổi sau khi resolve
+    uint32_t _failureReports;
+    uint32_t _lastResolveMs;
+};
+
+#endif
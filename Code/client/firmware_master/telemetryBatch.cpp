@@ -0,0 +1,202 @@
+#include "telemetryBatch.h"
+
+// ======= CBOR Writer =======
+CborWriter::CborWriter(uint8_t* buffer, size_t capacity)
+    : _buf(buffer), _cap(capacity), _len(0), _overflow(false) {}
+
+void CborWriter::put(uint8_t b) {
+    if (_len >= _cap) {
+        _overflow = true;
+        return;
+    }
+    _buf[_len++] = b;
+}
+
+void CborWriter::put(const uint8_t* data, size_t len) {
+    if (_len + len > _cap) {
+        _overflow = true;
+        return;
+    }
+    memcpy(_buf + _len, data, len);
+    _len += len;
+}
+
+void CborWriter::writeHead(uint8_t major, uint32_t value) {
+    major <<= 5;
+    if (value < 24) {
+        put(major | value);
+    } else if (value <= 0xFF) {
+        put(major | 24);
+        put((uint8_t)value);
+    } else if (value <= 0xFFFF) {
+        put(major | 25);
+        put((uint8_t)(value >> 8));
+        put((uint8_t)value);
+    } else {
+        put(major | 26);
+        put((uint8_t)(value >> 24));
+        put((uint8_t)(value >> 16));
+        put((uint8_t)(value >> 8));
+        put((uint8_t)value);
+    }
+}
+
+void CborWriter::writeUint(uint32_t value) {
+    writeHead(0, value);
+}
+
+void CborWriter::writeInt(int32_t value) {
+    if (value >= 0) {
+        writeHead(0, (uint32_t)value);
+    } else {
+        writeHead(1, (uint32_t)(-1 - value));
+    }
+}
+
+void CborWriter::writeFloat(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put(0xFA);  // major 7, float32
+    put((uint8_t)(bits >> 24));
+    put((uint8_t)(bits >> 16));
+    put((uint8_t)(bits >> 8));
+    put((uint8_t)bits);
+}
+
+void CborWriter::writeBool(bool value) {
+    put(value ? 0xF5 : 0xF4);
+}
+
+void CborWriter::writeText(const char* text) {
+    writeText(text, strlen(text));
+}
+
+void CborWriter::writeText(const char* text, size_t len) {
+    writeHead(3, len);
+    put((const uint8_t*)text, len);
+}
+
+void CborWriter::beginArray(size_t count) {
+    writeHead(4, count);
+}
+
+void CborWriter::beginMap(size_t count) {
+    writeHead(5, count);
+}
+
+// ======= Telemetry Batcher =======
+TelemetryBatcher::TelemetryBatcher()
+    : _enabled(false), _windowMs(TLM_BATCH_DEFAULT_WINDOW_MS), _count(0),
+      _encodedSize(TLM_BATCH_HEADER_MAX) {}
+
+size_t TelemetryBatcher::headSize(uint32_t value) {
+    if (value < 24) return 1;
+    if (value <= 0xFF) return 2;
+    if (value <= 0xFFFF) return 3;
+    return 5;
+}
+
+// Khớp từng byte với encode()
+size_t TelemetryBatcher::sampleSize(const TelemetryRecord& rec, uint32_t base) {
+    size_t size = 1 + headSize(rec.virtualPin) + headSize(rec.timestamp - base);
+    switch (rec.type) {
+        case TLM_INT:
+            size += headSize(rec.value.i >= 0 ? (uint32_t)rec.value.i : (uint32_t)(-1 - rec.value.i));
+            break;
+        case TLM_FLOAT: size += 5; break;
+        case TLM_BOOL:  size += 1; break;
+        default: {
+            size_t len = strnlen(rec.value.s, TLM_SHORT_STR_LEN - 1);
+            size += headSize(len) + len;
+            break;
+        }
+    }
+    return size;
+}
+
+void TelemetryBatcher::begin() {
+    Settings settings("telemetry", false);
+    _windowMs = settings.getInt("batch_window", 0);
+    _enabled = _windowMs > 0;
+    if (_enabled && _windowMs < TLM_BATCH_MIN_WINDOW_MS) {
+        _windowMs = TLM_BATCH_MIN_WINDOW_MS;
+    }
+    Serial.printf("📦 [Telemetry] Batch mode: %s (window %u ms)\n",
+                  _enabled ? "ON" : "OFF", _windowMs);
+}
+
+void TelemetryBatcher::configure(uint32_t windowMs) {
+    if (windowMs > 0 && windowMs < TLM_BATCH_MIN_WINDOW_MS) {
+        windowMs = TLM_BATCH_MIN_WINDOW_MS;
+    }
+    _enabled = windowMs > 0;
+    _windowMs = windowMs;
+
+    Settings settings("telemetry", true);
+    settings.setInt("batch_window", windowMs);
+    Serial.printf("📦 [Telemetry] Batch mode %s (window %u ms)\n",
+                  _enabled ? "enabled" : "disabled", windowMs);
+}
+
+bool TelemetryBatcher::accepts(const TelemetryRecord& rec) const {
+    return _enabled && !(rec.flags & (TLM_FLAG_NC | TLM_FLAG_PREV_BOOT)) && rec.type != TLM_BLOB;
+}
+
+bool TelemetryBatcher::add(const TelemetryRecord& rec) {
+    if (_count >= TLM_BATCH_MAX_SAMPLES) {
+        return false;
+    }
+    uint32_t base = _count > 0 ? _samples[0].timestamp : rec.timestamp;
+    size_t size = sampleSize(rec, base);
+    if (_encodedSize + size > TLM_BATCH_BUF_SIZE) {
+        return false;       // Caller giữ lại record (journal), batch sẽ được flush
+    }
+    _samples[_count++] = rec;
+    _encodedSize += size;
+    return true;
+}
+
+bool TelemetryBatcher::shouldFlush(uint32_t now) const {
+    if (_count == 0) return false;
+    if (_count >= TLM_BATCH_MAX_SAMPLES) return true;
+    if (_encodedSize + TLM_BATCH_SAMPLE_MAX > TLM_BATCH_BUF_SIZE) return true;   // Mẫu kế có thể không vừa
+    // Tắt batch giữa chừng -> đẩy nốt các mẫu đang giữ
+    if (!_enabled) return true;
+    return (now - _samples[0].timestamp) >= _windowMs;
+}
+
+size_t TelemetryBatcher::encode(uint8_t* out, size_t capacity, uint32_t now) {
+    if (_count == 0) return 0;
+
+    uint32_t base = _samples[0].timestamp;
+    CborWriter cbor(out, capacity);
+
+    cbor.beginMap(4);
+    cbor.writeText("v");
+    cbor.writeUint(TLM_BATCH_VERSION);
+    cbor.writeText("t");
+    cbor.writeUint(base);
+    cbor.writeText("n");
+    cbor.writeUint(now);
+    cbor.writeText("s");
+    cbor.beginArray(_count);
+
+    for (size_t i = 0; i < _count; i++) {
+        const TelemetryRecord& rec = _samples[i];
+        cbor.beginArray(3);
+        cbor.writeUint(rec.virtualPin);
+        cbor.writeUint(rec.timestamp - base);
+        switch (rec.type) {
+            case TLM_INT:   cbor.writeInt(rec.value.i); break;
+            case TLM_FLOAT: cbor.writeFloat(rec.value.f); break;
+            case TLM_BOOL:  cbor.writeBool(rec.value.b); break;
+            default:        cbor.writeText(rec.value.s); break;
+        }
+    }
+
+    if (cbor.overflowed()) {
+        Serial.printf("❌ [Telemetry] CBOR buffer overflow (%u samples)\n", (unsigned)_count);
+        return 0;
+    }
+    return cbor.length();
+}
@@ -0,0 +1,99 @@
+#ifndef TELEMETRY_BATCH_H
+#define TELEMETRY_BATCH_H
+
+#include <Arduino.h>
+#include "telemetry.h"
+#include "settings.h"
+
+// ======= Batch Configuration =======
+#define TLM_BATCH_MAX_SAMPLES       32      // Số mẫu tối đa trong 1 document
+#define TLM_BATCH_DEFAULT_WINDOW_MS 60000   // Cửa sổ gom mẫu mặc định (1 phút)
+#define TLM_BATCH_MIN_WINDOW_MS     1000
+#define TLM_BATCH_BUF_SIZE          448     // CBOR output, add() không nhận mẫu làm vượt buffer
+#define TLM_BATCH_HEADER_MAX        22      // map + 4 key + 3 uint32 + array head (<= 32 mẫu)
+#define TLM_BATCH_SAMPLE_MAX        25      // [pin uint16, dt uint32, text 15 ký tự]
+#define TLM_BATCH_VERSION           1
+
+// ======= CBOR Writer =======
+// Encoder CBOR (RFC 8949) tối giản, ghi thẳng vào buffer cố định.
+// Chỉ hỗ trợ các kiểu mà batch telemetry cần: uint/int, float32, bool, text, array, map.
+class CborWriter {
+public:
+    CborWriter(uint8_t* buffer, size_t capacity);
+
+    void writeUint(uint32_t value);
+    void writeInt(int32_t value);
+    void writeFloat(float value);
+    void writeBool(bool value);
+    void writeText(const char* text);
+    void writeText(const char* text, size_t len);
+    void beginArray(size_t count);
+    void beginMap(size_t count);
+
+    size_t length() const { return _len; }
+    bool overflowed() const { return _overflow; }
+
+private:
+    void writeHead(uint8_t major, uint32_t value);
+    void put(uint8_t b);
+    void put(const uint8_t* data, size_t len);
+
+    uint8_t* _buf;
+    size_t _cap;
+    size_t _len;
+    bool _overflow;
+};
+
+// ======= Telemetry Batcher =======
+/**
+ * Gom nhiều TelemetryRecord (nhiều virtual pin) trong 1 cửa sổ thời gian rồi
+ * publish 1 lần dưới dạng CBOR lên SS/<clientId>/batch:
+ *
+ *   { "v": 1,              // version format
+ *     "t": <millis>,       // thời điểm mẫu đầu tiên
+ *     "n": <millis>,       // thời điểm encode (server dùng để quy đổi ra giờ thực)
+ *     "s": [ [pin, dt_ms, value], ... ] }
+ *
+ * value là int / float32 / bool / text tùy kiểu record. Notification (NC) và
+ * chuỗi dài trong arena không đi qua batch.
+ */
+class TelemetryBatcher {
+public:
+    static TelemetryBatcher& getInstance() {
+        static TelemetryBatcher instance;
+        return instance;
+    }
+
+    void begin();   // Load cấu hình từ NVS (namespace "telemetry")
+
+    bool isEnabled() const { return _enabled; }
+    uint32_t getWindow() const { return _windowMs; }
+    // windowMs = 0 -> tắt batch, quay về publish từng giá trị
+    void configure(uint32_t windowMs);
+
+    // Record có đi qua batch được không (NC / blob / mẫu của lần boot trước thì không)
+    bool accepts(const TelemetryRecord& rec) const;
+    bool add(const TelemetryRecord& rec);   // false nếu batch đã đầy (số mẫu hoặc số byte CBOR)
+    bool shouldFlush(uint32_t now) const;
+    size_t count() const { return _count; }
+
+    // Encode các mẫu đang giữ ra CBOR, trả về số byte (0 nếu lỗi, batch giữ nguyên)
+    size_t encode(uint8_t* out, size_t capacity, uint32_t now);
+    void clear() { _count = 0; _encodedSize = TLM_BATCH_HEADER_MAX; }
+
+    TelemetryBatcher(const TelemetryBatcher&) = delete;
+    TelemetryBatcher& operator=(const TelemetryBatcher&) = delete;
+
+private:
+    TelemetryBatcher();
+    static size_t headSize(uint32_t value);     // Số byte của CborWriter::writeHead
+    static size_t sampleSize(const TelemetryRecord& rec, uint32_t base);
+
+    bool _enabled;
+    uint32_t _windowMs;
+    size_t _count;
+    size_t _encodedSize;    // Cận trên số byte CBOR của các mẫu đang giữ (kể cả header)
+    TelemetryRecord _samples[TLM_BATCH_MAX_SAMPLES];
+};
+
+#endif
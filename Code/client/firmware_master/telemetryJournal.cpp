@@ -0,0 +1,250 @@
+#include "telemetryJournal.h"
+
+TelemetryJournal::TelemetryJournal()
+    : _readFileSeg(0), _firstSeg(0), _ready(false), _bootId(0), _writeSeq(0), _readSeq(0), _unsavedPops(0),
+      _appended(0), _replayed(0), _dropped(0), _crcErrors(0) {
+    _mutex = xSemaphoreCreateMutex();
+}
+
+bool TelemetryJournal::begin() {
+    if (_ready) return true;
+
+    if (!LittleFS.begin(true)) {
+        Serial.println("❌ [Journal] LittleFS mount failed, offline telemetry will be dropped");
+        return false;
+    }
+
+    Settings settings("telemetry", true);
+    _bootId = (uint16_t)(settings.getInt("jrn_boot", 0) + 1);
+    settings.setInt("jrn_boot", _bootId);
+
+    if (LittleFS.exists(JRN_LEGACY_FILE)) {
+        LittleFS.remove(JRN_LEGACY_FILE);
+        Serial.println("🧹 [Journal] Removed legacy ring file");
+    }
+    LittleFS.mkdir(JRN_DIR);
+    File dir = LittleFS.open(JRN_DIR);
+    if (!dir || !dir.isDirectory()) {
+        Serial.println("❌ [Journal] Cannot open journal directory");
+        return false;
+    }
+
+    // Tìm segment cũ nhất / mới nhất (tên file = số segment)
+    bool found = false;
+    uint32_t firstSeg = 0;
+    uint32_t lastSeg = 0;
+    uint32_t segments = 0;
+    for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+        const char* name = strrchr(file.name(), '/');
+        name = name ? name + 1 : file.name();
+        uint32_t segment = strtoul(name, nullptr, 10);
+        file.close();
+        if (!found || segment < firstSeg) firstSeg = segment;
+        if (!found || segment > lastSeg) lastSeg = segment;
+        found = true;
+        segments++;
+    }
+    dir.close();
+
+    if (found) {
+        // Đếm record hợp lệ trong segment cuối; đuôi hỏng (mất điện lúc đang ghi) -> ghi tiếp ở segment mới
+        _firstSeg = firstSeg;
+        _writeSeq = lastSeg * JRN_SEGMENT_RECORDS;
+        JournalEntry entry;
+        while (readEntry(_writeSeq, entry) && entry.seq == _writeSeq) {
+            _writeSeq++;
+            if (_writeSeq % JRN_SEGMENT_RECORDS == 0) break;
+        }
+        File last = LittleFS.open(segmentPath(lastSeg), FILE_READ);
+        size_t expected = (_writeSeq - lastSeg * JRN_SEGMENT_RECORDS) * sizeof(JournalEntry);
+        if (last && last.size() != expected) {
+            _writeSeq = (lastSeg + 1) * JRN_SEGMENT_RECORDS;
+        }
+        last.close();
+    } else {
+        // Không còn segment nào: đánh số tiếp từ read cursor
+        _writeSeq = (uint32_t)settings.getInt("jrn_read", 0);
+        _firstSeg = _writeSeq / JRN_SEGMENT_RECORDS;
+    }
+
+    // Read cursor trong NVS có thể cũ hơn thực tế (chỉ lưu mỗi JRN_CURSOR_SAVE_EVERY record)
+    _readSeq = (uint32_t)settings.getInt("jrn_read", 0);
+    if (_readSeq > _writeSeq) {
+        _readSeq = _writeSeq;
+    }
+    if (_readSeq < _firstSeg * JRN_SEGMENT_RECORDS) {
+        _readSeq = _firstSeg * JRN_SEGMENT_RECORDS;
+    }
+    dropReplayedSegments();
+
+    _ready = true;
+    Serial.printf("✅ [Journal] Ready (boot #%u, %u segment(s) on flash)\n", _bootId, segments);
+    printStats();
+    return true;
+}
+
+bool TelemetryJournal::append(const TelemetryRecord& rec) {
+    if (!_ready || (rec.flags & TLM_FLAG_NC)) return false;
+
+    JournalEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.bootId = _bootId;
+    entry.record = rec;
+    entry.record.flags &= ~TLM_FLAG_PREV_BOOT;
+    if (rec.type == TLM_BLOB) {
+        // Arena không sống qua reboot -> giữ phần đầu của chuỗi ngay trong record
+        const char* data = TelemetryArena::getInstance().get(rec.value.blob.handle);
+        entry.record.type = TLM_STR;
+        memset(entry.record.value.s, 0, TLM_SHORT_STR_LEN);
+        if (data) {
+            strncpy(entry.record.value.s, data, TLM_SHORT_STR_LEN - 1);
+        }
+    }
+
+    bool ok = false;
+    if (xSemaphoreTake(_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+        Serial.println("⚠️ [Journal] Could not acquire mutex for append");
+        return false;
+    }
+    uint32_t writeSeg = _writeSeq / JRN_SEGMENT_RECORDS;
+    if (writeSeg - _firstSeg >= JRN_MAX_SEGMENTS) {
+        // Journal đầy -> bỏ cả segment cũ nhất
+        uint32_t segEnd = (_firstSeg + 1) * JRN_SEGMENT_RECORDS;
+        if (_readSeq < segEnd) {
+            _dropped += segEnd - max(_readSeq, _firstSeg * JRN_SEGMENT_RECORDS);
+            _readSeq = segEnd;
+        }
+        removeSegment(_firstSeg);
+        _firstSeg++;
+    }
+    entry.seq = _writeSeq;
+    entry.crc = crc32((const uint8_t*)&entry, offsetof(JournalEntry, crc));
+
+    if (openWriteSegment() && _writeFile.write((const uint8_t*)&entry, sizeof(entry)) == sizeof(entry)) {
+        _writeFile.flush();
+        _writeSeq++;
+        _appended++;
+        ok = true;
+        if (_writeSeq % JRN_SEGMENT_RECORDS == 0) {
+            _writeFile.close();     // Segment đủ record -> lần sau mở file mới
+        }
+    } else {
+        Serial.printf("❌ [Journal] Write failed at seq %u\n", (unsigned)_writeSeq);
+        _writeFile.close();
+    }
+    xSemaphoreGive(_mutex);
+    return ok;
+}
+
+bool TelemetryJournal::peek(TelemetryRecord& rec) {
+    if (!_ready) return false;
+
+    bool found = false;
+    if (xSemaphoreTake(_mutex, pdMS_TO_TICKS(100)) != pdTRUE) return false;
+    JournalEntry entry;
+    while (_readSeq < _writeSeq) {
+        if (readEntry(_readSeq, entry) && entry.seq == _readSeq) {
+            rec = entry.record;
+            if (entry.bootId != _bootId) {
+                rec.flags |= TLM_FLAG_PREV_BOOT;
+            }
+            found = true;
+            break;
+        }
+        uint32_t segment = _readSeq / JRN_SEGMENT_RECORDS;
+        size_t offset = (_readSeq % JRN_SEGMENT_RECORDS) * sizeof(JournalEntry);
+        if (segment < _writeSeq / JRN_SEGMENT_RECORDS && (!_readFile || offset >= _readFile.size())) {
+            // Segment bị ngắt giữa chừng (mất điện) đã đọc hết -> sang segment sau
+            _readSeq = (segment + 1) * JRN_SEGMENT_RECORDS;
+        } else {
+            // Record hỏng (mất điện lúc đang ghi) -> bỏ qua
+            _crcErrors++;
+            _readSeq++;
+        }
+        dropReplayedSegments();
+    }
+    xSemaphoreGive(_mutex);
+    return found;
+}
+
+void TelemetryJournal::pop() {
+    if (!_ready) return;
+    if (xSemaphoreTake(_mutex, pdMS_TO_TICKS(100)) != pdTRUE) return;
+    if (_readSeq < _writeSeq) {
+        _readSeq++;
+        _replayed++;
+        _unsavedPops++;
+        if (_unsavedPops >= JRN_CURSOR_SAVE_EVERY || pending() == 0) {
+            saveCursor();
+        }
+        dropReplayedSegments();
+    }
+    xSemaphoreGive(_mutex);
+}
+
+void TelemetryJournal::printStats() {
+    Serial.printf("📼 [Journal] pending %u/%u, appended %u, replayed %u, dropped %u, crc errors %u, wraps %u\n",
+                  pending(), capacity(), _appended, _replayed, _dropped, _crcErrors, getWraps());
+}
+
+bool TelemetryJournal::readEntry(uint32_t seq, JournalEntry& entry) {
+    uint32_t segment = seq / JRN_SEGMENT_RECORDS;
+    uint32_t offset = (seq % JRN_SEGMENT_RECORDS) * sizeof(JournalEntry);
+    // Segment đang ghi: mở lại nếu handle cũ chưa thấy phần vừa nối thêm
+    if (_readFile && _readFileSeg == segment && offset + sizeof(entry) > _readFile.size()) {
+        _readFile.close();
+    }
+    if (!_readFile || _readFileSeg != segment) {
+        _readFile.close();
+        _readFile = LittleFS.open(segmentPath(segment), FILE_READ);
+        _readFileSeg = segment;
+        if (!_readFile) return false;
+    }
+    if (!_readFile.seek(offset)) return false;
+    if (_readFile.read((uint8_t*)&entry, sizeof(entry)) != sizeof(entry)) return false;
+    return entry.crc == crc32((const uint8_t*)&entry, offsetof(JournalEntry, crc));
+}
+
+// Gọi khi đang giữ _mutex
+bool TelemetryJournal::openWriteSegment() {
+    if (_writeFile) return true;
+    _writeFile = LittleFS.open(segmentPath(_writeSeq / JRN_SEGMENT_RECORDS), FILE_APPEND);
+    return (bool)_writeFile;
+}
+
+void TelemetryJournal::removeSegment(uint32_t segment) {
+    if (_readFile && _readFileSeg == segment) {
+        _readFile.close();
+    }
+    LittleFS.remove(segmentPath(segment));
+}
+
+// Xóa các segment đã replay hết (không xóa segment đang ghi)
+void TelemetryJournal::dropReplayedSegments() {
+    uint32_t writeSeg = _writeSeq / JRN_SEGMENT_RECORDS;
+    while (_firstSeg < _readSeq / JRN_SEGMENT_RECORDS && _firstSeg < writeSeg) {
+        removeSegment(_firstSeg);
+        _firstSeg++;
+    }
+}
+
+String TelemetryJournal::segmentPath(uint32_t segment) {
+    return String(JRN_DIR) + "/" + String(segment);
+}
+
+void TelemetryJournal::saveCursor() {
+    Settings settings("telemetry", true);
+    settings.setInt("jrn_read", (int32_t)_readSeq);
+    _unsavedPops = 0;
+}
+
+uint32_t TelemetryJournal::crc32(const uint8_t* data, size_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
@@ -0,0 +1,105 @@
+#ifndef TELEMETRY_JOURNAL_H
+#define TELEMETRY_JOURNAL_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include "telemetry.h"
+#include "settings.h"
+
+// ======= Journal Configuration =======
+#define JRN_DIR                 "/jrn"              // Mỗi segment 1 file: /jrn/<số segment>
+#define JRN_LEGACY_FILE         "/tlm_journal.bin"  // Ring 1 file cũ, xóa khi begin()
+#define JRN_SEGMENT_RECORDS     112     // 112 * 36 bytes = 4032 B: 1 segment vừa 1 block LittleFS
+#define JRN_MAX_SEGMENTS        16      // 16 segment = 1792 record (~64 KB), ~4h với 1 mẫu / 8s
+#define JRN_MAX_SLOTS           (JRN_SEGMENT_RECORDS * JRN_MAX_SEGMENTS)
+#define JRN_REPLAY_BURST        4       // Số record replay mỗi lượt
+#define JRN_REPLAY_INTERVAL_MS  250     // -> tối đa 16 msg/s, không làm nghẽn broker sau khi reconnect
+#define JRN_CURSOR_SAVE_EVERY   16      // Ghi read cursor vào NVS mỗi N record (giảm ghi NVS)
+
+// ======= Journal Entry (trên flash) =======
+// Record seq nằm ở segment seq / JRN_SEGMENT_RECORDS, vị trí (seq % JRN_SEGMENT_RECORDS) trong file.
+// Segment chỉ được ghi nối đuôi (không seek + ghi giữa file: LittleFS copy-on-write sẽ ghi lại
+// cả phần sau), đọc hết thì xóa cả file. seq tăng đơn điệu qua các lần boot nên begin() chỉ cần
+// tìm segment lớn nhất và đếm record trong đó.
+struct JournalEntry {
+    uint32_t seq;
+    uint16_t bootId;        // Lần boot ghi record (timestamp millis() chỉ đúng trong cùng 1 boot)
+    uint16_t reserved;
+    TelemetryRecord record;
+    uint32_t crc;           // CRC32 của tất cả các field phía trên
+};
+
+// ======= Telemetry Journal =======
+/**
+ * Journal append-only cho telemetry khi mất WiFi / broker (store-and-forward).
+ *
+ * - append(): record được ghi nối đuôi vào segment file trên LittleFS; đủ
+ *   JRN_MAX_SEGMENTS segment thì xóa segment cũ nhất (record chưa gửi đếm vào dropped).
+ * - peek()/pop(): đọc lại theo đúng thứ tự để replay sau khi reconnect.
+ *   Read cursor được lưu trong NVS ("telemetry"/"jrn_read") nên reboot giữa
+ *   chừng chỉ gửi lặp tối đa JRN_CURSOR_SAVE_EVERY record. Segment đã replay hết bị xóa.
+ *
+ * Notification (NC) không được ghi vào journal. Chuỗi dài (TLM_BLOB) bị cắt
+ * còn TLM_SHORT_STR_LEN - 1 ký tự vì arena không tồn tại qua reboot.
+ */
+class TelemetryJournal {
+public:
+    static TelemetryJournal& getInstance() {
+        static TelemetryJournal instance;
+        return instance;
+    }
+
+    bool begin();       // Mount LittleFS, quét journal, load read cursor từ NVS
+
+    bool append(const TelemetryRecord& rec);
+    // Lấy record cũ nhất chưa gửi (không xóa). Record của lần boot trước có TLM_FLAG_PREV_BOOT.
+    bool peek(TelemetryRecord& rec);
+    void pop();         // Đánh dấu record vừa peek() đã gửi xong
+
+    bool isReady() const { return _ready; }
+    uint32_t pending() const { return _writeSeq - _readSeq; }
+    uint32_t capacity() const { return JRN_MAX_SLOTS; }
+
+    // ======= Metrics =======
+    uint32_t getAppended() const { return _appended; }     // Trong lần boot này
+    uint32_t getReplayed() const { return _replayed; }
+    uint32_t getDropped() const { return _dropped; }       // Bị bỏ khi journal đầy
+    uint32_t getCrcErrors() const { return _crcErrors; }
+    // Số vòng journal đã ghi từ trước tới nay (seq tăng liên tục qua các lần boot)
+    uint32_t getWraps() const { return _writeSeq / JRN_MAX_SLOTS; }
+    void printStats();
+
+    TelemetryJournal(const TelemetryJournal&) = delete;
+    TelemetryJournal& operator=(const TelemetryJournal&) = delete;
+
+private:
+    TelemetryJournal();
+
+    bool readEntry(uint32_t seq, JournalEntry& entry);
+    bool openWriteSegment();
+    void removeSegment(uint32_t segment);
+    void dropReplayedSegments();
+    static String segmentPath(uint32_t segment);
+    void saveCursor();
+    static uint32_t crc32(const uint8_t* data, size_t len);
+
+    SemaphoreHandle_t _mutex;
+    File _writeFile;        // Segment đang ghi (append)
+    File _readFile;         // Segment đang replay
+    uint32_t _readFileSeg;
+    uint32_t _firstSeg;     // Segment cũ nhất còn trên flash
+    bool _ready;
+    uint16_t _bootId;
+    uint32_t _writeSeq;     // seq của record tiếp theo sẽ ghi
+    uint32_t _readSeq;      // seq của record cũ nhất chưa gửi
+    uint32_t _unsavedPops;
+
+    uint32_t _appended;
+    uint32_t _replayed;
+    uint32_t _dropped;
+    uint32_t _crcErrors;
+};
+
+#endif
@@ -0,0 +1,383 @@
+#include "tlsClient.h"
+#include "settings.h"
+#include <mbedtls/net_sockets.h>
+#include <new>
+
+// mbedTLS 3.x ẩn field của struct, 2.x thì không
+#ifndef MBEDTLS_PRIVATE
+#define MBEDTLS_PRIVATE(member) member
+#endif
+
+// ======= TLS Session Cache =======
+TlsSessionCache::TlsSessionCache() : _mutex(NULL), _insecure(false) {
+    memset(_entries, 0, sizeof(_entries));
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+        mbedtls_ssl_session_init(&_entries[i].session);
+    }
+}
+
+void TlsSessionCache::begin() {
+    if (_mutex == NULL) {
+        _mutex = xSemaphoreCreateMutex();
+    }
+    Settings tlsSettings("tls", false);
+    _ca = tlsSettings.getString("ca", "");
+    _insecure = tlsSettings.getBool("insecure", false);
+    if (_ca.length() > 0) {
+        Serial.printf("🔐 [TLS] CA certificate loaded (%u bytes)\n", _ca.length());
+    } else if (_insecure) {
+        Serial.println("⚠️ [TLS] No CA in NVS, tls/insecure=1: server certificates will NOT be verified");
+    } else {
+        Serial.println("⚠️ [TLS] No CA in NVS, TLS connections will be refused (set tls/ca)");
+    }
+}
+
+TlsSessionCache::Entry* TlsSessionCache::find(const char* host, uint16_t port, bool create) {
+    Entry* oldest = nullptr;
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+        Entry& entry = _entries[i];
+        if (entry.port == port && strncmp(entry.host, host, sizeof(entry.host)) == 0) {
+            return &entry;
+        }
+        if (oldest == nullptr || entry.port == 0 ||
+            (oldest->port != 0 && entry.lastUsed < oldest->lastUsed)) {
+            oldest = &entry;
+        }
+    }
+    if (!create || oldest == nullptr) return nullptr;
+
+    // Thay host dùng lâu nhất
+    if (oldest->valid) {
+        mbedtls_ssl_session_free(&oldest->session);
+    }
+    memset(oldest, 0, sizeof(Entry));
+    mbedtls_ssl_session_init(&oldest->session);
+    strncpy(oldest->host, host, sizeof(oldest->host) - 1);
+    oldest->port = port;
+    oldest->lastUsed = millis();
+    return oldest;
+}
+
+bool TlsSessionCache::restore(const char* host, uint16_t port, mbedtls_ssl_context* ssl) {
+    if (_mutex == NULL || !xSemaphoreTake(_mutex, portMAX_DELAY)) return false;
+    bool offered = false;
+    Entry* entry = find(host, port, false);
+    if (entry != nullptr && entry->valid) {
+        offered = mbedtls_ssl_set_session(ssl, &entry->session) == 0;
+        entry->lastUsed = millis();
+    }
+    xSemaphoreGive(_mutex);
+    return offered;
+}
+
+bool TlsSessionCache::store(const char* host, uint16_t port, const mbedtls_ssl_context* ssl) {
+    mbedtls_ssl_session fresh;
+    mbedtls_ssl_session_init(&fresh);
+    if (mbedtls_ssl_get_session(ssl, &fresh) != 0) {
+        mbedtls_ssl_session_free(&fresh);
+        return false;
+    }
+    if (_mutex == NULL || !xSemaphoreTake(_mutex, portMAX_DELAY)) {
+        mbedtls_ssl_session_free(&fresh);
+        return false;
+    }
+
+    bool resumed = false;
+    Entry* entry = find(host, port, true);
+    if (entry->valid) {
+        // Resume (session id hoặc ticket) giữ nguyên master secret của session cũ
+        resumed = memcmp(entry->session.MBEDTLS_PRIVATE(master), fresh.MBEDTLS_PRIVATE(master),
+                         sizeof(fresh.MBEDTLS_PRIVATE(master))) == 0;
+        mbedtls_ssl_session_free(&entry->session);
+    }
+    // Chuyển quyền sở hữu (ticket, chứng chỉ) của fresh sang cache, không free fresh
+    entry->session = fresh;
+    entry->valid = true;
+    entry->lastUsed = millis();
+    xSemaphoreGive(_mutex);
+    return resumed;
+}
+
+void TlsSessionCache::forget(const char* host, uint16_t port) {
+    if (_mutex == NULL || !xSemaphoreTake(_mutex, portMAX_DELAY)) return;
+    Entry* entry = find(host, port, false);
+    if (entry != nullptr && entry->valid) {
+        mbedtls_ssl_session_free(&entry->session);
+        mbedtls_ssl_session_init(&entry->session);
+        entry->valid = false;
+    }
+    xSemaphoreGive(_mutex);
+}
+
+void TlsSessionCache::record(const char* host, uint16_t port, bool resumed, uint32_t ms, uint32_t heapUsed) {
+    if (_mutex == NULL || !xSemaphoreTake(_mutex, portMAX_DELAY)) return;
+    Entry* entry = find(host, port, true);
+    if (resumed) {
+        entry->resumedHandshakes++;
+        entry->resumedMs += ms;
+    } else {
+        entry->fullHandshakes++;
+        entry->fullMs += ms;
+    }
+    if (heapUsed > entry->heapPeak) entry->heapPeak = heapUsed;
+    xSemaphoreGive(_mutex);
+}
+
+void TlsSessionCache::printStats() {
+    if (_mutex == NULL || !xSemaphoreTake(_mutex, portMAX_DELAY)) return;
+    bool any = false;
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+        const Entry& entry = _entries[i];
+        if (entry.port == 0) continue;
+        any = true;
+        Serial.printf("🔐 [TLS] %s:%u full %u (avg %u ms), resumed %u (avg %u ms), heap peak %u B\n",
+                      entry.host, entry.port,
+                      entry.fullHandshakes, entry.fullHandshakes ? entry.fullMs / entry.fullHandshakes : 0,
+                      entry.resumedHandshakes, entry.resumedHandshakes ? entry.resumedMs / entry.resumedHandshakes : 0,
+                      entry.heapPeak);
+    }
+    xSemaphoreGive(_mutex);
+    if (!any) return;     // Chưa có kết nối TLS nào
+    Serial.printf("🔐 [TLS] Mode: %s\n", _ca.length() > 0 ? "verify CA"
+                                       : _insecure ? "INSECURE (no certificate verification)" : "no CA, refusing");
+    Serial.printf("🔐 [TLS] Free heap %u B, minimum since boot %u B\n", ESP.getFreeHeap(), ESP.getMinFreeHeap());
+}
+
+// ======= TLS Client =======
+TlsClient::TlsClient() : _tls(nullptr), _peeked(-1), _resumed(false), _handshakeMs(0), _heapLow(0) {}
+
+TlsClient::~TlsClient() {
+    stop();
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port) {
+    return connect(ip, port, TLS_HANDSHAKE_TIMEOUT_MS);
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port, int32_t timeout) {
+    stop();
+    if (!WiFiClient::connect(ip, port, timeout)) return 0;
+    return handshake(ip.toString().c_str(), port) ? 1 : 0;
+}
+
+int TlsClient::connect(const char* host, uint16_t port) {
+    return connect(host, port, TLS_HANDSHAKE_TIMEOUT_MS);
+}
+
+int TlsClient::connect(const char* host, uint16_t port, int32_t timeout) {
+    stop();
+    if (!WiFiClient::connect(host, port, timeout)) return 0;
+    return handshake(host, port) ? 1 : 0;
+}
+
+bool TlsClient::handshake(const char* host, uint16_t port) {
+    TlsSessionCache& cache = TlsSessionCache::getInstance();
+    if (cache.caCert() == nullptr && !cache.insecure()) {
+        Serial.printf("❌ [TLS] No CA for %s:%u, refusing unverified connection\n", host, port);
+        WiFiClient::stop();
+        return false;
+    }
+    uint32_t start = millis();
+    uint32_t heapBefore = ESP.getFreeHeap();
+    _heapLow = heapBefore;
+    _resumed = false;
+
+    _tls = new (std::nothrow) TlsState;
+    if (_tls == nullptr) {
+        Serial.println("❌ [TLS] Out of memory");
+        WiFiClient::stop();
+        return false;
+    }
+    mbedtls_ssl_init(&_tls->ssl);
+    mbedtls_ssl_config_init(&_tls->conf);
+    mbedtls_ctr_drbg_init(&_tls->drbg);
+    mbedtls_entropy_init(&_tls->entropy);
+    mbedtls_x509_crt_init(&_tls->ca);
+
+    int ret = mbedtls_ctr_drbg_seed(&_tls->drbg, mbedtls_entropy_func, &_tls->entropy, nullptr, 0);
+    if (ret == 0) {
+        ret = mbedtls_ssl_config_defaults(&_tls->conf, MBEDTLS_SSL_IS_CLIENT,
+                                          MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if (ret == 0) {
+        const char* ca = cache.caCert();
+        if (ca != nullptr) {
+            ret = mbedtls_x509_crt_parse(&_tls->ca, (const unsigned char*)ca, strlen(ca) + 1);
+            mbedtls_ssl_conf_ca_chain(&_tls->conf, &_tls->ca, nullptr);
+            mbedtls_ssl_conf_authmode(&_tls->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        } else {
+            // Chỉ tới được đây khi NVS "tls"/"insecure" = 1
+            mbedtls_ssl_conf_authmode(&_tls->conf, MBEDTLS_SSL_VERIFY_NONE);
+        }
+    }
+    if (ret == 0) {
+        mbedtls_ssl_conf_rng(&_tls->conf, mbedtls_ctr_drbg_random, &_tls->drbg);
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        // Resume TLS 1.3 phải chờ NewSessionTicket sau handshake -> giữ TLS 1.2
+        mbedtls_ssl_conf_max_tls_version(&_tls->conf, MBEDTLS_SSL_VERSION_TLS1_2);
+#endif
+        ret = mbedtls_ssl_setup(&_tls->ssl, &_tls->conf);
+    }
+    if (ret == 0) {
+        ret = mbedtls_ssl_set_hostname(&_tls->ssl, host);
+    }
+    if (ret != 0) {
+        Serial.printf("❌ [TLS] Setup failed: -0x%04x\n", -ret);
+        stop();
+        return false;
+    }
+
+    mbedtls_ssl_set_bio(&_tls->ssl, this, bioSend, bioRecv, nullptr);
+    bool offered = cache.restore(host, port, &_tls->ssl);
+
+    while ((ret = mbedtls_ssl_handshake(&_tls->ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) break;
+        if (millis() - start > TLS_HANDSHAKE_TIMEOUT_MS) {
+            ret = MBEDTLS_ERR_SSL_TIMEOUT;
+            break;
+        }
+        delay(2);
+    }
+    if (ret != 0) {
+        Serial.printf("❌ [TLS] Handshake with %s:%u failed: -0x%04x\n", host, port, -ret);
+        if (offered) {
+            // Lần sau handshake đầy đủ thay vì thử lại session cũ
+            cache.forget(host, port);
+        }
+        stop();
+        return false;
+    }
+
+    _handshakeMs = millis() - start;
+    _resumed = cache.store(host, port, &_tls->ssl);
+    trackHeap();
+    cache.record(host, port, _resumed, _handshakeMs, heapBefore - _heapLow);
+    Serial.printf("🔐 [TLS] %s:%u %s handshake in %u ms, heap used %u B\n",
+                  host, port, _resumed ? "resumed" : "full", _handshakeMs, heapBefore - _heapLow);
+    return true;
+}
+
+void TlsClient::trackHeap() {
+    uint32_t freeHeap = ESP.getFreeHeap();
+    if (freeHeap < _heapLow) _heapLow = freeHeap;
+}
+
+int TlsClient::bioSend(void* ctx, const unsigned char* buf, size_t len) {
+    TlsClient* self = static_cast<TlsClient*>(ctx);
+    self->trackHeap();
+    size_t written = self->WiFiClient::write(buf, len);
+    if (written > 0) return (int)written;
+    return self->WiFiClient::connected() ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+int TlsClient::bioRecv(void* ctx, unsigned char* buf, size_t len) {
+    TlsClient* self = static_cast<TlsClient*>(ctx);
+    self->trackHeap();
+    int avail = self->WiFiClient::available();
+    if (avail <= 0) {
+        return self->WiFiClient::connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+    }
+    int n = self->WiFiClient::read(buf, min(len, (size_t)avail));
+    return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+size_t TlsClient::write(uint8_t b) {
+    return write(&b, 1);
+}
+
+size_t TlsClient::write(const uint8_t* buf, size_t size) {
+    if (_tls == nullptr) return 0;
+    size_t sent = 0;
+    uint32_t start = millis();
+    while (sent < size) {
+        int ret = mbedtls_ssl_write(&_tls->ssl, buf + sent, size - sent);
+        if (ret > 0) {
+            sent += ret;
+            continue;
+        }
+        if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+            millis() - start > TLS_IO_TIMEOUT_MS) {
+            Serial.printf("❌ [TLS] Write failed: -0x%04x\n", -ret);
+            stop();
+            break;
+        }
+        delay(1);
+    }
+    return sent;
+}
+
+int TlsClient::available() {
+    if (_tls == nullptr) return 0;
+    int pending = mbedtls_ssl_get_bytes_avail(&_tls->ssl);
+    if (pending == 0 && WiFiClient::available() > 0) {
+        // Giải mã record đang chờ trên socket để biết còn bao nhiêu byte dữ liệu
+        int ret = mbedtls_ssl_read(&_tls->ssl, nullptr, 0);
+        if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            stop();
+            return _peeked >= 0 ? 1 : 0;
+        }
+        pending = mbedtls_ssl_get_bytes_avail(&_tls->ssl);
+    }
+    return pending + (_peeked >= 0 ? 1 : 0);
+}
+
+int TlsClient::read() {
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int TlsClient::read(uint8_t* buf, size_t size) {
+    if (size == 0) return 0;
+    size_t got = 0;
+    if (_peeked >= 0) {
+        buf[got++] = (uint8_t)_peeked;
+        _peeked = -1;
+        if (got == size) return got;
+    }
+    if (_tls == nullptr) return got > 0 ? got : -1;
+
+    int ret = mbedtls_ssl_read(&_tls->ssl, buf + got, size - got);
+    if (ret > 0) return got + ret;
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        // 0 / close_notify: server đóng kết nối
+        stop();
+    }
+    return got > 0 ? got : -1;
+}
+
+int TlsClient::peek() {
+    if (_peeked < 0) {
+        uint8_t b;
+        if (read(&b, 1) == 1) _peeked = b;
+    }
+    return _peeked;
+}
+
+void TlsClient::flush() {
+    // mbedtls_ssl_write() đã ghi hết record ra socket
+}
+
+void TlsClient::stop() {
+    freeTls();
+    _peeked = -1;
+    WiFiClient::stop();
+}
+
+void TlsClient::freeTls() {
+    if (_tls == nullptr) return;
+    mbedtls_ssl_close_notify(&_tls->ssl);
+    mbedtls_ssl_free(&_tls->ssl);
+    mbedtls_ssl_config_free(&_tls->conf);
+    mbedtls_ctr_drbg_free(&_tls->drbg);
+    mbedtls_entropy_free(&_tls->entropy);
+    mbedtls_x509_crt_free(&_tls->ca);
+    delete _tls;
+    _tls = nullptr;
+}
+
+uint8_t TlsClient::connected() {
+    if (_peeked >= 0) return 1;
+    if (_tls == nullptr) return 0;
+    if (mbedtls_ssl_get_bytes_avail(&_tls->ssl) > 0) return 1;
+    return WiFiClient::connected();
+}
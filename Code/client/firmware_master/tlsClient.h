@@ -0,0 +1,134 @@
+#ifndef TLS_CLIENT_H
+#define TLS_CLIENT_H
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+
+// ======= TLS Configuration =======
+#define TLS_SESSION_CACHE_SIZE      4       // Số host (broker, backend...) giữ session để resume
+#define TLS_HOST_MAX_LEN            64
+#define TLS_HANDSHAKE_TIMEOUT_MS    10000
+#define TLS_IO_TIMEOUT_MS           5000
+#define TLS_MQTT_DEFAULT_PORT       8883
+
+// ======= TLS Session Cache =======
+/**
+ * Session TLS dùng chung cho mọi kết nối TLS của thiết bị (MQTT, OTA, audio).
+ *
+ * Handshake đầy đủ trên ESP32 mất 1-3 s và ~40 KB heap. Sau lần đầu, session
+ * (session id hoặc session ticket) của từng host được giữ lại; lần kết nối sau
+ * tới cùng host chỉ cần handshake rút gọn, không trao đổi khóa / kiểm tra chứng chỉ.
+ *
+ * CA (PEM) đọc từ NVS "tls"/"ca". Không có CA -> handshake bị từ chối, trừ khi
+ * NVS "tls"/"insecure" = 1 (chỉ dùng khi thử nghiệm: chấp nhận mọi chứng chỉ).
+ */
+class TlsSessionCache {
+public:
+    static TlsSessionCache& getInstance() {
+        static TlsSessionCache instance;
+        return instance;
+    }
+
+    void begin();
+    const char* caCert() const { return _ca.length() > 0 ? _ca.c_str() : nullptr; }
+    bool insecure() const { return _insecure; }
+
+    // Nạp session đã lưu của host vào ssl trước handshake. Trả về true nếu có session để thử resume
+    bool restore(const char* host, uint16_t port, mbedtls_ssl_context* ssl);
+    // Lưu session sau handshake thành công. Trả về true nếu handshake vừa rồi là resume
+    bool store(const char* host, uint16_t port, const mbedtls_ssl_context* ssl);
+    void forget(const char* host, uint16_t port);
+    void record(const char* host, uint16_t port, bool resumed, uint32_t ms, uint32_t heapUsed);
+    void printStats();
+
+    TlsSessionCache(const TlsSessionCache&) = delete;
+    TlsSessionCache& operator=(const TlsSessionCache&) = delete;
+
+private:
+    TlsSessionCache();
+
+    struct Entry {
+        char host[TLS_HOST_MAX_LEN];
+        uint16_t port;
+        bool valid;
+        uint32_t lastUsed;
+        mbedtls_ssl_session session;
+        // Metrics
+        uint16_t fullHandshakes;
+        uint16_t resumedHandshakes;
+        uint32_t fullMs;
+        uint32_t resumedMs;
+        uint32_t heapPeak;      // Heap lớn nhất 1 handshake dùng (byte)
+    };
+
+    Entry* find(const char* host, uint16_t port, bool create);
+
+    Entry _entries[TLS_SESSION_CACHE_SIZE];
+    SemaphoreHandle_t _mutex;
+    String _ca;
+    bool _insecure;
+};
+
+// ======= TLS Client =======
+/**
+ * Client TLS (mbedTLS) dùng TlsSessionCache để resume session.
+ * Kế thừa WiFiClient để dùng được với HTTPClient::begin(client, url) và MqttClient;
+ * phần TCP vẫn do WiFiClient xử lý. Trạng thái mbedTLS chỉ được cấp phát
+ * khi đang kết nối để client rảnh không tốn heap.
+ */
+class TlsClient : public WiFiClient {
+public:
+    TlsClient();
+    ~TlsClient();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(IPAddress ip, uint16_t port, int32_t timeout) override;
+    int connect(const char* host, uint16_t port) override;
+    int connect(const char* host, uint16_t port, int32_t timeout) override;
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t* buf, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buf, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override { return connected(); }
+    using Print::write;
+
+    bool lastResumed() const { return _resumed; }
+    uint32_t lastHandshakeMs() const { return _handshakeMs; }
+
+    TlsClient(const TlsClient&) = delete;
+    TlsClient& operator=(const TlsClient&) = delete;
+
+private:
+    struct TlsState {
+        mbedtls_ssl_context ssl;
+        mbedtls_ssl_config conf;
+        mbedtls_ctr_drbg_context drbg;
+        mbedtls_entropy_context entropy;
+        mbedtls_x509_crt ca;
+    };
+
+    static int bioSend(void* ctx, const unsigned char* buf, size_t len);
+    static int bioRecv(void* ctx, unsigned char* buf, size_t len);
+    bool handshake(const char* host, uint16_t port);
+    void freeTls();
+    void trackHeap();
+
+    TlsState* _tls;
+    int _peeked;                // Byte đã peek() nhưng chưa read(), -1 = không có
+    bool _resumed;
+    uint32_t _handshakeMs;
+    uint32_t _heapLow;          // Heap thấp nhất trong lúc handshake
+};
+
+#endif
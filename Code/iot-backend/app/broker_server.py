@@ -8,9 +8,11 @@ Mục đích: Học tập và hiểu rõ cách hoạt động của MQTT Broker
 """
 
 import socket
+import ssl
 import threading
 import struct
 import time
+from collections import deque
 from typing import Dict, List, Optional
 from app.security import verify_device_token    
 # MQTT Control Packet Types (theo MQTT 3.1.1 specification)
@@ -31,9 +33,170 @@ MQTT_PACKET_TYPES = {
     14: 'DISCONNECT'
 }
 TAG = "MQTT Broker : "
+
+
+def decode_remaining_length(data, offset=1):
+    """
+    Giải mã Remaining Length (MQTT 3.1.1 mục 2.2.3)
+    Trả về (remaining_length, header_len) hoặc (None, None) nếu thiếu byte
+    """
+    multiplier = 1
+    value = 0
+    index = offset
+    while index < len(data) and index < offset + 4:
+        encoded = data[index]
+        value += (encoded & 0x7F) * multiplier
+        index += 1
+        if (encoded & 0x80) == 0:
+            return value, index
+        multiplier *= 128
+    return None, None
+
+
+def encode_remaining_length(length):
+    """Mã hóa Remaining Length thành 1-4 byte"""
+    encoded = bytearray()
+    while True:
+        digit = length % 128
+        length //= 128
+        if length > 0:
+            digit |= 0x80
+        encoded.append(digit)
+        if length == 0:
+            return bytes(encoded)
+
+def split_mqtt_packets(buffer):
+    """
+    Tách các packet hoàn chỉnh khỏi stream TCP.
+    1 lần recv() có thể chứa nhiều packet (thiết bị gửi liên tiếp nhiều QoS 1
+    publish trong in-flight window) hoặc chỉ một phần packet.
+    Trả về ([(first_byte, payload), ...], phần dữ liệu còn thiếu)
+    """
+    packets = []
+    offset = 0
+    while len(buffer) - offset >= 2:
+        remaining_length, header_len = decode_remaining_length(buffer, offset + 1)
+        if remaining_length is None:
+            break
+        end = header_len + remaining_length
+        if end > len(buffer):
+            break
+        packets.append((buffer[offset], buffer[header_len:end]))
+        offset = end
+    return packets, buffer[offset:]
+
+
+# Kích thước (byte) giá trị của từng property MQTT 5 (mục 2.2.2.2).
+# None = chuỗi / binary có 2 byte độ dài, 'varint' = Variable Byte Integer, 'pair' = user property
+MQTT5_PROPERTY_SIZES = {
+    0x01: 1, 0x02: 4, 0x03: None, 0x08: None, 0x09: None, 0x0B: 'varint', 0x11: 4,
+    0x12: None, 0x13: 2, 0x15: None, 0x16: None, 0x17: 1, 0x18: 4, 0x19: 1, 0x1A: None,
+    0x1C: None, 0x1F: None, 0x21: 2, 0x22: 2, 0x23: 2, 0x24: 1, 0x25: 1, 0x26: 'pair',
+    0x27: 4, 0x28: 1, 0x29: 1, 0x2A: 1,
+}
+
+
+def parse_properties(data, offset):
+    """
+    Đọc khối property MQTT 5 bắt đầu tại offset.
+    Trả về ({property_id: value}, offset sau khối property) hoặc (None, None) nếu lỗi.
+    Property số nguyên trả về int, còn lại trả về bytes thô.
+    """
+    length, index = decode_remaining_length(data, offset)
+    if length is None or index + length > len(data):
+        return None, None
+    end = index + length
+    props = {}
+    while index < end:
+        prop_id = data[index]
+        index += 1
+        size = MQTT5_PROPERTY_SIZES.get(prop_id, -1)
+        if size == -1:
+            return None, None
+        if size == 'varint':
+            value, index = decode_remaining_length(data, index)
+            if value is None:
+                return None, None
+        elif size == 'pair':
+            start = index
+            for _ in range(2):
+                index += 2 + struct.unpack(">H", data[index:index + 2])[0]
+            value = data[start:index]
+        elif size is None:
+            str_len = struct.unpack(">H", data[index:index + 2])[0]
+            value = data[index + 2:index + 2 + str_len]
+            index += 2 + str_len
+        else:
+            value = int.from_bytes(data[index:index + size], 'big')
+            index += size
+        props[prop_id] = value
+    if index != end:
+        return None, None
+    return props, end
+
+
+def parse_connect(payload):
+    """
+    Đọc protocol level và client id từ CONNECT (3.1.1 hoặc 5).
+    Trả về (protocol_level, client_id) hoặc (None, None) nếu packet lỗi
+    """
+    try:
+        name_len = struct.unpack(">H", payload[0:2])[0]
+        offset = 2 + name_len
+        level = payload[offset]
+        offset += 4  # level + connect flags + keep alive
+        if level == MQTT_PROTOCOL_V5:
+            _, offset = parse_properties(payload, offset)
+            if offset is None:
+                return level, None
+        id_len = struct.unpack(">H", payload[offset:offset + 2])[0]
+        return level, payload[offset + 2:offset + 2 + id_len].decode('utf-8')
+    except (IndexError, struct.error, UnicodeDecodeError):
+        return None, None
+
+
+def to_base36(number):
+    """Handle ngắn cho thiết bị: 1 -> '1', 46655 -> 'zzz'"""
+    digits = "0123456789abcdefghijklmnopqrstuvwxyz"
+    text = ""
+    while True:
+        number, rem = divmod(number, 36)
+        text = digits[rem] + text
+        if number == 0:
+            return text
+
+
+# Số packet id QoS 1 gần nhất nhớ cho mỗi client để lọc bản gửi lại (DUP)
+RECENT_PACKET_IDS = 64
+
+# ======= MQTT 5 / giảm overhead topic =======
+MQTT_PROTOCOL_V311 = 4
+MQTT_PROTOCOL_V5 = 5
+PROP_TOPIC_ALIAS_MAXIMUM = 0x22
+PROP_TOPIC_ALIAS = 0x23
+# Số topic alias mỗi thiết bị MQTT 5 được dùng (báo trong CONNACK)
+TOPIC_ALIAS_MAXIMUM = 32
+# Thiết bị 3.1.1 subscribe HD/<client_id> -> broker trả handle ngắn, thiết bị publish SS/~<handle>/<pin>
+TOPIC_HANDLE = "HD/"
+DEVICE_HANDLE_MARK = "~"
+# Return code CONNACK 3.1.1 -> reason code MQTT 5
+CONNACK_V5_REASON = {0: 0x00, 1: 0x84, 2: 0x85, 3: 0x88, 4: 0x86, 5: 0x87}
+
 TOPIC_CONTRO=  "CT/"
 TOPIC_SENSOR = "SS/"
 TOPIC_NOFICATION = "NC/"
+def create_tls_context(certfile, keyfile):
+    """
+    Context TLS cho broker (mqtts, thường là port 8883).
+    Giữ session cache + session ticket mặc định của OpenSSL để thiết bị resume
+    session khi reconnect; tối đa TLS 1.2 giống firmware (tlsClient.cpp).
+    """
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.maximum_version = ssl.TLSVersion.TLSv1_2
+    context.load_cert_chain(certfile, keyfile)
+    return context
+
+
 class SimpleMQTTBroker:
     """
     MQTT Broker đơn giản - Trái tim của IoT communication
@@ -43,9 +206,10 @@ class SimpleMQTTBroker:
     - Dictionary lưu subscriptions (topic -> list clients) 
     - Logic Pub/Sub: ai subscribe topic nào thì nhận tin nhắn topic đó
     """
-    def __init__(self, host='localhost', port=1883):
+    def __init__(self, host='localhost', port=1883, ssl_context=None):
         self.host = host
         self.port = port
+        self.ssl_context = ssl_context      # None = TCP thường, có context = mqtts
         self.socket = None
         self.running = False
         self.handle_disconect = None
@@ -54,6 +218,19 @@ class SimpleMQTTBroker:
         self.clients = {}                    # {client_id: socket_object}
         self.subscriptions = {}              # {topic: [list_of_client_sockets]} <- MAGIC HERE!
         self.client_subscriptions = {}       # {client_socket: [list_of_topics]}
+        # QoS 1: packet id đã nhận gần đây, giữ qua các lần reconnect vì thiết bị
+        # gửi lại message chưa có PUBACK ngay sau khi kết nối lại
+        self.recent_packet_ids = {}          # {client_id: deque([packet_id, ...])}
+        self.duplicates_dropped = 0
+        # MQTT 5 topic alias (chỉ sống trong 1 kết nối) và handle ngắn cho thiết bị 3.1.1
+        self.protocol_levels = {}            # {client_socket: 4 | 5}
+        self.topic_aliases = {}              # {client_socket: {alias: topic_bytes}}
+        self.device_handles = {}             # {client_id: handle}
+        self.handle_owners = {}              # {handle: client_id}
+        self.next_handle = 1
+        # TLS: số handshake đầy đủ / resume (session id hoặc ticket)
+        self.tls_full_handshakes = 0
+        self.tls_resumed_handshakes = 0
 
     def start(self):
         """Khởi động MQTT Broker Server"""
@@ -72,6 +249,8 @@ class SimpleMQTTBroker:
                 try:
                     # Accept kết nối mới - Khi ESP32 gọi client.connect()
                     client_socket, address = self.socket.accept()
+                    # Tắt Nagle: PUBACK 4 byte phải đi ngay, không chờ gom với packet sau
+                    client_socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
                     print(TAG + f"\n🌟 Kết nối mới từ: {address}")
                     print(TAG + f"🔌 Socket object: {client_socket}")
 
@@ -111,11 +290,27 @@ class SimpleMQTTBroker:
         # Nếu client không gửi gì trong 45s → coi như mất kết nối
         client_socket.settimeout(45.0)
 
+        if self.ssl_context:
+            # Handshake trong thread của client để 1 thiết bị chậm không chặn accept()
+            try:
+                client_socket = self.ssl_context.wrap_socket(client_socket, server_side=True)
+            except (ssl.SSLError, OSError) as e:
+                print(TAG + f"❌ TLS handshake với {address} thất bại: {e}")
+                client_socket.close()
+                return
+            if client_socket.session_reused:
+                self.tls_resumed_handshakes += 1
+            else:
+                self.tls_full_handshakes += 1
+            print(TAG + f"🔐 TLS {client_socket.version()} với {address}, "
+                        f"{'resume session' if client_socket.session_reused else 'handshake đầy đủ'}")
+
+        buffer = b''
         try:
             while self.running:
                 try:
                     # Nhận dữ liệu từ client - đây là socket.recv()
-                    data = client_socket.recv(1024)
+                    data = client_socket.recv(4096)
                     if not data:
                         print(f"🔌 Client {address} đã ngắt kết nối (empty data)")
                         break
@@ -123,24 +318,35 @@ class SimpleMQTTBroker:
                     # Client không gửi gì trong 45s → mất kết nối
                     print(f"⏰ Client {address} timeout (không nhận được ping trong 45s)")
                     break
-                # Parse MQTT packet - Giải mã "ngôn ngữ" MQTT
-                packet_type, payload = self.parse_mqtt_packet(data)
-                # Xử lý các loại packet khác nhau
-                if packet_type == 'CONNECT':
-                    client_id = self.handle_connect(client_socket, payload, address)
-                elif packet_type == 'PUBLISH':
-                    print("🎯 *** ĐÂY LÀ PUBLISH - TRÁI TIM PUB/SUB! ***")
-                    self.handle_publish(client_socket, payload)
-                elif packet_type == 'SUBSCRIBE':
-                    print("🎯 *** ĐÂY LÀ SUBSCRIBE - ĐĂNG KÝ NHẬN TIN! ***")
-                    self.handle_subscribe(client_socket, payload, client_id)
-                elif packet_type == 'PINGREQ':
-                    self.handle_ping(client_socket)
-                elif packet_type == 'DISCONNECT':
-                    self.cleanup_client(client_socket, client_id)
+                # Ghép stream rồi tách thành từng packet MQTT hoàn chỉnh
+                buffer += data
+                packets, buffer = split_mqtt_packets(buffer)
+                disconnected = False
+                for first_byte, payload in packets:
+                    packet_type = MQTT_PACKET_TYPES.get((first_byte >> 4) & 0x0F, 'UNKNOWN')
+                    # Xử lý các loại packet khác nhau
+                    if packet_type == 'CONNECT':
+                        # Ghi nhận version trước để handle_connect (kể cả bản override) trả đúng CONNACK
+                        self.protocol_levels[client_socket], _ = parse_connect(payload)
+                        client_id = self.handle_connect(client_socket, payload, address)
+                    elif packet_type == 'PUBLISH':
+                        print("🎯 *** ĐÂY LÀ PUBLISH - TRÁI TIM PUB/SUB! ***")
+                        self.handle_publish_packet(client_socket, client_id, first_byte, payload)
+                    elif packet_type == 'SUBSCRIBE':
+                        print("🎯 *** ĐÂY LÀ SUBSCRIBE - ĐĂNG KÝ NHẬN TIN! ***")
+                        self.handle_subscribe(client_socket, payload, client_id)
+                    elif packet_type == 'PINGREQ':
+                        self.handle_ping(client_socket)
+                    elif packet_type == 'PUBACK':
+                        pass  # Broker chỉ gửi QoS 0 xuống thiết bị nên không chờ PUBACK
+                    elif packet_type == 'DISCONNECT':
+                        self.cleanup_client(client_socket, client_id)
+                        disconnected = True
+                        break
+                    else:
+                        print(TAG + f"⚠️ Packet type không được hỗ trợ: {packet_type} ")
+                if disconnected:
                     break
-                else:
-                    print(TAG + f"⚠️ Packet type không được hỗ trợ: {packet_type} ")
 
         except Exception as e:
             print(TAG + f"❌ Lỗi khi xử lý client {address}: {e}")
@@ -165,9 +371,12 @@ class SimpleMQTTBroker:
         first_byte = data[0]
         packet_type_num = (first_byte >> 4) & 0x0F  # Lấy 4 bits cao
         packet_type = MQTT_PACKET_TYPES.get(packet_type_num, 'UNKNOWN')
-        # Byte thứ 2 là remaining length (simplified - thực tế phức tạp hơn)
-        remaining_length = data[1] if len(data) > 1 else 0
-        payload = data[2:2+remaining_length] if len(data) > 2 else b''
+        # Remaining length: varint 1-4 byte (7 bit mỗi byte, bit cao = còn tiếp)
+        # Batch CBOR > 127 byte nên không thể coi byte thứ 2 là toàn bộ độ dài
+        remaining_length, header_len = decode_remaining_length(data)
+        if remaining_length is None:
+            return packet_type, b''
+        payload = data[header_len:header_len+remaining_length]
         return packet_type, payload
 
     def handle_connect(self, client_socket, payload, address): # loi iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii
@@ -177,21 +386,19 @@ class SimpleMQTTBroker:
         try:
             # Parse client ID từ payload (simplified parsing)   
             # Thực tế MQTT CONNECT packet phức tạp hơn nhiều
-            client_id = payload[10:10+len(payload)].decode('utf-8') # Đơn giản hóa
+            _, client_id = parse_connect(payload)
 
             # data_device = verify_device_token(client_id)
             data_device = "78"
             if(data_device is None): 
-                connack = bytes([0x20, 0x02, 0x00, 0x02])  # CONNACK với return code 2 tức là client id không hợp lệ 
-                client_socket.send(connack)
+                self.send_connack(client_socket, 2)  # CONNACK với return code 2 tức là client id không hợp lệ 
                 return None
             else:
             # *** LƯU CLIENT VÀO 'BỘ NHỚ' BROKER ***
                 self.clients[client_id] = client_socket
                 self.client_subscriptions[client_socket] = []
                 # Gửi CONNACK - "Chào lại, kết nối thành công!"
-                connack = bytes([0x20, 0x02, 0x00, 0x00])  # CONNACK với return code 0
-                client_socket.send(connack)
+                self.send_connack(client_socket, 0)
                 if self.handle_connected : 
                     self.handle_connected(client_socket , client_id)
                 print(TAG + f"📤 Đã gửi CONNACK cho {client_id}")
@@ -201,6 +408,133 @@ class SimpleMQTTBroker:
             print(TAG + f"❌ Lỗi xử lý CONNECT: {e} --- client_socket : {client_socket} ")
             return None
 
+    def send_connack(self, client_socket, return_code):
+        """
+        CONNACK theo version client đã gửi trong CONNECT.
+        MQTT 5 kèm Topic Alias Maximum để thiết bị thay topic dài bằng alias 2 byte
+        """
+        if self.protocol_levels.get(client_socket) == MQTT_PROTOCOL_V5:
+            props = b''
+            if return_code == 0:
+                props = bytes([PROP_TOPIC_ALIAS_MAXIMUM]) + struct.pack(">H", TOPIC_ALIAS_MAXIMUM)
+            body = bytes([0x00, CONNACK_V5_REASON.get(return_code, 0x80)]) + encode_remaining_length(len(props)) + props
+        else:
+            body = bytes([0x00, return_code])
+        client_socket.send(bytes([0x20]) + encode_remaining_length(len(body)) + body)
+
+    def assign_device_handle(self, client_id):
+        """Handle mới cho thiết bị chưa có (override được để lấy handle cố định từ database)"""
+        handle = to_base36(self.next_handle)
+        self.next_handle += 1
+        return handle
+
+    def send_device_handle(self, client_socket, client_id):
+        """Cấp (hoặc gửi lại) handle ngắn cho thiết bị đã subscribe HD/<client_id>"""
+        handle = self.device_handles.get(client_id)
+        if handle is None:
+            handle = self.assign_device_handle(client_id)
+            if handle is None or self.handle_owners.get(handle, client_id) != client_id:
+                handle = SimpleMQTTBroker.assign_device_handle(self, client_id)
+            self.device_handles[client_id] = handle
+            self.handle_owners[handle] = client_id
+        try:
+            client_socket.send(self.create_publish_packet(TOPIC_HANDLE + client_id, handle, client_socket))
+            print(TAG + f"🏷️ Handle '{handle}' -> {client_id}")
+        except Exception as e:
+            print(TAG + f"❌ Không gửi được handle cho {client_id}: {e}")
+
+    def resolve_topic(self, client_socket, topic, props):
+        """
+        Đưa topic thiết bị gửi về dạng đầy đủ SS/<client_id>/<pin>:
+        - MQTT 5: topic rỗng + alias -> topic đã gán; topic + alias -> gán alias
+        - SS/~<handle>/... -> SS/<client_id>/...
+        Trả về None nếu alias chưa được gán (lỗi protocol)
+        """
+        alias = (props or {}).get(PROP_TOPIC_ALIAS)
+        if alias is not None:
+            aliases = self.topic_aliases.setdefault(client_socket, {})
+            if not 0 < alias <= TOPIC_ALIAS_MAXIMUM:
+                return None
+            if topic:
+                aliases[alias] = topic
+            else:
+                topic = aliases.get(alias)
+                if topic is None:
+                    return None
+        parts = topic.split(b"/")
+        if len(parts) > 1 and parts[1].startswith(DEVICE_HANDLE_MARK.encode()):
+            owner = self.handle_owners.get(parts[1][1:].decode('utf-8', 'replace'))
+            if owner is None:
+                print(TAG + f"⚠️ Handle không xác định trong topic {topic!r}")
+            else:
+                parts[1] = owner.encode()
+                topic = b"/".join(parts)
+        return topic
+
+    def handle_publish_packet(self, client_socket, client_id, first_byte, payload):
+        """
+        Xử lý QoS / MQTT 5 của PUBLISH trước khi vào handle_publish:
+        - QoS 1: gửi PUBACK, bỏ bản DUP của packet id vừa nhận
+        - MQTT 5: bỏ property, thay topic alias bằng topic đầy đủ
+        - Topic dùng handle ngắn (SS/~<handle>/...) được đổi lại thành client id
+        Packet id / property được cắt khỏi payload để handle_publish xử lý như QoS 0
+        """
+        qos = (first_byte >> 1) & 0x03
+        if qos > 1:
+            print(TAG + f"⚠️ QoS {qos} không được hỗ trợ, bỏ message")
+            return
+        if len(payload) < 2:
+            return
+
+        topic_len = struct.unpack(">H", payload[0:2])[0]
+        offset = 2 + topic_len
+        topic = payload[2:offset]
+        packet_id = None
+        if qos == 1:
+            if len(payload) < offset + 2:
+                print(TAG + f"❌ PUBLISH QoS 1 thiếu packet id")
+                return
+            packet_id = struct.unpack(">H", payload[offset:offset + 2])[0]
+            offset += 2
+
+        props = None
+        if self.protocol_levels.get(client_socket) == MQTT_PROTOCOL_V5:
+            props, offset = parse_properties(payload, offset)
+            if props is None:
+                print(TAG + f"❌ PUBLISH MQTT 5 có property lỗi")
+                return
+        topic = self.resolve_topic(client_socket, topic, props)
+        if topic is None:
+            # Alias chưa gán trong kết nối này -> lỗi protocol, đóng kết nối để thiết bị gửi lại kèm topic
+            print(TAG + f"❌ Topic alias không hợp lệ từ {client_id}, đóng kết nối")
+            client_socket.shutdown(socket.SHUT_RDWR)
+            return
+
+        if qos == 1:
+            dup = bool(first_byte & 0x08)
+            try:
+                client_socket.send(bytes([0x40, 0x02]) + struct.pack(">H", packet_id))  # PUBACK
+            except Exception as e:
+                print(TAG + f"❌ Không gửi được PUBACK {packet_id}: {e}")
+
+            if self.is_duplicate(client_id, packet_id, dup):
+                self.duplicates_dropped += 1
+                print(TAG + f"♻️ Bỏ bản DUP packet id {packet_id} từ {client_id}")
+                return
+
+        # handle_publish (và bản override) luôn nhận dạng 3.1.1 QoS 0: [topic_len][topic][message]
+        self.handle_publish(client_socket, struct.pack(">H", len(topic)) + topic + payload[offset:])
+
+    def is_duplicate(self, client_id, packet_id, dup):
+        """Bản DUP của packet id đã nhận gần đây -> trùng. Không có cờ DUP -> id được dùng lại cho message mới"""
+        recent = self.recent_packet_ids.setdefault(client_id, deque(maxlen=RECENT_PACKET_IDS))
+        if packet_id in recent:
+            if dup:
+                return True
+            recent.remove(packet_id)
+        recent.append(packet_id)
+        return False
+
     def handle_publish(self, client_socket, payload):
         """
         *** ĐÂY LÀ TRÁI TIM CỦA PUB/SUB PATTERN! ***
@@ -238,13 +572,12 @@ class SimpleMQTTBroker:
 
             if topic in self.subscriptions:
                 subscribers = self.subscriptions[topic]
-                # Tạo PUBLISH packet để gửi cho subscribers
-                publish_packet = self.create_publish_packet(topic, message)
                 # *** GỬI CHO TẤT CẢ SUBSCRIBERS - ĐÂY LÀ DISTRIBUTION! ***
                 successful_sends = 0
                 for subscriber_socket in subscribers:
                     try:
-                        subscriber_socket.send(publish_packet)
+                        # Tạo PUBLISH packet theo version của từng subscriber
+                        subscriber_socket.send(self.create_publish_packet(topic, message, subscriber_socket))
                         successful_sends += 1
                     except Exception as e:
                         print(f"❌ Không thể gửi đến subscriber: {e}")
@@ -273,6 +606,12 @@ class SimpleMQTTBroker:
             # Parse SUBSCRIBE packet
             # Skip packet identifier (2 bytes đầu)
             offset = 2
+            v5 = self.protocol_levels.get(client_socket) == MQTT_PROTOCOL_V5
+            if v5:
+                _, offset = parse_properties(payload, offset)
+                if offset is None:
+                    print(TAG + f"❌ SUBSCRIBE MQTT 5 có property lỗi")
+                    return
             subscribed_topics = []
 
             while offset < len(payload):
@@ -311,9 +650,12 @@ class SimpleMQTTBroker:
             # Gửi SUBACK - "Đã đăng ký thành công!"
             if subscribed_topics:
                 # Simplified SUBACK packet
-                suback_payload = bytes([payload[0], payload[1]]) + b'\x00' * len(subscribed_topics)
+                suback_payload = bytes([payload[0], payload[1]]) + (b'\x00' if v5 else b'') + b'\x00' * len(subscribed_topics)
                 suback = bytes([0x90, len(suback_payload)]) + suback_payload
                 client_socket.send(suback)
+                # Thiết bị xin handle ngắn (chỉ cần khi không có topic alias của MQTT 5)
+                if client_id and TOPIC_HANDLE + client_id in subscribed_topics:
+                    self.send_device_handle(client_socket, client_id)
 
             for topic, subscribers in self.subscriptions.items():
                 print(TAG + f"   '{topic}': {len(subscribers)} subscribers ")
@@ -332,30 +674,34 @@ class SimpleMQTTBroker:
         # tra ve danh sachs subrice 
         return self.subscriptions.keys()
 
-    def create_publish_packet(self, topic, message):
+    def create_publish_packet(self, topic, message, client_socket=None):
         """
         Tạo MQTT PUBLISH packet để gửi cho subscribers
 
         Đây là quá trình 'đóng gói' message theo định dạng MQTT
-        để gửi cho clients đã subscribe
+        để gửi cho clients đã subscribe.
+        client_socket kết nối bằng MQTT 5 thì packet có thêm khối property (rỗng)
         """
         topic_bytes = topic.encode('utf-8')
-        message_bytes = message.encode('utf-8')
+        # message có thể là text hoặc bytes (batch CBOR từ thiết bị)
+        message_bytes = message if isinstance(message, (bytes, bytearray)) else message.encode('utf-8')
 
         # MQTT PUBLISH packet format:
         # [Fixed Header: packet type + remaining length]
         # [Variable Header: topic length + topic] 
         # [Payload: message]
 
-        remaining_length = 2 + len(topic_bytes) + len(message_bytes)
+        properties = b'\x00' if self.protocol_levels.get(client_socket) == MQTT_PROTOCOL_V5 else b''
+        remaining_length = 2 + len(topic_bytes) + len(properties) + len(message_bytes)
 
         packet = bytearray()
         packet.append(0x30)  # PUBLISH packet type (0011 0000)
-        packet.append(remaining_length)  # Remaining length (simplified)
+        packet.extend(encode_remaining_length(remaining_length))
 
         # Variable Header: Topic length + topic
         packet.extend(struct.pack(">H", len(topic_bytes)))  # Topic length (2 bytes big-endian)
         packet.extend(topic_bytes)
+        packet.extend(properties)
 
         # Payload: Message
         packet.extend(message_bytes)
@@ -387,6 +733,9 @@ class SimpleMQTTBroker:
             # Xóa client subscriptions
             if client_socket in self.client_subscriptions:
                 del self.client_subscriptions[client_socket]
+            # Topic alias chỉ có hiệu lực trong kết nối này
+            self.topic_aliases.pop(client_socket, None)
+            self.protocol_levels.pop(client_socket, None)
 
             # Đóng socket
             try:
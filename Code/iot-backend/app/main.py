@@ -77,4 +77,5 @@ async def shutdown_event():
 
 if __name__ == "__main__":
     import uvicorn
-    uvicorn.run(app, host="0.0.0.0", port=8000)
\ No newline at end of file
+    # Giữ kết nối keep-alive lâu hơn HTTP_POOL_IDLE_MS (25 s) của firmware để thiết bị dùng lại kết nối
+    uvicorn.run(app, host="0.0.0.0", port=8000, timeout_keep_alive=30)
\ No newline at end of file
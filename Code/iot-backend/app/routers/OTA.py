@@ -1,13 +1,17 @@
 import os
 import uuid
+import json
+import hashlib
 from typing import Optional
 
-from fastapi import APIRouter, File, UploadFile, Form, HTTPException, status, Depends
+from fastapi import APIRouter, BackgroundTasks, File, UploadFile, Form, HTTPException, status, Depends, Request, Response
+from fastapi.responses import FileResponse, JSONResponse
 from pydantic import BaseModel
 from app.database import db, supabase_admin
 from app.middleware.auth import get_current_device, get_current_user
 from app.routers.mqtt import broker_host , broker_port
 from app.services.mqtt_service import mqtt_service
+from app.services import ota_cache, ota_compress, ota_delta, ota_schedule, ota_sign
 from time import sleep
 from app.websockets.audio_stream import wsURL
 # --- Khởi tạo Router ---
@@ -18,6 +22,16 @@ router = APIRouter(
 class PostInfoOTA(BaseModel):
     client_id: str
     type: int # 0: check , 1: update
+
+class PostOTACache(BaseModel):
+    version: str    # Phiên bản slave master đang cache, rỗng = bỏ cache
+    sha256: str
+    ip: str         # IP LAN của master
+    port: int
+
+class PostOTARollout(BaseModel):
+    file_id: str
+    percent: int    # 0-100: phần trăm thiết bị được nhận bản này (xem app/services/ota_schedule.py)
     
 # --- Các mô hình dữ liệu Pydantic ---
 class FileInfoBase(BaseModel):
@@ -35,13 +49,23 @@ class FileInfoResponse(FileInfoBase):
 
 # --- Các Endpoint của API ---
 
+def build_patch_from_storage(previous: dict, new_content: bytes, new_file_id):
+    """Chạy nền sau upload: tạo patch từ bản trước cùng loại sang bản vừa upload."""
+    try:
+        old_content = supabase_admin.storage.from_("firmwereStorge").download(previous["storage_path"])
+        ota_delta.build_patch(old_content, new_content, new_file_id, previous["version"])
+    except Exception as e:
+        print(f"⚠️ [OTA Delta] Không tạo được patch từ {previous.get('version')}: {e}")
+
 @router.post("/upload", status_code=status.HTTP_201_CREATED)
 async def upload_file(
+    background_tasks: BackgroundTasks,
     file: UploadFile = File(..., description="File .bin cần tải lên"),
     filename: str = Form(..., description="Tên file"),
     change_log: str = Form(..., description="Ghi chú thay đổi"),
     version: str = Form(..., description="Phiên bản firmware"),
     type: int = Form(..., description="Loại firmware: 0 = master, 1 = slave"),
+    rollout: int = Form(100, description="Phần trăm thiết bị được nhận bản này (0-100)"),
     current_user: dict = Depends(get_current_user)
 ):
     """
@@ -107,6 +131,23 @@ async def upload_file(
                 "message": "Không thể lưu thông tin file vào database."
             }
 
+        # sha256 (+ chữ ký) để thiết bị kiểm tra ảnh trước khi đổi partition boot
+        ota_sign.save_digest(file_content, response[0]["id"])
+        if rollout < 100:
+            ota_schedule.set_rollout(response[0]["id"], rollout)
+
+        # Patch delta từ bản mới nhất trước đó (thiết bị đang chạy bản này chỉ cần tải patch)
+        rows = db.execute_query(
+            table="file_info",
+            operation="select",
+            filters={"user_id": current_user["id"], "type": type}
+        ) or []
+        previous = [row for row in rows if row["id"] != response[0]["id"]]
+        if previous:
+            background_tasks.add_task(build_patch_from_storage, previous[-1], file_content, response[0]["id"])
+        # Ảnh nén cho thiết bị chưa có patch (bản cũ hơn / vừa flash)
+        background_tasks.add_task(ota_compress.build_compressed, file_content, response[0]["id"])
+
         return {
             "success": True,
             "message": "File được tải lên thành công!",
@@ -155,13 +196,25 @@ async def get_all_files(
             detail=f"Đã xảy ra lỗi khi lấy danh sách file: {e}"
         )
 
+def manifest_etag(manifest: dict) -> str:
+    """ETag của manifest OTA: đổi khi bất kỳ trường nào (version, link, broker, ws_url) đổi."""
+    payload = json.dumps(manifest, sort_keys=True, separators=(",", ":"))
+    return '"' + hashlib.sha1(payload.encode()).hexdigest()[:16] + '"'
+
 @router.get("/get_info_update", response_model= dict)
 async def get_info_update(
+    request: Request,
     current_device: dict = Depends(get_current_device)
 ):
     """
     Lấy thông tin update firmware mới nhất của user (để ESP32 tự động cập nhật OTA).
+    Trả ETag; thiết bị gửi lại qua If-None-Match và nhận 304 (không body) nếu manifest không đổi.
+    Quá tải (cả site boot cùng lúc) trả 503 + Retry-After, thiết bị hẹn lại đúng thời điểm đó.
     """
+    retry_after = ota_schedule.admit()
+    if retry_after is not None:
+        return Response(status_code=status.HTTP_503_SERVICE_UNAVAILABLE,
+                        headers={"Retry-After": str(retry_after)})
     try:
         # Truy vấn file mới nhất
         response = db.execute_query(
@@ -181,6 +234,9 @@ async def get_info_update(
         slave_version = None
         master_link = None
         slave_link = None
+        # Patch delta: chỉ từ bản liền trước, thiết bị đang chạy đúng bản đó mới dùng
+        latest = {}
+        previous = {}
         response = response[::-1]
         for file in response:
             if file["type"] == 0 and master_link is None:
@@ -189,8 +245,25 @@ async def get_info_update(
             if file["type"] == 1 and slave_link is None:
                 slave_link = file["download_url"]
                 slave_version = file["version"]
-        
-        return {
+            if file["type"] not in latest:
+                latest[file["type"]] = file
+            elif file["type"] not in previous:
+                previous[file["type"]] = file
+        patches = {}
+        compressed = {}
+        digests = {}
+        for fw_type in (0, 1):
+            patches[fw_type] = (None, None)
+            compressed[fw_type] = (None, None)
+            digests[fw_type] = (ota_sign.find_digest(latest[fw_type]["id"]) if fw_type in latest else None) or {}
+            if fw_type in latest and ota_compress.find_compressed(latest[fw_type]["id"]):
+                compressed[fw_type] = ("zlib", f"/ota/image/{latest[fw_type]['id']}")
+            if fw_type in previous:
+                file_id, from_version = latest[fw_type]["id"], previous[fw_type]["version"]
+                if ota_delta.find_patch(file_id, from_version):
+                    patches[fw_type] = (from_version, f"/ota/patch/{file_id}?from_version={from_version}")
+
+        manifest = {
             "success": True,
             "broker_server": broker_host,
             "broker_port": broker_port,
@@ -198,8 +271,33 @@ async def get_info_update(
             "master_link": master_link,
             "master_version": master_version,
             "slave_link": slave_link,
-            "slave_version": slave_version
+            "slave_version": slave_version,
+            "master_patch_from": patches[0][0],
+            "master_patch_link": patches[0][1],
+            "slave_patch_from": patches[1][0],
+            "slave_patch_link": patches[1][1],
+            "master_compression": compressed[0][0],
+            "master_compressed_link": compressed[0][1],
+            "slave_compression": compressed[1][0],
+            "slave_compressed_link": compressed[1][1],
+            "master_sha256": digests[0].get("sha256"),
+            "master_signature": digests[0].get("signature"),
+            "slave_sha256": digests[1].get("sha256"),
+            "slave_signature": digests[1].get("signature"),
+            "slave_origin_link": None,
+            "master_rollout": ota_schedule.get_rollout(latest[0]["id"]) if 0 in latest else None,
+            "slave_rollout": ota_schedule.get_rollout(latest[1]["id"]) if 1 in latest else None
         }
+        # Slave cùng site với master đang cache đúng bản này -> tải trong LAN, link gốc để dự phòng
+        cache_link = ota_cache.lookup(current_device["user_id"], slave_version,
+                                      digests[1].get("sha256"), request.client.host)
+        if cache_link:
+            manifest["slave_origin_link"] = slave_link
+            manifest["slave_link"] = cache_link
+        etag = manifest_etag(manifest)
+        if request.headers.get("if-none-match") == etag:
+            return Response(status_code=status.HTTP_304_NOT_MODIFIED, headers={"ETag": etag})
+        return JSONResponse(content=manifest, headers={"ETag": etag})
 
     except HTTPException:
         raise
@@ -209,6 +307,95 @@ async def get_info_update(
             status_code=status.HTTP_500_INTERNAL_SERVER_ERROR,
             detail=f"Đã xảy ra lỗi khi lấy firmware mới nhất: {e}"
         )
+@router.post("/cache")
+async def announce_cache(
+    data: PostOTACache,
+    request: Request,
+    current_device: dict = Depends(get_current_device)
+):
+    """
+    Master báo đang cache ảnh slave trong LAN (xem app/services/ota_cache.py).
+    Slave cùng IP public sẽ nhận slave_link trỏ về master trong get_info_update.
+    """
+    if not data.version:
+        ota_cache.withdraw(current_device["user_id"], request.client.host)
+        return {"success": True}
+    ota_cache.announce(
+        current_device["user_id"], current_device.get("id"), data.version, data.sha256,
+        f"http://{data.ip}:{data.port}/ota/cache/slave.bin", request.client.host
+    )
+    return {"success": True}
+
+@router.post("/rollout")
+async def set_rollout(
+    data: PostOTARollout,
+    current_user: dict = Depends(get_current_user)
+):
+    """
+    Đổi phần trăm rollout của 1 firmware. Tăng dần (vd 5 -> 25 -> 100): thiết bị đã nhận ở
+    mức trước vẫn nằm trong nhóm mới, thiết bị thấy manifest đổi ở lần check kế tiếp.
+    """
+    rows = db.execute_query(
+        table="file_info",
+        operation="select",
+        filters={"id": data.file_id, "user_id": current_user["id"]}
+    )
+    if not rows:
+        raise HTTPException(
+            status_code=status.HTTP_404_NOT_FOUND,
+            detail=f"Không tìm thấy file với ID: {data.file_id}"
+        )
+    return {
+        "success": True,
+        "file_id": data.file_id,
+        "percent": ota_schedule.set_rollout(data.file_id, data.percent)
+    }
+
+@router.get("/patch/{file_id}")
+async def get_patch(
+    file_id: str,
+    from_version: str,
+    current_device: dict = Depends(get_current_device)
+):
+    """
+    Tải patch delta from_version -> file_id (format xem app/services/ota_delta.py).
+    Link lấy từ master_patch_link / slave_patch_link trong get_info_update.
+    """
+    owned = db.execute_query(
+        table="file_info",
+        operation="select",
+        filters={"user_id": current_device["user_id"], "id": file_id}
+    )
+    path = ota_delta.find_patch(file_id, from_version) if owned else None
+    if not path:
+        raise HTTPException(
+            status_code=status.HTTP_404_NOT_FOUND,
+            detail="Không có patch cho phiên bản này"
+        )
+    return FileResponse(path, media_type="application/octet-stream")
+
+@router.get("/image/{file_id}")
+async def get_compressed_image(
+    file_id: str,
+    current_device: dict = Depends(get_current_device)
+):
+    """
+    Tải ảnh firmware nén (format xem app/services/ota_compress.py).
+    Link lấy từ master_compressed_link / slave_compressed_link trong get_info_update.
+    """
+    owned = db.execute_query(
+        table="file_info",
+        operation="select",
+        filters={"user_id": current_device["user_id"], "id": file_id}
+    )
+    path = ota_compress.find_compressed(file_id) if owned else None
+    if not path:
+        raise HTTPException(
+            status_code=status.HTTP_404_NOT_FOUND,
+            detail="Không có ảnh nén cho firmware này"
+        )
+    return FileResponse(path, media_type="application/octet-stream")
+
 @router.post("/check-info-ota")
 def check_info_ota(data: PostInfoOTA , current_user: dict = Depends(get_current_user)):
     try:   
@@ -8,10 +8,11 @@ import json
 import time
 from typing import Dict, List, Callable, Optional
 from unittest import result
-from app.broker_server import TAG, TOPIC_CONTRO, TOPIC_NOFICATION, TOPIC_SENSOR , SimpleMQTTBroker
+from app.broker_server import TAG, TOPIC_CONTRO, TOPIC_NOFICATION, TOPIC_SENSOR , SimpleMQTTBroker, parse_connect, to_base36
 from app.database import db
 from app.mqtt_client import SimpleMQTTClient
 from app.security import verify_device_token
+from app.services.telemetry_codec import BATCH_TOPIC_SUFFIX, CBORDecodeError, decode_batch, format_value
 TAG = "MQTT_SERVICE"
 
 class MQTTService:
@@ -34,7 +35,9 @@ class MQTTService:
         self.client_running = False
         self.device_tokens = {}     # {device_token: device_info}
         self.client_is_voice = {}
+        self.client_eos_done = set()    # Đã kết thúc bằng frame "eos" trên WebSocket, chờ AU:OFF đến muộn
         self.client_ota_data = {}
+        self.client_boot_data = {}      # Timeline boot gần nhất của từng thiết bị
     def start_client(self , host='localhost', port=1883 , token = "client-1"):
         if self.client_running : 
             print(TAG + f" client da chay roi")
@@ -47,14 +50,14 @@ class MQTTService:
         )
         self.client_thread.start()
 
-    def start_broker(self, host='localhost', port=1883):
+    def start_broker(self, host='localhost', port=1883, ssl_context=None):
 
         """Khởi động MQTT Broker trong thread riêng"""
         if self.running:
             print(TAG + "⚠️ MQTT Broker đã đang chạy")
             return
             
-        self.broker = SimpleMQTTBroker(host, port)
+        self.broker = SimpleMQTTBroker(host, port, ssl_context)
         self.running = True
         
         # Chạy broker trong thread riêng để không block FastAPI
@@ -84,6 +87,7 @@ class MQTTService:
             self.broker.handle_connect = self.handle_connect
             self.broker.handle_connected = self.handle_connected
             self.broker.handle_disconect = self.handle_disconect
+            self.broker.assign_device_handle = self.assign_device_handle
             self.broker.start()
         except Exception as e:
             print(TAG + f"❌ Lỗi chạy MQTT Broker: {e}")
@@ -96,7 +100,7 @@ class MQTTService:
             # Parse client ID từ payload (simplified parsing)   
             # Thực tế MQTT CONNECT packet phức tạp hơn nhiều
             print(TAG + f"ket noi tu client {client_socket} {address}")
-            client_id = payload[12:12+len(payload)].decode('utf-8') # Đơn giản hóa\
+            _, client_id = parse_connect(payload)
             if not client_id :
                 print(TAG + f"loi roi ket noi do client_id None")
                 return
@@ -113,8 +117,7 @@ class MQTTService:
                 data_device = verify_device_token(device[0]["device_access_token"])
 
             if(data_device is None): 
-                connack = bytes([0x20, 0x02, 0x00, 0x02])  # CONNACK với return code 2 tức là client id không hợp lệ 
-                client_socket.send(connack)
+                self.broker.send_connack(client_socket, 2)  # CONNACK với return code 2 tức là client id không hợp lệ 
                 return None
             else:
             # *** LƯU CLIENT VÀO 'BỘ NHỚ' BROKER ***
@@ -132,8 +135,7 @@ class MQTTService:
                     "error" : []
                 }
                 # Gửi CONNACK - "Chào lại, kết nối thành công!"
-                connack = bytes([0x20, 0x02, 0x00, 0x00])  # CONNACK với return code 0
-                client_socket.send(connack)
+                self.broker.send_connack(client_socket, 0)
                 self.handle_connected(client_socket , client_id)
                 return client_id
 
@@ -141,6 +143,14 @@ class MQTTService:
             print(TAG + f"❌ Lỗi xử lý CONNECT: {e} --- client_socket : {client_socket} ")
             return None
 
+    def assign_device_handle(self, client_id):
+        """Handle ngắn cho thiết bị MQTT 3.1.1 lấy theo id trong database để không đổi khi broker khởi động lại"""
+        device = self.device_tokens.get(client_id) or {}
+        try:
+            return to_base36(int(device.get("id")))
+        except (TypeError, ValueError):
+            return None  # id không phải số -> broker tự cấp handle tuần tự
+
     def handle_connected(self ,client_socket , client_id ):
         result = db.execute_query(
             table="devices",
@@ -187,8 +197,15 @@ class MQTTService:
                 return
                 
             topic = payload[2:2+topic_len].decode('utf-8')
-            message = payload[2+topic_len:].decode('utf-8')
+            raw_message = payload[2+topic_len:]
             
+            # Batch CBOR: SS/{client_id}/batch - payload nhị phân
+            if topic.startswith(TOPIC_SENSOR) and topic.endswith(BATCH_TOPIC_SUFFIX):
+                print(f"📨 MQTT Batch: {topic} -> {len(raw_message)} bytes")
+                self._handle_sensor_batch(topic, raw_message)
+                return
+            
+            message = raw_message.decode('utf-8')
             print(f"📨 MQTT Message: {topic} -> {message}")
             
             # Xử lý sensor data
@@ -202,21 +219,42 @@ class MQTTService:
                 
             if topic in self.broker.subscriptions:
                 subscribers = self.broker.subscriptions[topic]
-                publish_packet = self.broker.create_publish_packet(topic, message)
                 
                 for subscriber_socket in subscribers:
                     try:
                         if subscriber_socket == client_socket:
                             continue
                         print(TAG + f"🔔 Phan hoi message đến subscriber: {subscriber_socket}")
-                        subscriber_socket.send(publish_packet)
+                        subscriber_socket.send(self.broker.create_publish_packet(topic, message, subscriber_socket))
                     except Exception as e:
                         print(TAG + f"❌ Không thể gửi đến subscriber: {e}")
                         
         except Exception as e:
             print(f"❌ Lỗi xử lý MQTT message: {e}")
             
-    def _handle_sensor_data(self, topic: str, message: str):
+    def _handle_sensor_batch(self, topic: str, payload: bytes):
+        """
+        Xử lý batch telemetry CBOR: SS/{token_verify}/batch
+        Mỗi mẫu được lưu như 1 message SS/{token_verify}/{virtual_pin} riêng,
+        với timestamp quy đổi từ offset trong batch.
+        """
+        try:
+            parts = topic.split('/')
+            token_verify = parts[1]
+            samples = decode_batch(payload)
+            print(TAG + f" 📦 Batch {token_verify}: {len(samples)} mẫu / {len(payload)} bytes")
+            for sample in samples:
+                self._handle_sensor_data(
+                    f"{TOPIC_SENSOR}{token_verify}/{sample['virtual_pin']}",
+                    format_value(sample["value"]),
+                    recorded_at=sample["recorded_at"]
+                )
+        except CBORDecodeError as e:
+            print(TAG + f"❌ Batch CBOR không hợp lệ từ {topic}: {e}")
+        except Exception as e:
+            print(TAG + f"❌ Lỗi xử lý batch: {e}")
+
+    def _handle_sensor_data(self, topic: str, message: str, recorded_at=None):
         
         """Xử lý sensor data từ MQTT"""
         try:
@@ -247,6 +285,9 @@ class MQTTService:
                     "value_string": "0" if message == "nan" else message,
                     "value_numeric": float(message) if message.replace('.', '', 1).isdigit() else 0
                 }
+                if recorded_at is not None:
+                    # Mẫu từ batch: dùng thời điểm đo thực tế thay vì thời điểm nhận
+                    sensor_data["timestamp"] = recorded_at.isoformat()
                 
                 result = db.execute_query(
                     table="sensor_data",
@@ -277,10 +318,16 @@ class MQTTService:
                 print(TAG + f"loi roi ")
             elif(message.startswith("AU")):
                 if message.split(":")[1] == "ON" :
+                    # MQTT giữ thứ tự: AU:OFF của lần trước (nếu có) đã tới trước AU:ON này
+                    self.client_eos_done.discard(client_id)
                     if self.client_is_voice.get(client_id , None) is None:
                         self.client_is_voice[client_id] = 1
                     else:
                         self.client_is_voice[client_id] += 1
+                elif client_id in self.client_eos_done:
+                    # Lần ghi âm này đã được xử lý khi nhận "eos"
+                    self.client_eos_done.discard(client_id)
+                    self.client_is_voice[client_id] = 0
                 else:
                     if self.client_is_voice.get(client_id , None) is None:
                         self.client_is_voice[client_id] = 0
@@ -289,6 +336,8 @@ class MQTTService:
                 print(TAG + f"client_is_voice {client_id}: {self.client_is_voice[client_id]}")
             elif(message.startswith("OTA")):
                 self.handle_ota(client_id , message)
+            elif(message.startswith("BOOT")):
+                self.handle_boot(client_id , message)
                 
         except Exception as e:
             print(f"❌ Lỗi xử lý notification: {e}")
@@ -333,6 +382,9 @@ class MQTTService:
                     self.client_ota_data[client_id] = {
                         "is_updating": True,
                         "on_progress": message[1],
+                        # Firmware mới gửi thêm "@<KB/s>@<giây đã chạy>"
+                        "throughput_kbps": int(message[2]) if len(message) > 2 else None,
+                        "elapsed_s": int(message[3]) if len(message) > 3 else None,
                         "auto_update" : data['auto_update'],
                         "lastVersion" : data['lastVersion'],
                         "lastUpdate" : data['lastUpdate'],
@@ -354,7 +406,8 @@ class MQTTService:
                     }
                 elif message.startswith("INFO"):
                     # "OTA:INFO@" + lastVersion + "@" + lastUpdate + "@" + 
-        #    String(autoUpdateEnabled) + "@" + String(hasNewVersion ? 1 : 0);
+        #    String(autoUpdateEnabled) + "@" + String(hasNewVersion ? 1 : 0) + "@" + currentVersion
+        #    + "@" + lastDurationMs + "@" + lastKbps;
                     data = self.client_ota_data[client_id]
                     message = message.split('@')
                     self.client_ota_data[client_id] = {
@@ -365,6 +418,9 @@ class MQTTService:
                         "lastUpdate" : None if message[2] == 'unknown' else message[2],
                         "hasNewVersion" : message[4] == '1',
                         "currentVersion" : message[5],
+                        # Thời gian (ms) và tốc độ (KB/s) của lần update trước, 0 = chưa có
+                        "lastDurationMs" : int(message[6]) if len(message) > 6 else None,
+                        "lastThroughputKbps" : int(message[7]) if len(message) > 7 else None,
                         "error" : data['error']
                     }
        
@@ -372,6 +428,29 @@ class MQTTService:
         except Exception as e:
             print(f"❌ Lỗi xử lý OTA: {e}")
 
+    def handle_boot(self , client_id , message):
+        # "BOOT:<ms tới lần đầu kết nối MQTT>@<phase>=<bắt đầu ms>+<thời lượng ms>@..."
+        # Phase chưa xong lúc gửi không có "+<thời lượng>"
+        try:
+            items = message.split(':', 1)[1].split('@')
+            phases = {}
+            for item in items[1:]:
+                name, timing = item.split('=', 1)
+                start, _, duration = timing.partition('+')
+                phases[name] = {
+                    "start_ms": int(start),
+                    "duration_ms": int(duration) if duration else None
+                }
+            self.client_boot_data[client_id] = {
+                "ready_ms": int(items[0]),
+                "phases": phases
+            }
+            print(TAG + f"⏱️ Boot {client_id}: ready after {items[0]} ms, "
+                  + ", ".join(f"{name}={p['duration_ms'] if p['duration_ms'] is not None else '...'}ms"
+                              for name, p in phases.items()))
+        except Exception as e:
+            print(f"❌ Lỗi xử lý BOOT: {e}")
+
 
     def publish_message_CT(self , client_id , virtualPin ,  message):
         if not client_id :
@@ -398,7 +477,7 @@ class MQTTService:
             # Tạo MQTT PUBLISH packet
             #CT/{device_token}/virtualpin 
             topic = TOPIC_CONTRO + client_id +"/"+str(virtualPin)
-            publish_packet = self.broker.create_publish_packet(topic, message)
+            publish_packet = self.broker.create_publish_packet(topic, message, client_socket)
             client_socket.send(publish_packet)
             print(TAG + f"📤 Đã publish dieu khien : {topic} -> {message}")
             return None
@@ -428,7 +507,7 @@ class MQTTService:
                 return "Socket của client không tồn tại"
             
             topic = TOPIC_NOFICATION + client_id
-            publish_packet = self.broker.create_publish_packet(topic, message)
+            publish_packet = self.broker.create_publish_packet(topic, message, client_socket)
             client_socket.send(publish_packet)
             print(TAG + f"📤 Đã publish thong bao : {topic} -> {message}")
             return None
@@ -444,15 +523,12 @@ class MQTTService:
             return False
             
         try:
-            # Tạo MQTT PUBLISH packet
-            publish_packet = self.broker.create_publish_packet(topic, message)
-            
-            # Gửi cho tất cả subscribers
+            # Gửi cho tất cả subscribers (PUBLISH packet theo version của từng subscriber)
             if topic in self.broker.subscriptions:
                 subscribers = self.broker.subscriptions[topic]
                 for subscriber_socket in subscribers:
                     try:
-                        subscriber_socket.send(publish_packet)
+                        subscriber_socket.send(self.broker.create_publish_packet(topic, message, subscriber_socket))
                     except Exception as e:
                         print(f"❌ Không thể gửi message: {e}")
                         
@@ -0,0 +1,55 @@
+# OTA Cache - Master làm cache firmware slave trong mạng LAN
+# app/services/ota_cache.py
+"""
+Master tải ảnh slave 1 lần qua WAN, lưu trong partition OTA còn trống và phục vụ qua HTTP
+trong LAN (OtaCache trong firmware_master), rồi POST /ota/cache để báo cho backend.
+
+get_info_update trả slave_link = link LAN của master (slave_origin_link = link gốc) khi:
+- master đã cache đúng phiên bản slave mới nhất và đúng sha256 (slave vẫn kiểm tra sha256)
+- slave hỏi từ cùng IP public với master (cùng site / cùng NAT), site khác vẫn tải link gốc
+- lần báo gần nhất chưa quá CACHE_TTL_S (master báo lại mỗi lần check manifest)
+
+Lưu trong RAM: backend restart thì slave dùng link gốc tới khi master báo lại.
+"""
+import os
+import threading
+import time
+from typing import Optional
+
+CACHE_TTL_S = int(os.getenv("OTA_CACHE_TTL_S", "21600"))   # 6 giờ
+
+_lock = threading.Lock()
+_caches = {}        # (user_id, public_ip) -> thông tin cache của master
+
+
+def announce(user_id, device_id, version: str, sha256: str, url: str, public_ip: str) -> None:
+    with _lock:
+        _caches[(user_id, public_ip)] = {
+            "device_id": device_id,
+            "version": version,
+            "sha256": sha256.lower(),
+            "url": url,
+            "announced_at": time.time(),
+        }
+    print(f"📦 [OTA Cache] {device_id} cache slave {version} tại {url} ({public_ip})")
+
+
+def withdraw(user_id, public_ip: str) -> None:
+    with _lock:
+        _caches.pop((user_id, public_ip), None)
+
+
+def lookup(user_id, version: Optional[str], sha256: Optional[str], public_ip: str) -> Optional[str]:
+    """Link LAN cho slave ở public_ip, None nếu không có cache dùng được"""
+    if not version or not sha256:
+        return None
+    with _lock:
+        cache = _caches.get((user_id, public_ip))
+        if cache is None:
+            return None
+        if time.time() - cache["announced_at"] > CACHE_TTL_S:
+            del _caches[(user_id, public_ip)]
+            return None
+        if cache["version"] != version or cache["sha256"] != sha256.lower():
+            return None
+        return cache["url"]
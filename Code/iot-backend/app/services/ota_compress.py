@@ -0,0 +1,54 @@
+# OTA Compress - Nén ảnh firmware để thiết bị giải nén theo luồng khi OTA
+# app/services/ota_compress.py
+"""
+Firmware ESP32 nén được 30-50%. Ảnh nén được đóng gói:
+
+    "EDZ1" | u32 image_size (little-endian) | zlib stream (wbits=12)
+
+Cửa sổ zlib giới hạn 4 KB (wbits=12) để thiết bị giải nén bằng tinfl trong ROM với
+1 buffer vòng 4 KB cố định (OtaInflater trong firmware), không cần 32 KB như zlib mặc định.
+image_size cho Update.begin() biết trước kích thước; adler32 cuối stream zlib
+được tinfl kiểm tra.
+"""
+import os
+import struct
+import zlib
+from typing import Optional
+
+from app.services import ota_delta
+
+MAGIC = b"EDZ1"
+HEADER = struct.Struct("<4sI")
+WINDOW_BITS = 12        # 4 KB = OTA_ZLIB_WINDOW trên thiết bị
+LEVEL = 9
+
+
+def compress_image(image: bytes) -> bytes:
+    compressor = zlib.compressobj(LEVEL, zlib.DEFLATED, WINDOW_BITS)
+    return HEADER.pack(MAGIC, len(image)) + compressor.compress(image) + compressor.flush()
+
+
+# ======= Lưu trữ (cùng thư mục với patch delta) =======
+def compressed_path(file_id) -> str:
+    return os.path.join(ota_delta.PATCH_DIR, f"{file_id}.z")
+
+
+def find_compressed(file_id) -> Optional[str]:
+    path = compressed_path(file_id)
+    return path if os.path.exists(path) else None
+
+
+def build_compressed(image: bytes, file_id) -> Optional[str]:
+    data = compress_image(image)
+    if len(data) >= len(image):
+        print(f"⚠️ [OTA Compress] {file_id} không nén được, bỏ qua")
+        return None
+    os.makedirs(ota_delta.PATCH_DIR, exist_ok=True)
+    path = compressed_path(file_id)
+    tmp = path + ".tmp"
+    with open(tmp, "wb") as f:
+        f.write(data)
+    os.replace(tmp, path)   # Manifest chỉ thấy ảnh nén khi đã ghi xong
+    print(f"✅ [OTA Compress] {file_id}: {len(data)} B thay vì {len(image)} B "
+          f"({len(data) * 100 / len(image):.1f}%)")
+    return path
@@ -0,0 +1,180 @@
+# OTA Delta - Tạo / áp dụng patch nhị phân giữa 2 phiên bản firmware
+# app/services/ota_delta.py
+"""
+Firmware master/slave giữa 2 bản thường chỉ khác vài KB, nhưng 1 byte chèn thêm làm
+dịch địa chỉ của toàn bộ code phía sau -> so khớp copy/insert thông thường không dùng được.
+Format ở đây theo ý tưởng bsdiff: ảnh mới được dựng từ các đoạn "diff" (byte ảnh cũ +
+chênh lệch, phần lớn là 0 kể cả khi con trỏ bị dịch) xen với các đoạn "extra" (byte mới).
+Thiết bị (OtaDelta trong firmware) đọc ảnh cũ từ partition đang chạy, áp patch theo luồng
+với RAM cố định và ghi thẳng vào partition OTA.
+
+    header : "EDP1" | u32 old_size | u32 new_size | sha256(old) | sha256(new)    (little-endian)
+    record : varint diff_len | varint extra_len | zigzag varint seek
+             diff   : lặp (varint zero_run, varint literal_len, literal bytes) tới đủ diff_len
+             extra  : extra_len byte thô
+
+    Với mỗi record: out += (old[pos + i] + diff[i]) & 0xFF, pos += diff_len;
+                    out += extra; pos += seek.
+
+Thiết bị kiểm tra sha256(old) trước khi tải tiếp và sha256(new) trước khi đổi partition boot.
+"""
+import hashlib
+import os
+import struct
+from typing import List, Optional, Tuple
+
+MAGIC = b"EDP1"
+HEADER = struct.Struct("<4sII32s32s")
+
+SEED_LEN = 8            # Độ dài khóa tìm vị trí khớp trong ảnh cũ
+WINDOW = 32             # Bước kiểm tra 1 đoạn diff còn "giống" ảnh cũ
+MIN_MATCH = WINDOW // 2 # >= 50% byte trùng trong cửa sổ thì vẫn giữ đoạn diff
+
+PATCH_DIR = os.getenv("OTA_PATCH_DIR", "ota_patches")
+
+
+class PatchError(ValueError):
+    pass
+
+
+# ======= Varint =======
+def _write_varint(out: bytearray, value: int):
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return
+
+
+def _zigzag(value: int) -> int:
+    return (value << 1) if value >= 0 else ((-value << 1) - 1)
+
+
+# ======= Tạo patch =======
+def _find_spans(old: bytes, new: bytes) -> List[Tuple[int, int, int]]:
+    """Các đoạn diff (new_start, length, old_start), không chồng lấn, tăng dần theo new."""
+    index = {old[i:i + SEED_LEN]: i for i in range(len(old) - SEED_LEN + 1)}
+    spans = []
+    i = 0
+    start = -1          # new_start của đoạn đang mở, -1 = không có
+    delta = 0           # old_pos - new_pos của đoạn đang mở
+    n = len(new)
+
+    def close(end: int):
+        if start >= 0 and end > start:
+            spans.append((start, end - start, start + delta))
+
+    while i < n:
+        if start >= 0:
+            j = i + delta
+            w = min(WINDOW, n - i, len(old) - j)
+            if w > 0:
+                same = sum(1 for a, b in zip(new[i:i + w], old[j:j + w]) if a == b)
+                if same * 2 >= w and (w == WINDOW or same == w):
+                    i += w
+                    continue
+                # Cửa sổ không đạt: vẫn giữ phần đầu còn trùng khít
+                while i < n and i + delta < len(old) and new[i] == old[i + delta]:
+                    i += 1
+            close(i)
+            start = -1
+            if i >= n:
+                break
+        j = index.get(new[i:i + SEED_LEN]) if i + SEED_LEN <= n else None
+        if j is None:
+            i += 1      # Byte mới -> extra
+            continue
+        # Mở đoạn mới, lùi về trước qua phần extra nếu vẫn trùng khít
+        prev_end = spans[-1][0] + spans[-1][1] if spans else 0
+        back = 0
+        while i - back > prev_end and j - back > 0 and new[i - back - 1] == old[j - back - 1]:
+            back += 1
+        start = i - back
+        delta = j - i
+        i += SEED_LEN
+    close(n if start >= 0 else i)
+    return spans
+
+
+def _encode_diff(out: bytearray, diff: bytes):
+    pos = 0
+    n = len(diff)
+    while pos < n:
+        zeros = pos
+        while zeros < n and diff[zeros] == 0:
+            zeros += 1
+        lits = zeros
+        # Literal kết thúc ở chuỗi >= 2 số 0 (1 số 0 lẻ rẻ hơn khi để trong literal)
+        while lits < n and not (diff[lits] == 0 and lits + 1 < n and diff[lits + 1] == 0):
+            lits += 1
+        _write_varint(out, zeros - pos)
+        _write_varint(out, lits - zeros)
+        out += diff[zeros:lits]
+        pos = lits
+
+
+def make_patch(old: bytes, new: bytes) -> bytes:
+    spans = _find_spans(old, new)
+    out = bytearray(HEADER.pack(MAGIC, len(old), len(new),
+                                hashlib.sha256(old).digest(), hashlib.sha256(new).digest()))
+    # Record đầu: extra trước đoạn diff đầu tiên (nếu có), rồi seek tới đoạn đó
+    first_new = spans[0][0] if spans else len(new)
+    first_old = spans[0][2] if spans else 0
+    _write_varint(out, 0)
+    _write_varint(out, first_new)
+    _write_varint(out, _zigzag(first_old))
+    out += new[:first_new]
+
+    for k, (new_start, length, old_start) in enumerate(spans):
+        next_new = spans[k + 1][0] if k + 1 < len(spans) else len(new)
+        next_old = spans[k + 1][2] if k + 1 < len(spans) else old_start + length
+        diff = bytes((new[new_start + x] - old[old_start + x]) & 0xFF for x in range(length))
+        _write_varint(out, length)
+        _write_varint(out, next_new - new_start - length)
+        _write_varint(out, _zigzag(next_old - old_start - length))
+        _encode_diff(out, diff)
+        out += new[new_start + length:next_new]
+    return bytes(out)
+
+
+# ======= Đọc header (patch được áp bởi OtaDelta trong firmware) =======
+def parse_header(patch: bytes) -> Tuple[int, int, bytes, bytes]:
+    if len(patch) < HEADER.size:
+        raise PatchError("Patch quá ngắn")
+    magic, old_size, new_size, old_sha, new_sha = HEADER.unpack_from(patch)
+    if magic != MAGIC:
+        raise PatchError("Sai magic")
+    return old_size, new_size, old_sha, new_sha
+
+
+# ======= Lưu trữ patch =======
+def patch_path(file_id, from_version: str) -> str:
+    safe_version = "".join(c if c.isalnum() or c in "._-" else "_" for c in from_version)
+    return os.path.join(PATCH_DIR, f"{file_id}.from-{safe_version}.patch")
+
+
+def find_patch(file_id, from_version: Optional[str]) -> Optional[str]:
+    if not from_version:
+        return None
+    path = patch_path(file_id, from_version)
+    return path if os.path.exists(path) else None
+
+
+def build_patch(old: bytes, new: bytes, file_id, from_version: str) -> Optional[str]:
+    """Tạo patch from_version -> file_id; bỏ qua nếu patch không nhỏ hơn ảnh đầy đủ."""
+    patch = make_patch(old, new)
+    if len(patch) >= len(new):
+        print(f"⚠️ [OTA Delta] Patch {from_version} -> {file_id} không nhỏ hơn ảnh đầy đủ, bỏ qua")
+        return None
+    os.makedirs(PATCH_DIR, exist_ok=True)
+    path = patch_path(file_id, from_version)
+    tmp = path + ".tmp"
+    with open(tmp, "wb") as f:
+        f.write(patch)
+    os.replace(tmp, path)   # Manifest chỉ thấy patch khi đã ghi xong
+    print(f"✅ [OTA Delta] {from_version} -> {file_id}: {len(patch)} B thay vì {len(new)} B "
+          f"({len(patch) * 100 / len(new):.1f}%)")
+    return path
@@ -0,0 +1,99 @@
+# OTA Schedule - Dàn đều lượt check OTA của cả đội thiết bị và rollout theo phần trăm
+# app/services/ota_schedule.py
+"""
+Sau khi mất điện cả site, mọi thiết bị boot cùng lúc và gọi get_info_update gần như cùng giây.
+Firmware (OTAUpdate) đã tự dàn lượt check theo FNV-1a(CLIENT_ID); backend giữ thêm 2 lớp:
+
+1. Giới hạn tốc độ get_info_update (token bucket CHECK_RATE req/s, CHECK_BURST):
+   vượt thì trả 503 + Retry-After. Mỗi request bị từ chối được hẹn 1 "slot" kế tiếp cách nhau
+   1/CHECK_RATE giây, nên các thiết bị quay lại rải đều thay vì cùng lúc (thiết bị còn cộng jitter).
+
+2. Rollout: mỗi firmware có phần trăm thiết bị được nhận (mặc định 100), manifest trả
+   master_rollout / slave_rollout. Thiết bị tự tính bucket = FNV-1a("<client_id>@<version>") % 100
+   và chỉ update khi bucket < rollout. Tăng phần trăm thì nhóm cũ vẫn nằm trong nhóm mới;
+   mỗi phiên bản có nhóm đi trước khác nhau. Manifest giống nhau cho mọi thiết bị nên ETag / 304 vẫn dùng được.
+"""
+import json
+import math
+import os
+import threading
+import time
+from typing import Optional
+
+from app.services import ota_delta
+
+CHECK_RATE = float(os.getenv("OTA_CHECK_RATE", "20"))        # get_info_update / giây
+CHECK_BURST = int(os.getenv("OTA_CHECK_BURST", "40"))
+MAX_RETRY_AFTER_S = int(os.getenv("OTA_MAX_RETRY_AFTER_S", "900"))
+
+_clock = time.monotonic     # Test thay bằng đồng hồ giả
+_lock = threading.Lock()
+_tokens = float(CHECK_BURST)
+_refilled_at = None
+_next_slot = 0.0            # Slot hẹn cho request bị từ chối kế tiếp
+
+
+# ======= FNV-1a 32 bit (giống OTAUpdate::fnv1a trong firmware) =======
+def fnv1a(text: str) -> int:
+    h = 0x811C9DC5
+    for b in text.encode():
+        h ^= b
+        h = (h * 0x01000193) & 0xFFFFFFFF
+    return h
+
+
+def rollout_bucket(client_id: str, version: str) -> int:
+    return fnv1a(f"{client_id}@{version}") % 100
+
+
+def in_rollout(client_id: str, version: str, percent: Optional[int]) -> bool:
+    return rollout_bucket(client_id, version) < (100 if percent is None else percent)
+
+
+# ======= Giới hạn tốc độ check =======
+def admit() -> Optional[int]:
+    """None nếu request được phục vụ, ngược lại số giây Retry-After"""
+    global _tokens, _refilled_at, _next_slot
+    with _lock:
+        now = _clock()
+        if _refilled_at is not None:
+            _tokens = min(CHECK_BURST, _tokens + (now - _refilled_at) * CHECK_RATE)
+        _refilled_at = now
+        if _tokens >= 1:
+            _tokens -= 1
+            return None
+        _next_slot = max(_next_slot, now) + 1.0 / CHECK_RATE
+        return min(MAX_RETRY_AFTER_S, max(1, math.ceil(_next_slot - now - 1e-6)))   # 1e-6: sai số cộng dồn
+
+
+def reset() -> None:
+    global _tokens, _refilled_at, _next_slot
+    with _lock:
+        _tokens = float(CHECK_BURST)
+        _refilled_at = None
+        _next_slot = 0.0
+
+
+# ======= Phần trăm rollout (cùng thư mục với patch delta / ảnh nén) =======
+def rollout_path(file_id) -> str:
+    return os.path.join(ota_delta.PATCH_DIR, f"{file_id}.rollout.json")
+
+
+def get_rollout(file_id) -> int:
+    path = rollout_path(file_id)
+    if not os.path.exists(path):
+        return 100
+    with open(path) as f:
+        return json.load(f)["percent"]
+
+
+def set_rollout(file_id, percent: int) -> int:
+    percent = max(0, min(100, int(percent)))
+    os.makedirs(ota_delta.PATCH_DIR, exist_ok=True)
+    path = rollout_path(file_id)
+    tmp = path + ".tmp"
+    with open(tmp, "w") as f:
+        json.dump({"percent": percent}, f)
+    os.replace(tmp, path)
+    print(f"✅ [OTA Rollout] {file_id}: {percent}%")
+    return percent
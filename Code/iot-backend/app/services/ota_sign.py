@@ -0,0 +1,86 @@
+# OTA Sign - SHA-256 (+ chữ ký ECDSA tùy chọn) của ảnh firmware cho manifest OTA
+# app/services/ota_sign.py
+"""
+Thiết bị hash ảnh mới theo từng block khi ghi flash (OtaVerifier trong firmware) rồi so với
+sha256 trong manifest trước khi đổi partition boot, áp dụng cho cả ảnh đầy đủ, patch và ảnh nén.
+
+Chữ ký (tùy chọn): khi đặt OTA_SIGNING_KEY (file PEM khóa riêng ECDSA P-256), backend ký
+sha256 của ảnh, chữ ký DER mã hóa base64. Firmware có OTA_SIGNING_PUBKEY thì bắt buộc chữ ký hợp lệ.
+
+Tạo khóa:
+    openssl ecparam -name prime256v1 -genkey -noout -out ota_signing.pem
+    openssl ec -in ota_signing.pem -pubout      # dán vào OTA_SIGNING_PUBKEY của firmware
+"""
+import base64
+import hashlib
+import json
+import os
+from typing import Optional
+
+from cryptography.exceptions import InvalidSignature
+from cryptography.hazmat.primitives import hashes, serialization
+from cryptography.hazmat.primitives.asymmetric import ec
+from cryptography.hazmat.primitives.asymmetric.utils import Prehashed
+
+from app.services import ota_delta
+
+SIGNING_KEY_PATH = os.getenv("OTA_SIGNING_KEY")
+
+
+def image_sha256(image: bytes) -> str:
+    return hashlib.sha256(image).hexdigest()
+
+
+def load_signing_key(path: Optional[str] = None):
+    path = path or SIGNING_KEY_PATH
+    if not path:
+        return None
+    with open(path, "rb") as f:
+        key = serialization.load_pem_private_key(f.read(), password=None)
+    if not isinstance(key, ec.EllipticCurvePrivateKey) or key.curve.name != "secp256r1":
+        raise ValueError("OTA_SIGNING_KEY phải là khóa ECDSA P-256")
+    return key
+
+
+def sign_digest(digest: bytes, key) -> str:
+    """Ký sha256 đã tính sẵn (mbedtls_pk_verify trên thiết bị nhận đúng hash này)"""
+    return base64.b64encode(key.sign(digest, ec.ECDSA(Prehashed(hashes.SHA256())))).decode()
+
+
+def verify_signature(digest: bytes, signature: str, public_key) -> bool:
+    try:
+        public_key.verify(base64.b64decode(signature), digest, ec.ECDSA(Prehashed(hashes.SHA256())))
+        return True
+    except (InvalidSignature, ValueError):
+        return False
+
+
+# ======= Lưu trữ (cùng thư mục với patch delta / ảnh nén) =======
+def digest_path(file_id) -> str:
+    return os.path.join(ota_delta.PATCH_DIR, f"{file_id}.sha256.json")
+
+
+def find_digest(file_id) -> Optional[dict]:
+    path = digest_path(file_id)
+    if not os.path.exists(path):
+        return None
+    with open(path) as f:
+        return json.load(f)
+
+
+def save_digest(image: bytes, file_id, key=None) -> dict:
+    key = key or load_signing_key()
+    digest = hashlib.sha256(image).digest()
+    info = {
+        "sha256": digest.hex(),
+        "signature": sign_digest(digest, key) if key else None,
+    }
+    os.makedirs(ota_delta.PATCH_DIR, exist_ok=True)
+    path = digest_path(file_id)
+    tmp = path + ".tmp"
+    with open(tmp, "w") as f:
+        json.dump(info, f)
+    os.replace(tmp, path)
+    print(f"✅ [OTA Sign] {file_id}: sha256 {info['sha256'][:16]}…"
+          f"{' (đã ký)' if info['signature'] else ''}")
+    return info
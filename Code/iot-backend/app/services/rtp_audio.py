@@ -0,0 +1,452 @@
+# RTP Audio - Nhận audio mic của ESP32 qua RTP/UDP
+# app/services/rtp_audio.py
+"""
+Bộ nhận thay thế cho WebSocket /audio_stream/ws khi thiết bị được cấu hình
+ws_url = "rtp://<host>:<port>" (firmware_master/rtpAudio.cpp):
+
+- RTP (port, mặc định 5004): mỗi gói 1 frame 512 mẫu = 32 ms, 16 kHz mono
+    PT 6  : DVI4 (IMA ADPCM, RFC 3551) - header 4 byte + 256 byte
+    PT 96 : L16 big-endian
+    PT 98 : RED (RFC 2198) - frame DVI4 hiện tại + 1-2 frame trước đó
+- RTCP (port + 1): SDES CNAME = client_id, BYE khi thiết bị thả nút ghi âm
+
+Ghép lại PCM 16-bit little-endian (giống dữ liệu WebSocket) theo timestamp,
+frame mất thay bằng khoảng lặng, và đo mất gói / khôi phục nhờ RED / jitter /
+độ trễ tương đối (so với gói đến sớm nhất).
+
+Chạy độc lập: python -m app.services.rtp_audio [port] [thu_muc_wav]
+"""
+import os
+import socket
+import struct
+import sys
+import threading
+import time
+import wave
+from typing import Callable, Dict, List, Optional, Tuple
+
+TAG = "RTP_AUDIO"
+CLOCK_RATE = 16000
+PT_DVI4 = 6
+PT_L16 = 96
+PT_RED = 98
+RTCP_SR, RTCP_RR, RTCP_SDES, RTCP_BYE = 200, 201, 202, 203
+
+IMA_STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+]
+IMA_INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8]
+
+
+class RtpDecodeError(ValueError):
+    pass
+
+
+# ============= DVI4 (IMA ADPCM) =============
+def dvi4_encode(samples: List[int], predictor: int = 0, index: int = 0) -> Tuple[bytes, int, int]:
+    """Mã hóa giống firmware, trả về (payload, predictor, index) để nối frame sau"""
+    out = bytearray(struct.pack(">hBB", predictor, index, 0))
+    nibbles = []
+    for sample in samples:
+        step = IMA_STEP_TABLE[index]
+        diff = sample - predictor
+        code = 0
+        if diff < 0:
+            code = 8
+            diff = -diff
+        delta = step >> 3
+        if diff >= step:
+            code |= 4
+            diff -= step
+            delta += step
+        step >>= 1
+        if diff >= step:
+            code |= 2
+            diff -= step
+            delta += step
+        step >>= 1
+        if diff >= step:
+            code |= 1
+            delta += step
+        predictor += -delta if code & 8 else delta
+        predictor = max(-32768, min(32767, predictor))
+        index = max(0, min(88, index + IMA_INDEX_TABLE[code]))
+        nibbles.append(code)
+    if len(nibbles) % 2:
+        nibbles.append(0)
+    out += bytes((nibbles[i] << 4) | nibbles[i + 1] for i in range(0, len(nibbles), 2))
+    return bytes(out), predictor, index
+
+
+def dvi4_decode(payload: bytes) -> List[int]:
+    if len(payload) < 4:
+        raise RtpDecodeError("DVI4 payload thiếu header")
+    predictor, index, _ = struct.unpack(">hBB", payload[:4])
+    if index > 88:
+        raise RtpDecodeError(f"DVI4 step index không hợp lệ: {index}")
+    samples = []
+    for byte in payload[4:]:
+        for code in (byte >> 4, byte & 0x0F):
+            step = IMA_STEP_TABLE[index]
+            delta = step >> 3
+            if code & 4:
+                delta += step
+            if code & 2:
+                delta += step >> 1
+            if code & 1:
+                delta += step >> 2
+            predictor += -delta if code & 8 else delta
+            predictor = max(-32768, min(32767, predictor))
+            index = max(0, min(88, index + IMA_INDEX_TABLE[code]))
+            samples.append(predictor)
+    return samples
+
+
+def decode_frame(payload_type: int, payload: bytes) -> List[int]:
+    if payload_type == PT_DVI4:
+        return dvi4_decode(payload)
+    if payload_type == PT_L16:
+        if len(payload) % 2:
+            raise RtpDecodeError("L16 payload lẻ byte")
+        return list(struct.unpack(f">{len(payload) // 2}h", payload))
+    raise RtpDecodeError(f"Payload type không hỗ trợ: {payload_type}")
+
+
+# ============= RTP / RED / RTCP =============
+def parse_rtp(packet: bytes) -> Dict:
+    if len(packet) < 12:
+        raise RtpDecodeError("Gói RTP ngắn hơn header")
+    first, second, seq, timestamp, ssrc = struct.unpack(">BBHII", packet[:12])
+    if first >> 6 != 2:
+        raise RtpDecodeError(f"RTP version {first >> 6}")
+    offset = 12 + 4 * (first & 0x0F)
+    if first & 0x10:
+        if len(packet) < offset + 4:
+            raise RtpDecodeError("Thiếu header extension")
+        offset += 4 + 4 * struct.unpack(">H", packet[offset + 2:offset + 4])[0]
+    end = len(packet)
+    if first & 0x20:
+        end -= packet[-1]
+    if offset > end:
+        raise RtpDecodeError("Gói RTP hỏng")
+    return {"marker": bool(second & 0x80), "pt": second & 0x7F, "seq": seq,
+            "timestamp": timestamp, "ssrc": ssrc, "payload": packet[offset:end]}
+
+
+def parse_red(payload: bytes, timestamp: int) -> List[Tuple[int, int, bytes]]:
+    """RFC 2198 -> [(pt, timestamp, data)], khối cũ nhất trước, khối chính cuối cùng"""
+    headers = []
+    offset = 0
+    while True:
+        if offset >= len(payload):
+            raise RtpDecodeError("RED thiếu header")
+        if payload[offset] & 0x80 == 0:
+            headers.append((payload[offset] & 0x7F, 0, None))
+            offset += 1
+            break
+        if offset + 4 > len(payload):
+            raise RtpDecodeError("RED header bị cắt")
+        word = struct.unpack(">I", payload[offset:offset + 4])[0]
+        headers.append(((word >> 24) & 0x7F, (word >> 10) & 0x3FFF, word & 0x3FF))
+        offset += 4
+    blocks = []
+    for pt, ts_offset, length in headers:
+        if length is None:
+            length = len(payload) - offset
+        if offset + length > len(payload):
+            raise RtpDecodeError("RED block vượt quá gói")
+        blocks.append((pt, (timestamp - ts_offset) & 0xFFFFFFFF, payload[offset:offset + length]))
+        offset += length
+    return blocks
+
+
+def parse_rtcp(packet: bytes) -> Tuple[Dict[int, str], List[int]]:
+    """Gói RTCP compound -> ({ssrc: cname}, [ssrc đã BYE])"""
+    cnames, byes = {}, []
+    offset = 0
+    while offset + 4 <= len(packet):
+        first, pt, length = struct.unpack(">BBH", packet[offset:offset + 4])
+        if first >> 6 != 2:
+            raise RtpDecodeError(f"RTCP version {first >> 6}")
+        end = offset + 4 * (length + 1)
+        if end > len(packet):
+            raise RtpDecodeError("RTCP bị cắt")
+        count = first & 0x1F
+        if pt == RTCP_SDES:
+            pos = offset + 4
+            for _ in range(count):
+                ssrc = struct.unpack(">I", packet[pos:pos + 4])[0]
+                pos += 4
+                while pos < end and packet[pos] != 0:
+                    item, item_len = packet[pos], packet[pos + 1]
+                    if item == 1:
+                        cnames[ssrc] = packet[pos + 2:pos + 2 + item_len].decode(errors="replace")
+                    pos += 2 + item_len
+                pos = (pos + 4) & ~3     # Bỏ byte END + padding tới hết word
+        elif pt == RTCP_BYE:
+            for i in range(count):
+                byes.append(struct.unpack(">I", packet[offset + 4 + 4 * i:offset + 8 + 4 * i])[0])
+        offset = end
+    return cnames, byes
+
+
+def _signed32(value: int) -> int:
+    value &= 0xFFFFFFFF
+    return value - 0x100000000 if value >= 0x80000000 else value
+
+
+# ============= STREAM =============
+class RtpStream:
+    """Trạng thái 1 luồng (1 SSRC = 1 lần ghi âm)"""
+
+    def __init__(self, ssrc: int):
+        self.ssrc = ssrc
+        self.cname: Optional[str] = None
+        self.closed = False
+        self.frames: Dict[int, List[int]] = {}      # timestamp tương đối -> PCM
+        self.arrivals: Dict[int, float] = {}        # timestamp tương đối -> lúc có frame
+        self.recovered = 0                          # Frame chỉ có được nhờ RED
+        self.packets = 0
+        self.duplicates = 0
+        self.reordered = 0
+        self.decode_errors = 0
+        self.jitter = 0.0                           # RFC 3550, đơn vị mẫu
+        self.base_timestamp: Optional[int] = None
+        self._base_seq: Optional[int] = None
+        self._max_seq = 0                           # Sequence mở rộng (đã tính wrap)
+        self._seen_seq = set()
+        self._last_transit: Optional[float] = None
+        self._first_arrival = 0.0
+
+    def _extend_seq(self, seq: int) -> int:
+        delta = (seq - self._max_seq) & 0xFFFF
+        if delta >= 0x8000:
+            delta -= 0x10000
+        return self._max_seq + delta
+
+    def on_packet(self, rtp: Dict, arrival: float):
+        if self._base_seq is None:
+            self._base_seq = self._max_seq = rtp["seq"]
+            self.base_timestamp = rtp["timestamp"]
+            self._first_arrival = arrival
+        seq = self._extend_seq(rtp["seq"])
+        if seq in self._seen_seq:
+            self.duplicates += 1
+            return
+        self._seen_seq.add(seq)
+        self.packets += 1
+        if seq < self._max_seq:
+            self.reordered += 1
+        self._max_seq = max(self._max_seq, seq)
+
+        transit = arrival * CLOCK_RATE - rtp["timestamp"]
+        if self._last_transit is not None:
+            d = transit - self._last_transit
+            # Chuẩn hóa khi timestamp wrap quanh 2^32
+            d = (d + 2 ** 31) % 2 ** 32 - 2 ** 31
+            self.jitter += (abs(d) - self.jitter) / 16
+        self._last_transit = transit
+
+        try:
+            if rtp["pt"] == PT_RED:
+                blocks = parse_red(rtp["payload"], rtp["timestamp"])
+            else:
+                blocks = [(rtp["pt"], rtp["timestamp"], rtp["payload"])]
+            for index, (pt, timestamp, data) in enumerate(blocks):
+                key = _signed32(timestamp - self.base_timestamp)
+                if key in self.frames:
+                    continue
+                self.frames[key] = decode_frame(pt, data)
+                self.arrivals[key] = arrival
+                if index < len(blocks) - 1:
+                    self.recovered += 1
+        except RtpDecodeError as e:
+            self.decode_errors += 1
+            print(f"{TAG} SSRC {self.ssrc:08x}: gói {rtp['seq']} lỗi: {e}")
+
+    def frame_samples(self) -> int:
+        """Số mẫu / frame danh định (i2s_read có thể trả frame ngắn hơn, timestamp vẫn đúng)"""
+        if not self.frames:
+            return 0
+        return max(len(samples) for samples in self.frames.values())
+
+    def missing_samples(self) -> int:
+        missing, cursor = 0, None
+        for key in sorted(self.frames):
+            if cursor is not None and key > cursor:
+                missing += key - cursor
+            cursor = key + len(self.frames[key])
+        return missing
+
+    def pcm(self) -> bytes:
+        """PCM 16-bit little-endian như luồng WebSocket, frame mất thay bằng khoảng lặng"""
+        out = bytearray()
+        cursor = None
+        for key in sorted(self.frames):
+            samples = self.frames[key]
+            if cursor is not None:
+                if key > cursor:
+                    out += bytes(2 * (key - cursor))
+                else:
+                    samples = samples[cursor - key:]
+            out += struct.pack(f"<{len(samples)}h", *samples)
+            cursor = key + len(self.frames[key])
+        return bytes(out)
+
+    def relative_delays_ms(self) -> List[float]:
+        """Độ trễ mỗi frame so với frame đến sớm nhất (theo đồng hồ mẫu của thiết bị)"""
+        if not self.arrivals:
+            return []
+        raw = [self.arrivals[key] - self._first_arrival - key / CLOCK_RATE for key in self.arrivals]
+        best = min(raw)
+        return [(value - best) * 1000 for value in raw]
+
+    def stats(self) -> Dict:
+        step = self.frame_samples()
+        expected_packets = self._max_seq - self._base_seq + 1 if self._base_seq is not None else 0
+        missing_frames = -(-self.missing_samples() // step) if step else 0
+        expected_frames = len(self.frames) + missing_frames
+        delays = sorted(self.relative_delays_ms())
+
+        def percentile(p):
+            return delays[min(len(delays) - 1, int(len(delays) * p))] if delays else 0.0
+
+        return {
+            "ssrc": f"{self.ssrc:08x}",
+            "cname": self.cname,
+            "packets": self.packets,
+            "packets_lost": expected_packets - self.packets,
+            "packet_loss_pct": 100.0 * (expected_packets - self.packets) / expected_packets if expected_packets else 0.0,
+            "frames": len(self.frames),
+            "frames_recovered": self.recovered,
+            "frames_missing": missing_frames,
+            "frame_loss_pct": 100.0 * missing_frames / expected_frames if expected_frames else 0.0,
+            "duplicates": self.duplicates,
+            "reordered": self.reordered,
+            "decode_errors": self.decode_errors,
+            "jitter_ms": self.jitter * 1000 / CLOCK_RATE,
+            "delay_p50_ms": percentile(0.5),
+            "delay_p95_ms": percentile(0.95),
+            "delay_max_ms": delays[-1] if delays else 0.0,
+        }
+
+
+# ============= RECEIVER =============
+class RtpAudioReceiver:
+    """Nghe RTP trên port và RTCP trên port + 1, on_complete(stream) được gọi khi nhận BYE"""
+
+    def __init__(self, host: str = "0.0.0.0", port: int = 5004,
+                 on_complete: Optional[Callable[[RtpStream], None]] = None):
+        self.host = host
+        self.port = port
+        self.on_complete = on_complete
+        self.streams: Dict[int, RtpStream] = {}
+        self.lock = threading.Lock()
+        self.running = False
+        self._pending_cnames: Dict[int, str] = {}
+        self._sockets = []
+
+    def start(self):
+        self.running = True
+        for port, handler in ((self.port, self._handle_rtp), (self.port + 1, self._handle_rtcp)):
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+            sock.bind((self.host, port))
+            sock.settimeout(0.5)
+            self._sockets.append(sock)
+            threading.Thread(target=self._loop, args=(sock, handler), daemon=True).start()
+        print(f"{TAG} Listening RTP {self.host}:{self.port}, RTCP {self.port + 1}")
+
+    def stop(self):
+        self.running = False
+        for sock in self._sockets:
+            sock.close()
+        self._sockets = []
+
+    def _loop(self, sock, handler):
+        while self.running:
+            try:
+                data, _ = sock.recvfrom(2048)
+            except socket.timeout:
+                continue
+            except OSError:
+                break
+            handler(data, time.monotonic())
+
+    def _stream(self, ssrc: int) -> RtpStream:
+        stream = self.streams.get(ssrc)
+        if stream is None:
+            stream = self.streams[ssrc] = RtpStream(ssrc)
+            stream.cname = self._pending_cnames.pop(ssrc, None)
+        return stream
+
+    def _handle_rtp(self, data: bytes, arrival: float):
+        try:
+            rtp = parse_rtp(data)
+        except RtpDecodeError as e:
+            print(f"{TAG} Bỏ gói RTP lỗi: {e}")
+            return
+        with self.lock:
+            stream = self._stream(rtp["ssrc"])
+            if not stream.closed:
+                stream.on_packet(rtp, arrival)
+
+    def _handle_rtcp(self, data: bytes, arrival: float):
+        try:
+            cnames, byes = parse_rtcp(data)
+        except RtpDecodeError as e:
+            print(f"{TAG} Bỏ gói RTCP lỗi: {e}")
+            return
+        completed = []
+        with self.lock:
+            for ssrc, cname in cnames.items():
+                if ssrc in self.streams:
+                    self.streams[ssrc].cname = cname
+                else:
+                    # RTCP đầu tiên có thể tới trước gói RTP đầu tiên
+                    self._pending_cnames[ssrc] = cname
+            for ssrc in byes:
+                stream = self.streams.get(ssrc)
+                if stream is not None and not stream.closed:
+                    stream.closed = True
+                    completed.append(stream)
+        for stream in completed:
+            print(f"{TAG} BYE từ {stream.cname or f'{stream.ssrc:08x}'}: {stream.stats()}")
+            if self.on_complete:
+                self.on_complete(stream)
+
+
+def write_wav(path: str, stream: RtpStream):
+    with wave.open(path, "wb") as wav:
+        wav.setnchannels(1)
+        wav.setsampwidth(2)
+        wav.setframerate(CLOCK_RATE)
+        wav.writeframes(stream.pcm())
+
+
+if __name__ == "__main__":
+    listen_port = int(sys.argv[1]) if len(sys.argv) > 1 else 5004
+    out_dir = sys.argv[2] if len(sys.argv) > 2 else "."
+    os.makedirs(out_dir, exist_ok=True)
+
+    def save(stream: RtpStream):
+        path = os.path.join(out_dir, f"{stream.cname or f'{stream.ssrc:08x}'}_{int(time.time())}.wav")
+        write_wav(path, stream)
+        print(f"{TAG} Đã lưu {path}")
+
+    receiver = RtpAudioReceiver(port=listen_port, on_complete=save)
+    receiver.start()
+    try:
+        while True:
+            time.sleep(5)
+            with receiver.lock:
+                for stream in receiver.streams.values():
+                    if not stream.closed:
+                        print(f"{TAG} {stream.cname or f'{stream.ssrc:08x}'}: {stream.stats()}")
+    except KeyboardInterrupt:
+        receiver.stop()
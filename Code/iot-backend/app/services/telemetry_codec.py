@@ -0,0 +1,138 @@
+# Telemetry Codec - Giải mã batch telemetry CBOR từ ESP32
+# app/services/telemetry_codec.py
+"""
+Thiết bị bật batch mode (NC "TLM:BATCH@<window_ms>") sẽ gom nhiều mẫu rồi
+publish 1 document CBOR lên SS/<client_id>/batch:
+
+    { "v": 1,              # version format
+      "t": <millis>,       # millis() của mẫu đầu tiên
+      "n": <millis>,       # millis() lúc encode
+      "s": [ [virtual_pin, dt_ms, value], ... ] }
+
+Chỉ cài phần CBOR mà firmware dùng (uint/nint, float16/32/64, bool, null,
+text/bytes, array, map) nên không cần thêm thư viện ngoài.
+"""
+import struct
+from datetime import datetime, timedelta, timezone
+from typing import Any, Dict, List, Tuple
+
+BATCH_TOPIC_SUFFIX = "/batch"
+BATCH_VERSION = 1
+
+
+class CBORDecodeError(ValueError):
+    pass
+
+
+def _read_length(data: bytes, offset: int, info: int) -> Tuple[int, int]:
+    if info < 24:
+        return info, offset
+    sizes = {24: 1, 25: 2, 26: 4, 27: 8}
+    if info not in sizes:
+        raise CBORDecodeError(f"Độ dài không hỗ trợ (info={info})")
+    n = sizes[info]
+    if offset + n > len(data):
+        raise CBORDecodeError("Thiếu dữ liệu khi đọc độ dài")
+    return int.from_bytes(data[offset:offset + n], "big"), offset + n
+
+
+def _decode_item(data: bytes, offset: int) -> Tuple[Any, int]:
+    if offset >= len(data):
+        raise CBORDecodeError("Hết dữ liệu")
+    initial = data[offset]
+    offset += 1
+    major, info = initial >> 5, initial & 0x1F
+
+    if major == 7:
+        float_sizes = {25: 2, 26: 4, 27: 8}
+        if info in float_sizes and offset + float_sizes[info] > len(data):
+            raise CBORDecodeError("Thiếu dữ liệu khi đọc float")
+        if info == 20:
+            return False, offset
+        if info == 21:
+            return True, offset
+        if info == 22:
+            return None, offset
+        if info == 25:
+            return struct.unpack(">e", data[offset:offset + 2])[0], offset + 2
+        if info == 26:
+            return struct.unpack(">f", data[offset:offset + 4])[0], offset + 4
+        if info == 27:
+            return struct.unpack(">d", data[offset:offset + 8])[0], offset + 8
+        raise CBORDecodeError(f"Simple value không hỗ trợ (info={info})")
+
+    value, offset = _read_length(data, offset, info)
+    if major == 0:
+        return value, offset
+    if major == 1:
+        return -1 - value, offset
+    if major in (2, 3):
+        end = offset + value
+        if end > len(data):
+            raise CBORDecodeError("String vượt quá payload")
+        raw = data[offset:end]
+        return (raw if major == 2 else raw.decode("utf-8")), end
+    if major == 4:
+        items = []
+        for _ in range(value):
+            item, offset = _decode_item(data, offset)
+            items.append(item)
+        return items, offset
+    if major == 5:
+        result = {}
+        for _ in range(value):
+            key, offset = _decode_item(data, offset)
+            item, offset = _decode_item(data, offset)
+            result[key] = item
+        return result, offset
+    raise CBORDecodeError(f"Major type không hỗ trợ: {major}")
+
+
+def cbor_loads(data: bytes) -> Any:
+    """Giải mã 1 CBOR item, báo lỗi nếu còn byte thừa"""
+    value, offset = _decode_item(data, 0)
+    if offset != len(data):
+        raise CBORDecodeError(f"Còn {len(data) - offset} byte thừa sau document")
+    return value
+
+
+def decode_batch(payload: bytes, received_at: datetime = None) -> List[Dict[str, Any]]:
+    """
+    Giải mã document batch thành danh sách mẫu:
+        [{"virtual_pin": 5, "value": 27.5, "device_ms": 123456, "recorded_at": datetime}, ...]
+
+    recorded_at được quy đổi từ offset: received_at - (n - (t + dt)).
+    """
+    doc = cbor_loads(payload)
+    if not isinstance(doc, dict):
+        raise CBORDecodeError("Batch phải là CBOR map")
+    if doc.get("v") != BATCH_VERSION:
+        raise CBORDecodeError(f"Version batch không hỗ trợ: {doc.get('v')}")
+
+    base_ms = doc.get("t", 0)
+    encoded_ms = doc.get("n", base_ms)
+    received_at = received_at or datetime.now(timezone.utc)
+
+    samples = []
+    for entry in doc.get("s", []):
+        if not isinstance(entry, list) or len(entry) != 3:
+            raise CBORDecodeError(f"Mẫu không hợp lệ: {entry}")
+        virtual_pin, dt_ms, value = entry
+        device_ms = base_ms + dt_ms
+        age_ms = max(0, encoded_ms - device_ms)
+        samples.append({
+            "virtual_pin": virtual_pin,
+            "value": value,
+            "device_ms": device_ms,
+            "recorded_at": received_at - timedelta(milliseconds=age_ms),
+        })
+    return samples
+
+
+def format_value(value: Any) -> str:
+    """Đưa giá trị về dạng text giống firmware khi publish từng giá trị"""
+    if isinstance(value, bool):
+        return "1" if value else "0"
+    if isinstance(value, float):
+        return "nan" if value != value else f"{value:.2f}"
+    return str(value)
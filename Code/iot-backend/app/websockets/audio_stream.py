@@ -13,6 +13,7 @@ from app.services.mqtt_service import mqtt_service
 from app.services.conversation_service import conversation_service
 import httpx
 import asyncio
+import json
 wsURL = "ws://192.168.3.3:8000/audio_stream/ws/"
 router = APIRouter(prefix="/audio_stream", tags=["Audio Stream"])
 TAG = "AUDIO_STREAM"
@@ -22,6 +23,18 @@ class AudioStreamRequest(BaseModel):
     pin_label:str 
     device_name : str
     virtual_pin : int
+def parse_control_frame(text: str):
+    """Text frame điều khiển từ thiết bị, vd. {"type": "eos", "frames": 94, "bytes": 96256}"""
+    try:
+        message = json.loads(text)
+    except ValueError:
+        return None
+    return message if isinstance(message, dict) and "type" in message else None
+STT_FRAME_BYTES = 1024  # 512 mẫu = 32 ms, cửa sổ VAD của STTSystem
+def process_audio_message(stt_system: STTSystem, data: bytes):
+    """Thiết bị có thể gộp nhiều frame 32 ms vào 1 message khi mạng chậm -> tách lại cho VAD"""
+    for offset in range(0, len(data), STT_FRAME_BYTES):
+        stt_system.process_chunk(data[offset:offset + STT_FRAME_BYTES])
 executor_stt = ThreadPoolExecutor(max_workers=4, thread_name_prefix="STTSystem-Worker")
 list_audio_url = dict[str, str]()
 list_audio_url_lock = threading.Lock()
@@ -39,11 +52,13 @@ async def websocket_endpoint(websocket: WebSocket, client_id: str):
         print(f"{TAG} Client {client_id}:  KHởi động thu âm ")
         stt_system = STTSystem(max_workers=1, token_master=client_id)
         chunk_count = 0
+        byte_count = 0
+        end_of_stream = False
         
         try:
             while True:
-                # Kiểm tra trạng thái voice từ MQTT
-                if client_id in mqtt_service.client_is_voice and mqtt_service.client_is_voice[client_id] > 1 :
+                # Kết thúc khi nhận frame "eos" (ngay sau chunk cuối) hoặc trạng thái voice từ MQTT (AU:OFF)
+                if end_of_stream or (client_id in mqtt_service.client_is_voice and mqtt_service.client_is_voice[client_id] > 1):
                     text = stt_system.get_result_text()
                     if not text or text.strip() == "":
                         text = "Không nhận diện được giọng nói"
@@ -60,23 +75,40 @@ async def websocket_endpoint(websocket: WebSocket, client_id: str):
                         list_audio_url[client_id] = final_audio_url.replace("https://", "http://")
                         mqtt_service.publish_message_NC(client_id, "WAV:RD")
                     print(f"{TAG} [Client: {client_id}] Final Audio URL: {final_audio_url}")
+                    # Kết thúc nhờ "eos" mà AU:OFF vẫn chưa tới -> AU:OFF đến muộn phải bỏ qua
+                    if end_of_stream and mqtt_service.client_is_voice.get(client_id, 0) <= 1:
+                        mqtt_service.client_eos_done.add(client_id)
                     mqtt_service.client_is_voice[client_id] = 0
                     return
                 try:
                     # Nhận data với timeout 0.5 giây để có thể kiểm tra điều kiện
-                    data = await asyncio.wait_for(
-                        websocket.receive_bytes(),
+                    message = await asyncio.wait_for(
+                        websocket.receive(),
                         timeout=0.5
                     )
                 except asyncio.TimeoutError:
                     # Timeout → quay lại đầu vòng lặp để kiểm tra client_is_voice > 1
                     continue
+                if message["type"] == "websocket.disconnect":
+                    raise WebSocketDisconnect(message.get("code", 1000))
+                if message.get("bytes") is None:
+                    control = parse_control_frame(message.get("text") or "")
+                    if control and control["type"] == "eos":
+                        end_of_stream = True
+                        if control.get("frames") != chunk_count or control.get("bytes") != byte_count:
+                            print(f"{TAG} Client {client_id}: EOS báo {control.get('frames')} chunk / {control.get('bytes')} byte, "
+                                  f"server nhận {chunk_count} / {byte_count}")
+                        else:
+                            print(f"{TAG} Client {client_id}: EOS, đủ {chunk_count} chunk / {byte_count} byte")
+                    continue
+                data = message["bytes"]
                     
                 chunk_count += 1
+                byte_count += len(data)
                 
                 # Xử lý audio chunk
-                print(f"{TAG} Client {client_id}: Nhận được data  : {chunk_count} ")
-                await asyncio.to_thread(stt_system.process_chunk, data)
+                print(f"{TAG} Client {client_id}: Nhận được data  : {chunk_count} ({len(data)} byte)")
+                await asyncio.to_thread(process_audio_message, stt_system, data)
                 
         except WebSocketDisconnect:
             print(f"{TAG} CONNECTION: Client {client_id} đã ngắt kết nối.")
@@ -2,7 +2,7 @@
 Script để test WebSocket Audio Streaming API
 - Gửi MQTT message để bắt đầu ghi âm
 - Kết nối WebSocket và gửi audio chunks
-- Gửi MQTT message để dừng ghi âm
+- Gửi frame "eos" ngay sau chunk cuối (giống MicRecorder::stopRecording) + MQTT message để dừng ghi âm
 - Nhận text kết quả từ WebSocket
 """
 
@@ -153,6 +153,7 @@ async def record_and_stream_audio(websocket, duration_seconds):
         
         start_time = time.time()
         chunks_sent = 0
+        bytes_sent = 0
         
         while (time.time() - start_time) < duration_seconds:
             # Đọc audio chunk từ microphone (512 samples = 32ms)
@@ -161,6 +162,7 @@ async def record_and_stream_audio(websocket, duration_seconds):
             # Gửi qua WebSocket
             await websocket.send(audio_data)
             chunks_sent += 1
+            bytes_sent += len(audio_data)
             
             # Hiển thị progress
             elapsed = time.time() - start_time
@@ -172,9 +174,11 @@ async def record_and_stream_audio(websocket, duration_seconds):
         # Đóng stream
         stream.stop_stream()
         stream.close()
+        return chunks_sent, bytes_sent
         
     except Exception as e:
         print(f"\n❌ [AUDIO] Lỗi khi ghi âm: {e}")
+        return 0, 0
     finally:
         audio.terminate()
 
@@ -238,19 +242,20 @@ async def test_audio_websocket():
             
             # Bước 4: Ghi âm và gửi audio
             print(f"\n🎤 [Bước 4] Ghi âm và gửi audio qua WebSocket...")
-            await record_and_stream_audio(websocket, RECORD_SECONDS)
+            chunks_sent, bytes_sent = await record_and_stream_audio(websocket, RECORD_SECONDS)
             
-            # Bước 5: Gửi MQTT message để dừng
-            print(f"\n📤 [Bước 5] Gửi gói tin MQTT để báo DỪNG ghi âm...")
+            # Bước 5: Báo kết thúc ngay trên WebSocket, MQTT AU:OFF vẫn gửi như firmware
+            print(f"\n📤 [Bước 5] Gửi frame eos + gói tin MQTT để báo DỪNG ghi âm...")
+            await websocket.send(json.dumps({"type": "eos", "frames": chunks_sent, "bytes": bytes_sent}))
+            stop_time = time.time()
             send_mqtt_message(MQTT_TOPIC_STOP, "AU:OFF")
-            await asyncio.sleep(0.5)  # Đợi server xử lý
             
             # Bước 6: Nhận text kết quả từ WebSocket
             print(f"\n📥 [Bước 6] Chờ nhận text kết quả từ WebSocket...")
             try:
                 # Đợi nhận message với timeout
                 result_text = await asyncio.wait_for(websocket.recv(), timeout=10)
-                print(f"✅ [WebSocket] Nhận được kết quả:")
+                print(f"✅ [WebSocket] Nhận được kết quả sau {(time.time() - stop_time) * 1000:.0f} ms:")
                 print("=" * 60)
                 print(f"📝 TEXT: {result_text}")
                 print("=" * 60)
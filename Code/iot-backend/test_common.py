@@ -0,0 +1,178 @@
+"""
+Helper dùng chung cho các script test (không phải test):
+- log / silence: module backend đang test in log liên tục (broker, http.server, ota_*...)
+  nên script tắt stdout và in kết quả thẳng ra console.
+- build_firmware: build 1 module firmware (client/firmware_master) thành thư viện .so bằng
+  g++ với Arduino / ESP-IDF giả, để test gọi chính code chạy trên thiết bị qua ctypes.
+
+    from test_common import log, silence
+    silence()
+    log("✅ OK")
+"""
+
+import ctypes
+import io
+import os
+import subprocess
+import sys
+
+FIRMWARE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "client", "firmware_master")
+
+
+def log(*args):
+    """In kết quả test ra console, kể cả khi stdout đã bị tắt bằng silence()"""
+    print(*args, file=sys.__stdout__, flush=True)
+
+
+def silence(stderr=False):
+    """Bỏ log của module đang test; stderr=True để bỏ cả log request của http.server"""
+    sys.stdout = io.StringIO()
+    if stderr:
+        sys.stderr = io.StringIO()
+
+
+# ============= BUILD CODE FIRMWARE TRÊN MÁY =============
+# Đủ Arduino cho các module OTA (otaVerify / otaDelta / otaInflate) chạy trên máy
+ARDUINO_H = r"""
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <time.h>
+#include <string>
+#include <algorithm>
+using std::min;
+
+inline unsigned long millis() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+inline unsigned long micros() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+class String {
+public:
+    String(const char* s = "") : _s(s ? s : "") {}
+    unsigned int length() const { return _s.size(); }
+    const char* c_str() const { return _s.c_str(); }
+    bool equalsIgnoreCase(const String& o) const {
+        return _s.size() == o._s.size() && strcasecmp(_s.c_str(), o._s.c_str()) == 0;
+    }
+private:
+    std::string _s;
+};
+
+struct HostSerial {
+    int printf(const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vfprintf(stderr, fmt, args);
+        va_end(args);
+        return n;
+    }
+};
+static HostSerial Serial;
+"""
+
+# Socket giả: trả dữ liệu từ buffer, mỗi lần readBytes tối đa chunk byte (giả lập gói TCP)
+WIFI_CLIENT_H = r"""
+#pragma once
+#include "Arduino.h"
+
+class WiFiClient {
+public:
+    WiFiClient(const uint8_t* data = nullptr, size_t len = 0, size_t chunk = 1460)
+        : _data(data), _len(len), _pos(0), _chunk(chunk) {}
+    size_t readBytes(uint8_t* buf, size_t length) {
+        size_t n = min(min(length, _chunk), _len - _pos);
+        memcpy(buf, _data + _pos, n);
+        _pos += n;
+        return n;
+    }
+    uint8_t connected() { return _pos < _len; }
+private:
+    const uint8_t* _data;
+    size_t _len;
+    size_t _pos;
+    size_t _chunk;
+};
+"""
+
+ESP_PARTITION_H = r"""
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+typedef struct { uint32_t address; uint32_t size; char label[17]; } esp_partition_t;
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* dst, size_t size);
+"""
+
+# Partition giả: flash là buffer Python, đọc từ offset failAt trở đi thì lỗi
+HOST_FLASH_CPP = r"""
+#include <string.h>
+#include "esp_partition.h"
+
+static const uint8_t* g_flash = nullptr;
+static size_t g_flashLen = 0;
+static size_t g_failAt = (size_t)-1;
+static int g_reads = 0;
+
+esp_err_t esp_partition_read(const esp_partition_t*, size_t offset, void* dst, size_t size) {
+    g_reads++;
+    if (offset >= g_failAt || offset + size > g_flashLen) return ESP_FAIL;
+    memcpy(dst, g_flash + offset, size);
+    return ESP_OK;
+}
+
+extern "C" {
+void host_flash(const uint8_t* flash, size_t flashLen, size_t failAt) {
+    g_flash = flash;
+    g_flashLen = flashLen;
+    g_failAt = failAt;
+    g_reads = 0;
+}
+int host_flash_reads() { return g_reads; }
+}
+"""
+
+
+def build_firmware(workdir, name, sources, harness_cpp, headers=None, cflags=(), libs=()):
+    """Build sources (file trong FIRMWARE_DIR) + harness_cpp thành lib<name>.so và load bằng ctypes.
+
+    headers: {tên file: nội dung} thêm / đè lên Arduino.h, WiFiClient.h, esp_partition.h giả.
+    mbedTLS lấy từ MBEDTLS_INCLUDE / MBEDTLS_LIB nếu có (vd. từ ESP-IDF hoặc bản build riêng).
+    """
+    files = {"Arduino.h": ARDUINO_H, "WiFiClient.h": WIFI_CLIENT_H, "esp_partition.h": ESP_PARTITION_H,
+             "host_flash.cpp": HOST_FLASH_CPP, f"{name}_harness.cpp": harness_cpp}
+    files.update(headers or {})
+    for filename, text in files.items():
+        path = os.path.join(workdir, filename)
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, "w") as f:
+            f.write(text)
+    cmd = ["g++", "-std=c++17", "-O2", "-shared", "-fPIC", "-w", "-I", workdir, "-I", FIRMWARE_DIR, *cflags]
+    if os.environ.get("MBEDTLS_INCLUDE"):
+        cmd += ["-I", os.environ["MBEDTLS_INCLUDE"]]
+    if os.environ.get("MBEDTLS_LIB"):
+        cmd += ["-L", os.environ["MBEDTLS_LIB"], "-Wl,-rpath," + os.environ["MBEDTLS_LIB"]]
+    output = os.path.join(workdir, f"lib{name}.so")
+    cmd += [os.path.join(workdir, "host_flash.cpp"), os.path.join(workdir, f"{name}_harness.cpp")]
+    cmd += [s if os.path.isabs(s) else os.path.join(FIRMWARE_DIR, s) for s in sources]
+    cmd += [*libs, "-o", output]
+    result = subprocess.run(cmd, capture_output=True, text=True)
+    if result.returncode != 0:
+        log(result.stderr)
+        raise RuntimeError(f"Không build được {', '.join(sources)} (cần g++ + thư viện ghi ở đầu script test)")
+
+    lib = ctypes.CDLL(output)
+    lib.host_flash.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t]
+    return lib
@@ -0,0 +1,259 @@
+"""
+Script để test QoS 1 của broker (app/broker_server.py) và đo throughput
+theo kích thước in-flight window, giống cách firmware (mqttClient.cpp) gửi:
+- Nhiều PUBLISH QoS 1 chờ PUBACK cùng lúc (window 1/2/4/8) so với QoS 0
+- Packet id, PUBACK, lọc bản gửi lại có cờ DUP (kể cả sau khi reconnect)
+- Nhiều packet trong 1 lần recv() phải được tách đúng
+
+Chạy: python test_mqtt_qos.py [rtt_ms] [so_message]
+Độ trễ mạng WiFi được giả lập bằng 1 proxy TCP đặt giữa client và broker.
+"""
+
+import socket
+import struct
+import sys
+import os
+import threading
+import time
+import heapq
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from app.broker_server import SimpleMQTTBroker, encode_remaining_length, split_mqtt_packets
+from test_common import log, silence
+
+# ============= CẤU HÌNH =============
+BROKER_HOST = "127.0.0.1"
+BROKER_PORT = 18830
+PROXY_PORT = 18831
+CLIENT_ID = "066420c45a4e819437bbfbea63b83739"
+TOPIC = f"SS/{CLIENT_ID}/5"
+PAYLOAD = b"27.25"
+RTT_MS = int(sys.argv[1]) if len(sys.argv) > 1 else 40
+MESSAGES = int(sys.argv[2]) if len(sys.argv) > 2 else 200
+WINDOWS = [1, 2, 4, 8]
+
+
+# ============= BROKER + PROXY =============
+class CountingBroker(SimpleMQTTBroker):
+    """Broker chỉ đếm message thay vì forward / lưu database"""
+    def __init__(self, host, port):
+        super().__init__(host, port)
+        self.delivered = 0
+
+    def handle_publish(self, client_socket, payload):
+        self.delivered += 1
+
+
+class LatencyProxy:
+    """Proxy TCP trễ RTT/2 mỗi chiều, giả lập đường WiFi -> broker"""
+    def __init__(self, listen_port, target, one_way_s):
+        self.target = target
+        self.delay = one_way_s
+        self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.server.bind((BROKER_HOST, listen_port))
+        self.server.listen(5)
+        threading.Thread(target=self._accept, daemon=True).start()
+
+    def _accept(self):
+        while True:
+            client, _ = self.server.accept()
+            upstream = socket.create_connection(self.target)
+            for sock in (client, upstream):
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            for src, dst in ((client, upstream), (upstream, client)):
+                threading.Thread(target=self._pump, args=(src, dst), daemon=True).start()
+
+    def _pump(self, src, dst):
+        pending = []
+        lock = threading.Condition()
+
+        def sender():
+            while True:
+                with lock:
+                    while not pending:
+                        lock.wait()
+                    release, _, chunk = pending[0]
+                    wait = release - time.monotonic()
+                    if wait > 0:
+                        lock.wait(wait)
+                        continue
+                    heapq.heappop(pending)
+                if chunk is None:
+                    dst.close()
+                    return
+                try:
+                    dst.sendall(chunk)
+                except OSError:
+                    return
+
+        threading.Thread(target=sender, daemon=True).start()
+        seq = 0
+        while True:
+            try:
+                chunk = src.recv(4096)
+            except OSError:
+                chunk = b''
+            with lock:
+                heapq.heappush(pending, (time.monotonic() + self.delay, seq, chunk or None))
+                seq += 1
+                lock.notify()
+            if not chunk:
+                return
+
+
+# ============= MQTT CLIENT (giống firmware) =============
+def build_packet(header, body):
+    return bytes([header]) + encode_remaining_length(len(body)) + body
+
+
+def build_publish(packet_id=None, dup=False):
+    topic = TOPIC.encode()
+    body = struct.pack(">H", len(topic)) + topic
+    header = 0x30
+    if packet_id is not None:
+        header |= 0x02 | (0x08 if dup else 0)
+        body += struct.pack(">H", packet_id)
+    return build_packet(header, body + PAYLOAD)
+
+
+def mqtt_connect(port):
+    sock = socket.create_connection((BROKER_HOST, port))
+    # Firmware cũng tắt Nagle (setNoDelay) để PUBLISH trong window không bị giữ lại
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    cid = CLIENT_ID.encode()
+    body = b"\x00\x04MQTT\x04\x02\x00\x0f" + struct.pack(">H", len(cid)) + cid
+    sock.sendall(build_packet(0x10, body))
+    connack = sock.recv(4)
+    assert connack[:1] == b"\x20" and connack[3] == 0, f"CONNACK lỗi: {connack!r}"
+    return sock
+
+
+class AckReader:
+    """Đọc PUBACK từ stream (có thể dính nhiều packet trong 1 recv)"""
+    def __init__(self, sock):
+        self.sock = sock
+        self.buffer = b''
+
+    def read_acks(self):
+        self.buffer += self.sock.recv(4096)
+        packets, self.buffer = split_mqtt_packets(self.buffer)
+        return [struct.unpack(">H", body[:2])[0] for first, body in packets if first & 0xF0 == 0x40]
+
+
+def run_qos0(port, count):
+    sock = mqtt_connect(port)
+    start = time.monotonic()
+    for _ in range(count):
+        sock.sendall(build_publish())
+    elapsed = time.monotonic() - start
+    sock.close()
+    return elapsed, 0.0
+
+
+def run_qos1(port, count, window):
+    sock = mqtt_connect(port)
+    reader = AckReader(sock)
+    inflight = {}
+    ack_times = []
+    next_id = 1
+    sent = 0
+    start = time.monotonic()
+    while sent < count or inflight:
+        while sent < count and len(inflight) < window:
+            inflight[next_id] = time.monotonic()
+            sock.sendall(build_publish(next_id))
+            next_id = next_id % 65535 + 1
+            sent += 1
+        for packet_id in reader.read_acks():
+            sent_at = inflight.pop(packet_id, None)
+            if sent_at is not None:
+                ack_times.append(time.monotonic() - sent_at)
+    elapsed = time.monotonic() - start
+    sock.close()
+    return elapsed, sum(ack_times) / len(ack_times) * 1000
+
+
+def wait_delivered(broker, expected, timeout=5.0):
+    deadline = time.monotonic() + timeout
+    while broker.delivered < expected and time.monotonic() < deadline:
+        time.sleep(0.01)
+    return broker.delivered
+
+
+# ============= TESTS =============
+def test_duplicate_suppression(broker):
+    log("\n♻️ Test: lọc bản DUP (cùng phiên và sau reconnect)")
+    broker.delivered = 0
+    sock = mqtt_connect(BROKER_PORT)
+    reader = AckReader(sock)
+    sock.sendall(build_publish(7))
+    sock.sendall(build_publish(7, dup=True))
+    acks = []
+    while len(acks) < 2:
+        acks += reader.read_acks()
+    sock.close()
+
+    # Thiết bị reconnect và gửi lại message chưa kịp nhận PUBACK
+    sock = mqtt_connect(BROKER_PORT)
+    reader = AckReader(sock)
+    sock.sendall(build_publish(7, dup=True))
+    acks += reader.read_acks()
+    # Packet id được dùng lại cho message mới (không có DUP) -> phải nhận
+    sock.sendall(build_publish(7))
+    acks += reader.read_acks()
+    sock.close()
+
+    assert acks == [7, 7, 7, 7], acks
+    assert wait_delivered(broker, 2) == 2, broker.delivered
+    log(f"   PUBACK: {acks}, delivered: {broker.delivered}, dup dropped: {broker.duplicates_dropped}")
+    log("✅ OK")
+
+
+def test_coalesced_packets(broker):
+    log("\n📦 Test: nhiều packet trong 1 lần gửi TCP")
+    broker.delivered = 0
+    sock = mqtt_connect(BROKER_PORT)
+    reader = AckReader(sock)
+    sock.sendall(b"".join(build_publish(100 + i) for i in range(5)) + build_publish()[:3])
+    acks = []
+    while len(acks) < 5:
+        acks += reader.read_acks()
+    sock.close()
+    assert acks == [100, 101, 102, 103, 104], acks
+    assert wait_delivered(broker, 5) == 5, broker.delivered
+    log(f"   PUBACK: {acks}")
+    log("✅ OK")
+
+
+def test_throughput(broker):
+    log(f"\n📊 Test: throughput {MESSAGES} message, RTT giả lập {RTT_MS} ms")
+    log(f"   {'Mode':<14}{'msg/s':>10}{'avg ack ms':>12}")
+    runs = [("QoS 0", lambda: run_qos0(PROXY_PORT, MESSAGES))]
+    runs += [(f"QoS 1 win={w}", lambda w=w: run_qos1(PROXY_PORT, MESSAGES, w)) for w in WINDOWS]
+    for name, run in runs:
+        broker.delivered = 0
+        elapsed, avg_ack = run()
+        wait_delivered(broker, MESSAGES)
+        assert broker.delivered == MESSAGES, (name, broker.delivered)
+        log(f"   {name:<14}{MESSAGES / elapsed:>10.1f}{avg_ack:>12.1f}")
+    log("   (QoS 0 chỉ đo thời gian ghi socket, không biết message có tới broker hay không)")
+    log("✅ OK")
+
+
+if __name__ == "__main__":
+    log("=" * 60)
+    log("🧪 TEST MQTT QoS 1 / IN-FLIGHT WINDOW")
+    log("=" * 60)
+    silence()
+    broker = CountingBroker(BROKER_HOST, BROKER_PORT)
+    threading.Thread(target=broker.start, daemon=True).start()
+    time.sleep(0.3)
+    LatencyProxy(PROXY_PORT, (BROKER_HOST, BROKER_PORT), RTT_MS / 2000)
+
+    test_duplicate_suppression(broker)
+    test_coalesced_packets(broker)
+    test_throughput(broker)
+    broker.stop()
+    log("\n🎉 Tất cả test đều pass")
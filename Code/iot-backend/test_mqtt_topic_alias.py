@@ -0,0 +1,241 @@
+"""
+Script để test MQTT 5 topic alias / handle ngắn của broker (app/broker_server.py)
+và đo số byte mỗi lần gửi 1 giá trị cảm biến, giống cách firmware (mqttClient.cpp) gửi:
+- MQTT 3.1.1, topic đầy đủ SS/<client_id>/5 (trước đây)
+- MQTT 3.1.1, subscribe HD/<client_id> để broker cấp handle ngắn -> SS/~<handle>/5
+- MQTT 5, topic alias: lần đầu topic + alias, các lần sau topic rỗng + alias
+Broker phải chuyển cả 3 dạng về đúng topic SS/<client_id>/5 trước khi xử lý.
+
+Chạy: python test_mqtt_topic_alias.py [so_message]
+"""
+
+import socket
+import struct
+import sys
+import os
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from app.broker_server import (SimpleMQTTBroker, encode_remaining_length, decode_remaining_length,
+                               parse_connect, parse_properties, TOPIC_ALIAS_MAXIMUM)
+from test_common import log, silence
+
+# ============= CẤU HÌNH =============
+BROKER_HOST = "127.0.0.1"
+BROKER_PORT = 18832
+CLIENT_ID = "066420c45a4e819437bbfbea63b83739"
+TOPIC = f"SS/{CLIENT_ID}/5"
+PAYLOAD = b"27.25"
+MESSAGES = int(sys.argv[1]) if len(sys.argv) > 1 else 200
+
+
+# ============= BROKER =============
+class RecordingBroker(SimpleMQTTBroker):
+    """Broker chỉ ghi lại topic / message đã nhận thay vì forward / lưu database"""
+    def __init__(self, host, port):
+        super().__init__(host, port)
+        self.received = []
+
+    def handle_publish(self, client_socket, payload):
+        topic_len = struct.unpack(">H", payload[0:2])[0]
+        self.received.append((payload[2:2 + topic_len].decode(), payload[2 + topic_len:]))
+
+
+# ============= MQTT CLIENT (giống firmware) =============
+def build_packet(header, body):
+    return bytes([header]) + encode_remaining_length(len(body)) + body
+
+
+def build_publish(topic, packet_id, props=None):
+    """props=None: 3.1.1, props=b'...': MQTT 5 (khối property đã encode, không gồm độ dài)"""
+    topic = topic.encode()
+    body = struct.pack(">H", len(topic)) + topic + struct.pack(">H", packet_id)
+    if props is not None:
+        body += encode_remaining_length(len(props)) + props
+    return build_packet(0x32, body + PAYLOAD)
+
+
+def alias_props(alias):
+    return bytes([0x23]) + struct.pack(">H", alias)
+
+
+class Client:
+    """Client QoS 1 đếm byte gửi / nhận trên socket"""
+    def __init__(self, level):
+        self.sock = socket.create_connection((BROKER_HOST, BROKER_PORT))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.sock.settimeout(2.0)
+        self.buffer = b''
+        self.sent = 0
+        cid = CLIENT_ID.encode()
+        props = b"\x00" if level == 5 else b""
+        body = b"\x00\x04MQTT" + bytes([level, 0x02]) + b"\x00\x0f" + props + struct.pack(">H", len(cid)) + cid
+        self.send(build_packet(0x10, body))
+        first, self.connack = self.read_packet()
+        assert first == 0x20 and self.connack[1] == 0, f"CONNACK lỗi: {self.connack!r}"
+        self.sent = 0  # chỉ tính byte của PUBLISH
+
+    def send(self, packet):
+        self.sock.sendall(packet)
+        self.sent += len(packet)
+
+    def read_packet(self):
+        while True:
+            length, header_len = decode_remaining_length(self.buffer)
+            if length is not None and len(self.buffer) >= header_len + length:
+                first, body = self.buffer[0], self.buffer[header_len:header_len + length]
+                self.buffer = self.buffer[header_len + length:]
+                return first, body
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                return None, b''
+            self.buffer += chunk
+
+    def wait_puback(self, packet_id):
+        while True:
+            first, body = self.read_packet()
+            assert first is not None, "Broker đóng kết nối"
+            if first & 0xF0 == 0x40:
+                assert struct.unpack(">H", body[:2])[0] == packet_id
+                return
+
+    def close(self):
+        self.sock.close()
+
+
+def wait_received(broker, expected, timeout=5.0):
+    deadline = time.monotonic() + timeout
+    while len(broker.received) < expected and time.monotonic() < deadline:
+        time.sleep(0.01)
+    return broker.received
+
+
+# ============= TESTS =============
+def run_full_topic():
+    client = Client(4)
+    for i in range(MESSAGES):
+        client.send(build_publish(TOPIC, i + 1))
+        client.wait_puback(i + 1)
+    client.close()
+    return client.sent
+
+
+def run_handle():
+    client = Client(4)
+    topic = f"HD/{CLIENT_ID}".encode()
+    client.send(build_packet(0x82, b"\x00\x01" + struct.pack(">H", len(topic)) + topic + b"\x00"))
+    first, body = client.read_packet()
+    assert first == 0x90, first
+    first, body = client.read_packet()
+    topic_len = struct.unpack(">H", body[:2])[0]
+    assert body[2:2 + topic_len].decode() == f"HD/{CLIENT_ID}", body
+    handle = body[2 + topic_len:].decode()
+    for i in range(MESSAGES):
+        client.send(build_publish(f"SS/~{handle}/5", i + 1))
+        client.wait_puback(i + 1)
+    client.close()
+    return client.sent - len(topic) - 7  # không tính SUBSCRIBE (1 lần mỗi kết nối)
+
+
+def run_alias():
+    client = Client(5)
+    props, _ = parse_properties(client.connack, 2)
+    assert props[0x22] == TOPIC_ALIAS_MAXIMUM, props
+    for i in range(MESSAGES):
+        topic = TOPIC if i == 0 else ""
+        client.send(build_publish(topic, i + 1, alias_props(1)))
+        client.wait_puback(i + 1)
+    client.close()
+    return client.sent
+
+
+def test_parse_connect():
+    log("\n🔌 Test: đọc client id từ CONNECT 3.1.1 và MQTT 5")
+    cid = CLIENT_ID.encode()
+    v4 = b"\x00\x04MQTT\x04\x02\x00\x0f" + struct.pack(">H", len(cid)) + cid
+    v5 = b"\x00\x04MQTT\x05\x02\x00\x0f\x05\x11\x00\x00\x00\x3c" + struct.pack(">H", len(cid)) + cid
+    assert parse_connect(v4) == (4, CLIENT_ID), parse_connect(v4)
+    assert parse_connect(v5) == (5, CLIENT_ID), parse_connect(v5)
+    log("✅ OK")
+
+
+def test_bytes_per_reading(broker):
+    log(f"\n📏 Test: byte gửi lên broker cho mỗi giá trị ({MESSAGES} message QoS 1, payload {len(PAYLOAD)} byte)")
+    log(f"   {'Mode':<26}{'bytes/reading':>14}{'topic+alias':>13}")
+    results = {}
+    for name, run in (("3.1.1 topic đầy đủ", run_full_topic),
+                      ("3.1.1 handle ngắn", run_handle),
+                      ("MQTT 5 topic alias", run_alias)):
+        broker.received = []
+        sent = run()
+        received = wait_received(broker, MESSAGES)
+        assert len(received) == MESSAGES, (name, len(received))
+        assert all(item == (TOPIC, PAYLOAD) for item in received), (name, received[:3])
+        per_reading = sent / MESSAGES
+        results[name] = per_reading
+        log(f"   {name:<26}{per_reading:>14.1f}{per_reading - 2 - 2 - 2 - len(PAYLOAD):>13.1f}")
+    baseline = results["3.1.1 topic đầy đủ"]
+    for name, value in results.items():
+        log(f"   {name:<26}{value / baseline * 100:>13.0f}%")
+    assert results["MQTT 5 topic alias"] < baseline / 2
+    assert results["3.1.1 handle ngắn"] < baseline / 2
+    log("   (PUBACK broker -> thiết bị luôn 4 byte, không đổi)")
+    log("✅ OK")
+
+
+def test_alias_scope(broker):
+    log("\n🔁 Test: alias chỉ sống trong 1 kết nối")
+    broker.received = []
+    client = Client(5)
+    client.send(build_publish(TOPIC, 1, alias_props(3)))
+    client.wait_puback(1)
+    client.close()
+
+    # Kết nối mới: gửi lại chỉ bằng alias -> broker đóng kết nối, không nhận message
+    client = Client(5)
+    client.send(build_publish("", 2, alias_props(3)))
+    first, _ = client.read_packet()
+    assert first is None, first
+    client.close()
+
+    # Firmware gửi lại kèm topic đầy đủ sau reconnect -> nhận bình thường
+    client = Client(5)
+    client.send(build_publish(TOPIC, 2, alias_props(3)))
+    client.wait_puback(2)
+    client.close()
+    received = wait_received(broker, 2)
+    assert received == [(TOPIC, PAYLOAD), (TOPIC, PAYLOAD)], received
+    log("✅ OK")
+
+
+def test_v5_subscriber(broker):
+    log("\n📡 Test: subscriber MQTT 5 nhận PUBLISH có khối property")
+    client = Client(5)
+    topic = f"CT/{CLIENT_ID}/5".encode()
+    client.send(build_packet(0x82, b"\x00\x01\x00" + struct.pack(">H", len(topic)) + topic + b"\x00"))
+    first, body = client.read_packet()
+    assert first == 0x90 and body == b"\x00\x01\x00\x00", (first, body)
+    SimpleMQTTBroker.handle_publish(broker, None, struct.pack(">H", len(topic)) + topic + b"ON")
+    first, body = client.read_packet()
+    assert first == 0x30 and body == struct.pack(">H", len(topic)) + topic + b"\x00ON", body
+    client.close()
+    log("✅ OK")
+
+
+if __name__ == "__main__":
+    log("=" * 60)
+    log("🧪 TEST MQTT 5 TOPIC ALIAS / HANDLE NGẮN")
+    log("=" * 60)
+    silence()
+    broker = RecordingBroker(BROKER_HOST, BROKER_PORT)
+    threading.Thread(target=broker.start, daemon=True).start()
+    time.sleep(0.3)
+
+    test_parse_connect()
+    test_bytes_per_reading(broker)
+    test_alias_scope(broker)
+    test_v5_subscriber(broker)
+    broker.stop()
+    log("\n🎉 Tất cả test đều pass")
@@ -0,0 +1,83 @@
+"""
+Script để test việc ghép slave với master đang cache firmware trong LAN (app/services/ota_cache.py):
+- Slave cùng IP public, đúng phiên bản + sha256 -> nhận link LAN của master
+- Site khác / phiên bản cũ / sha256 khác / manifest không có sha256 -> dùng link gốc
+- Master bỏ cache (version rỗng) hoặc quá CACHE_TTL_S không báo lại -> dùng link gốc
+
+Chạy: python test_ota_cache.py
+"""
+
+import os
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from app.services import ota_cache
+from test_common import log, silence
+
+# ============= CẤU HÌNH =============
+USER = "user-1"
+SITE_IP = "203.0.113.7"             # IP public của nhà có master
+OTHER_IP = "198.51.100.20"
+VERSION = "Slave_1.0.3"
+SHA256 = "ab" * 32
+LAN_URL = "http://192.168.1.50:8080/ota/cache/slave.bin"
+
+
+def reset():
+    with ota_cache._lock:
+        ota_cache._caches.clear()
+
+
+def test_lookup():
+    log("\n🔸 Test 1: Slave cùng site nhận link LAN")
+    reset()
+    assert ota_cache.lookup(USER, VERSION, SHA256, SITE_IP) is None
+    ota_cache.announce(USER, "master-1", VERSION, SHA256.upper(), LAN_URL, SITE_IP)
+
+    assert ota_cache.lookup(USER, VERSION, SHA256, SITE_IP) == LAN_URL
+    cases = {
+        "site khác": (USER, VERSION, SHA256, OTHER_IP),
+        "user khác": ("user-2", VERSION, SHA256, SITE_IP),
+        "phiên bản khác": (USER, "Slave_1.0.2", SHA256, SITE_IP),
+        "sha256 khác": (USER, VERSION, "cd" * 32, SITE_IP),
+        "manifest không có sha256": (USER, VERSION, None, SITE_IP),
+    }
+    for name, args in cases.items():
+        assert ota_cache.lookup(*args) is None, name
+        log(f"   {name}: link gốc")
+    log("✅ OK")
+
+
+def test_withdraw_and_ttl():
+    log("\n🔸 Test 2: Master bỏ cache / hết hạn")
+    reset()
+    ota_cache.announce(USER, "master-1", VERSION, SHA256, LAN_URL, SITE_IP)
+    ota_cache.withdraw(USER, SITE_IP)
+    assert ota_cache.lookup(USER, VERSION, SHA256, SITE_IP) is None
+    log("   Bỏ cache: link gốc")
+
+    ota_cache.announce(USER, "master-1", VERSION, SHA256, LAN_URL, SITE_IP)
+    with ota_cache._lock:
+        ota_cache._caches[(USER, SITE_IP)]["announced_at"] -= ota_cache.CACHE_TTL_S + 1
+    assert ota_cache.lookup(USER, VERSION, SHA256, SITE_IP) is None
+    assert (USER, SITE_IP) not in ota_cache._caches
+    log("   Quá CACHE_TTL_S không báo lại: link gốc")
+
+    # Master cache bản mới thì thay bản cũ
+    ota_cache.announce(USER, "master-1", VERSION, SHA256, LAN_URL, SITE_IP)
+    ota_cache.announce(USER, "master-1", "Slave_1.0.4", "ef" * 32, LAN_URL, SITE_IP)
+    assert ota_cache.lookup(USER, VERSION, SHA256, SITE_IP) is None
+    assert ota_cache.lookup(USER, "Slave_1.0.4", "ef" * 32, SITE_IP) == LAN_URL
+    log("   Bản mới thay bản cũ")
+    log("✅ OK")
+
+
+if __name__ == "__main__":
+    log("=" * 60)
+    log("🧪 TEST OTA CACHE")
+    log("=" * 60)
+    silence()
+    test_lookup()
+    test_withdraw_and_ttl()
+    log("\n🎉 Tất cả test đều pass")
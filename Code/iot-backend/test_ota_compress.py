@@ -0,0 +1,299 @@
+"""
+Script để test ảnh OTA nén (app/services/ota_compress.py) với chính OtaInflater của firmware
+(client/firmware_master/otaInflate.cpp, build trên máy bằng g++ + tinfl của miniz) và đo thời
+gian update so với ảnh không nén trên 1 server HTTP cục bộ giới hạn băng thông (giả lập WiFi):
+- Container "EDZ1" giải nén đúng qua buffer vòng 4 KB, kể cả khi socket trả từng mẩu lẻ,
+  ảnh được đọc ra theo block lẻ và back-reference / run dài vắt qua chỗ buffer vòng quay lại
+- Header EDZ1 sai / cửa sổ zlib > 4 KB / stream hỏng / bị cắt / sai kích thước bị từ chối
+- Client đi theo pipeline của firmware (OTAUpdate::downloadAndUpdate): tải -> giải nén
+  4 KB/lần -> luồng ghi flash riêng với thời gian xóa + ghi mỗi sector cố định
+
+Chạy: python test_ota_compress.py [link_KB/s] [flash_ms_moi_sector] [kich_thuoc_KB]
+Cần g++ và miniz (gói libminiz-dev). Header / thư viện nằm chỗ khác thì đặt
+MINIZ_INCLUDE / MINIZ_LIB.
+"""
+
+import ctypes
+import os
+import queue
+import random
+import struct
+import sys
+import tempfile
+import threading
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from app.services.ota_compress import HEADER, WINDOW_BITS, compress_image
+from test_common import FIRMWARE_DIR, build_firmware, log, silence
+
+# ============= CẤU HÌNH =============
+HOST = "127.0.0.1"
+PORT = 18081
+LINK_KBPS = float(sys.argv[1]) if len(sys.argv) > 1 else 64
+FLASH_MS_PER_SECTOR = float(sys.argv[2]) if len(sys.argv) > 2 else 10
+IMAGE_KB = int(sys.argv[3]) if len(sys.argv) > 3 else 256
+BLOCK = 4096                        # OTA_BLOCK_SIZE
+FLASH_BASE = 0x400D0000
+WINDOW = 4096                       # OTA_ZLIB_WINDOW
+
+# Giống OTAUpdate: begin (đọc header) -> Update.begin(imageSize) -> read từng block -> finish
+HARNESS_CPP = r"""
+#include <vector>
+#include "otaInflate.h"
+
+static const char* g_error = "";
+
+extern "C" {
+int oi_inflate(const uint8_t* data, size_t len, size_t compressedSize, size_t chunk, size_t outChunk,
+               uint8_t* out, size_t outCap, size_t* outLen) {
+    WiFiClient stream(data, len, chunk);
+    OtaInflater inflater;
+    std::vector<uint8_t> buf(outChunk);
+    *outLen = 0;
+    bool ok = inflater.begin(&stream, compressedSize);
+    size_t n;
+    while (ok && (n = inflater.read(buf.data(), buf.size())) > 0) {
+        if (*outLen + n > outCap || *outLen + n > inflater.imageSize()) {
+            g_error = "Output exceeds image_size";
+            return 0;
+        }
+        memcpy(out + *outLen, buf.data(), n);
+        *outLen += n;
+    }
+    ok = ok && inflater.finish();
+    g_error = inflater.error();
+    return ok ? 1 : 0;
+}
+const char* oi_error() { return g_error; }
+}
+"""
+
+# Firmware include <esp32/rom/miniz.h> (tinfl trong ROM) -> miniz.h của máy
+ROM_MINIZ_H = """
+#pragma once
+#include <miniz.h>
+"""
+
+
+def build_inflater(workdir):
+    include = os.environ.get("MINIZ_INCLUDE", "/usr/include/miniz")
+    cflags = ["-I", include]
+    libs = ["-lminiz"]
+    if os.environ.get("MINIZ_LIB"):
+        libs = ["-L", os.environ["MINIZ_LIB"], "-Wl,-rpath," + os.environ["MINIZ_LIB"]] + libs
+    lib = build_firmware(workdir, "otainflate", ["otaInflate.cpp"], HARNESS_CPP,
+                         headers={"esp32/rom/miniz.h": ROM_MINIZ_H}, cflags=cflags, libs=libs)
+    lib.oi_inflate.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t,
+                               ctypes.c_size_t, ctypes.c_void_p, ctypes.c_size_t,
+                               ctypes.POINTER(ctypes.c_size_t)]
+    lib.oi_error.restype = ctypes.c_char_p
+    return lib
+
+
+def inflate(lib, data, chunk=1460, out_chunk=4096, compressed_size=None):
+    """Giải nén bằng OtaInflater của firmware -> (ảnh, None) hoặc (None, lỗi)"""
+    # Buffer ra = image_size trong header (như Update.begin), không kiểm tra magic ở đây
+    cap = max(HEADER.unpack_from(data)[1], 1) if len(data) >= HEADER.size else 1
+    out = ctypes.create_string_buffer(cap)
+    out_len = ctypes.c_size_t(0)
+    compressed_size = len(data) if compressed_size is None else compressed_size
+    ok = lib.oi_inflate(bytes(data), len(data), compressed_size, chunk, out_chunk,
+                        out, cap, ctypes.byref(out_len))
+    if not ok:
+        return None, lib.oi_error().decode()
+    return out.raw[:out_len.value], None
+
+
+def make_firmware(size, seed=1):
+    """Code lặp theo mẫu + con trỏ tuyệt đối + chuỗi log, nén được tương tự ảnh ESP32 thật"""
+    rng = random.Random(seed)
+    opcodes = [rng.randrange(256) for _ in range(48)]
+    out = bytearray()
+    while len(out) < size:
+        for _ in range(rng.randrange(8, 40)):
+            out += bytes([rng.choice(opcodes), rng.randrange(16), rng.choice(opcodes)])
+        out += struct.pack("<I", FLASH_BASE + rng.randrange(size) & ~3)
+        if rng.random() < 0.1:
+            out += b"[OTA] message %d\x00" % rng.randrange(1000)
+    return bytes(out[:size])
+
+
+# ============= SERVER GIỚI HẠN BĂNG THÔNG =============
+FILES = {}
+
+
+class ThrottledHandler(BaseHTTPRequestHandler):
+    def do_GET(self):
+        body = FILES.get(self.path)
+        if body is None:
+            self.send_error(404)
+            return
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        chunk = 1024
+        start = time.time()
+        for offset in range(0, len(body), chunk):
+            self.wfile.write(body[offset:offset + chunk])
+            # Giữ tốc độ trung bình = LINK_KBPS
+            ahead = (offset + chunk) / 1024 / LINK_KBPS - (time.time() - start)
+            if ahead > 0:
+                time.sleep(ahead)
+
+
+# ============= CLIENT (giống pipeline firmware) =============
+def ota_download(path, compressed):
+    """Trả (thời gian, ảnh đã ghi). Luồng chính tải + giải nén, luồng phụ 'ghi flash'."""
+    import http.client
+    full = queue.Queue(maxsize=2)   # OTA_PIPELINE_BUFFERS
+    written = bytearray()
+
+    def writer():
+        while True:
+            block = full.get()
+            if block is None:
+                return
+            time.sleep(FLASH_MS_PER_SECTOR / 1000)      # Xóa + ghi 1 sector
+            written.extend(block)
+
+    start = time.time()
+    thread = threading.Thread(target=writer)
+    thread.start()
+    conn = http.client.HTTPConnection(HOST, PORT)
+    conn.request("GET", path)
+    resp = conn.getresponse()
+    assert resp.status == 200
+
+    pending = bytearray()
+    if compressed:
+        assert resp.read(HEADER.size)[:4] == b"EDZ1"
+        decompressor = zlib.decompressobj(WINDOW_BITS)
+        while True:
+            data = resp.read(1024)
+            if not data:
+                break
+            pending += decompressor.decompress(data)
+            while len(pending) >= BLOCK:
+                full.put(bytes(pending[:BLOCK]))
+                del pending[:BLOCK]
+        pending += decompressor.flush()
+    else:
+        while True:
+            data = resp.read(1024)
+            if not data:
+                break
+            pending += data
+            while len(pending) >= BLOCK:
+                full.put(bytes(pending[:BLOCK]))
+                del pending[:BLOCK]
+    if pending:
+        full.put(bytes(pending))
+    full.put(None)
+    thread.join()
+    conn.close()
+    return time.time() - start, bytes(written)
+
+
+def test_container(lib):
+    log("\n🔸 Test 1: OtaInflater giải nén EDZ1")
+    image = make_firmware(IMAGE_KB * 1024)
+    data = compress_image(image)
+    start = time.time()
+    inflated, error = inflate(lib, data)
+    inflate_ms = (time.time() - start) * 1000
+    assert inflated == image, error
+    log(f"   {len(image)} B -> {len(data)} B ({len(data) * 100 / len(image):.1f}%), "
+        f"OtaInflater {inflate_ms:.0f} ms")
+    assert len(data) < len(image) * 0.8
+
+    # Socket trả từng mẩu lẻ, Update.write nhận block lẻ
+    for chunk, out_chunk in ((1, 4096), (7, 333), (513, 1), (4096, 100003)):
+        inflated, error = inflate(lib, data, chunk=chunk, out_chunk=out_chunk)
+        assert inflated == image, (chunk, out_chunk, error)
+    log("   Ảnh nén theo mẩu 1 / 7 / 513 / 4096 B, đọc ra block 4096 / 333 / 1 / 100003 B: khớp")
+
+    # Back-reference xa gần hết cửa sổ (zlib tối đa WINDOW - 262) + run 0xFF dài:
+    # bản sao vắt qua chỗ buffer vòng quay về 0
+    rng = random.Random(5)
+    block = bytes(rng.randrange(256) for _ in range(WINDOW - 300))
+    wrap = (block * 6)[:WINDOW * 5 + 77] + b"\xff" * (3 * WINDOW + 5) + block[:1000] * 3
+    wrap_data = compress_image(wrap)
+    assert len(wrap_data) < len(wrap) // 4, len(wrap_data)      # Đúng là back-reference, không phải literal
+    for chunk, out_chunk in ((1460, 4096), (3, 1000), (1, 4097)):
+        inflated, error = inflate(lib, wrap_data, chunk=chunk, out_chunk=out_chunk)
+        assert inflated == wrap, (chunk, out_chunk, error)
+    log(f"   Khoảng cách {len(block)} B / run 0xFF {3 * WINDOW + 5} B qua buffer vòng "
+        f"({len(wrap)} B -> {len(wrap_data)} B): khớp")
+    log("✅ OK")
+
+
+def test_rejects_bad_input(lib):
+    log("\n🔸 Test 2: Header EDZ1 / stream zlib sai")
+    image = make_firmware(64 * 1024, seed=2)
+    data = compress_image(image)
+    stream = data[HEADER.size:]
+    half = len(data) // 2
+
+    # Stream nén với cửa sổ 32 KB (zlib mặc định) không giải nén được bằng buffer 4 KB
+    wide = zlib.compress(image, 9)
+    cases = {
+        "sai magic": (b"XXXX" + data[4:], {}, "Bad image magic"),
+        "image_size = 0": (HEADER.pack(b"EDZ1", 0) + stream, {}, "Empty image"),
+        "header bị cắt": (data[:HEADER.size - 3], {}, "Compressed image truncated"),
+        "cửa sổ 32 KB": (HEADER.pack(b"EDZ1", len(image)) + wide, {}, "Corrupt zlib stream"),
+        "bị cắt": (data[:half], {}, "Compressed image truncated"),
+        "mất kết nối giữa chừng": (data[:half], {"compressed_size": len(data)}, "Compressed download stalled"),
+        "image_size lớn hơn": (HEADER.pack(b"EDZ1", len(image) + 1) + stream, {}, "Compressed image ended early"),
+        "image_size nhỏ hơn": (HEADER.pack(b"EDZ1", len(image) - 1) + stream, {}, "Image larger than header size"),
+        "sai adler32": (data[:-1] + bytes([data[-1] ^ 1]), {}, "Adler32 mismatch"),
+        "sai byte giữa stream": (data[:half] + bytes([data[half] ^ 0xFF]) + data[half + 1:], {}, None),
+    }
+    for name, (bad, kwargs, error) in cases.items():
+        inflated, got = inflate(lib, bad, **kwargs)
+        assert inflated is None, f"{name}: không bị từ chối"
+        assert error is None or got == error, (name, got)
+        log(f"   {name}: {got}")
+    log("✅ OK")
+
+
+def test_update_time():
+    log(f"\n🔸 Test 3: Thời gian update qua link {LINK_KBPS:.0f} KB/s, flash {FLASH_MS_PER_SECTOR:.0f} ms/sector")
+    image = make_firmware(IMAGE_KB * 1024)
+    FILES["/fw.bin"] = image
+    FILES["/fw.z"] = compress_image(image)
+    server = ThreadingHTTPServer((HOST, PORT), ThrottledHandler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    try:
+        raw_time, raw = ota_download("/fw.bin", compressed=False)
+        z_time, z = ota_download("/fw.z", compressed=True)
+    finally:
+        server.shutdown()
+        server.server_close()
+    assert raw == image and z == image
+    flash_floor = len(image) / BLOCK * FLASH_MS_PER_SECTOR / 1000
+    log(f"   Không nén: {len(image)} B trong {raw_time:.2f} s ({len(image) / 1024 / raw_time:.0f} KB/s)")
+    log(f"   Nén:       {len(FILES['/fw.z'])} B trong {z_time:.2f} s ({len(image) / 1024 / z_time:.0f} KB/s)")
+    log(f"   -> nhanh hơn {raw_time / z_time:.2f} lần (giới hạn ghi flash {flash_floor:.2f} s)")
+    # Link chậm hơn flash: thời gian giảm gần theo tỉ lệ nén
+    if len(image) / 1024 / LINK_KBPS > flash_floor * 1.2:
+        assert z_time < raw_time * 0.85, (z_time, raw_time)
+    log("✅ OK")
+
+
+if __name__ == "__main__":
+    log("=" * 60)
+    log("🧪 TEST OTA COMPRESS")
+    log("=" * 60)
+    with tempfile.TemporaryDirectory() as build_dir:
+        lib = build_inflater(build_dir)
+        log(f"🔧 Built otaInflate.cpp ({FIRMWARE_DIR})")
+        silence(stderr=True)      # Cả log request của http.server
+        test_container(lib)
+        test_rejects_bad_input(lib)
+    test_update_time()
+    log("\n🎉 Tất cả test đều pass")
@@ -0,0 +1,274 @@
+"""
+Script để test patch delta OTA (app/services/ota_delta.py) với chính OtaDelta của firmware
+(client/firmware_master/otaDelta.cpp), build trên máy bằng g++ + mbedTLS:
+- Ảnh firmware giả lập: code + bảng con trỏ tuyệt đối + chuỗi
+- Bản mới chèn thêm code giữa ảnh (toàn bộ con trỏ phía sau bị dịch) + sửa vài hằng số
+- Patch phải nhỏ hơn ảnh đầy đủ cả chục lần và OtaDelta dựng lại đúng từng byte, kể cả khi
+  socket trả patch theo từng mẩu lẻ và ảnh mới được đọc ra theo block lẻ
+- Sai ảnh gốc / header hỏng / record EDP1 sai / đọc vượt ảnh gốc / sai hash đều bị từ chối
+
+Chạy: python test_ota_delta.py [kich_thuoc_KB]
+Cần g++ và mbedTLS 2.x (xem test_ota_sign.py, MBEDTLS_INCLUDE / MBEDTLS_LIB).
+"""
+
+import ctypes
+import hashlib
+import os
+import random
+import struct
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from app.services import ota_delta
+from app.services.ota_delta import HEADER, MAGIC, make_patch, parse_header
+from test_common import FIRMWARE_DIR, build_firmware, log, silence
+
+# ============= CẤU HÌNH =============
+IMAGE_KB = int(sys.argv[1]) if len(sys.argv) > 1 else 256
+FLASH_BASE = 0x400D0000             # Địa chỉ map của app trên ESP32
+INSERT_AT = 0.4                     # Vị trí chèn code mới (tỉ lệ ảnh)
+INSERT_LEN = 1200
+PARTITION_SIZE = 0x140000           # Partition app0 mặc định
+
+# Giống OTAUpdate: begin (kiểm tra ảnh gốc) -> read từng block -> verify
+HARNESS_CPP = r"""
+#include <vector>
+#include "otaDelta.h"
+
+extern "C" void host_flash(const uint8_t* flash, size_t flashLen, size_t failAt);
+
+static const char* g_error = "";
+
+extern "C" {
+int od_apply(const uint8_t* base, size_t baseLen, uint32_t partitionSize, size_t failAt,
+             const uint8_t* patch, size_t patchLen, size_t chunk, size_t outChunk,
+             uint8_t* out, size_t outCap, size_t* outLen) {
+    esp_partition_t partition = {0x10000, partitionSize, "app0"};
+    host_flash(base, baseLen, failAt);
+    WiFiClient stream(patch, patchLen, chunk);
+    OtaDelta delta;
+    std::vector<uint8_t> buf(outChunk);
+    *outLen = 0;
+    bool ok = delta.begin(&stream, patchLen, &partition);
+    size_t n;
+    while (ok && (n = delta.read(buf.data(), buf.size())) > 0) {
+        if (*outLen + n > outCap || *outLen + n > delta.newSize()) {
+            g_error = "Output exceeds new_size";
+            return 0;
+        }
+        memcpy(out + *outLen, buf.data(), n);
+        *outLen += n;
+    }
+    ok = ok && delta.verify();
+    g_error = delta.error();
+    return ok ? 1 : 0;
+}
+const char* od_error() { return g_error; }
+}
+"""
+
+
+def build_delta(workdir):
+    lib = build_firmware(workdir, "otadelta", ["otaDelta.cpp"], HARNESS_CPP, libs=["-lmbedcrypto"])
+    lib.od_apply.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_uint32, ctypes.c_size_t,
+                             ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t,
+                             ctypes.c_void_p, ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t)]
+    lib.od_error.restype = ctypes.c_char_p
+    return lib
+
+
+def apply_patch(lib, base, patch, chunk=1460, out_chunk=4096, partition_size=PARTITION_SIZE, fail_at=None):
+    """Áp patch bằng OtaDelta của firmware -> (ảnh mới, None) hoặc (None, lỗi)"""
+    # Buffer ra = new_size trong header (như Update.begin), không kiểm tra magic ở đây
+    cap = max(HEADER.unpack_from(patch)[2], 1) if len(patch) >= HEADER.size else 1
+    out = ctypes.create_string_buffer(cap)
+    out_len = ctypes.c_size_t(0)
+    fail_at = len(base) if fail_at is None else fail_at
+    ok = lib.od_apply(bytes(base), len(base), partition_size, fail_at, bytes(patch), len(patch),
+                      chunk, out_chunk, out, cap, ctypes.byref(out_len))
+    if not ok:
+        return None, lib.od_error().decode()
+    return out.raw[:out_len.value], None
+
+
+def make_firmware(size, seed=1):
+    """Các 'hàm' gồm opcode lặp lại theo mẫu + literal pool chứa con trỏ tuyệt đối vào ảnh"""
+    rng = random.Random(seed)
+    opcodes = [rng.randrange(256) for _ in range(64)]
+    out = bytearray()
+    pointers = []                   # offset của các con trỏ trong ảnh
+    while len(out) < size:
+        for _ in range(rng.randrange(8, 40)):
+            out += bytes([rng.choice(opcodes), rng.randrange(16), rng.choice(opcodes)])
+        for _ in range(rng.randrange(1, 4)):
+            pointers.append(len(out))
+            out += struct.pack("<I", FLASH_BASE + rng.randrange(size))
+        if rng.random() < 0.05:
+            out += b"[OTA] message %d\x00" % rng.randrange(1000)
+    return bytearray(out[:size]), [p for p in pointers if p + 4 <= size]
+
+
+def release(old, pointers, seed=2):
+    """Bản mới: chèn code, dời mọi con trỏ trỏ qua điểm chèn, sửa vài hằng số"""
+    rng = random.Random(seed)
+    new = bytearray(old)
+    insert_at = int(len(old) * INSERT_AT)
+    for p in pointers:
+        target = struct.unpack_from("<I", new, p)[0] - FLASH_BASE
+        if target >= insert_at:
+            struct.pack_into("<I", new, p, FLASH_BASE + target + INSERT_LEN)
+    for _ in range(20):
+        new[rng.randrange(len(new))] ^= 0x5A
+    inserted = bytes(rng.randrange(256) for _ in range(INSERT_LEN))
+    return bytes(new[:insert_at] + inserted + new[insert_at:])
+
+
+def craft(old, new, *records):
+    """Patch EDP1 viết tay: header đúng cho (old, new) + các record (int -> varint, bytes -> thô)"""
+    out = bytearray(HEADER.pack(MAGIC, len(old), len(new),
+                                hashlib.sha256(old).digest(), hashlib.sha256(new).digest()))
+    for item in records:
+        if isinstance(item, int):
+            ota_delta._write_varint(out, item)
+        else:
+            out += item
+    return bytes(out)
+
+
+def test_round_trip(lib):
+    log("\n🔸 Test 1: Bản mới chèn code + dời con trỏ")
+    old, pointers = make_firmware(IMAGE_KB * 1024)
+    old = bytes(old)
+    new = release(old, pointers)
+
+    start = time.time()
+    patch = make_patch(old, new)
+    make_ms = (time.time() - start) * 1000
+    start = time.time()
+    rebuilt, error = apply_patch(lib, old, patch)
+    apply_ms = (time.time() - start) * 1000
+
+    ratio = len(new) / len(patch)
+    log(f"   Ảnh {len(old)} -> {len(new)} B, {len(pointers)} con trỏ, patch {len(patch)} B "
+        f"(nhỏ hơn {ratio:.1f} lần), tạo {make_ms:.0f} ms, OtaDelta áp {apply_ms:.0f} ms")
+    assert rebuilt == new, error
+    old_size, new_size, _, _ = parse_header(patch)
+    assert (old_size, new_size) == (len(old), len(new))
+    # Con trỏ bị dời chỉ tạo ra byte diff nhỏ, không phải extra -> patch nhỏ hơn >= 10 lần
+    assert ratio >= 10, ratio
+
+    # Socket trả từng mẩu lẻ, Update.write nhận block lẻ: token / varint bị cắt ngang giữa 2 lần đọc
+    for chunk, out_chunk in ((1, 4096), (7, 333), (513, 1), (4096, 100003)):
+        rebuilt, error = apply_patch(lib, old, patch, chunk=chunk, out_chunk=out_chunk)
+        assert rebuilt == new, (chunk, out_chunk, error)
+    log("   Patch theo mẩu 1 / 7 / 513 / 4096 B, đọc ra block 4096 / 333 / 1 / 100003 B: khớp")
+
+    # Ảnh gốc nằm trong partition lớn hơn ảnh (phần sau là 0xFF)
+    flash = old + b"\xff" * 4096
+    assert apply_patch(lib, flash, patch)[0] == new
+    log("✅ OK")
+
+
+def test_identical_and_unrelated(lib):
+    log("\n🔸 Test 2: Ảnh giống hệt / hoàn toàn khác")
+    old = bytes(make_firmware(64 * 1024)[0])
+    same = make_patch(old, old)
+    assert apply_patch(lib, old, same)[0] == old
+    assert len(same) < HEADER.size + 32, len(same)
+    log(f"   Giống hệt: patch {len(same)} B")
+
+    unrelated = bytes(random.Random(9).randrange(256) for _ in range(len(old)))
+    patch = make_patch(old, unrelated)
+    assert apply_patch(lib, old, patch)[0] == unrelated
+    log(f"   Khác hoàn toàn: patch {len(patch)} B cho ảnh {len(unrelated)} B")
+
+    with tempfile.TemporaryDirectory() as tmp:
+        ota_delta.PATCH_DIR = tmp
+        assert ota_delta.build_patch(old, unrelated, "file-b", "1.0.0") is None
+        assert ota_delta.find_patch("file-b", "1.0.0") is None
+        path = ota_delta.build_patch(old, old[:1000] + b"x" + old[1000:], "file-a", "Master_1.0/2")
+        assert path and ota_delta.find_patch("file-a", "Master_1.0/2") == path
+        assert os.path.basename(path) == "file-a.from-Master_1.0_2.patch"
+    log("✅ OK")
+
+
+def expect_rejected(lib, cases):
+    for name, (base, patch, error, kwargs) in cases.items():
+        rebuilt, got = apply_patch(lib, base, patch, **kwargs)
+        assert rebuilt is None, f"{name}: không bị từ chối"
+        assert error is None or got == error, (name, got)
+        log(f"   {name}: {got}")
+
+
+def test_rejects_bad_header(lib):
+    log("\n🔸 Test 3: Header / ảnh gốc sai")
+    old, pointers = make_firmware(32 * 1024)
+    old = bytes(old)
+    new = release(old, pointers)
+    patch = make_patch(old, new)
+
+    expect_rejected(lib, {
+        "ảnh gốc khác": (old[:-1] + b"\x00", patch, "Running image does not match patch base", {}),
+        "ảnh gốc lớn hơn partition": (old, patch, "Base image larger than partition",
+                                      {"partition_size": len(old) - 1}),
+        "lỗi đọc partition": (old, patch, "Base partition read failed", {"fail_at": len(old) // 2}),
+        "sai magic": (old, b"XXXX" + patch[4:], "Bad patch magic", {}),
+        "header bị cắt": (old, patch[:HEADER.size - 1], "Patch truncated", {}),
+        "patch bị cắt": (old, patch[:len(patch) // 2], "Patch truncated", {}),
+        "sha256 ảnh mới sai": (old, patch[:44] + bytes(32) + patch[76:], "New image hash mismatch", {}),
+        "byte cuối bị sửa": (old, patch[:-1] + bytes([patch[-1] ^ 1]), None, {}),
+    })
+    log("✅ OK")
+
+
+def test_rejects_bad_records(lib):
+    log("\n🔸 Test 4: Record EDP1 sai / vượt biên")
+    old = bytes(range(256)) * 4            # 1 KB
+    new = old[:512] + b"xyz"
+    zz = ota_delta._zigzag
+
+    expect_rejected(lib, {
+        "varint quá 5 byte": (old, craft(old, new, b"\x80" * 5 + b"\x01"), "Varint too long", {}),
+        "diff_len > new_size": (old, craft(old, new, len(new) + 1, 0, 0), "Patch record exceeds image size", {}),
+        # diff_len + extra_len tràn uint32 về 1
+        "diff_len + extra_len tràn số": (old, craft(old, new, 0xFFFFFFFF, 2, 0),
+                                        "Patch record exceeds image size", {}),
+        "token diff rỗng": (old, craft(old, new, 512, 0, 0, 0, 0), "Bad diff token", {}),
+        "token dài hơn diff_len": (old, craft(old, new, 512, 0, 0, 500, 13), "Bad diff token", {}),
+        "token tràn số": (old, craft(old, new, 512, 0, 0, 0xFFFFFFFF, 2), "Bad diff token", {}),
+        "diff đọc quá cuối ảnh gốc": (old, craft(old[:256], new, 512, 0, 0, 512, 0),
+                                      "Patch reads past base image", {}),
+        # extra 4 byte rồi seek về trước đầu ảnh gốc (_oldPos quay vòng)
+        "seek âm quá đầu ảnh": (old, craft(old, new, 0, 4, zz(-8), b"abcd", 508, 0, 0, 508, 0),
+                                "Patch reads past base image", {}),
+        "seek quá cuối ảnh": (old, craft(old, new, 0, 0, zz(2000), 512, 0, 0, 512, 0),
+                              "Patch reads past base image", {}),
+        "extra bị cắt": (old, craft(old, new, 0, len(new), 0, new[:100]), "Patch truncated", {}),
+        "literal bị cắt": (old, craft(old, new, 512, 0, 0, 0, 512, bytes(10)), "Patch truncated", {}),
+    })
+
+    # Patch viết tay đúng format: zero run + literal + extra + seek âm
+    good = craft(old, new, 0, 0, zz(256), 256, 0, zz(-512), 256, 0,
+                 256, 3, 0, 0, 256, bytes(256), b"xyz")
+    rebuilt, error = apply_patch(lib, old, good, chunk=3, out_chunk=17)
+    assert rebuilt == new, error
+    log("   Record viết tay (seek dương / âm, zero run, literal): dựng đúng")
+    log("✅ OK")
+
+
+if __name__ == "__main__":
+    log("=" * 60)
+    log("🧪 TEST OTA DELTA")
+    log("=" * 60)
+    with tempfile.TemporaryDirectory() as build_dir:
+        lib = build_delta(build_dir)
+        log(f"🔧 Built otaDelta.cpp ({FIRMWARE_DIR})")
+        silence()
+        test_round_trip(lib)
+        test_identical_and_unrelated(lib)
+        test_rejects_bad_header(lib)
+        test_rejects_bad_records(lib)
+    log("\n🎉 Tất cả test đều pass")
@@ -0,0 +1,168 @@
+"""
+Script để test lịch check OTA dàn đều theo thiết bị (app/services/ota_schedule.py + OTAUpdate):
+- FNV-1a giống firmware, bucket rollout phân bố đều, tăng % thì nhóm cũ vẫn nằm trong nhóm mới
+- Giới hạn tốc độ get_info_update: vượt burst thì trả Retry-After rải đều theo CHECK_RATE
+- Mô phỏng mất điện cả site: N thiết bị bật nguồn cùng lúc
+    cũ:  ai cũng check ngay khi có WiFi, lỗi thì retry sau 6 s, tối đa 5 lần
+    mới: boot bằng manifest NVS, hỏi server ở pha FNV-1a(CLIENT_ID) trong OTA_BOOT_SPREAD_MS,
+         server quá tải trả 503 + Retry-After, thiết bị cộng thêm phần lệch riêng rồi mới hỏi lại
+
+Chạy: python test_ota_schedule.py [so_thiet_bi]
+"""
+
+import heapq
+import os
+import random
+import sys
+import tempfile
+from collections import Counter
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from app.services import ota_delta, ota_schedule
+from test_common import log, silence
+
+# ============= CẤU HÌNH =============
+DEVICES = int(sys.argv[1]) if len(sys.argv) > 1 else 500
+SERVER_CAPACITY = 20                # get_info_update / giây server chịu được
+WIFI_CONNECT_S = 3.0                # Thiết bị có WiFi trong 0-3 s sau khi có điện
+MAX_RETRIES = 5                     # MAX_RETRIES
+RETRY_DELAY_S = 6.0                 # RETRY_DELAY_MS
+BOOT_SPREAD_S = 300.0               # OTA_BOOT_SPREAD_MS
+
+
+def client_ids(n):
+    rng = random.Random(7)
+    return ["%032x" % rng.getrandbits(128) for _ in range(n)]
+
+
+class FakeClock:
+    def __init__(self):
+        self.now = 0.0
+
+    def __call__(self):
+        return self.now
+
+
+def test_fnv_and_rollout():
+    log("\n🔸 Test 1: FNV-1a / bucket rollout")
+    # Vector chuẩn FNV-1a 32 bit: firmware OTAUpdate::fnv1a phải cho cùng kết quả
+    assert ota_schedule.fnv1a("") == 0x811C9DC5
+    assert ota_schedule.fnv1a("a") == 0xE40C292C
+    assert ota_schedule.fnv1a("foobar") == 0xBF9CF968
+
+    ids = client_ids(10000)
+    deciles = Counter(ota_schedule.rollout_bucket(c, "Slave_1.0.3") // 10 for c in ids)
+    spread = [deciles[i] / len(ids) * 100 for i in range(10)]
+    assert all(8 <= p <= 12 for p in spread), spread
+    log(f"   10 nhóm bucket: {min(spread):.1f}% - {max(spread):.1f}% thiết bị mỗi nhóm")
+
+    at_10 = {c for c in ids if ota_schedule.in_rollout(c, "Slave_1.0.3", 10)}
+    at_50 = {c for c in ids if ota_schedule.in_rollout(c, "Slave_1.0.3", 50)}
+    assert at_10 <= at_50
+    assert not any(ota_schedule.in_rollout(c, "Slave_1.0.3", 0) for c in ids)
+    assert all(ota_schedule.in_rollout(c, "Slave_1.0.3", None) for c in ids)
+    next_10 = {c for c in ids if ota_schedule.in_rollout(c, "Slave_1.0.4", 10)}
+    overlap = len(at_10 & next_10) / len(at_10) * 100
+    assert overlap < 25
+    log(f"   10% -> 50%: {len(at_10)} thiết bị đầu vẫn nằm trong {len(at_50)}")
+    log(f"   Bản kế tiếp 10%: chỉ {overlap:.0f}% trùng nhóm đi trước của bản cũ")
+
+    with tempfile.TemporaryDirectory() as tmp:
+        ota_delta.PATCH_DIR = tmp
+        assert ota_schedule.get_rollout("file-a") == 100
+        assert ota_schedule.set_rollout("file-a", 150) == 100
+        assert ota_schedule.set_rollout("file-a", 25) == 25
+        assert ota_schedule.get_rollout("file-a") == 25
+    log("✅ OK")
+
+
+def test_admit():
+    log("\n🔸 Test 2: Giới hạn tốc độ + Retry-After")
+    clock = FakeClock()
+    ota_schedule._clock = clock
+    ota_schedule.reset()
+
+    results = [ota_schedule.admit() for _ in range(ota_schedule.CHECK_BURST + 200)]
+    admitted = results.count(None)
+    assert admitted == ota_schedule.CHECK_BURST
+    waits = [r for r in results if r is not None]
+    # 200 request bị từ chối được hẹn trải đều 10 s (CHECK_RATE = 20/s)
+    per_second = Counter(waits)
+    assert max(waits) == 200 / ota_schedule.CHECK_RATE
+    assert max(per_second.values()) <= ota_schedule.CHECK_RATE + 1
+    log(f"   {admitted} request qua ngay, {len(waits)} được hẹn lại sau 1-{max(waits)} s, "
+        f"tối đa {max(per_second.values())} request cùng 1 giây")
+
+    clock.now += 1.0
+    assert ota_schedule.admit() is None         # Đã hồi token
+    log("✅ OK")
+
+
+def simulate(ids, new_schedule):
+    """Trả (peak request/s, tổng request, số thiết bị không lấy được manifest, giây tới khi xong)"""
+    rng = random.Random(11)
+    events = []
+    for c in ids:
+        boot = rng.uniform(0, WIFI_CONNECT_S)
+        if new_schedule:
+            boot += (ota_schedule.fnv1a(c) % int(BOOT_SPREAD_S * 1000)) / 1000.0
+        heapq.heappush(events, (boot, c, 1))
+
+    clock = FakeClock()
+    ota_schedule._clock = clock
+    ota_schedule.reset()
+    served_in = Counter()
+    requests = Counter()
+    failed = 0
+    done_at = 0.0
+    while events:
+        t, c, attempt = heapq.heappop(events)
+        clock.now = t
+        second = int(t)
+        requests[second] += 1
+        if new_schedule:
+            retry_after = ota_schedule.admit()
+            ok = retry_after is None
+        else:
+            ok = served_in[second] < SERVER_CAPACITY    # Quá tải: request timeout / 5xx
+            served_in[second] += ok
+        if ok:
+            done_at = max(done_at, t)
+            continue
+        if attempt >= MAX_RETRIES:
+            failed += 1
+            continue
+        if new_schedule:
+            wait_ms = retry_after * 1000
+            wait = (wait_ms + ota_schedule.fnv1a(c) % (wait_ms // 4 + 1000)) / 1000.0
+        else:
+            wait = RETRY_DELAY_S
+        heapq.heappush(events, (t + wait, c, attempt + 1))
+    return max(requests.values()), sum(requests.values()), failed, done_at
+
+
+def test_power_cut():
+    log(f"\n🔸 Test 3: Mất điện cả site, {DEVICES} thiết bị bật nguồn cùng lúc")
+    ids = client_ids(DEVICES)
+    old = simulate(ids, new_schedule=False)
+    new = simulate(ids, new_schedule=True)
+    for name, (peak, total, failed, done_at) in (("Cũ ", old), ("Mới", new)):
+        log(f"   {name}: đỉnh {peak:4d} req/s, tổng {total:4d} request, "
+            f"{failed:3d} thiết bị bỏ cuộc, xong sau {done_at:5.0f} s")
+    assert new[0] < old[0]
+    assert new[2] == 0
+    assert new[0] <= ota_schedule.CHECK_BURST + ota_schedule.CHECK_RATE
+    log(f"   Đỉnh tải giảm {old[0] / new[0]:.1f} lần")
+    log("✅ OK")
+
+
+if __name__ == "__main__":
+    log("=" * 60)
+    log("🧪 TEST OTA SCHEDULE")
+    log("=" * 60)
+    silence()
+    test_fnv_and_rollout()
+    test_admit()
+    test_power_cut()
+    log("\n🎉 Tất cả test đều pass")
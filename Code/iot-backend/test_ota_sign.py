@@ -0,0 +1,267 @@
+"""
+Script để test sha256 / chữ ký ECDSA của ảnh OTA (app/services/ota_sign.py) với chính
+OtaVerifier của firmware (client/firmware_master/otaVerify.cpp), build trên máy bằng g++ + mbedTLS:
+- Hash theo từng block 4 KB khi ghi flash (kể cả block cuối ngắn) = sha256 trong manifest
+- Tải tiếp bằng Range: resumeFrom() đọc lại phần đã có trong flash (esp_partition_read giả) rồi
+  nối tiếp vẫn ra đúng sha256, lỗi đọc flash thì báo lỗi
+- Manifest chưa có sha256: chấp nhận khi firmware không cấu hình khóa, từ chối khi có khóa
+- Chữ ký hợp lệ được chấp nhận; ảnh bị sửa 1 byte / khóa khác / chữ ký hỏng bị từ chối
+- Lưu và đọc lại file sha256 cạnh patch / ảnh nén
+
+Chạy: python test_ota_sign.py [kich_thuoc_KB]
+Cần g++ và mbedTLS 2.x (gói libmbedtls-dev). Header / thư viện nằm chỗ khác thì đặt
+MBEDTLS_INCLUDE / MBEDTLS_LIB (vd. từ ESP-IDF hoặc bản build mbedTLS riêng).
+"""
+
+import ctypes
+import hashlib
+import os
+import random
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from cryptography.hazmat.primitives import serialization
+from cryptography.hazmat.primitives.asymmetric import ec
+
+from app.services import ota_delta, ota_sign
+from test_common import FIRMWARE_DIR, build_firmware, log, silence
+
+# ============= CẤU HÌNH =============
+IMAGE_KB = int(sys.argv[1]) if len(sys.argv) > 1 else 1000
+BLOCK = 4096                        # OTA_BLOCK_SIZE
+RESUME_SAVE = 64 * 1024             # OTA_RESUME_SAVE_BYTES
+READ_BUF = 1024                     # OTA_VERIFY_READ_BUF
+
+HARNESS_CPP = r"""
+#include "otaVerify.h"
+
+extern "C" void host_flash(const uint8_t* flash, size_t flashLen, size_t failAt);
+
+extern "C" {
+OtaVerifier* ov_new() { return new OtaVerifier(); }
+void ov_free(OtaVerifier* v) { delete v; }
+void ov_begin(OtaVerifier* v) { v->begin(); }
+void ov_update(OtaVerifier* v, const uint8_t* data, size_t len) { v->update(data, len); }
+int ov_resume(OtaVerifier* v, const uint8_t* flash, size_t flashLen, size_t length, size_t failAt) {
+    esp_partition_t partition = {0x10000, (uint32_t)flashLen, "app1"};
+    host_flash(flash, flashLen, failAt);
+    return v->resumeFrom(&partition, length) ? 1 : 0;
+}
+int ov_verify(OtaVerifier* v, const char* sha256, const char* signature) {
+    return v->verify(String(sha256), String(signature)) ? 1 : 0;
+}
+const char* ov_error(OtaVerifier* v) { return v->error(); }
+size_t ov_hashed(OtaVerifier* v) { return v->hashed(); }
+}
+"""
+
+
+def build_verifier(workdir, name, public_pem=None):
+    """Build otaVerify.cpp thành thư viện .so; public_pem khác None = OTA_SIGNING_PUBKEY"""
+    cflags = []
+    if public_pem is not None:
+        key_header = os.path.join(workdir, f"{name}_key.h")
+        literal = "".join(line + "\\n" for line in public_pem.strip().splitlines())
+        with open(key_header, "w") as f:
+            f.write(f'#define OTA_SIGNING_PUBKEY "{literal}"\n')
+        cflags = ["-include", key_header]
+    lib = build_firmware(workdir, name, ["otaVerify.cpp"], HARNESS_CPP, cflags=cflags, libs=["-lmbedcrypto"])
+    lib.ov_new.restype = ctypes.c_void_p
+    lib.ov_free.argtypes = [ctypes.c_void_p]
+    lib.ov_begin.argtypes = [ctypes.c_void_p]
+    lib.ov_update.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+    lib.ov_resume.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_size_t]
+    lib.ov_verify.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p]
+    lib.ov_error.argtypes = [ctypes.c_void_p]
+    lib.ov_error.restype = ctypes.c_char_p
+    lib.ov_hashed.argtypes = [ctypes.c_void_p]
+    lib.ov_hashed.restype = ctypes.c_size_t
+    return lib
+
+
+class Verifier:
+    """Bọc 1 OtaVerifier C++ (begin() ngay khi tạo, như OTAUpdate trước block đầu tiên)"""
+
+    def __init__(self, lib):
+        self.lib = lib
+        self.handle = lib.ov_new()
+        lib.ov_begin(self.handle)
+
+    def __del__(self):
+        self.lib.ov_free(self.handle)
+
+    def update(self, block):
+        self.lib.ov_update(self.handle, bytes(block), len(block))
+
+    def resume_from(self, flash, length, fail_at=None):
+        flash = bytes(flash)
+        fail_at = len(flash) if fail_at is None else fail_at
+        return bool(self.lib.ov_resume(self.handle, flash, len(flash), length, fail_at))
+
+    def verify(self, expected, signature=None):
+        return bool(self.lib.ov_verify(self.handle, expected.encode(), (signature or "").encode()))
+
+    @property
+    def hashed(self):
+        return self.lib.ov_hashed(self.handle)
+
+    @property
+    def error(self):
+        return self.lib.ov_error(self.handle).decode()
+
+
+def make_image(size, seed=1):
+    rng = random.Random(seed)
+    return bytes(rng.randrange(256) for _ in range(size))
+
+
+def test_streaming_hash(lib):
+    log("\n🔸 Test 1: Hash theo block khi ghi flash")
+    image = make_image(IMAGE_KB * 1024 + 123)    # Block cuối ngắn
+    expected = ota_sign.image_sha256(image)
+
+    start = time.time()
+    verifier = Verifier(lib)
+    for offset in range(0, len(image), BLOCK):
+        verifier.update(image[offset:offset + BLOCK])
+    stream_ms = (time.time() - start) * 1000
+    assert verifier.hashed == len(image)
+    assert verifier.verify(expected), verifier.error
+    log(f"   {len(image)} B, {(len(image) + BLOCK - 1) // BLOCK} block, {stream_ms:.0f} ms")
+
+    # sha256 trong manifest viết hoa vẫn khớp
+    verifier = Verifier(lib)
+    verifier.update(image)
+    assert verifier.verify(expected.upper()), verifier.error
+
+    # Mất kết nối sau vài lần lưu offset: hash lại phần đã ghi + phần tải tiếp
+    resume_at = (len(image) // 3) // RESUME_SAVE * RESUME_SAVE
+    flash = bytearray(b"\xff" * len(image))
+    flash[:resume_at] = image[:resume_at]
+    verifier = Verifier(lib)
+    assert verifier.resume_from(flash, resume_at), verifier.error
+    assert lib.host_flash_reads() == (resume_at + READ_BUF - 1) // READ_BUF
+    for offset in range(resume_at, len(image), BLOCK):
+        verifier.update(image[offset:offset + BLOCK])
+    assert verifier.hashed == len(image)
+    assert verifier.verify(expected), verifier.error
+    log(f"   Tải tiếp từ {resume_at} B ({lib.host_flash_reads()} lần đọc flash): sha256 khớp")
+
+    # Offset đã lưu không phải bội số của buffer đọc
+    odd_resume = resume_at + 700
+    flash[:odd_resume] = image[:odd_resume]
+    verifier = Verifier(lib)
+    assert verifier.resume_from(flash, odd_resume), verifier.error
+    verifier.update(image[odd_resume:])
+    assert verifier.verify(expected), verifier.error
+
+    # Flash đọc lỗi giữa chừng -> không được coi là đã hash xong
+    verifier = Verifier(lib)
+    assert not verifier.resume_from(flash, resume_at, fail_at=resume_at // 2)
+    assert verifier.error == "Partition read failed", verifier.error
+    log("   Lỗi đọc flash khi tải tiếp: báo lỗi")
+
+    # Thiếu block cuối / thứ tự block sai -> không khớp
+    verifier = Verifier(lib)
+    verifier.update(image[:-123])
+    assert not verifier.verify(expected)
+    assert verifier.error == "sha256 mismatch", verifier.error
+    verifier = Verifier(lib)
+    verifier.update(image[BLOCK:2 * BLOCK])
+    verifier.update(image[:BLOCK])
+    verifier.update(image[2 * BLOCK:])
+    assert not verifier.verify(expected)
+    log("✅ OK")
+
+
+def test_missing_sha256(lib, signed_lib):
+    log("\n🔸 Test 2: Manifest chưa có sha256")
+    image = make_image(16 * 1024, seed=4)
+
+    verifier = Verifier(lib)
+    verifier.update(image)
+    assert verifier.verify("", None), verifier.error
+    log("   Không cấu hình khóa: chấp nhận")
+
+    verifier = Verifier(signed_lib)
+    verifier.update(image)
+    assert not verifier.verify("", None)
+    assert verifier.error == "Manifest has no sha256", verifier.error
+    log("   Có OTA_SIGNING_PUBKEY: từ chối")
+    log("✅ OK")
+
+
+def test_signature(signed_lib, key):
+    log("\n🔸 Test 3: Chữ ký ECDSA P-256")
+    image = make_image(64 * 1024, seed=2)
+    digest = hashlib.sha256(image).digest()
+    signature = ota_sign.sign_digest(digest, key)
+    assert ota_sign.verify_signature(digest, signature, key.public_key())
+    log(f"   Chữ ký {len(signature)} ký tự base64")
+
+    verifier = Verifier(signed_lib)
+    verifier.update(image)
+    assert verifier.verify(digest.hex(), signature), verifier.error
+
+    tampered = bytearray(image)
+    tampered[1000] ^= 1
+    other_key = ec.generate_private_key(ec.SECP256R1())
+    bad_signature = signature[:10] + ("A" if signature[10] != "A" else "B") + signature[11:]
+    cases = {
+        "ảnh bị sửa 1 byte": (bytes(tampered), digest.hex(), signature, "sha256 mismatch"),
+        # Kẻ tấn công sửa cả sha256 trong manifest nhưng không có khóa riêng
+        "sha256 giả + chữ ký cũ": (bytes(tampered), hashlib.sha256(tampered).hexdigest(), signature,
+                                   "Signature invalid"),
+        "khóa khác": (image, digest.hex(), ota_sign.sign_digest(digest, other_key), "Signature invalid"),
+        "chữ ký hỏng": (image, digest.hex(), bad_signature, None),
+        "chữ ký không phải base64": (image, digest.hex(), "!!" + signature[2:], "Bad signature encoding"),
+        "thiếu chữ ký": (image, digest.hex(), None, "Manifest has no signature"),
+    }
+    for name, (data, expected, sig, error) in cases.items():
+        verifier = Verifier(signed_lib)
+        verifier.update(data)
+        assert not verifier.verify(expected, sig), name
+        assert error is None or verifier.error == error, (name, verifier.error)
+        log(f"   {name}: bị từ chối ({verifier.error})")
+    log("✅ OK")
+
+
+def test_storage():
+    log("\n🔸 Test 4: Lưu sha256 cạnh patch / ảnh nén")
+    image = make_image(8 * 1024, seed=3)
+    with tempfile.TemporaryDirectory() as tmp:
+        ota_delta.PATCH_DIR = tmp
+        assert ota_sign.find_digest("file-a") is None
+
+        info = ota_sign.save_digest(image, "file-a")
+        assert info == ota_sign.find_digest("file-a")
+        assert info["sha256"] == hashlib.sha256(image).hexdigest()
+        assert info["signature"] is None
+
+        key = ec.generate_private_key(ec.SECP256R1())
+        signed = ota_sign.save_digest(image, "file-b", key=key)
+        assert ota_sign.verify_signature(bytes.fromhex(signed["sha256"]), signed["signature"], key.public_key())
+        assert ota_sign.find_digest("file-b") == signed
+    log("✅ OK")
+
+
+if __name__ == "__main__":
+    log("=" * 60)
+    log("🧪 TEST OTA SIGN")
+    log("=" * 60)
+    key = ec.generate_private_key(ec.SECP256R1())
+    public_pem = key.public_key().public_bytes(
+        serialization.Encoding.PEM, serialization.PublicFormat.SubjectPublicKeyInfo).decode()
+    with tempfile.TemporaryDirectory() as build_dir:
+        lib = build_verifier(build_dir, "otaverify")
+        signed_lib = build_verifier(build_dir, "otaverify_signed", public_pem)
+        log(f"🔧 Built otaVerify.cpp ({FIRMWARE_DIR})")
+        silence()
+        test_streaming_hash(lib)
+        test_missing_sha256(lib, signed_lib)
+        test_signature(signed_lib, key)
+        test_storage()
+    log("\n🎉 Tất cả test đều pass")
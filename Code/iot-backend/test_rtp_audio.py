@@ -0,0 +1,290 @@
+"""
+Script để test bộ nhận RTP audio (app/services/rtp_audio.py) với luồng giống hệt
+firmware_master/rtpAudio.cpp:
+- DVI4 (IMA ADPCM) giải mã lại đủ chất lượng cho STT, 1024 byte PCM -> 260 byte
+- Đi qua 1 đường UDP giả lập WiFi (mất gói ngẫu nhiên + trễ + jitter)
+- So sánh không redundancy / RED 1 frame: frame mất, độ trễ, jitter
+- RTCP SDES gán client_id cho SSRC, BYE kết thúc luồng
+
+Chạy: python test_rtp_audio.py [loss_%] [so_frame]
+"""
+
+import math
+import os
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from app.services.rtp_audio import (CLOCK_RATE, PT_DVI4, PT_L16, PT_RED, RtpAudioReceiver,
+                                    dvi4_decode, dvi4_encode, parse_rtcp, parse_red, parse_rtp)
+from test_common import log, silence
+
+# ============= CẤU HÌNH =============
+HOST = "127.0.0.1"
+RECEIVER_PORT = 15004
+LINK_PORT = 15014
+CLIENT_ID = "066420c45a4e819437bbfbea63b83739"
+FRAME_SAMPLES = 512                 # 32 ms
+LOSS_PCT = float(sys.argv[1]) if len(sys.argv) > 1 else 10.0
+FRAMES = int(sys.argv[2]) if len(sys.argv) > 2 else 100
+LINK_DELAY_MS = 20
+LINK_JITTER_MS = 12
+
+
+def voice_like(count, start=0):
+    """Tổng vài sóng sin + nhiễu nhẹ, biên độ như giọng nói qua INMP441"""
+    rng = random.Random(start)
+    out = []
+    for n in range(start, start + count):
+        t = n / CLOCK_RATE
+        value = 6000 * math.sin(2 * math.pi * 220 * t) + 3000 * math.sin(2 * math.pi * 660 * t + 1) \
+            + 1500 * math.sin(2 * math.pi * 1800 * t) + rng.uniform(-300, 300)
+        out.append(int(value))
+    return out
+
+
+# ============= SENDER (giống rtpAudio.cpp) =============
+class RtpSender:
+    def __init__(self, port, cname, codec=PT_DVI4, redundancy=1):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.port = port
+        self.cname = cname
+        self.codec = codec
+        self.redundancy = redundancy if codec == PT_DVI4 else 0
+        self.ssrc = random.getrandbits(32)
+        self.seq = random.getrandbits(16)
+        self.timestamp = random.getrandbits(32)
+        self.marker = True
+        self.predictor = 0
+        self.index = 0
+        self.history = []               # [(timestamp, payload)] các frame DVI4 trước
+        self.sent_at = {}               # timestamp -> lúc gửi, để đo độ trễ tuyệt đối
+        self.rtcp(bye=False)
+
+    def header(self, pt):
+        return struct.pack(">BBHII", 0x80, (0x80 if self.marker else 0) | pt, self.seq, self.timestamp, self.ssrc)
+
+    def send_frame(self, samples):
+        if self.codec == PT_L16:
+            packet = self.header(PT_L16) + struct.pack(f">{len(samples)}h", *samples)
+        else:
+            payload, self.predictor, self.index = dvi4_encode(samples, self.predictor, self.index)
+            blocks = self.history[-self.redundancy:] if self.redundancy else []
+            if not blocks:
+                packet = self.header(PT_DVI4) + payload
+            else:
+                headers = b"".join(struct.pack(">I", (0x80 | PT_DVI4) << 24 | (self.timestamp - ts) << 10 | len(data))
+                                   for ts, data in blocks)
+                packet = self.header(PT_RED) + headers + bytes([PT_DVI4]) + b"".join(d for _, d in blocks) + payload
+            self.history = (self.history + [(self.timestamp, payload)])[-2:]
+        self.sent_at[self.timestamp] = time.monotonic()
+        self.sock.sendto(packet, (HOST, self.port))
+        self.seq = (self.seq + 1) & 0xFFFF
+        self.timestamp = (self.timestamp + len(samples)) & 0xFFFFFFFF
+        self.marker = False
+        return len(packet)
+
+    def rtcp(self, bye):
+        cname = self.cname.encode()
+        packet = struct.pack(">BBHI", 0x80, 201, 1, self.ssrc)
+        chunk = struct.pack(">I", self.ssrc) + bytes([1, len(cname)]) + cname + b"\x00"
+        chunk += b"\x00" * (-len(chunk) % 4)
+        packet += struct.pack(">BBH", 0x81, 202, len(chunk) // 4) + chunk
+        if bye:
+            packet += struct.pack(">BBHI", 0x81, 203, 1, self.ssrc)
+        self.sock.sendto(packet, (HOST, self.port + 1))
+
+
+# ============= ĐƯỜNG TRUYỀN GIẢ LẬP =============
+class LossyLink:
+    """Chuyển tiếp UDP port -> receiver, gói RTP bị mất theo loss_pct và trễ delay ± jitter.
+    RTCP (port + 1) đi thẳng không mất để kết quả test ổn định."""
+
+    def __init__(self, listen_port, target_port, loss_pct, seed):
+        self.listen_port = listen_port
+        self.target_port = target_port
+        self.loss = loss_pct / 100
+        self.rng = random.Random(seed)
+        self.dropped = 0
+        self.out = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.running = True
+        self.sockets = []
+
+    def start(self):
+        for offset in (0, 1):
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            sock.bind((HOST, self.listen_port + offset))
+            sock.settimeout(0.2)
+            self.sockets.append(sock)
+            threading.Thread(target=self._loop, args=(sock, offset), daemon=True).start()
+
+    def _loop(self, sock, offset):
+        while self.running:
+            try:
+                data, _ = sock.recvfrom(2048)
+            except socket.timeout:
+                continue
+            target = (HOST, self.target_port + offset)
+            if offset == 1:
+                self.out.sendto(data, target)
+                continue
+            if self.rng.random() < self.loss:
+                self.dropped += 1
+                continue
+            delay = (LINK_DELAY_MS + self.rng.uniform(-LINK_JITTER_MS, LINK_JITTER_MS)) / 1000
+            threading.Timer(delay, self.out.sendto, args=(data, target)).start()
+
+    def stop(self):
+        self.running = False
+        for sock in self.sockets:
+            sock.close()
+
+
+# ============= TESTS =============
+def test_codec():
+    log("\n🎚️ Test: DVI4 (IMA ADPCM) mã hóa / giải mã")
+    samples = voice_like(FRAME_SAMPLES * 20)
+    decoded, predictor, index = [], 0, 0
+    sizes = []
+    for i in range(0, len(samples), FRAME_SAMPLES):
+        payload, predictor, index = dvi4_encode(samples[i:i + FRAME_SAMPLES], predictor, index)
+        sizes.append(len(payload))
+        decoded += dvi4_decode(payload)
+    assert decoded != samples and len(decoded) == len(samples)
+    signal = sum(s * s for s in samples)
+    noise = sum((a - b) ** 2 for a, b in zip(samples, decoded))
+    snr = 10 * math.log10(signal / noise)
+    log(f"   1 frame: {FRAME_SAMPLES * 2} byte PCM -> {sizes[0]} byte, SNR {snr:.1f} dB")
+    assert set(sizes) == {4 + FRAME_SAMPLES // 2}
+    assert snr > 20, snr
+
+    # Frame mang sẵn trạng thái bộ mã hóa -> giải mã được dù frame trước bị mất
+    alone = dvi4_decode(dvi4_encode(samples[FRAME_SAMPLES * 5:FRAME_SAMPLES * 6], *state_before(samples, 5))[0])
+    assert alone == decoded[FRAME_SAMPLES * 5:FRAME_SAMPLES * 6]
+    log("✅ OK")
+
+
+def state_before(samples, frame):
+    predictor, index = 0, 0
+    for i in range(frame):
+        _, predictor, index = dvi4_encode(samples[i * FRAME_SAMPLES:(i + 1) * FRAME_SAMPLES], predictor, index)
+    return predictor, index
+
+
+def test_packet_format():
+    log("\n📦 Test: RTP header, RED (RFC 2198), RTCP SDES / BYE")
+    receiver_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    receiver_sock.bind((HOST, LINK_PORT + 10))
+    rtcp_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    rtcp_sock.bind((HOST, LINK_PORT + 11))
+    sender = RtpSender(LINK_PORT + 10, CLIENT_ID, redundancy=2)
+    cnames, byes = parse_rtcp(rtcp_sock.recv(2048))
+    assert cnames == {sender.ssrc: CLIENT_ID} and byes == []
+
+    sizes = []
+    for i in range(3):
+        sizes.append(sender.send_frame(voice_like(FRAME_SAMPLES, i * FRAME_SAMPLES)))
+    packets = [parse_rtp(receiver_sock.recv(2048)) for _ in range(3)]
+    assert [p["pt"] for p in packets] == [PT_DVI4, PT_RED, PT_RED]
+    assert [p["marker"] for p in packets] == [True, False, False]
+    assert (packets[2]["seq"] - packets[0]["seq"]) & 0xFFFF == 2
+    blocks = parse_red(packets[2]["payload"], packets[2]["timestamp"])
+    assert [pt for pt, _, _ in blocks] == [PT_DVI4] * 3
+    assert [(packets[2]["timestamp"] - ts) & 0xFFFFFFFF for _, ts, _ in blocks] == [1024, 512, 0]
+    assert blocks[0][2] == packets[0]["payload"]
+    log(f"   Kích thước gói: {sizes} byte (RED 0 / 1 / 2 frame cũ)")
+
+    sender.rtcp(bye=True)
+    cnames, byes = parse_rtcp(rtcp_sock.recv(2048))
+    assert byes == [sender.ssrc] and cnames[sender.ssrc] == CLIENT_ID
+    for sock in (receiver_sock, rtcp_sock, sender.sock):
+        sock.close()
+    log("✅ OK")
+
+
+def stream_over_link(redundancy, seed):
+    """Gửi FRAMES frame theo đúng nhịp 32 ms qua LossyLink, trả về (stream, sender, link)"""
+    completed = threading.Event()
+    # Mỗi lần chạy 1 cặp port riêng, socket của lần trước có thể chưa đóng hẳn
+    port_offset = 2 * redundancy
+    receiver = RtpAudioReceiver(HOST, RECEIVER_PORT + port_offset, on_complete=lambda stream: completed.set())
+    receiver.start()
+    link = LossyLink(LINK_PORT + port_offset, RECEIVER_PORT + port_offset, LOSS_PCT, seed)
+    link.start()
+    random.seed(seed)
+    sender = RtpSender(LINK_PORT + port_offset, CLIENT_ID, redundancy=redundancy)
+    start = time.monotonic()
+    for i in range(FRAMES):
+        sender.send_frame(voice_like(FRAME_SAMPLES, i * FRAME_SAMPLES))
+        next_at = start + (i + 1) * FRAME_SAMPLES / CLOCK_RATE
+        time.sleep(max(0.0, next_at - time.monotonic()))
+    time.sleep((LINK_DELAY_MS + LINK_JITTER_MS) / 1000 + 0.05)
+    sender.rtcp(bye=True)
+    assert completed.wait(2), "Không nhận được BYE"
+    stream = receiver.streams[sender.ssrc]
+    receiver.stop()
+    link.stop()
+    sender.sock.close()
+    return stream, sender, link
+
+
+def absolute_latency_ms(stream, sender):
+    """Thời điểm frame có mặt ở receiver - lúc firmware gửi frame đó"""
+    values = []
+    for key, arrival in stream.arrivals.items():
+        ts = (stream.base_timestamp + key) & 0xFFFFFFFF
+        if ts in sender.sent_at:
+            values.append((arrival - sender.sent_at[ts]) * 1000)
+    return sorted(values)
+
+
+def test_loss_recovery():
+    log(f"\n📡 Test: {FRAMES} frame ({FRAMES * 32} ms) qua UDP mất {LOSS_PCT:.0f}%, "
+        f"trễ {LINK_DELAY_MS} ± {LINK_JITTER_MS} ms")
+    log(f"   {'RED':<5}{'Gói mất':>9}{'Frame mất':>11}{'Khôi phục':>11}{'Đảo':>6}"
+        f"{'Jitter':>9}{'Trễ p50':>9}{'p95':>7}{'max':>7}")
+    results = {}
+    for redundancy in (0, 1):
+        stream, sender, link = stream_over_link(redundancy, seed=7)
+        stats = stream.stats()
+        latency = absolute_latency_ms(stream, sender)
+        p50 = latency[len(latency) // 2]
+        p95 = latency[int(len(latency) * 0.95)]
+        log(f"   {redundancy:<5}{stats['packets_lost']:>9}{stats['frames_missing']:>11}{stats['frames_recovered']:>11}"
+            f"{stats['reordered']:>6}{stats['jitter_ms']:>7.1f}ms{p50:>7.1f}ms{p95:>5.0f}ms{latency[-1]:>5.0f}ms")
+        results[redundancy] = stats
+
+        assert stream.cname == CLIENT_ID
+        assert stats["decode_errors"] == 0 and stats["duplicates"] == 0
+        # Gói mất ở đầu / cuối luồng không đếm được theo sequence
+        assert 0 < stats["packets_lost"] <= link.dropped, (stats["packets_lost"], link.dropped)
+        # PCM ghép lại đủ độ dài (frame mất = khoảng lặng), trừ frame đầu / cuối bị mất hẳn
+        assert len(stream.pcm()) == 2 * FRAME_SAMPLES * (stats["frames"] + stats["frames_missing"])
+        # Độ trễ chỉ gồm trễ đường truyền, không có chờ gửi lại như TCP
+        assert p95 < LINK_DELAY_MS + LINK_JITTER_MS + 32 + 15, p95
+
+    no_red, red = results[0], results[1]
+    assert no_red["frames_recovered"] == 0
+    assert no_red["frames_missing"] + no_red["frames"] >= FRAMES - 2
+    # RED 1 frame: chỉ mất khi 2 gói liền nhau cùng mất
+    assert red["frames_missing"] < max(1, no_red["frames_missing"]) / 2, (red, no_red)
+    assert red["frames_recovered"] > 0
+    log(f"   -> RED giảm frame mất {no_red['frame_loss_pct']:.1f}% -> {red['frame_loss_pct']:.1f}% "
+        f"(gói lớn hơn {260 + 5} byte)")
+    log("✅ OK")
+
+
+if __name__ == "__main__":
+    log("=" * 60)
+    log("🧪 TEST RTP AUDIO")
+    log("=" * 60)
+    silence()
+    test_codec()
+    test_packet_format()
+    test_loss_recovery()
+    log("\n🎉 Tất cả test đều pass")
@@ -0,0 +1,112 @@
+"""
+Script để test giải mã batch telemetry CBOR (SS/<client_id>/batch)
+- Giải mã document mẫu do firmware (TelemetryBatcher::encode) sinh ra
+- Kiểm tra quy đổi thời gian và format giá trị
+- So sánh số packet / số byte giữa publish từng giá trị và publish batch
+"""
+
+import sys
+import os
+from datetime import datetime, timedelta, timezone
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from app.services.telemetry_codec import (
+    CBORDecodeError,
+    cbor_loads,
+    decode_batch,
+    format_value,
+)
+
+# ============= CẤU HÌNH =============
+CLIENT_ID = "180c89ca8d814b6d83c9fc0440505cb0"
+
+# Output của firmware cho 4 mẫu: V5=27.25 @100000, V4=-3 @108000,
+# V6=true @116000, V7="ok" @124000, encode lúc millis() = 130000
+FIRMWARE_BATCH_HEX = (
+    "a461760161741a000186a0616e1a0001fbd0617384830500fa41da0000"
+    "8304191f40228306193e80f58307195dc0626f6b"
+)
+
+# Header MQTT PUBLISH QoS0: fixed header (2) + topic length (2)
+MQTT_PUBLISH_OVERHEAD = 4
+
+
+def publish_size(topic: str, payload: bytes) -> int:
+    return MQTT_PUBLISH_OVERHEAD + len(topic) + len(payload)
+
+
+def test_decode_firmware_batch():
+    print("\n📦 Test: giải mã batch từ firmware")
+    payload = bytes.fromhex(FIRMWARE_BATCH_HEX)
+    received_at = datetime(2024, 1, 1, 12, 0, 0, tzinfo=timezone.utc)
+
+    samples = decode_batch(payload, received_at=received_at)
+    assert [s["virtual_pin"] for s in samples] == [5, 4, 6, 7]
+    assert [s["value"] for s in samples] == [27.25, -3, True, "ok"]
+    assert [s["device_ms"] for s in samples] == [100000, 108000, 116000, 124000]
+
+    # Mẫu đầu tiên đo trước lúc encode 30s
+    assert samples[0]["recorded_at"] == received_at - timedelta(seconds=30)
+    assert samples[-1]["recorded_at"] == received_at - timedelta(seconds=6)
+
+    for s in samples:
+        print(f"   V{s['virtual_pin']}: {format_value(s['value'])} @ {s['recorded_at'].isoformat()}")
+    print("✅ OK")
+
+
+def test_format_value():
+    print("\n🔤 Test: format giá trị giống firmware")
+    assert format_value(27.25) == "27.25"
+    assert format_value(True) == "1"
+    assert format_value(False) == "0"
+    assert format_value(-3) == "-3"
+    assert format_value("ok") == "ok"
+    assert format_value(float("nan")) == "nan"
+    print("✅ OK")
+
+
+def test_reject_invalid():
+    print("\n🚫 Test: từ chối payload lỗi")
+    payload = bytes.fromhex(FIRMWARE_BATCH_HEX)
+    cases = {
+        "truncated": payload[:-3],
+        "trailing bytes": payload + b"\x00",
+        "wrong version": bytes.fromhex("a1617602"),
+        "not a map": bytes.fromhex("83010203"),
+    }
+    for name, data in cases.items():
+        try:
+            decode_batch(data)
+        except CBORDecodeError as e:
+            print(f"   {name}: {e}")
+            continue
+        raise AssertionError(f"{name}: lẽ ra phải lỗi")
+    print("✅ OK")
+
+
+def test_bytes_on_air():
+    print("\n📊 Test: số byte / packet, từng giá trị vs batch")
+    payload = bytes.fromhex(FIRMWARE_BATCH_HEX)
+    doc = cbor_loads(payload)
+
+    single_bytes = 0
+    for pin, _, value in doc["s"]:
+        single_bytes += publish_size(f"SS/{CLIENT_ID}/{pin}", format_value(value).encode())
+    batch_bytes = publish_size(f"SS/{CLIENT_ID}/batch", payload)
+
+    print(f"   Từng giá trị: {len(doc['s'])} packet, {single_bytes} bytes")
+    print(f"   Batch:        1 packet, {batch_bytes} bytes")
+    assert batch_bytes < single_bytes
+    print("✅ OK")
+
+
+if __name__ == "__main__":
+    print("=" * 60)
+    print("🧪 TEST TELEMETRY BATCH CODEC")
+    print("=" * 60)
+    test_decode_firmware_batch()
+    test_format_value()
+    test_reject_invalid()
+    test_bytes_on_air()
+    print("\n🎉 Tất cả test đều pass")
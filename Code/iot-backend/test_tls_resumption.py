@@ -0,0 +1,243 @@
+"""
+Script để test mqtts của broker (app/broker_server.py) và đo lợi ích của TLS
+session resumption, giống cách firmware (tlsClient.cpp) kết nối lại:
+- Lần đầu handshake đầy đủ (chứng chỉ + trao đổi khóa)
+- Các lần sau đưa lại session cũ (session id / ticket) -> handshake rút gọn
+- Broker khởi động lại (session cũ không còn hợp lệ) -> tự quay về handshake đầy đủ
+Mỗi kết nối gửi CONNECT + 1 PUBLISH QoS 1 rồi đóng, như thiết bị reconnect sau khi mất mạng.
+
+Chạy: python test_tls_resumption.py [rtt_ms] [so_ket_noi]
+Cần lệnh openssl để tạo chứng chỉ tự ký. Độ trễ WiFi được giả lập bằng 1 proxy TCP
+đặt giữa client và broker, proxy cũng đếm số byte đi qua.
+"""
+
+import os
+import shutil
+import socket
+import ssl
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from app.broker_server import SimpleMQTTBroker, create_tls_context, encode_remaining_length, split_mqtt_packets
+from test_common import log, silence
+
+# ============= CẤU HÌNH =============
+BROKER_HOST = "127.0.0.1"
+BROKER_PORT = 18883
+RESTARTED_PORT = 18884
+PROXY_PORT = 18885
+CLIENT_ID = "066420c45a4e819437bbfbea63b83739"
+TOPIC = f"SS/{CLIENT_ID}/5"
+PAYLOAD = b"27.25"
+RTT_MS = int(sys.argv[1]) if len(sys.argv) > 1 else 40
+CONNECTIONS = int(sys.argv[2]) if len(sys.argv) > 2 else 10
+
+
+# ============= BROKER + PROXY =============
+class RecordingBroker(SimpleMQTTBroker):
+    """Broker chỉ ghi lại message đã nhận thay vì forward / lưu database"""
+    def __init__(self, host, port, ssl_context):
+        super().__init__(host, port, ssl_context)
+        self.received = []
+
+    def handle_publish(self, client_socket, payload):
+        self.received.append(payload)
+
+
+class CountingProxy:
+    """Proxy TCP trễ RTT/2 mỗi chiều, đếm byte 2 chiều (tương đương airtime của ESP32)"""
+    def __init__(self, listen_port, target_port, rtt_ms):
+        self.listen_port = listen_port
+        self.target_port = target_port
+        self.delay = rtt_ms / 2000.0
+        self.bytes = 0
+        self.lock = threading.Lock()
+
+    def start(self):
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind((BROKER_HOST, self.listen_port))
+        server.listen(5)
+        threading.Thread(target=self._accept, args=(server,), daemon=True).start()
+
+    def _accept(self, server):
+        while True:
+            client, _ = server.accept()
+            upstream = socket.create_connection((BROKER_HOST, self.target_port))
+            for sock in (client, upstream):
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=self._pipe, args=(client, upstream), daemon=True).start()
+            threading.Thread(target=self._pipe, args=(upstream, client), daemon=True).start()
+
+    def _pipe(self, src, dst):
+        try:
+            while True:
+                data = src.recv(16384)
+                if not data:
+                    break
+                time.sleep(self.delay)
+                with self.lock:
+                    self.bytes += len(data)
+                dst.sendall(data)
+        except OSError:
+            pass
+        finally:
+            for sock in (src, dst):
+                try:
+                    sock.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+
+
+# ============= CHỨNG CHỈ =============
+def make_certificate(directory):
+    cert = os.path.join(directory, "broker.crt")
+    key = os.path.join(directory, "broker.key")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1",
+                    "-subj", "/CN=localhost", "-keyout", key, "-out", cert],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return cert, key
+
+
+# ============= MQTT CLIENT (giống firmware) =============
+def build_packet(header, body):
+    return bytes([header]) + encode_remaining_length(len(body)) + body
+
+
+def mqtt_session(tls_sock, packet_id):
+    """CONNECT -> CONNACK -> PUBLISH QoS 1 -> PUBACK trên kết nối TLS đã handshake"""
+    cid = CLIENT_ID.encode()
+    tls_sock.sendall(build_packet(0x10, b"\x00\x04MQTT\x04\x02\x00\x0f" + struct.pack(">H", len(cid)) + cid))
+    topic = TOPIC.encode()
+    publish = build_packet(0x32, struct.pack(">H", len(topic)) + topic + struct.pack(">H", packet_id) + PAYLOAD)
+    buffer = b''
+    sent_publish = False
+    while True:
+        chunk = tls_sock.recv(4096)
+        assert chunk, "Broker đóng kết nối"
+        buffer += chunk
+        packets, buffer = split_mqtt_packets(buffer)
+        for first, body in packets:
+            if first == 0x20:
+                assert body[1] == 0, f"CONNACK lỗi: {body!r}"
+                tls_sock.sendall(publish)
+                sent_publish = True
+            elif first == 0x40:
+                assert sent_publish and struct.unpack(">H", body[:2])[0] == packet_id
+                return
+
+
+def connect(context, port, session, packet_id):
+    """Trả về (session mới, có resume không, thời gian handshake ms, thời gian cả phiên ms)"""
+    start = time.perf_counter()
+    raw = socket.create_connection((BROKER_HOST, port))
+    raw.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    tls_sock = context.wrap_socket(raw, server_hostname="localhost", session=session)
+    handshake_ms = (time.perf_counter() - start) * 1000
+    mqtt_session(tls_sock, packet_id)
+    total_ms = (time.perf_counter() - start) * 1000
+    result = (tls_sock.session, tls_sock.session_reused, handshake_ms, total_ms)
+    tls_sock.close()
+    return result
+
+
+def client_context(cafile):
+    context = ssl.create_default_context(cafile=cafile)
+    context.maximum_version = ssl.TLSVersion.TLSv1_2
+    return context
+
+
+# ============= TESTS =============
+def wait_received(broker, expected, timeout=5.0):
+    deadline = time.monotonic() + timeout
+    while len(broker.received) < expected and time.monotonic() < deadline:
+        time.sleep(0.01)
+    return broker.received
+
+
+def test_resumption(broker, proxy, context):
+    log(f"\n🔐 Test: {CONNECTIONS} lần kết nối lại qua mqtts (RTT {RTT_MS} ms)")
+    log(f"   {'Lần':<6}{'Handshake':<12}{'TLS (ms)':>10}{'Cả phiên (ms)':>15}{'Byte':>8}")
+    session = None
+    full, resumed = [], []
+    for i in range(CONNECTIONS):
+        before = proxy.bytes
+        session, reused, handshake_ms, total_ms = connect(context, PROXY_PORT, session, i + 1)
+        time.sleep(0.05)    # proxy đếm xong byte của kết nối này
+        used = proxy.bytes - before
+        (resumed if reused else full).append((handshake_ms, used))
+        log(f"   {i + 1:<6}{'resume' if reused else 'đầy đủ':<12}{handshake_ms:>10.1f}{total_ms:>15.1f}{used:>8}")
+        assert reused == (i > 0), f"Lần {i + 1}: session_reused={reused}"
+
+    received = wait_received(broker, CONNECTIONS)
+    assert len(received) == CONNECTIONS, len(received)
+    assert broker.tls_full_handshakes == 1 and broker.tls_resumed_handshakes == CONNECTIONS - 1, \
+        (broker.tls_full_handshakes, broker.tls_resumed_handshakes)
+
+    full_ms, full_bytes = full[0]
+    avg_ms = sum(ms for ms, _ in resumed) / len(resumed)
+    avg_bytes = sum(used for _, used in resumed) / len(resumed)
+    log(f"   Đầy đủ: {full_ms:.1f} ms, {full_bytes} byte | Resume (TB): {avg_ms:.1f} ms, {avg_bytes:.0f} byte")
+    log(f"   -> Resume nhanh hơn {full_ms / avg_ms:.1f}x, ít hơn {full_bytes - avg_bytes:.0f} byte mỗi lần")
+    assert avg_bytes < full_bytes / 2, (avg_bytes, full_bytes)
+    assert avg_ms < full_ms, (avg_ms, full_ms)
+    log("✅ OK")
+    return session
+
+
+def test_stale_session(context, session, cert, key):
+    log("\n♻️ Test: broker khởi động lại, session cũ không còn hợp lệ -> handshake đầy đủ")
+    broker = RecordingBroker(BROKER_HOST, RESTARTED_PORT, create_tls_context(cert, key))
+    threading.Thread(target=broker.start, daemon=True).start()
+    time.sleep(0.3)
+    _, reused, handshake_ms, _ = connect(context, RESTARTED_PORT, session, 1)
+    assert not reused
+    assert wait_received(broker, 1) == [struct.pack(">H", len(TOPIC)) + TOPIC.encode() + PAYLOAD]
+    assert broker.tls_full_handshakes == 1 and broker.tls_resumed_handshakes == 0
+    broker.stop()
+    log(f"   Handshake đầy đủ {handshake_ms:.1f} ms, message vẫn tới broker")
+    log("✅ OK")
+
+
+def test_bad_handshake(broker):
+    log("\n🚫 Test: client không nói TLS bị đóng, broker vẫn chạy")
+    raw = socket.create_connection((BROKER_HOST, BROKER_PORT))
+    raw.sendall(build_packet(0x10, b"\x00\x04MQTT\x04\x02\x00\x0f\x00\x01x"))
+    raw.settimeout(2.0)
+    try:
+        assert raw.recv(4096) == b''
+    except ConnectionResetError:
+        pass
+    raw.close()
+    assert broker.running
+    log("✅ OK")
+
+
+if __name__ == "__main__":
+    log("=" * 60)
+    log("🧪 TEST MQTTS / TLS SESSION RESUMPTION")
+    log("=" * 60)
+    if shutil.which("openssl") is None:
+        log("⚠️ Không tìm thấy lệnh openssl, bỏ qua test")
+        sys.exit(0)
+    silence()
+    with tempfile.TemporaryDirectory() as directory:
+        cert, key = make_certificate(directory)
+        broker = RecordingBroker(BROKER_HOST, BROKER_PORT, create_tls_context(cert, key))
+        threading.Thread(target=broker.start, daemon=True).start()
+        proxy = CountingProxy(PROXY_PORT, BROKER_PORT, RTT_MS)
+        proxy.start()
+        time.sleep(0.3)
+
+        context = client_context(cert)
+        session = test_resumption(broker, proxy, context)
+        test_stale_session(context, session, cert, key)
+        test_bad_handshake(broker)
+        broker.stop()
+    log("\n🎉 Tất cả test đều pass")